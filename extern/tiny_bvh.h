@@ -55,6 +55,8 @@ THE SOFTWARE.
 // #define HQBVHBINS 32     - the number of bins to use in SBVH construction. Default is 8.
 // #define INST_IDX_BITS 10 - the number of bits to use for the instance index. Default is 32,
 //                            which stores the bits in a separate field in tinybvh::Intersection.
+// #define INST_MAX_LEVELS 4 - the maximum TLAS nesting depth. Default is 1; larger values add
+//                            the instance index of each level to tinybvh::Intersection.
 // #define C_INT 1          - the estimated cost of a primitive intersection test. Default is 1.
 // #define C_TRAV 1         - the estimated cost of a traversal step. Default is 1.
 
@@ -112,6 +114,11 @@ THE SOFTWARE.
 #else
 #define PRIM_IDX_MASK ((1 << INST_IDX_SHFT) - 1) // instance index stored in top bits of hit.prim.
 #endif
+// Nested instancing: a TLAS may be used as a BLAS in another TLAS. With INST_MAX_LEVELS > 1
+// a hit records the instance index for each level in Intersection::instPath.
+#ifndef INST_MAX_LEVELS
+#define INST_MAX_LEVELS 1 // Single-level instancing; hit.inst is the only instance index.
+#endif
 
 // SAH BVH building: Heuristic parameters
 // CPU traversal: C_INT = 1, C_TRAV = 1 seems optimal.
@@ -127,6 +134,29 @@ THE SOFTWARE.
 // SBVH: "Unsplitting"
 #define SBVH_UNSPLITTING
 
+// LBVH builder: Morton code size. Use 30 (10 bits per axis) for speed, or 63
+// (21 bits per axis) for scenes with a large spatial extent.
+#ifndef LBVH_MORTON_BITS
+#define LBVH_MORTON_BITS 30
+#endif
+
+// PLOC builder: search radius for nearest neighbours along the Morton curve.
+// Larger values are slower, and do not necessarily yield better trees.
+#ifndef PLOC_RADIUS
+#define PLOC_RADIUS 4
+#endif
+
+// Multi-threaded building: nodes with fewer primitives than this are subdivided
+// by a single thread; larger nodes hand their children to the thread pool.
+#ifndef MT_BUILD_THRESHOLD
+#define MT_BUILD_THRESHOLD 16384
+#endif
+// Loops over at least this many primitives (fragment setup, binning and partitioning
+// of large nodes) are executed by all threads.
+#ifndef MT_BIN_THRESHOLD
+#define MT_BIN_THRESHOLD 65536
+#endif
+
 // 'Infinity' values
 #define BVH_FAR	1e30f		// actual valid ieee range: 3.40282347E+38
 #define BVH_DBL_FAR 1e300	// actual valid ieee range: 1.797693134862315E+308
@@ -143,6 +173,9 @@ THE SOFTWARE.
 #ifndef NO_CUSTOM_GEOMETRY
 #define ENABLE_CUSTOM_GEOMETRY
 #endif
+#if !defined(NO_THREADED_BUILDS) && (!defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__))
+#define ENABLE_THREADED_BUILDS
+#endif
 
 // CWBVH triangle format: doesn't seem to help on GPU?
 // #define CWBVH_COMPRESSED_TRIS
@@ -153,12 +186,47 @@ THE SOFTWARE.
 // #define BVH8_CPU_COMPACT
 // BVH8_CPU Embree 'modified-Woop' intersector, inexplicably slower?
 // #define BVH8_WOOP_TRIS
+// Watertight ray/triangle intersection for BVH, BVH_SoA, BVH4_CPU and BVH8_CPU:
+// no rays slip through edges shared by adjacent triangles. Implies BVH8_WOOP_TRIS.
+// #define WATERTIGHT_TRIS
+#if defined(WATERTIGHT_TRIS) && !defined(BVH8_WOOP_TRIS)
+#define BVH8_WOOP_TRIS
+#endif
+// Ray/box tests scale the exit distance by this factor in WATERTIGHT_TRIS mode, so
+// that rounding in the slab test can not reject a box the ray just touches. Factor
+// is 1 + 2 * gamma(3) from "Robust BVH Ray Traversal", Ize, 2013.
+#define BVH_CONSERVATIVE_TMAX 1.00000036f
+// BVH8_CPU closest-hit traversal with one stack entry per node: the node and a mask
+// of its unvisited children, CWBVH-style, instead of an index/distance pair per child.
+// Less stack memory per ray; children are culled against t one level later.
+// #define BVH8_CPU_GROUP_STACK
+// Optional: keep at most this many group entries. On overflow the oldest entry is
+// dropped; traversal then restarts from the root, guided by a restart trail.
+// #define BVH8_CPU_SHORT_STACK 8
+#if defined(BVH8_CPU_SHORT_STACK) && !defined(BVH8_CPU_GROUP_STACK)
+#define BVH8_CPU_GROUP_STACK
+#endif
+// TLAS traversal reads a compact copy of each instance: its inverse transform as an
+// affine 3x4 matrix plus the blas index, 64 bytes. Optional: 32 bytes per instance,
+// with the 3x3 part of the matrix in half precision. Limits the BLAS count to 32768.
+// Note: the half matrix assumes the instance transform itself is affine as well.
+// #define TLAS_HALF_TRANSFORMS
 // BVH8_CPU align to big boundaries - experimental.
 // #define BVH8_ALIGN_4K
 #define BVH8_ALIGN_32K
 
 // We'll use this whenever a layout has no specialized shadow ray query.
 #define FALLBACK_SHADOW_QUERY( s ) { Ray r = s; float d = s.hit.t; Intersect( r ); return r.hit.t < d; }
+// Batch shadow query: bit i of mask is set when rays[i] is occluded.
+#define BATCH_SHADOW_QUERY( rays, count, mask ) { for (uint32_t i = 0; i < ((count + 31) >> 5); i++) mask[i] = 0; \
+	for (uint32_t i = 0; i < count; i++) if (IsOccluded( rays[i] )) mask[i >> 5] |= 1u << (i & 31); }
+// Dispatch table for a traversal kernel templated on the ray octant; index is RayOctant.
+#define OCTANT_KERNELS( f ) { &f<false, false, false>, &f<true, false, false>, &f<false, true, false>, &f<true, true, false>, \
+	&f<false, false, true>, &f<true, false, true>, &f<false, true, true>, &f<true, true, true> }
+// Batch traversal: the octant kernel is selected once per run of rays with the same octant.
+#define OCTANT_BATCH( rays, count ) { for (uint32_t first = 0, last; first < count; first = last) { \
+	const uint32_t octant = RayOctant( rays[first] ); const IntersectKernel kernel = intersectKernel[octant]; \
+	for (last = first; last < count && RayOctant( rays[last] ) == octant; last++) (this->*kernel)(rays[last]); } }
 
 // include fast AVX BVH builder
 #ifndef TINYBVH_NO_SIMD
@@ -197,6 +265,14 @@ THE SOFTWARE.
 #include <cstring>
 #endif
 #include <cstdint>
+#ifdef ENABLE_THREADED_BUILDS
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#endif
 
 // aligned memory allocation
 // note: formally, size needs to be a multiple of 'alignment', see:
@@ -417,6 +493,23 @@ inline bvhvec3 tinybvh_transform_vector( const bvhvec3& v, const float* T )
 	return bvhvec3( T[0] * v.x + T[1] * v.y + T[2] * v.z, T[4] * v.x +
 		T[5] * v.y + T[6] * v.z, T[8] * v.x + T[9] * v.y + T[10] * v.z );
 }
+// half precision floats: rescaling by 2^112 maps the half exponent range onto the
+// float range, including denormals. No inf / nan; large values are clamped.
+inline float tinybvh_half_to_float( const uint16_t h )
+{
+	union { uint32_t u; float f; } v;
+	v.u = (uint32_t)(h & 0x7fff) << 13, v.f *= 5.192296858534828e33f; // 2^112
+	v.u |= (uint32_t)(h & 0x8000) << 16;
+	return v.f;
+}
+inline uint16_t tinybvh_float_to_half( const float f )
+{
+	union { uint32_t u; float f; } v;
+	v.f = fabsf( f ) * 1.925929944387236e-34f; // 2^-112
+	const uint32_t h = tinybvh_min( (v.u + 0x1000) >> 13, 0x7bffu ); // round to nearest
+	v.f = f;
+	return (uint16_t)(h | ((v.u >> 16) & 0x8000));
+}
 
 #ifdef DOUBLE_PRECISION_SUPPORT
 // Double-precision math
@@ -563,6 +656,12 @@ struct Intersection
 		double userDouble[7];
 		uint64_t userInt64[7];
 	};
+#if INST_MAX_LEVELS > 1
+	// Nested instancing: instance index per level, starting at the outermost TLAS.
+	// The last valid entry equals 'inst'.
+	uint32_t instPath[INST_MAX_LEVELS];
+	uint32_t instLevels;	// number of valid entries in instPath.
+#endif
 };
 #if defined(_MSC_VER) || defined(__GNUC__)
 #pragma pack(pop) // is there a good alternative for Clang / EMSCRIPTEN?
@@ -580,13 +679,16 @@ struct ALIGNED( 64 ) Ray
 		O = origin, D = tinybvh_normalize( direction ), rD = tinybvh_safercp( D );
 		hit.t = t;
 	}
-	ALIGNED( 16 ) bvhvec3 O; uint32_t dummy1;
+	ALIGNED( 16 ) bvhvec3 O; float time = 0; // motion blur: ray time, 0..1.
 	ALIGNED( 16 ) bvhvec3 D; uint32_t instIdx = 0;
 	ALIGNED( 16 ) bvhvec3 rD;
 #if INST_IDX_BITS != 32
 	uint32_t dummy2; // align to 16 bytes if field 'hit' is 16 bytes; otherwise don't.
 #endif
 	Intersection hit;
+#if INST_MAX_LEVELS > 1
+	uint32_t instLevel = 0; // TLAS nesting depth of the ray.
+#endif
 };
 
 #ifdef DOUBLE_PRECISION_SUPPORT
@@ -618,15 +720,66 @@ struct RayEx
 
 #endif
 
+#ifdef ENABLE_THREADED_BUILDS
+
+// ThreadPool: a small work-stealing thread pool, used by the multi-threaded builders.
+// Each worker owns a task queue; it takes its own work LIFO and steals from the other
+// queues FIFO. A thread that waits for a TaskGroup executes pending tasks in the
+// meantime, so tasks can safely spawn and wait for subtasks.
+struct TaskGroup
+{
+	std::atomic<uint32_t> pending{ 0 };	// number of tasks in the group that did not finish yet.
+};
+
+class ThreadPool
+{
+public:
+	ThreadPool( const uint32_t threads = 0 ); // thread count includes the calling thread; 0: all cores.
+	~ThreadPool();
+	static ThreadPool& Default();
+	uint32_t ThreadCount() const { return workerCount + 1; }
+	void Run( TaskGroup& group, const std::function<void()>& task );
+	void Wait( TaskGroup& group );
+	void ParallelFor( const uint32_t count, const uint32_t chunks, const std::function<void( const uint32_t chunk, const uint32_t first, const uint32_t last )>& body );
+private:
+	struct Task { std::function<void()> func; TaskGroup* group = 0; };
+	struct TaskQueue { std::mutex lock; std::deque<Task> tasks; };
+	bool RunPendingTask( const uint32_t queueIdx );
+	void WorkerLoop( const uint32_t queueIdx );
+	uint32_t workerCount = 0;
+	TaskQueue* queue = 0;			// queue 0 is shared by threads outside the pool.
+	std::thread* worker = 0;
+	std::atomic<int32_t> queued{ 0 };
+	std::mutex sleepLock;
+	std::condition_variable wakeup;
+	bool quit = false;
+};
+
+// BuildInput: geometry of a single mesh in a batch build, see BVH::BuildBatch.
+struct BuildInput
+{
+	bvhvec4slice vertices;
+	const uint32_t* indices = 0;	// optional; requires primCount.
+	uint32_t primCount = 0;			// 0: vertices.count / 3.
+};
+
+#endif
+
 struct BVHContext
 {
 	void* (*malloc)(size_t size, void* userdata) = malloc64;
 	void (*free)(void* ptr, void* userdata) = free64;
 	void* userdata = nullptr;
+#ifdef ENABLE_THREADED_BUILDS
+	ThreadPool* threadPool = nullptr; // pool used by threaded builders; nullptr: ThreadPool::Default().
+#endif
 };
 
 enum TraceDevice : uint32_t { USE_CPU = 1, USE_GPU };
 
+struct BVHTri4Leaf;
+class BLASInstance;
+struct CompactInstance;
 class BVHBase
 {
 public:
@@ -677,10 +830,17 @@ public:
 	float c_int = C_INT;			// cost of a primitive intersection, used to steer SAH construction.
 	bvhvec3 aabbMin, aabbMax;		// bounds of the root node of the BVH.
 	// Custom memory allocation
-	void* AlignedAlloc( size_t size );
-	void AlignedFree( void* ptr );
+	void* AlignedAlloc( size_t size ) const;
+	void AlignedFree( void* ptr ) const;
 	// Common methods
 	void CopyBasePropertiesFrom( const BVHBase& original );	// copy flags from one BVH to another
+#ifdef ENABLE_THREADED_BUILDS
+	ThreadPool& GetThreadPool() const;						// context.threadPool, or the default pool.
+#endif
+#if INST_MAX_LEVELS > 1
+	// Nested instancing: combined object-to-world transform of the instance path of a hit, at ray time.
+	static void GetInstanceTransform( const BVHBase* tlas, const Intersection& hit, float* T, const float time = 0 );
+#endif
 protected:
 	~BVHBase() {}
 	__FORCEINLINE void IntersectTri( Ray& ray, const bvhvec4slice& verts, const uint32_t primIdx ) const;
@@ -688,12 +848,22 @@ protected:
 	__FORCEINLINE bool TriOccludes( const Ray& ray, const bvhvec4slice& verts, const uint32_t idx ) const;
 	__FORCEINLINE bool IndexedTriOccludes( const Ray& ray, const bvhvec4slice& verts, const uint32_t* indices, const uint32_t idx ) const;
 	static float IntersectAABB( const Ray& ray, const bvhvec3& aabbMin, const bvhvec3& aabbMax );
+	template <bool posX, bool posY, bool posZ> static float IntersectAABB( const Ray& ray, const bvhvec3& aabbMin, const bvhvec3& aabbMax );
 	static void PrecomputeTriangle( const bvhvec4slice& vert, const uint32_t ti0, const uint32_t ti1, const uint32_t ti2, float* T );
+	static void PackTri4Leafs( BVHTri4Leaf* leaf, const bvhvec4slice& verts, const uint32_t* vertIdx, const uint32_t* prims, const uint32_t count );
 	static float SA( const bvhvec3& aabbMin, const bvhvec3& aabbMax );
+	void RadixSort( uint64_t* keys, uint32_t* values, const uint32_t count, const uint32_t keyBits ) const;
+	void SortRays( const Ray* rays, const uint32_t count, uint32_t* order, const uint32_t dirBits = 0 ) const;
+	// TLAS leafs: trace a ray through a list of instances, dispatching on the BLAS layout.
+	static int32_t IntersectInstances( Ray& ray, const BLASInstance* instList, const CompactInstance* instData, BVHBase* const* blasList, const uint32_t* instIdx, const uint32_t count );
+	static bool InstancesOcclude( const Ray& ray, const BLASInstance* instList, const CompactInstance* instData, BVHBase* const* blasList, const uint32_t* instIdx, const uint32_t count );
+	static const BLASInstance* GetInstances( const BVHBase* bvh, BVHBase* const** blasList = 0 );
+	// octant follows the sign of rD, not D: safercp maps tiny components to +BVH_FAR.
+	static uint32_t RayOctant( const Ray& ray ) { return (ray.rD.x > 0 ? 1 : 0) + (ray.rD.y > 0 ? 2 : 0) + (ray.rD.z > 0 ? 4 : 0); }
 };
 
-class BLASInstance;
 class BVH_Verbose;
+class ThreadPool;
 class BVH : public BVHBase
 {
 public:
@@ -747,6 +917,14 @@ public:
 	void BuildHQ( const bvhvec4slice& vertices );
 	void BuildHQ( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
 	void BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	void BuildLBVH( const bvhvec4* vertices, const uint32_t primCount );
+	void BuildLBVH( const bvhvec4slice& vertices );
+	void BuildLBVH( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
+	void BuildLBVH( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	void BuildPLOC( const bvhvec4* vertices, const uint32_t primCount );
+	void BuildPLOC( const bvhvec4slice& vertices );
+	void BuildPLOC( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
+	void BuildPLOC( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 #ifdef BVH_USEAVX
 	void BuildAVX( const bvhvec4* vertices, const uint32_t primCount );
 	void BuildAVX( const bvhvec4slice& vertices );
@@ -760,23 +938,70 @@ public:
 	void PrepareNEONBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 	void BuildNEON();
 #endif
+#ifdef ENABLE_THREADED_BUILDS
+	void BuildMT( const bvhvec4* vertices, const uint32_t primCount );
+	void BuildMT( const bvhvec4slice& vertices );
+	void BuildMT( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
+	void BuildMT( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	static void BuildBatch( BVH** bvh, const BuildInput* input, const uint32_t count, ThreadPool* pool = 0 );
+#endif
+	// Deformation blur: vertex positions for ray time 0 and 1; interpolated per ray.
+	void BuildMotion( const bvhvec4* vertices0, const bvhvec4* vertices1, const uint32_t primCount );
+	void BuildMotion( const bvhvec4slice& vertices0, const bvhvec4slice& vertices1, const uint32_t* indices = 0, const uint32_t primCount = 0 );
 	void Refit( const uint32_t nodeIdx = 0 );
+	bool UpdateTLAS( const float maxCostGrowth = 1.5f ); // after moving instances; true if rebuilt.
 	void Optimize( const uint32_t iterations = 25, bool extreme = false );
 	void CombineLeafs( const uint32_t primCount );
+	void PrecomputeLeafTris();		// optional: store leaf triangles in 4-wide SoA blocks; requires BVH_USEAVX2.
+	void DiscardLeafTris();
+	void RefitMotion();				// deformation blur: recreate the time 1 bounds after a topology change.
+	void DiscardMotion();
 	int32_t Intersect( Ray& ray ) const;
 	bool IntersectSphere( const bvhvec3& pos, const float r ) const;
 	bool IsOccluded( const Ray& ray ) const;
+	void IsOccluded( const Ray* rays, const uint32_t count, uint32_t* occludedMask ) const { BATCH_SHADOW_QUERY( rays, count, occludedMask ); }
+	void IntersectBatch( Ray* rays, const uint32_t count ) const;
+	// Ray reordering: sort a ray buffer by octant, quantized direction and origin
+	// cell, trace it in sorted order and scatter the hits back. Timings in seconds.
+	struct SortStats { float sortTime, traceTime, scatterTime; };
+	void IntersectSorted( Ray* rays, const uint32_t count, SortStats* stats = 0, const uint32_t dirBits = 1 ) const;
+	// Intersect / IsOccluded specialize for ray octant using templated functions.
+	template <bool posX, bool posY, bool posZ> int32_t Intersect( Ray& ray ) const;
+	template <bool posX, bool posY, bool posZ> bool IsOccluded( const Ray& ray ) const;
+	typedef int32_t (BVH::*IntersectKernel)(Ray&) const;
+	typedef bool (BVH::*OcclusionKernel)(const Ray&) const;
+	static const IntersectKernel intersectKernel[8];
+	static const OcclusionKernel occlusionKernel[8];
 	void Intersect256Rays( Ray* first ) const;
 	void Intersect256RaysSSE( Ray* packet ) const; // requires BVH_USEAVX
+	void Intersect256RaysSpread( Ray* packet ) const; // origins may differ
 	// private:
 	void PrepareBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	void PrepareFragments( const uint32_t* indices );
+	void PrepareFragments( const uint32_t* indices, const uint32_t first, const uint32_t last, bvhvec3& bmin, bvhvec3& bmax );
 	void Build();
+	bool SubdivideNode( const uint32_t nodeIdx, const uint32_t childIdx, const bvhvec3& minDim, ThreadPool* pool = 0 );
+	uint32_t BuildSubtree( const uint32_t nodeIdx, uint32_t nodePtr, const bvhvec3& minDim );
+	void RefitSubtree( const uint32_t nodeIdx );
+	void LinkTLAS();
+#ifdef ENABLE_THREADED_BUILDS
+	void BuildMT();
+	void BuildMTTask( ThreadPool& pool, TaskGroup& group, const uint32_t nodeIdx, const uint32_t nodePtr, const bvhvec3& minDim );
+#endif
 	bool IsOccludedTLAS( const Ray& ray ) const;
 	int32_t IntersectTLAS( Ray& ray ) const;
+	bool IsOccludedMotion( const Ray& ray ) const;
+	int32_t IntersectMotion( Ray& ray ) const;
+	void MotionTri( const uint32_t prim, const float time, bvhvec4* tri ) const;
 	void PrepareAVXBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
 	void BuildAVX();
 	void PrepareHQBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t prims );
 	void BuildHQ();
+	struct HQBuildState;
+	void BuildHQSubtree( HQBuildState& state, uint32_t nodeIdx, uint32_t sliceStart, uint32_t sliceEnd );
+	void BuildLBVH();
+	void BuildPLOC();
+	void SortFragmentsMorton( uint64_t* keys );
 	bool ClipFrag( const Fragment& orig, Fragment& newFrag, bvhvec3 bmin, bvhvec3 bmax, bvhvec3 minDim, const uint32_t splitAxis );
 	void SplitFrag( const Fragment& orig, Fragment& left, Fragment& right, const bvhvec3& minDim, const uint32_t splitAxis, const float splitPos, bool& leftOK, bool& rightOK );
 protected:
@@ -790,6 +1015,7 @@ public:
 	bool isBLAS() const { return instList == 0; }
 	bool isIndexed() const { return vertIdx != 0; }
 	bool hasCustomGeom() const { return customIntersect != 0; }
+	bool hasMotion() const { return bvhNode1 != 0; }
 	// Basic BVH data
 	bvhvec4slice verts = {};		// pointer to input primitive array: 3x16 bytes per tri.
 	uint32_t* vertIdx = 0;			// vertex indices, only used in case the BVH is built over indexed prims.
@@ -800,6 +1026,16 @@ public:
 	BVHNode* bvhNode = 0;			// BVH node pool, Wald 32-byte format. Root is always in node 0.
 	uint32_t newNodePtr = 0;		// used during build to keep track of next free node in pool.
 	Fragment* fragment = 0;			// input primitive bounding boxes.
+	BVHTri4Leaf* leafTris = 0;		// optional leaf triangles in SoA blocks, see PrecomputeLeafTris.
+	uint32_t* leafTriBlock = 0;		// per node: index of the first block in leafTris.
+	bvhvec4slice verts1 = {};		// deformation blur: vertices at ray time 1; 'verts' has time 0.
+	BVHNode* bvhNode1 = 0;			// deformation blur: node bounds at ray time 1, same topology.
+	CompactInstance* instData = 0;	// per instance: inverse transform and blas index, for TLAS traversal.
+	uint32_t allocatedInstData = 0;	// number of CompactInstance records allocated.
+	uint32_t* tlasParent = 0;		// TLAS updates: parent of each node, see UpdateTLAS.
+	uint32_t* tlasInstLeaf = 0;		// TLAS updates: leaf node of each instance.
+	float tlasCost = 0;				// TLAS updates: current SAH cost, not normalized; 0 if unlinked.
+	float tlasBuildCost = 0;		// TLAS updates: SAH cost after the last full build.
 	// Custom geometry intersection callback
 	bool (*customIntersect)(Ray&, const unsigned) = 0;
 	bool (*customIsOccluded)(const Ray&, const unsigned) = 0;
@@ -839,6 +1075,7 @@ public:
 	double SAHCost( const uint64_t nodeIdx = 0 ) const;
 	int32_t Intersect( RayEx& ray ) const;
 	bool IsOccluded( const RayEx& ray ) const;
+	void IsOccluded( const RayEx* rays, const uint32_t count, uint32_t* occludedMask ) const { BATCH_SHADOW_QUERY( rays, count, occludedMask ); }
 	bool IsOccludedTLAS( const RayEx& ray ) const;
 	int32_t IntersectTLAS( RayEx& ray ) const;
 	bvhdbl3* verts = 0;				// pointer to input primitive array, double-precision, 3x24 bytes per tri.
@@ -892,7 +1129,8 @@ public:
 	float SAHCost( const uint32_t nodeIdx = 0 ) const { return bvh.SAHCost( nodeIdx ); }
 	void ConvertFrom( const BVH& original, bool compact = true );
 	int32_t Intersect( Ray& ray ) const;
-	bool IsOccluded( const Ray& ray ) const { FALLBACK_SHADOW_QUERY( ray ); }
+	bool IsOccluded( const Ray& ray ) const;
+	void IsOccluded( const Ray* rays, const uint32_t count, uint32_t* occludedMask ) const { BATCH_SHADOW_QUERY( rays, count, occludedMask ); }
 	// BVH data
 	BVHNode* bvhNode = 0;			// BVH node in Aila & Laine format.
 	BVH bvh;						// BVH4 is created from BVH and uses its data.
@@ -928,10 +1166,22 @@ public:
 	bool Load( const char* fileName, const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
 	bool Load( const char* fileName, const bvhvec4slice& vertices, const uint32_t* indices = 0, const uint32_t primCount = 0 );
 	void ConvertFrom( const BVH& original, bool compact = true );
+	void PrecomputeLeafTris();		// optional: store leaf triangles in 4-wide SoA blocks; requires BVH_USEAVX2.
+	void DiscardLeafTris();
 	int32_t Intersect( Ray& ray ) const;
 	bool IsOccluded( const Ray& ray ) const;
+	void IsOccluded( const Ray* rays, const uint32_t count, uint32_t* occludedMask ) const { BATCH_SHADOW_QUERY( rays, count, occludedMask ); }
+	void IntersectBatch( Ray* rays, const uint32_t count ) const { OCTANT_BATCH( rays, count ); }
+	// Intersect / IsOccluded specialize for ray octant using templated functions.
+	template <bool posX, bool posY, bool posZ> int32_t Intersect( Ray& ray ) const;
+	template <bool posX, bool posY, bool posZ> bool IsOccluded( const Ray& ray ) const;
+	typedef int32_t (BVH_SoA::*IntersectKernel)(Ray&) const;
+	typedef bool (BVH_SoA::*OcclusionKernel)(const Ray&) const;
+	static const IntersectKernel intersectKernel[8];
+	static const OcclusionKernel occlusionKernel[8];
 	// BVH data
 	BVHNode* bvhNode = 0;			// BVH node in 'structure of arrays' format.
+	BVHTri4Leaf* leafTris = 0;		// optional leaf triangles in SoA blocks; leaf.left is the first block.
 	BVH bvh;						// BVH_SoA is created from BVH and uses its data.
 	bool ownBVH = true;				// False when ConvertFrom receives an external bvh.
 };
@@ -968,7 +1218,11 @@ private:
 	struct SortItem { uint32_t idx; float cost; };
 	void RefitUp( uint32_t nodeIdx );
 	float SAHCostUp( uint32_t nodeIdx ) const;
-	uint32_t FindBestNewPosition( const uint32_t Lid ) const;
+	uint32_t FindBestNewPosition( const uint32_t Lid, const uint32_t Nid = 0 ) const;
+	void ReinsertChildren( const uint32_t Nid, uint32_t Xbest1 = 0, uint32_t Xbest2 = 0 );
+#ifdef ENABLE_THREADED_BUILDS
+	void OptimizeMT( const uint32_t iterations, const bool extreme );
+#endif
 	uint32_t CountSubtreeTris( const uint32_t nodeIdx, uint32_t* counters );
 	void MergeSubtree( const uint32_t nodeIdx, uint32_t* newIdx, uint32_t& newIdxPtr );
 public:
@@ -1008,6 +1262,9 @@ public:
 	uint32_t LeafCount( const uint32_t nodeIdx = 0 ) const;
 	float SAHCost( const uint32_t nodeIdx = 0 ) const;
 	void ConvertFrom( const BVH& original, bool compact = true );
+private:
+	void RefitSubtree( const uint32_t nodeIdx );
+public:
 	// BVH data
 	MBVHNode* mbvhNode = 0;			// BVH node for M-wide BVH.
 	BVH bvh;						// MBVH<M> is created from BVH and uses its data.
@@ -1051,7 +1308,8 @@ public:
 	void ConvertFrom( const MBVH<4>& original, bool compact = true );
 	float SAHCost( const uint32_t nodeIdx = 0 ) const { return bvh4.SAHCost( nodeIdx ); }
 	int32_t Intersect( Ray& ray ) const;
-	bool IsOccluded( const Ray& ray ) const { FALLBACK_SHADOW_QUERY( ray ); }
+	bool IsOccluded( const Ray& ray ) const;
+	void IsOccluded( const Ray* rays, const uint32_t count, uint32_t* occludedMask ) const { BATCH_SHADOW_QUERY( rays, count, occludedMask ); }
 	// BVH data
 	bvhvec4* bvh4Data = 0;			// 64-byte 4-wide BVH node for efficient GPU rendering.
 	uint32_t allocatedBlocks = 0;	// node data and triangles are stored in 16-byte blocks.
@@ -1084,18 +1342,46 @@ public:
 	void BuildHQ( const bvhvec4slice& vertices );
 	void BuildHQ( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
 	void BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	void Build( BLASInstance* instances, const uint32_t instCount, BVHBase** blasses, const uint32_t blasCount );
+#ifdef ENABLE_THREADED_BUILDS
+	void BuildMT( const bvhvec4* vertices, const uint32_t primCount );
+	void BuildMT( const bvhvec4slice& vertices );
+	void BuildMT( const bvhvec4* vertices, const uint32_t* indices, const uint32_t primCount );
+	void BuildMT( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t primCount );
+	static void BuildBatch( BVH4_CPU** bvh, const BuildInput* input, const uint32_t count, ThreadPool* pool = 0 );
+#endif
 	void Optimize( const uint32_t iterations = 25, bool extreme = false );
+	void Refit();
 	void Save( const char* fileName );
 	bool Load( const char* fileName, const uint32_t primCount );
 	float SAHCost( const uint32_t nodeIdx = 0 ) const;
 	void ConvertFrom( const MBVH<4>& original, bool compact = true );
 	int32_t Intersect( Ray& ray ) const;
 	bool IsOccluded( const Ray& ray ) const;
+	void IsOccluded( const Ray* rays, const uint32_t count, uint32_t* occludedMask ) const { BATCH_SHADOW_QUERY( rays, count, occludedMask ); }
+	void IntersectStream( Ray* rays, const uint32_t count ) const;
+	void IntersectBatch( Ray* rays, const uint32_t count ) const { OCTANT_BATCH( rays, count ); }
+	// Intersect / IsOccluded specialize for ray octant using templated functions.
+	template <bool posX, bool posY, bool posZ> int32_t Intersect( Ray& ray ) const;
+	template <bool posX, bool posY, bool posZ> bool IsOccluded( const Ray& ray ) const;
+	typedef int32_t (BVH4_CPU::*IntersectKernel)(Ray&) const;
+	typedef bool (BVH4_CPU::*OcclusionKernel)(const Ray&) const;
+	static const IntersectKernel intersectKernel[8];
+	static const OcclusionKernel occlusionKernel[8];
+private:
+	void RefitSubtree( const uint32_t nodeIdx, bvhvec3& bmin, bvhvec3& bmax );
+public:
 	// BVH data
 	BVHNode* bvh4Node = 0;			// 128-byte 4-wide BVH node for efficient CPU rendering.
 	bvhvec4* bvh4Tris = 0;			// triangle data for BVHNode4Alt2 nodes.
 	MBVH<4> bvh4;					// BVH4_CPU is created from BVH4 and uses its data.
 	bool ownBVH4 = true;			// False when ConvertFrom receives an external bvh4.
+	// TLAS data, see Build( BLASInstance*, .. ). Leafs refer to instances by index.
+	BLASInstance* instList = 0;		// instance array, for top-level acceleration structure.
+	BVHBase** blasList = 0;			// blas array, for TLAS traversal.
+	const uint32_t* instIdx = 0;	// instance index array, owned by the underlying BVH.
+	const CompactInstance* instData = 0; // traversal data per instance, owned by the underlying BVH.
+	bool isTLAS() const { return instList != 0; }
 };
 
 class BVH8_CWBVH : public BVHBase
@@ -1118,7 +1404,12 @@ public:
 	void ConvertFrom( MBVH<8>& original, bool compact = true );
 	float SAHCost( const uint32_t nodeIdx = 0 ) const;
 	int32_t Intersect( Ray& ray ) const;
-	bool IsOccluded( const Ray& ray ) const { FALLBACK_SHADOW_QUERY( ray ); }
+	bool IsOccluded( const Ray& ray ) const;
+	void IsOccluded( const Ray* rays, const uint32_t count, uint32_t* occludedMask ) const { BATCH_SHADOW_QUERY( rays, count, occludedMask ); }
+private:
+	// closest-hit traversal stores the nearest hit in 'hit'; any-hit returns at the first hit.
+	template <bool anyHit> bool Traverse( const Ray& ray, Intersection& hit ) const;
+public:
 	// BVH8 data
 	bvhvec4* bvh8Data = 0;			// nodes in CWBVH format.
 	bvhvec4* bvh8Tris = 0;			// triangle data for CWBVH nodes.
@@ -1128,7 +1419,8 @@ public:
 	bool ownBVH8 = true;			// false when ConvertFrom receives an external bvh8.
 };
 
-// Storage for up to four triangles, in SoA layout, for BVH4_AVX2_WIP and BVH8_CPU.
+// Storage for up to four triangles, in SoA layout, for BVH4_AVX2_WIP and BVH8_CPU,
+// and for the optional leaf blocks of BVH and BVH_SoA.
 struct BVHTri4Leaf
 {
 	SIMDVEC4 v0x4, v0y4, v0z4;
@@ -1176,6 +1468,7 @@ public:
 	void ConvertFrom( const MBVH<4>& original, bool compact = true );
 	int32_t Intersect( Ray& ray ) const;
 	bool IsOccluded( const Ray& ray ) const;
+	void IsOccluded( const Ray* rays, const uint32_t count, uint32_t* occludedMask ) const { BATCH_SHADOW_QUERY( rays, count, occludedMask ); }
 	// Intersect / IsOccluded specialize for ray octant using templated functions.
 	template <bool posX, bool posY, bool posZ> bool IsOccluded( const Ray& ray ) const;
 	// BVH4 data
@@ -1224,21 +1517,54 @@ public:
 	void BuildHQ( const bvhvec4slice& vertices );
 	void BuildHQ( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims );
 	void BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims );
+	void Build( BLASInstance* instances, const uint32_t instCount, BVHBase** blasses, const uint32_t blasCount );
+#ifdef ENABLE_THREADED_BUILDS
+	void BuildMT( const bvhvec4* vertices, const uint32_t primCount );
+	void BuildMT( const bvhvec4slice& vertices );
+	void BuildMT( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims );
+	void BuildMT( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims );
+	static void BuildBatch( BVH8_CPU** bvh, const BuildInput* input, const uint32_t count, ThreadPool* pool = 0 );
+#endif
 	void Optimize( const uint32_t iterations, bool extreme );
 	void Refit();
 	float SAHCost( const uint32_t nodeIdx ) const;
 	void ConvertFrom( const MBVH<8>& original );
 	int32_t Intersect( Ray& ray ) const;
 	bool IsOccluded( const Ray& ray ) const;
+	void IsOccluded( const Ray* rays, const uint32_t count, uint32_t* occludedMask ) const;
+	void IntersectStream( Ray* rays, const uint32_t count ) const;
+	// Packet traversal for coherent rays; IsOccluded returns a mask of occluded rays.
+	void Intersect8Rays( Ray* packet ) const;
+	void Intersect16Rays( Ray* packet ) const;
+	uint32_t IsOccluded8Rays( const Ray* packet ) const;
+	uint32_t IsOccluded16Rays( const Ray* packet ) const;
+	void IntersectBatch( Ray* rays, const uint32_t count ) const { OCTANT_BATCH( rays, count ); }
 	// Intersect / IsOccluded specialize for ray octant using templated functions.
 	template <bool posX, bool posY, bool posZ> int32_t Intersect( Ray& ray ) const;
 	template <bool posX, bool posY, bool posZ> bool IsOccluded( const Ray& ray ) const;
+	typedef int32_t (BVH8_CPU::*IntersectKernel)(Ray&) const;
+	typedef bool (BVH8_CPU::*OcclusionKernel)(const Ray&) const;
+	static const IntersectKernel intersectKernel[8];
+	static const OcclusionKernel occlusionKernel[8];
+private:
+	void RefitSubtree( const uint32_t blockIdx, bvhvec3& bmin, bvhvec3& bmax );
+	template <uint32_t K, bool occlusion> uint32_t IntersectPacket( const Ray* packet, Ray* hits ) const;
+#ifdef BVH8_CPU_COMPACT
+	static void QuantizeNode( BVHNodeCompact* compact, const BVHNode* node, const bvhvec3& bmin, const bvhvec3& bmax );
+#endif
+public:
 	// BVH8 data
 	CacheLine* bvh8Data = 0;		// Interleaved interior (256b) and leaf (192b) data.
 	MBVH<8> bvh8;					// BVH8_CPU is created from BVH8 and uses its data.
 	bool ownBVH8 = true;			// false when ConvertFrom receives an external bvh8.
 	uint32_t allocatedBlocks = 0;	// node data and triangles are stored in 16-byte blocks.
 	uint32_t usedBlocks = 0;		// the amount of data actually used.
+	// TLAS data, see Build( BLASInstance*, .. ). Leafs refer to instances by index.
+	BLASInstance* instList = 0;		// instance array, for top-level acceleration structure.
+	BVHBase** blasList = 0;			// blas array, for TLAS traversal.
+	const uint32_t* instIdx = 0;	// instance index array, owned by the underlying BVH.
+	const CompactInstance* instData = 0; // traversal data per instance, owned by the underlying BVH.
+	bool isTLAS() const { return instList != 0; }
 };
 
 // BLASInstance: A TLAS is built over BLAS instances, where a single BLAS can be
@@ -1254,9 +1580,37 @@ public:
 	bvhvec3 aabbMin = bvhvec3( BVH_FAR );
 	uint32_t blasIdx = 0;
 	bvhvec3 aabbMax = bvhvec3( -BVH_FAR );
-	uint32_t dummy[9]; // pad struct to 64 byte
+	uint32_t dirty = 0; // set when the transform changes; see BVH::UpdateTLAS.
+	const float* keyframes = 0; // motion blur: keyCount 4x4 transforms, spread evenly over ray time 0..1.
+	uint32_t keyCount = 0; // transform is used if keyCount < 2.
+	uint32_t dummy[5]; // pad struct to 64 byte
+	void SetTransform( const float* T ) { memcpy( transform, T, sizeof( transform ) ), dirty = 1; }
+	void SetKeyframes( const float* T, const uint32_t count ) { keyframes = T, keyCount = count, dirty = 1; }
+	void GetTransform( const float time, float* T ) const;
+	void TransformRay( const Ray& ray, Ray& tmp ) const;
 	void Update( BVHBase * blas );
 	void InvertTransform();
+	static void InvertMatrix( const float* T, float* invT );
+};
+
+// CompactInstance: the part of a BLASInstance that TLAS traversal needs. The inverse
+// transform is assumed to be affine and is stored per column, so that a ray can be
+// transformed with a few SIMD multiply-adds. Filled in by the TLAS builds.
+struct ALIGNED( 32 ) CompactInstance
+{
+#ifdef TLAS_HALF_TRANSFORMS
+	uint16_t invT[9];			// columns 0..2 of the inverse transform, half precision.
+	uint16_t blasIdx : 15;		// index of the BLAS in the TLAS blas list.
+	uint16_t moving : 1;		// keyframed instance; see BLASInstance::TransformRay.
+	bvhvec3 position;			// instance translation; O' = M * (O - position) keeps rounding local.
+#else
+	bvhvec3 col0; uint32_t blasIdx;
+	bvhvec3 col1; uint32_t moving;	// keyframed instance; see BLASInstance::TransformRay.
+	bvhvec3 col2; uint32_t dummy2;
+	bvhvec3 col3; uint32_t dummy3;
+#endif
+	void Set( const BLASInstance& inst );
+	void TransformRay( const Ray& ray, Ray& tmp ) const;
 };
 
 #ifdef DOUBLE_PRECISION_SUPPORT
@@ -1296,6 +1650,8 @@ public:
 #include <intrin.h>			// for __lzcnt
 #endif
 #include <fstream>			// fstream
+#include <algorithm>		// for std::sort
+#include <chrono>			// for BVH::IntersectSorted timings
 
 // We need quite a bit of type reinterpretation, so we'll
 // turn off the gcc warning here until the end of the file.
@@ -1359,12 +1715,12 @@ const bvhvec4& bvhvec4slice::operator[]( size_t i ) const
 	return *reinterpret_cast<const bvhvec4*>(data + stride * i);
 }
 
-void* BVHBase::AlignedAlloc( size_t size )
+void* BVHBase::AlignedAlloc( size_t size ) const
 {
 	return context.malloc ? context.malloc( size, context.userdata ) : nullptr;
 }
 
-void BVHBase::AlignedFree( void* ptr )
+void BVHBase::AlignedFree( void* ptr ) const
 {
 	if (context.free)
 		context.free( ptr, context.userdata );
@@ -1384,6 +1740,352 @@ void BVHBase::CopyBasePropertiesFrom( const BVHBase& original )
 	this->aabbMin = original.aabbMin, this->aabbMax = original.aabbMax;
 }
 
+#ifdef ENABLE_THREADED_BUILDS
+ThreadPool& BVHBase::GetThreadPool() const
+{
+	return context.threadPool ? *context.threadPool : ThreadPool::Default();
+}
+#endif
+
+#ifdef ENABLE_THREADED_BUILDS
+
+// ThreadPool implementation
+// ----------------------------------------------------------------------------
+
+static thread_local ThreadPool* tinybvh_pool = 0;	// pool that owns the current thread, if any.
+static thread_local uint32_t tinybvh_queue = 0;		// task queue of the current thread in that pool.
+
+ThreadPool::ThreadPool( const uint32_t threads )
+{
+	const uint32_t cores = std::thread::hardware_concurrency();
+	workerCount = (threads > 0 ? threads : (cores > 0 ? cores : 1)) - 1;
+	queue = new TaskQueue[workerCount + 1];
+	worker = new std::thread[workerCount];
+	for (uint32_t i = 0; i < workerCount; i++) worker[i] = std::thread( &ThreadPool::WorkerLoop, this, i + 1 );
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock( sleepLock );
+		quit = true;
+	}
+	wakeup.notify_all();
+	for (uint32_t i = 0; i < workerCount; i++) worker[i].join();
+	delete[] worker;
+	delete[] queue;
+}
+
+ThreadPool& ThreadPool::Default()
+{
+	// shared pool, created on first use; uses all available cores.
+	static ThreadPool pool;
+	return pool;
+}
+
+void ThreadPool::Run( TaskGroup& group, const std::function<void()>& task )
+{
+	const uint32_t q = tinybvh_pool == this ? tinybvh_queue : 0;
+	group.pending++;
+	{
+		std::lock_guard<std::mutex> lock( queue[q].lock );
+		Task t;
+		t.func = task, t.group = &group;
+		queue[q].tasks.push_back( t );
+	}
+	{
+		std::lock_guard<std::mutex> lock( sleepLock );
+		queued++;
+	}
+	wakeup.notify_one();
+}
+
+void ThreadPool::ParallelFor( const uint32_t count, const uint32_t chunks, const std::function<void( const uint32_t chunk, const uint32_t first, const uint32_t last )>& body )
+{
+	// split [0..count) in 'chunks' equal parts, and process these concurrently.
+	TaskGroup group;
+	for (uint32_t i = 1; i < chunks; i++)
+	{
+		const uint32_t first = (uint32_t)(((uint64_t)count * i) / chunks);
+		const uint32_t last = (uint32_t)(((uint64_t)count * (i + 1)) / chunks);
+		Run( group, [&body, i, first, last]() { body( i, first, last ); } );
+	}
+	body( 0, 0, (uint32_t)((uint64_t)count / (chunks > 0 ? chunks : 1)) );
+	Wait( group );
+}
+
+void ThreadPool::Wait( TaskGroup& group )
+{
+	// help out while waiting; this also makes it safe to wait inside a task.
+	const uint32_t q = tinybvh_pool == this ? tinybvh_queue : 0;
+	while (group.pending > 0) if (!RunPendingTask( q )) std::this_thread::yield();
+}
+
+bool ThreadPool::RunPendingTask( const uint32_t queueIdx )
+{
+	// take the most recent task from our own queue, or steal the oldest task
+	// from another queue: stolen tasks tend to be the large ones.
+	Task task;
+	bool found = false;
+	{
+		TaskQueue& own = queue[queueIdx];
+		std::lock_guard<std::mutex> lock( own.lock );
+		if (!own.tasks.empty()) task = own.tasks.back(), own.tasks.pop_back(), found = true;
+	}
+	for (uint32_t i = 1; i <= workerCount && !found; i++)
+	{
+		TaskQueue& victim = queue[(queueIdx + i) % (workerCount + 1)];
+		std::lock_guard<std::mutex> lock( victim.lock );
+		if (!victim.tasks.empty()) task = victim.tasks.front(), victim.tasks.pop_front(), found = true;
+	}
+	if (!found) return false;
+	queued--;
+	task.func();
+	task.group->pending--;
+	return true;
+}
+
+void ThreadPool::WorkerLoop( const uint32_t queueIdx )
+{
+	tinybvh_pool = this, tinybvh_queue = queueIdx;
+	while (1)
+	{
+		if (RunPendingTask( queueIdx )) continue;
+		std::unique_lock<std::mutex> lock( sleepLock );
+		wakeup.wait( lock, [this]() { return quit || queued > 0; } );
+		if (quit) break;
+	}
+}
+
+#endif
+
+// Run body( chunk, first, last ) over [0..count): in parallel for large counts if
+// a thread pool is specified, otherwise as a single chunk on the calling thread.
+template <class F> void tinybvh_parallel_for( ThreadPool* pool, const uint32_t count, const F& body )
+{
+#ifdef ENABLE_THREADED_BUILDS
+	if (pool && count >= MT_BIN_THRESHOLD) { pool->ParallelFor( count, pool->ThreadCount(), body ); return; }
+#else
+	(void)pool;
+#endif
+	body( 0, 0, count );
+}
+inline uint32_t tinybvh_chunk_count( ThreadPool* pool, const uint32_t count )
+{
+#ifdef ENABLE_THREADED_BUILDS
+	if (pool && count >= MT_BIN_THRESHOLD) return pool->ThreadCount();
+#else
+	(void)pool, (void)count;
+#endif
+	return 1;
+}
+
+#ifdef ENABLE_THREADED_BUILDS
+
+// Refit a large tree using all threads. The tree is expanded breadth-first until
+// there are plenty of subtrees to keep all threads busy; these are refitted in
+// parallel, after which the expanded nodes are refitted bottom-up.
+// getChildren( node, child ) stores the (up to 8) children of a node and returns
+// their number, which is 0 for leafs; refitSubtree( node ) refits a complete
+// subtree, and refitInterior( node ) updates an interior node from its children.
+template <class C, class S, class I> void tinybvh_parallel_refit( BVHBase& bvh, const C& getChildren, const S& refitSubtree, const I& refitInterior )
+{
+	ThreadPool& pool = bvh.GetThreadPool();
+	const uint32_t target = pool.ThreadCount() * 16, maxExpand = target * 4;
+	uint32_t* queue = (uint32_t*)bvh.AlignedAlloc( (1 + maxExpand * 8) * sizeof( uint32_t ) ), first = 0, last = 1, child[8];
+	queue[0] = 0;
+	while (first < last && last - first < target && first < maxExpand)
+		for (uint32_t n = getChildren( queue[first++], child ), i = 0; i < n; i++) queue[last++] = child[i];
+	pool.ParallelFor( last - first, last - first, [&]( const uint32_t, const uint32_t a, const uint32_t b ) {
+		for (uint32_t i = a; i < b; i++) refitSubtree( queue[first + i] );
+	} );
+	for (int32_t i = (int32_t)first - 1; i >= 0; i--)
+		if (getChildren( queue[i], child ) == 0) refitSubtree( queue[i] ); else refitInterior( queue[i] );
+	bvh.AlignedFree( queue );
+}
+
+// Schedule a batch of independent builds. Meshes of MT_BUILD_THRESHOLD primitives or
+// more get a task each and are built with a threaded builder, which splits them over
+// the pool; smaller meshes are packed, largest first, into one bin per thread, each
+// time adding to the bin with the least work. build( i, large ) builds mesh i.
+template <class B> void tinybvh_build_batch( ThreadPool& pool, const BuildInput* input, const uint32_t count, const B& build )
+{
+	if (count == 0) return;
+	const uint32_t bins = pool.ThreadCount(), END = 0xffffffff;
+	uint64_t* key = (uint64_t*)malloc64( count * sizeof( uint64_t ) );
+	uint64_t* load = (uint64_t*)malloc64( bins * sizeof( uint64_t ) );
+	uint32_t* next = (uint32_t*)malloc64( (count + bins) * sizeof( uint32_t ) ), * head = next + count;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const uint64_t prims = input[i].primCount ? input[i].primCount : input[i].vertices.count / 3;
+		key[i] = ((0xffffffffull - prims) << 32) + i; // ascending order: largest mesh first.
+	}
+	std::sort( key, key + count );
+	memset( load, 0, bins * sizeof( uint64_t ) );
+	memset( head, 255, bins * sizeof( uint32_t ) );
+	TaskGroup group;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const uint32_t idx = (uint32_t)key[i], prims = 0xffffffff - (uint32_t)(key[i] >> 32);
+		if (prims >= MT_BUILD_THRESHOLD) { pool.Run( group, [&build, idx]() { build( idx, true ); } ); continue; }
+		uint32_t bin = 0;
+		for (uint32_t b = 1; b < bins; b++) if (load[b] < load[bin]) bin = b;
+		load[bin] += prims + 1, next[idx] = head[bin], head[bin] = idx;
+	}
+	for (uint32_t b = 0; b < bins; b++) if (head[b] != END) pool.Run( group, [&build, next, head, b]() {
+		for (uint32_t idx = head[b]; idx != END; idx = next[idx]) build( idx, false );
+	} );
+	pool.Wait( group );
+	free64( key );
+	free64( load );
+	free64( next );
+}
+
+#endif
+
+// Morton code helpers
+inline int32_t tinybvh_clz64( const uint64_t x ) // x must be nonzero
+{
+#if defined(_MSC_VER) && !defined(__clang__) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long r;
+	_BitScanReverse64( &r, x );
+	return 63 - (int32_t)r;
+#elif defined(__GNUC__) || defined(__clang__)
+	return __builtin_clzll( x );
+#else
+	int32_t n = 0;
+	for (uint64_t m = 1ull << 63; !(x & m); m >>= 1) n++;
+	return n;
+#endif
+}
+inline uint64_t tinybvh_spread_bits( uint64_t x ) // insert two zeroes between each of the lowest 21 bits
+{
+	x &= 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffull;
+	x = (x | x << 16) & 0x1f0000ff0000ffull;
+	x = (x | x << 8) & 0x100f00f00f00f00full;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
+}
+inline uint64_t tinybvh_morton( const uint32_t x, const uint32_t y, const uint32_t z )
+{
+	return tinybvh_spread_bits( x ) | (tinybvh_spread_bits( y ) << 1) | (tinybvh_spread_bits( z ) << 2);
+}
+
+void BVHBase::RadixSort( uint64_t* keys, uint32_t* values, const uint32_t count, const uint32_t keyBits ) const
+{
+	// LSD radix sort of key/value pairs, 8 bits per pass. Large arrays are sorted
+	// by all threads: each thread builds a histogram for its part of the array,
+	// after which each thread scatters its part, which keeps the sort stable.
+#ifdef ENABLE_THREADED_BUILDS
+	ThreadPool* pool = count >= MT_BIN_THRESHOLD ? &GetThreadPool() : 0;
+#else
+	ThreadPool* pool = 0;
+#endif
+	const uint32_t chunks = tinybvh_chunk_count( pool, count );
+	uint64_t* keyTmp = (uint64_t*)AlignedAlloc( count * sizeof( uint64_t ) );
+	uint32_t* valueTmp = (uint32_t*)AlignedAlloc( count * sizeof( uint32_t ) );
+	uint32_t* offset = (uint32_t*)AlignedAlloc( chunks * 256 * sizeof( uint32_t ) );
+	uint64_t* srcKey = keys, * dstKey = keyTmp;
+	uint32_t* srcValue = values, * dstValue = valueTmp;
+	for (uint32_t shift = 0; shift < keyBits; shift += 8)
+	{
+		memset( offset, 0, chunks * 256 * sizeof( uint32_t ) );
+		tinybvh_parallel_for( pool, count, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+			uint32_t* hist = offset + chunk * 256;
+			for (uint32_t i = first; i < last; i++) hist[(srcKey[i] >> shift) & 255]++;
+		} );
+		for (uint32_t sum = 0, digit = 0; digit < 256; digit++) for (uint32_t c = 0; c < chunks; c++)
+		{
+			const uint32_t n = offset[c * 256 + digit];
+			offset[c * 256 + digit] = sum, sum += n;
+		}
+		tinybvh_parallel_for( pool, count, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+			uint32_t* dst = offset + chunk * 256;
+			for (uint32_t i = first; i < last; i++)
+			{
+				const uint32_t j = dst[(srcKey[i] >> shift) & 255]++;
+				dstKey[j] = srcKey[i], dstValue[j] = srcValue[i];
+			}
+		} );
+		tinybvh_swap( srcKey, dstKey );
+		tinybvh_swap( srcValue, dstValue );
+	}
+	if (srcKey != keys) // odd number of passes; copy back.
+		memcpy( keys, srcKey, count * sizeof( uint64_t ) ),
+		memcpy( values, srcValue, count * sizeof( uint32_t ) );
+	AlignedFree( offset );
+	AlignedFree( valueTmp );
+	AlignedFree( keyTmp );
+}
+
+void BVHBase::SortRays( const Ray* rays, const uint32_t count, uint32_t* order, const uint32_t dirBits ) const
+{
+	// order rays by direction octant first, optionally by their direction quantized
+	// to dirBits per axis within the octant next, and by the Morton code of their
+	// origin, quantized to the bounds of the BVH, last. Rays in one octant share the
+	// traversal order of each node; rays with nearby origins visit similar nodes.
+	FATAL_ERROR_IF( dirBits > 7, "BVHBase::SortRays( .. ), dirBits must be 7 or less." );
+#ifdef ENABLE_THREADED_BUILDS
+	ThreadPool* pool = count >= MT_BIN_THRESHOLD ? &GetThreadPool() : 0;
+#else
+	ThreadPool* pool = 0;
+#endif
+	const bvhvec3 extent = aabbMax - aabbMin;
+	const float maxCell = 1023.0f;
+	const bvhvec3 scale(
+		extent.x > 0 ? maxCell / extent.x : 0,
+		extent.y > 0 ? maxCell / extent.y : 0,
+		extent.z > 0 ? maxCell / extent.z : 0
+	);
+	const float dirCells = (float)(1 << dirBits), maxDirCell = dirCells - 1;
+	uint64_t* keys = (uint64_t*)AlignedAlloc( count * sizeof( uint64_t ) );
+	tinybvh_parallel_for( pool, count, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+		for (uint32_t i = first; i < last; i++)
+		{
+			const bvhvec3 c = (rays[i].O - aabbMin) * scale, D = rays[i].D;
+			const bvhvec3 d = bvhvec3( fabsf( D.x ), fabsf( D.y ), fabsf( D.z ) ) * dirCells;
+			const uint64_t dirKey = tinybvh_morton( (uint32_t)tinybvh_min( d.x, maxDirCell ),
+				(uint32_t)tinybvh_min( d.y, maxDirCell ), (uint32_t)tinybvh_min( d.z, maxDirCell ) );
+			keys[i] = ((((uint64_t)RayOctant( rays[i] ) << (3 * dirBits)) + dirKey) << 30) + tinybvh_morton(
+				(uint32_t)tinybvh_clamp( c.x, 0.0f, maxCell ), (uint32_t)tinybvh_clamp( c.y, 0.0f, maxCell ),
+				(uint32_t)tinybvh_clamp( c.z, 0.0f, maxCell ) );
+			order[i] = i;
+		}
+	} );
+	RadixSort( keys, order, count, 33 + 3 * dirBits );
+	AlignedFree( keys );
+}
+
+// IntersectWatertight (helper): "Watertight Ray/Triangle Intersection", Woop, Benthin
+// & Wald, 2013. Vertices are transformed to a ray-aligned space where the edge tests
+// for a shared edge are bitwise identical for both triangles. Used for WATERTIGHT_TRIS.
+inline bool IntersectWatertight( const Ray& ray, const bvhvec3& v0, const bvhvec3& v1, const bvhvec3& v2, float& t, float& u, float& v )
+{
+	const uint32_t kz = tinybvh_maxdim( ray.D );
+	uint32_t kx = (1 << kz) & 3, ky = (1 << kx) & 3; // https://www.codercorner.com/Modulo3.htm
+	if (ray.D[kz] < 0) tinybvh_swap( kx, ky );
+	const float Sz = ray.rD[kz], Sx = ray.D[kx] * Sz, Sy = ray.D[ky] * Sz;
+	const bvhvec3 A = v0 - ray.O, B = v1 - ray.O, C = v2 - ray.O;
+	const float Ax = A[kx] - Sx * A[kz], Ay = A[ky] - Sy * A[kz];
+	const float Bx = B[kx] - Sx * B[kz], By = B[ky] - Sy * B[kz];
+	const float Cx = C[kx] - Sx * C[kz], Cy = C[ky] - Sy * C[kz];
+	// edge functions in double precision: the products are exact, so a shared edge yields
+	// exactly opposite values for both triangles, even when the compiler contracts to FMA.
+	const float U = (float)((double)Cx * (double)By - (double)Cy * (double)Bx);
+	const float V = (float)((double)Ax * (double)Cy - (double)Ay * (double)Cx);
+	const float W = (float)((double)Bx * (double)Ay - (double)By * (double)Ax);
+	if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return false;
+	const float det = U + V + W;
+	if (det == 0) return false;
+	const float rcpDet = 1.0f / det;
+	t = Sz * (U * A[kz] + V * B[kz] + W * C[kz]) * rcpDet;
+	if (t <= 0 || t >= ray.hit.t) return false;
+	u = V * rcpDet, v = W * rcpDet; // same barycentrics as Moeller-Trumbore.
+	return true;
+}
+
 // BVH implementation
 // ----------------------------------------------------------------------------
 
@@ -1392,6 +2094,11 @@ BVH::~BVH()
 	AlignedFree( bvhNode );
 	AlignedFree( primIdx );
 	AlignedFree( fragment );
+	AlignedFree( tlasParent );
+	AlignedFree( tlasInstLeaf );
+	AlignedFree( instData );
+	DiscardLeafTris();
+	DiscardMotion();
 }
 
 void BVH::Save( const char* fileName )
@@ -1432,6 +2139,10 @@ bool BVH::Load( const char* fileName, const bvhvec4slice& vertices, const uint32
 	if (expectIndexed && fileTriCount != primCount) return false;
 	if (!expectIndexed && fileTriCount != vertices.count / 3) return false;
 	// all checks passed; safe to overwrite *this
+	DiscardLeafTris();
+	DiscardMotion();
+	AlignedFree( tlasParent );
+	AlignedFree( tlasInstLeaf );
 	s.read( (char*)this, sizeof( BVH ) );
 	bool fileIsIndexed = vertIdx != nullptr;
 	if (expectIndexed != fileIsIndexed) return false; // not what we expected.
@@ -1440,6 +2151,9 @@ bool BVH::Load( const char* fileName, const bvhvec4slice& vertices, const uint32
 	bvhNode = (BVHNode*)AlignedAlloc( allocatedNodes * sizeof( BVHNode ) );
 	primIdx = (uint32_t*)AlignedAlloc( idxCount * sizeof( uint32_t ) );
 	fragment = 0; // no need for this in a BVH that can't be rebuilt.
+	leafTris = 0, leafTriBlock = 0; // leaf blocks are not saved; use PrecomputeLeafTris.
+	tlasParent = tlasInstLeaf = 0, tlasCost = 0; // TLAS update data is not saved either.
+	bvhNode1 = 0, verts1 = {}; // neither is deformation blur data.
 	s.read( (char*)bvhNode, usedNodes * sizeof( BVHNode ) );
 	s.read( (char*)primIdx, idxCount * sizeof( uint32_t ) );
 	verts = vertices; // we can't load vertices since the BVH doesn't own this data.
@@ -1492,6 +2206,7 @@ void BVH::BuildDefault( const bvhvec4slice& vertices, const uint32_t* indices, c
 
 void BVH::ConvertFrom( const BVH_Verbose& original, bool compact )
 {
+	DiscardLeafTris();
 	// allocate space
 	const uint32_t spaceNeeded = compact ? original.usedNodes : original.allocatedNodes;
 	if (allocatedNodes < spaceNeeded)
@@ -1504,6 +2219,7 @@ void BVH::ConvertFrom( const BVH_Verbose& original, bool compact )
 	CopyBasePropertiesFrom( original );
 	this->verts = original.verts;
 	this->primIdx = original.primIdx;
+	tlasCost = 0; // nodes moved; UpdateTLAS needs to relink.
 	// start conversion
 	uint32_t srcNodeIdx = 0, dstNodeIdx = 0;
 	newNodePtr = 2;
@@ -1531,6 +2247,7 @@ void BVH::ConvertFrom( const BVH_Verbose& original, bool compact )
 		}
 	}
 	usedNodes = original.usedNodes;
+	if (hasMotion()) RefitMotion(); // e.g. after Optimize.
 }
 
 float BVH::SAHCost( const uint32_t nodeIdx ) const
@@ -1545,6 +2262,7 @@ float BVH::SAHCost( const uint32_t nodeIdx ) const
 
 void BVH::SplitLeafs( const uint32_t maxPrims )
 {
+	DiscardLeafTris();
 	uint32_t stack[64], stackPtr = 0, nodeIdx = 0;
 	while (1)
 	{
@@ -1572,6 +2290,7 @@ void BVH::SplitLeafs( const uint32_t maxPrims )
 		}
 	}
 	usedNodes = newNodePtr;
+	if (hasMotion()) RefitMotion();
 }
 
 int32_t BVH::PrimCount( const uint32_t nodeIdx ) const
@@ -1594,6 +2313,8 @@ void BVH::BuildQuick( const bvhvec4* vertices, const uint32_t primCount )
 void BVH::BuildQuick( const bvhvec4slice& vertices )
 {
 	FATAL_ERROR_IF( vertices.count == 0, "BVH::BuildQuick( .. ), primCount == 0." );
+	DiscardLeafTris();
+	DiscardMotion();
 	// allocate on first build
 	const uint32_t primCount = vertices.count / 3;
 	const uint32_t spaceNeeded = primCount * 2; // upper limit
@@ -1673,6 +2394,39 @@ void BVH::BuildQuick( const bvhvec4slice& vertices )
 	usedNodes = newNodePtr;
 }
 
+// Per-axis bins for binned SAH construction. Bins for disjoint sets of fragments
+// can be merged exactly, which allows binning a single node using several threads.
+template <int BINS> struct SAHBins
+{
+	bvhvec3 binMin[3][BINS], binMax[3][BINS];
+	uint32_t count[3][BINS];
+	void Clear()
+	{
+		for (uint32_t a = 0; a < 3; a++) for (uint32_t i = 0; i < BINS; i++) binMin[a][i] = BVH_FAR, binMax[a][i] = -BVH_FAR;
+		memset( count, 0, BINS * 3 * sizeof( uint32_t ) );
+	}
+	void Add( const BVHBase::Fragment& f, const bvhvec3& nmin3, const bvhvec3& rpd3 )
+	{
+		bvhint3 bi = bvhint3( ((f.bmin + f.bmax) * 0.5f - nmin3) * rpd3 );
+		bi.x = tinybvh_clamp( bi.x, 0, BINS - 1 );
+		bi.y = tinybvh_clamp( bi.y, 0, BINS - 1 );
+		bi.z = tinybvh_clamp( bi.z, 0, BINS - 1 );
+		binMin[0][bi.x] = tinybvh_min( binMin[0][bi.x], f.bmin );
+		binMax[0][bi.x] = tinybvh_max( binMax[0][bi.x], f.bmax ), count[0][bi.x]++;
+		binMin[1][bi.y] = tinybvh_min( binMin[1][bi.y], f.bmin );
+		binMax[1][bi.y] = tinybvh_max( binMax[1][bi.y], f.bmax ), count[1][bi.y]++;
+		binMin[2][bi.z] = tinybvh_min( binMin[2][bi.z], f.bmin );
+		binMax[2][bi.z] = tinybvh_max( binMax[2][bi.z], f.bmax ), count[2][bi.z]++;
+	}
+	void Merge( const SAHBins& other )
+	{
+		for (uint32_t a = 0; a < 3; a++) for (uint32_t i = 0; i < BINS; i++)
+			binMin[a][i] = tinybvh_min( binMin[a][i], other.binMin[a][i] ),
+			binMax[a][i] = tinybvh_max( binMax[a][i], other.binMax[a][i] ),
+			count[a][i] += other.count[a][i];
+	}
+};
+
 // Basic single-function binned-SAH-builder.
 // This is the reference builder; it yields a decent tree suitable for ray tracing on the CPU.
 // This code uses no SIMD instructions. Faster code, using SSE/AVX, is available for x64 CPUs.
@@ -1690,6 +2444,20 @@ void BVH::Build( const bvhvec4slice& vertices )
 	PrepareBuild( vertices, 0, 0 /* empty index list; primcount is derived from slice */ );
 	Build();
 }
+void BVH::BuildMotion( const bvhvec4* vertices0, const bvhvec4* vertices1, const uint32_t primCount )
+{
+	BuildMotion( bvhvec4slice( vertices0, primCount * 3, sizeof( bvhvec4 ) ), bvhvec4slice( vertices1, primCount * 3, sizeof( bvhvec4 ) ) );
+}
+void BVH::BuildMotion( const bvhvec4slice& vertices0, const bvhvec4slice& vertices1, const uint32_t* indices, const uint32_t prims )
+{
+	// deformation blur: the topology is built for time 0; the node bounds for time 1
+	// are obtained by refitting against the second vertex buffer.
+	FATAL_ERROR_IF( vertices0.count != vertices1.count, "BVH::BuildMotion( .. ), vertex buffers differ in size." );
+	PrepareBuild( vertices0, indices, prims );
+	Build();
+	verts1 = vertices1;
+	RefitMotion();
+}
 void BVH::Build( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims )
 {
 	// build the BVH with a continuous array of bvhvec4 vertices, indexed by 'indices'.
@@ -1705,6 +2473,8 @@ void BVH::Build( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t
 void BVH::Build( void (*customGetAABB)(const unsigned, bvhvec3&, bvhvec3&), const uint32_t primCount )
 {
 	FATAL_ERROR_IF( primCount == 0, "BVH::Build( void (*customGetAABB)( .. ), instCount ), instCount == 0." );
+	DiscardLeafTris();
+	DiscardMotion();
 	triCount = idxCount = primCount;
 	const uint32_t spaceNeeded = primCount * 2; // upper limit
 	if (allocatedNodes < spaceNeeded)
@@ -1736,6 +2506,8 @@ void BVH::Build( void (*customGetAABB)(const unsigned, bvhvec3&, bvhvec3&), cons
 void BVH::Build( BLASInstance* instances, const uint32_t instCount, BVHBase** blasses, const uint32_t bCount )
 {
 	FATAL_ERROR_IF( instCount == 0, "BVH::Build( BLASInstance*, instCount ), instCount == 0." );
+	DiscardLeafTris();
+	DiscardMotion();
 	triCount = idxCount = instCount;
 	const uint32_t spaceNeeded = instCount * 2; // upper limit
 	if (allocatedNodes < spaceNeeded)
@@ -1749,6 +2521,12 @@ void BVH::Build( BLASInstance* instances, const uint32_t instCount, BVHBase** bl
 		primIdx = (uint32_t*)AlignedAlloc( instCount * sizeof( uint32_t ) );
 		fragment = (Fragment*)AlignedAlloc( instCount * sizeof( Fragment ) );
 	}
+	if (allocatedInstData < instCount)
+	{
+		AlignedFree( instData );
+		instData = (CompactInstance*)AlignedAlloc( instCount * sizeof( CompactInstance ) );
+		allocatedInstData = instCount;
+	}
 	instList = instances;
 	blasList = blasses;
 	blasCount = bCount;
@@ -1763,6 +2541,7 @@ void BVH::Build( BLASInstance* instances, const uint32_t instCount, BVHBase** bl
 			BVH* blas = (BVH*)blasList[blasIdx];
 			instList[i].Update( blas );
 		}
+		instList[i].dirty = 0, instData[i].Set( instList[i] );
 		fragment[i].bmin = instList[i].aabbMin, fragment[i].primIdx = i;
 		fragment[i].bmax = instList[i].aabbMax, fragment[i].clipped = 0;
 		root.aabbMin = tinybvh_min( root.aabbMin, instList[i].aabbMin );
@@ -1771,10 +2550,13 @@ void BVH::Build( BLASInstance* instances, const uint32_t instCount, BVHBase** bl
 	// start build
 	newNodePtr = 2;
 	Build(); // or BuildAVX, for large TLAS.
+	tlasCost = 0; // UpdateTLAS needs to relink.
 }
 
 void BVH::PrepareBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t prims )
 {
+	DiscardLeafTris(); // leaf blocks would be stale after a rebuild.
+	DiscardMotion();
 #ifdef SLICEDUMP
 	// this code dumps the passed geometry data to a file - for debugging only.
 	std::fstream df{ "dump.bin", df.binary | df.out };
@@ -1806,137 +2588,338 @@ void BVH::PrepareBuild( const bvhvec4slice& vertices, const uint32_t* indices, c
 	verts = vertices, idxCount = triCount = primCount, vertIdx = (uint32_t*)indices;
 	// prepare fragments
 	FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareBuild( .. ), empty vertex slice." );
-	BVHNode& root = bvhNode[0];
-	root.leftFirst = 0, root.triCount = triCount, root.aabbMin = bvhvec3( BVH_FAR ), root.aabbMax = bvhvec3( -BVH_FAR );
-	if (!indices)
-	{
-		FATAL_ERROR_IF( prims != 0, "BVH::PrepareBuild( .. ), indices == 0." );
-		// building a BVH over triangles specified as three 16-byte vertices each.
-		for (uint32_t i = 0; i < triCount; i++)
-		{
-			const bvhvec4 v0 = verts[i * 3], v1 = verts[i * 3 + 1], v2 = verts[i * 3 + 2];
-			const bvhvec4 fmin = tinybvh_min( v0, tinybvh_min( v1, v2 ) );
-			const bvhvec4 fmax = tinybvh_max( v0, tinybvh_max( v1, v2 ) );
-			fragment[i].bmin = fmin, fragment[i].bmax = fmax;
-			root.aabbMin = tinybvh_min( root.aabbMin, fragment[i].bmin );
-			root.aabbMax = tinybvh_max( root.aabbMax, fragment[i].bmax ), primIdx[i] = i;
-		}
-	}
-	else
-	{
-		FATAL_ERROR_IF( prims == 0, "BVH::PrepareBuild( .. ), prims == 0." );
-		// building a BVH over triangles consisting of vertices indexed by 'indices'.
-		for (uint32_t i = 0; i < triCount; i++)
-		{
-			const uint32_t i0 = indices[i * 3], i1 = indices[i * 3 + 1], i2 = indices[i * 3 + 2];
-			const bvhvec4 v0 = verts[i0], v1 = verts[i1], v2 = verts[i2];
-			const bvhvec4 fmin = tinybvh_min( v0, tinybvh_min( v1, v2 ) );
-			const bvhvec4 fmax = tinybvh_max( v0, tinybvh_max( v1, v2 ) );
-			fragment[i].bmin = fmin, fragment[i].bmax = fmax;
-			root.aabbMin = tinybvh_min( root.aabbMin, fragment[i].bmin );
-			root.aabbMax = tinybvh_max( root.aabbMax, fragment[i].bmax ), primIdx[i] = i;
-		}
-	}
+	FATAL_ERROR_IF( !indices && prims != 0, "BVH::PrepareBuild( .. ), indices == 0." );
+	FATAL_ERROR_IF( indices && prims == 0, "BVH::PrepareBuild( .. ), prims == 0." );
+	PrepareFragments( indices );
 	// reset node pool
 	newNodePtr = 2;
 	bvh_over_indices = indices != nullptr;
 	// all set; actual build happens in BVH::Build.
 }
+
+void BVH::PrepareFragments( const uint32_t* indices )
+{
+	// calculate the bounds of all fragments, and the root node bounds. For large
+	// meshes this is done by all threads, each producing the bounds of its part of
+	// the fragments; these are then combined into the root bounds.
+	bvhvec3 rootMin( BVH_FAR ), rootMax( -BVH_FAR );
+#ifdef ENABLE_THREADED_BUILDS
+	if (triCount >= MT_BIN_THRESHOLD)
+	{
+		ThreadPool& pool = GetThreadPool();
+		const uint32_t chunks = pool.ThreadCount();
+		bvhaabb* chunkBounds = (bvhaabb*)AlignedAlloc( chunks * sizeof( bvhaabb ) );
+		pool.ParallelFor( triCount, chunks, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+			PrepareFragments( indices, first, last, chunkBounds[chunk].minBounds, chunkBounds[chunk].maxBounds );
+		} );
+		for (uint32_t i = 0; i < chunks; i++)
+			rootMin = tinybvh_min( rootMin, chunkBounds[i].minBounds ),
+			rootMax = tinybvh_max( rootMax, chunkBounds[i].maxBounds );
+		AlignedFree( chunkBounds );
+	}
+	else
+#endif
+	PrepareFragments( indices, 0, triCount, rootMin, rootMax );
+	BVHNode& root = bvhNode[0];
+	root.leftFirst = 0, root.triCount = triCount, root.aabbMin = rootMin, root.aabbMax = rootMax;
+}
+
+void BVH::PrepareFragments( const uint32_t* indices, const uint32_t first, const uint32_t last, bvhvec3& bmin, bvhvec3& bmax )
+{
+	// calculate the bounds of fragments [first..last), using SIMD where available. The
+	// fourth vertex component ends up in the unused Fragment::primIdx and clipped fields.
+	const int8_t* data = verts.data;
+	const size_t stride = verts.stride;
+#if defined(BVH_USEAVX)
+	__m128 min4 = _mm_set1_ps( BVH_FAR ), max4 = _mm_set1_ps( -BVH_FAR );
+	__m128* frag4 = (__m128*)fragment;
+	for (uint32_t i = first; i < last; i++)
+	{
+		const size_t i0 = indices ? indices[i * 3] : (i * 3), i1 = indices ? indices[i * 3 + 1] : (i * 3 + 1), i2 = indices ? indices[i * 3 + 2] : (i * 3 + 2);
+		const __m128 v0 = _mm_loadu_ps( (const float*)(data + i0 * stride) );
+		const __m128 v1 = _mm_loadu_ps( (const float*)(data + i1 * stride) );
+		const __m128 v2 = _mm_loadu_ps( (const float*)(data + i2 * stride) );
+		const __m128 t1 = _mm_min_ps( _mm_min_ps( v0, v1 ), v2 ), t2 = _mm_max_ps( _mm_max_ps( v0, v1 ), v2 );
+		frag4[i * 2] = t1, frag4[i * 2 + 1] = t2, min4 = _mm_min_ps( min4, t1 ), max4 = _mm_max_ps( max4, t2 );
+		primIdx[i] = i;
+	}
+	ALIGNED( 16 ) bvhvec4 rmin, rmax;
+	_mm_store_ps( &rmin.x, min4 ), _mm_store_ps( &rmax.x, max4 );
+	bmin = rmin, bmax = rmax;
+#elif defined(BVH_USENEON)
+	float32x4_t min4 = vdupq_n_f32( BVH_FAR ), max4 = vdupq_n_f32( -BVH_FAR );
+	float* frag4 = (float*)fragment;
+	for (uint32_t i = first; i < last; i++)
+	{
+		const size_t i0 = indices ? indices[i * 3] : (i * 3), i1 = indices ? indices[i * 3 + 1] : (i * 3 + 1), i2 = indices ? indices[i * 3 + 2] : (i * 3 + 2);
+		const float32x4_t v0 = vld1q_f32( (const float*)(data + i0 * stride) );
+		const float32x4_t v1 = vld1q_f32( (const float*)(data + i1 * stride) );
+		const float32x4_t v2 = vld1q_f32( (const float*)(data + i2 * stride) );
+		const float32x4_t t1 = vminq_f32( vminq_f32( v0, v1 ), v2 ), t2 = vmaxq_f32( vmaxq_f32( v0, v1 ), v2 );
+		vst1q_f32( frag4 + i * 8, t1 ), vst1q_f32( frag4 + i * 8 + 4, t2 );
+		min4 = vminq_f32( min4, t1 ), max4 = vmaxq_f32( max4, t2 );
+		primIdx[i] = i;
+	}
+	ALIGNED( 16 ) bvhvec4 rmin, rmax;
+	vst1q_f32( &rmin.x, min4 ), vst1q_f32( &rmax.x, max4 );
+	bmin = rmin, bmax = rmax;
+#else
+	bmin = bvhvec3( BVH_FAR ), bmax = bvhvec3( -BVH_FAR );
+	for (uint32_t i = first; i < last; i++)
+	{
+		const size_t i0 = indices ? indices[i * 3] : (i * 3), i1 = indices ? indices[i * 3 + 1] : (i * 3 + 1), i2 = indices ? indices[i * 3 + 2] : (i * 3 + 2);
+		const bvhvec4 v0 = *(const bvhvec4*)(data + i0 * stride);
+		const bvhvec4 v1 = *(const bvhvec4*)(data + i1 * stride);
+		const bvhvec4 v2 = *(const bvhvec4*)(data + i2 * stride);
+		fragment[i].bmin = tinybvh_min( v0, tinybvh_min( v1, v2 ) );
+		fragment[i].bmax = tinybvh_max( v0, tinybvh_max( v1, v2 ) );
+		bmin = tinybvh_min( bmin, fragment[i].bmin ), bmax = tinybvh_max( bmax, fragment[i].bmax ), primIdx[i] = i;
+	}
+#endif
+}
 void BVH::Build()
 {
 	// subdivide root node recursively
-	uint32_t task[256], taskCount = 0, nodeIdx = 0;
 	BVHNode& root = bvhNode[0];
-	bvhvec3 minDim = (root.aabbMax - root.aabbMin) * 1e-20f, bestLMin = 0, bestLMax = 0, bestRMin = 0, bestRMax = 0;
+	const bvhvec3 minDim = (root.aabbMax - root.aabbMin) * 1e-20f;
+	newNodePtr = BuildSubtree( 0, newNodePtr, minDim );
+	// all done.
+	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
+	refittable = true; // not using spatial splits: can refit this BVH
+	may_have_holes = false; // the reference builder produces a continuous list of nodes
+	bvh_over_aabbs = (verts == 0); // bvh over aabbs is suitable as TLAS
+	usedNodes = newNodePtr;
+}
+
+uint32_t BVH::BuildSubtree( const uint32_t nodeIdx, uint32_t nodePtr, const bvhvec3& minDim )
+{
+	// single-threaded subdivision of the subtree under nodeIdx. New nodes are
+	// taken from the pool starting at nodePtr; returns the next free node.
+	uint32_t task[256], taskCount = 0, subtreeIdx = nodeIdx;
 	while (1)
 	{
 		while (1)
 		{
-			BVHNode& node = bvhNode[nodeIdx];
-			// find optimal object split
-			bvhvec3 binMin[3][BVHBINS], binMax[3][BVHBINS];
-			for (uint32_t a = 0; a < 3; a++) for (uint32_t i = 0; i < BVHBINS; i++) binMin[a][i] = BVH_FAR, binMax[a][i] = -BVH_FAR;
-			uint32_t count[3][BVHBINS];
-			memset( count, 0, BVHBINS * 3 * sizeof( uint32_t ) );
-			const bvhvec3 rpd3 = bvhvec3( BVHBINS / (node.aabbMax - node.aabbMin) ), nmin3 = node.aabbMin;
-			for (uint32_t i = 0; i < node.triCount; i++) // process all tris for x,y and z at once
+			if (!SubdivideNode( subtreeIdx, nodePtr, minDim )) break;
+			// recurse
+			const uint32_t lci = nodePtr;
+			nodePtr += 2, task[taskCount++] = lci + 1, subtreeIdx = lci;
+		}
+		// fetch subdivision task from stack
+		if (taskCount == 0) break; else subtreeIdx = task[--taskCount];
+	}
+	return nodePtr;
+}
+
+bool BVH::SubdivideNode( const uint32_t nodeIdx, const uint32_t childIdx, const bvhvec3& minDim, ThreadPool* pool )
+{
+	// binned SAH object split of a single node. On success, the primitives of the node
+	// are partitioned, and the two child nodes are stored at childIdx and childIdx + 1.
+	// If a thread pool is specified, large nodes are binned and partitioned in parallel.
+#ifndef ENABLE_THREADED_BUILDS
+	(void)pool;
+#endif
+	BVHNode& node = bvhNode[nodeIdx];
+	bvhvec3 bestLMin = 0, bestLMax = 0, bestRMin = 0, bestRMax = 0;
+	// find optimal object split
+	SAHBins<BVHBINS> bins;
+	bins.Clear();
+	const bvhvec3 rpd3 = bvhvec3( BVHBINS / (node.aabbMax - node.aabbMin) ), nmin3 = node.aabbMin;
+#ifdef ENABLE_THREADED_BUILDS
+	const bool parallel = pool && node.triCount >= MT_BIN_THRESHOLD;
+	const uint32_t chunks = parallel ? pool->ThreadCount() : 1;
+	if (parallel)
+	{
+		// horizontal binning: each thread bins a part of the primitives of the node.
+		SAHBins<BVHBINS>* chunkBins = (SAHBins<BVHBINS>*)AlignedAlloc( chunks * sizeof( SAHBins<BVHBINS> ) );
+		pool->ParallelFor( node.triCount, chunks, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+			SAHBins<BVHBINS>& b = chunkBins[chunk];
+			b.Clear();
+			for (uint32_t i = first; i < last; i++) b.Add( fragment[primIdx[node.leftFirst + i]], nmin3, rpd3 );
+		} );
+		for (uint32_t i = 0; i < chunks; i++) bins.Merge( chunkBins[i] );
+		AlignedFree( chunkBins );
+	}
+	else
+#endif
+	for (uint32_t i = 0; i < node.triCount; i++) // process all tris for x,y and z at once
+		bins.Add( fragment[primIdx[node.leftFirst + i]], nmin3, rpd3 );
+	// calculate per-split totals
+	float splitCost = BVH_FAR, rSAV = 1.0f / node.SurfaceArea();
+	uint32_t bestAxis = 0, bestPos = 0;
+	for (int32_t a = 0; a < 3; a++) if ((node.aabbMax[a] - node.aabbMin[a]) > minDim[a])
+	{
+		bvhvec3 lBMin[BVHBINS - 1], rBMin[BVHBINS - 1], l1 = BVH_FAR, l2 = -BVH_FAR;
+		bvhvec3 lBMax[BVHBINS - 1], rBMax[BVHBINS - 1], r1 = BVH_FAR, r2 = -BVH_FAR;
+		float ANL[BVHBINS - 1], ANR[BVHBINS - 1];
+		for (uint32_t lN = 0, rN = 0, i = 0; i < BVHBINS - 1; i++)
+		{
+			lBMin[i] = l1 = tinybvh_min( l1, bins.binMin[a][i] );
+			rBMin[BVHBINS - 2 - i] = r1 = tinybvh_min( r1, bins.binMin[a][BVHBINS - 1 - i] );
+			lBMax[i] = l2 = tinybvh_max( l2, bins.binMax[a][i] );
+			rBMax[BVHBINS - 2 - i] = r2 = tinybvh_max( r2, bins.binMax[a][BVHBINS - 1 - i] );
+			lN += bins.count[a][i], rN += bins.count[a][BVHBINS - 1 - i];
+			ANL[i] = lN == 0 ? BVH_FAR : (tinybvh_half_area( l2 - l1 ) * (float)lN);
+			ANR[BVHBINS - 2 - i] = rN == 0 ? BVH_FAR : (tinybvh_half_area( r2 - r1 ) * (float)rN);
+		}
+		// evaluate bin totals to find best position for object split
+		for (uint32_t i = 0; i < BVHBINS - 1; i++)
+		{
+			const float C = c_trav + rSAV * c_int * (ANL[i] + ANR[i]);
+			if (C < splitCost)
 			{
-				const uint32_t fi = primIdx[node.leftFirst + i];
-				bvhint3 bi = bvhint3( ((fragment[fi].bmin + fragment[fi].bmax) * 0.5f - nmin3) * rpd3 );
-				bi.x = tinybvh_clamp( bi.x, 0, BVHBINS - 1 );
-				bi.y = tinybvh_clamp( bi.y, 0, BVHBINS - 1 );
-				bi.z = tinybvh_clamp( bi.z, 0, BVHBINS - 1 );
-				binMin[0][bi.x] = tinybvh_min( binMin[0][bi.x], fragment[fi].bmin );
-				binMax[0][bi.x] = tinybvh_max( binMax[0][bi.x], fragment[fi].bmax ), count[0][bi.x]++;
-				binMin[1][bi.y] = tinybvh_min( binMin[1][bi.y], fragment[fi].bmin );
-				binMax[1][bi.y] = tinybvh_max( binMax[1][bi.y], fragment[fi].bmax ), count[1][bi.y]++;
-				binMin[2][bi.z] = tinybvh_min( binMin[2][bi.z], fragment[fi].bmin );
-				binMax[2][bi.z] = tinybvh_max( binMax[2][bi.z], fragment[fi].bmax ), count[2][bi.z]++;
-			}
-			// calculate per-split totals
-			float splitCost = BVH_FAR, rSAV = 1.0f / node.SurfaceArea();
-			uint32_t bestAxis = 0, bestPos = 0;
-			for (int32_t a = 0; a < 3; a++) if ((node.aabbMax[a] - node.aabbMin[a]) > minDim[a])
-			{
-				bvhvec3 lBMin[BVHBINS - 1], rBMin[BVHBINS - 1], l1 = BVH_FAR, l2 = -BVH_FAR;
-				bvhvec3 lBMax[BVHBINS - 1], rBMax[BVHBINS - 1], r1 = BVH_FAR, r2 = -BVH_FAR;
-				float ANL[BVHBINS - 1], ANR[BVHBINS - 1];
-				for (uint32_t lN = 0, rN = 0, i = 0; i < BVHBINS - 1; i++)
-				{
-					lBMin[i] = l1 = tinybvh_min( l1, binMin[a][i] );
-					rBMin[BVHBINS - 2 - i] = r1 = tinybvh_min( r1, binMin[a][BVHBINS - 1 - i] );
-					lBMax[i] = l2 = tinybvh_max( l2, binMax[a][i] );
-					rBMax[BVHBINS - 2 - i] = r2 = tinybvh_max( r2, binMax[a][BVHBINS - 1 - i] );
-					lN += count[a][i], rN += count[a][BVHBINS - 1 - i];
-					ANL[i] = lN == 0 ? BVH_FAR : (tinybvh_half_area( l2 - l1 ) * (float)lN);
-					ANR[BVHBINS - 2 - i] = rN == 0 ? BVH_FAR : (tinybvh_half_area( r2 - r1 ) * (float)rN);
-				}
-				// evaluate bin totals to find best position for object split
-				for (uint32_t i = 0; i < BVHBINS - 1; i++)
-				{
-					const float C = c_trav + rSAV * c_int * (ANL[i] + ANR[i]);
-					if (C < splitCost)
-					{
-						splitCost = C, bestAxis = a, bestPos = i;
-						bestLMin = lBMin[i], bestRMin = rBMin[i], bestLMax = lBMax[i], bestRMax = rBMax[i];
-					}
-				}
+				splitCost = C, bestAxis = a, bestPos = i;
+				bestLMin = lBMin[i], bestRMin = rBMin[i], bestLMax = lBMax[i], bestRMax = rBMax[i];
 			}
-			float noSplitCost = (float)node.triCount * c_int;
-			if (splitCost >= noSplitCost) break; // not splitting is better.
-			// in-place partition
-			uint32_t j = node.leftFirst + node.triCount, src = node.leftFirst;
-			const float rpd = rpd3[bestAxis], nmin = nmin3[bestAxis];
-			for (uint32_t i = 0; i < node.triCount; i++)
-			{
-				const uint32_t fi = primIdx[src];
-				int32_t bi = (uint32_t)(((fragment[fi].bmin[bestAxis] + fragment[fi].bmax[bestAxis]) * 0.5f - nmin) * rpd);
-				bi = tinybvh_clamp( bi, 0, BVHBINS - 1 );
-				if ((uint32_t)bi <= bestPos) src++; else tinybvh_swap( primIdx[src], primIdx[--j] );
-			}
-			// create child nodes
-			uint32_t leftCount = src - node.leftFirst, rightCount = node.triCount - leftCount;
-			if (leftCount == 0 || rightCount == 0) break; // should not happen.
-			const int32_t lci = newNodePtr++, rci = newNodePtr++;
-			bvhNode[lci].aabbMin = bestLMin, bvhNode[lci].aabbMax = bestLMax;
-			bvhNode[lci].leftFirst = node.leftFirst, bvhNode[lci].triCount = leftCount;
-			bvhNode[rci].aabbMin = bestRMin, bvhNode[rci].aabbMax = bestRMax;
-			bvhNode[rci].leftFirst = j, bvhNode[rci].triCount = rightCount;
-			node.leftFirst = lci, node.triCount = 0;
-			// recurse
-			task[taskCount++] = rci, nodeIdx = lci;
 		}
-		// fetch subdivision task from stack
-		if (taskCount == 0) break; else nodeIdx = task[--taskCount];
 	}
+	float noSplitCost = (float)node.triCount * c_int;
+	if (splitCost >= noSplitCost) return false; // not splitting is better.
+	const float rpd = rpd3[bestAxis], nmin = nmin3[bestAxis];
+	uint32_t leftCount, rightCount, rightFirst;
+#ifdef ENABLE_THREADED_BUILDS
+	if (parallel)
+	{
+		// parallel partition: count per chunk, then scatter to a temporary index array.
+		// This is stable, so unlike the in-place partition below, the resulting order
+		// does not depend on the chunk count; a single-thread pool takes this path too.
+		uint32_t* chunkLeft = (uint32_t*)AlignedAlloc( (chunks * 2 + node.triCount) * sizeof( uint32_t ) );
+		uint32_t* chunkRight = chunkLeft + chunks, * tmp = chunkLeft + chunks * 2;
+		const uint32_t* idx = primIdx + node.leftFirst;
+		auto goesLeft = [&]( const uint32_t fi ) {
+			const int32_t bi = (int32_t)(((fragment[fi].bmin[bestAxis] + fragment[fi].bmax[bestAxis]) * 0.5f - nmin) * rpd);
+			return (uint32_t)tinybvh_clamp( bi, 0, BVHBINS - 1 ) <= bestPos;
+		};
+		pool->ParallelFor( node.triCount, chunks, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+			uint32_t lN = 0;
+			for (uint32_t i = first; i < last; i++) if (goesLeft( idx[i] )) lN++;
+			chunkLeft[chunk] = lN, chunkRight[chunk] = (last - first) - lN;
+		} );
+		leftCount = 0;
+		for (uint32_t i = 0; i < chunks; i++) leftCount += chunkLeft[i];
+		for (uint32_t i = 0, l = 0, r = leftCount; i < chunks; i++)
+		{
+			const uint32_t lN = chunkLeft[i], rN = chunkRight[i];
+			chunkLeft[i] = l, chunkRight[i] = r, l += lN, r += rN;
+		}
+		pool->ParallelFor( node.triCount, chunks, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+			uint32_t l = chunkLeft[chunk], r = chunkRight[chunk];
+			for (uint32_t i = first; i < last; i++) if (goesLeft( idx[i] )) tmp[l++] = idx[i]; else tmp[r++] = idx[i];
+		} );
+		pool->ParallelFor( node.triCount, chunks, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+			memcpy( primIdx + node.leftFirst + first, tmp + first, (last - first) * sizeof( uint32_t ) );
+		} );
+		AlignedFree( chunkLeft );
+		rightCount = node.triCount - leftCount, rightFirst = node.leftFirst + leftCount;
+	}
+	else
+#endif
+	{
+		// in-place partition
+		uint32_t j = node.leftFirst + node.triCount, src = node.leftFirst;
+		for (uint32_t i = 0; i < node.triCount; i++)
+		{
+			const uint32_t fi = primIdx[src];
+			int32_t bi = (uint32_t)(((fragment[fi].bmin[bestAxis] + fragment[fi].bmax[bestAxis]) * 0.5f - nmin) * rpd);
+			bi = tinybvh_clamp( bi, 0, BVHBINS - 1 );
+			if ((uint32_t)bi <= bestPos) src++; else tinybvh_swap( primIdx[src], primIdx[--j] );
+		}
+		leftCount = src - node.leftFirst, rightCount = node.triCount - leftCount, rightFirst = j;
+	}
+	// create child nodes
+	if (leftCount == 0 || rightCount == 0) return false; // should not happen.
+	const uint32_t lci = childIdx, rci = childIdx + 1;
+	bvhNode[lci].aabbMin = bestLMin, bvhNode[lci].aabbMax = bestLMax;
+	bvhNode[lci].leftFirst = node.leftFirst, bvhNode[lci].triCount = leftCount;
+	bvhNode[rci].aabbMin = bestRMin, bvhNode[rci].aabbMax = bestRMax;
+	bvhNode[rci].leftFirst = rightFirst, bvhNode[rci].triCount = rightCount;
+	node.leftFirst = lci, node.triCount = 0;
+	return true;
+}
+
+#ifdef ENABLE_THREADED_BUILDS
+
+// Multi-threaded binned SAH builder.
+// Large nodes are split exactly like in the reference builder, after which their
+// children are handed to the thread pool. Each node owns the range of 2 * triCount - 2
+// nodes following its child pair for all of its descendants, so tasks never compete
+// for nodes. Large nodes are partitioned stably (see SubdivideNode), so neither the
+// node layout nor the primitive order depends on the number of threads. Node ranges
+// are generally not used completely: the resulting BVH 'may have holes'.
+void BVH::BuildMT( const bvhvec4* vertices, const uint32_t primCount )
+{
+	BuildMT( bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+}
+void BVH::BuildMT( const bvhvec4slice& vertices )
+{
+	PrepareBuild( vertices, 0, 0 );
+	BuildMT();
+}
+void BVH::BuildMT( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims )
+{
+	BuildMT( bvhvec4slice{ vertices, prims * 3, sizeof( bvhvec4 ) }, indices, prims );
+}
+void BVH::BuildMT( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims )
+{
+	PrepareBuild( vertices, indices, prims );
+	BuildMT();
+}
+void BVH::BuildMT()
+{
+	// small trees are not worth the threading overhead.
+	if (triCount < MT_BUILD_THRESHOLD) { Build(); return; }
+	ThreadPool& pool = GetThreadPool();
+	BVHNode& root = bvhNode[0];
+	const bvhvec3 minDim = (root.aabbMax - root.aabbMin) * 1e-20f;
+	TaskGroup group;
+	BuildMTTask( pool, group, 0, 2, minDim );
+	pool.Wait( group );
 	// all done.
 	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
 	refittable = true; // not using spatial splits: can refit this BVH
-	may_have_holes = false; // the reference builder produces a continuous list of nodes
-	bvh_over_aabbs = (verts == 0); // bvh over aabbs is suitable as TLAS
-	usedNodes = newNodePtr;
+	may_have_holes = true; // per-task node ranges are not fully used; see BVH::Compact.
+	bvh_over_aabbs = (verts == 0);
+	usedNodes = newNodePtr = triCount * 2;
+}
+void BVH::BuildMTTask( ThreadPool& pool, TaskGroup& group, const uint32_t nodeIdx, const uint32_t nodePtr, const bvhvec3& minDim )
+{
+	if (bvhNode[nodeIdx].triCount < MT_BUILD_THRESHOLD)
+	{
+		BuildSubtree( nodeIdx, nodePtr, minDim );
+		return;
+	}
+	if (!SubdivideNode( nodeIdx, nodePtr, minDim, &pool )) return;
+	// the left child uses the nodes directly after the child pair; the right child
+	// gets the range after that.
+	const uint32_t rightPtr = nodePtr + 2 * bvhNode[nodePtr].triCount;
+	const bvhvec3 dim = minDim;
+	pool.Run( group, [this, &pool, &group, nodePtr, rightPtr, dim]() { BuildMTTask( pool, group, nodePtr + 1, rightPtr, dim ); } );
+	BuildMTTask( pool, group, nodePtr, nodePtr + 2, minDim );
 }
 
+// Batch builder: builds a BVH for each input mesh, using all threads regardless
+// of mesh count. Large meshes are built with BuildMT on the batch pool; the
+// others are built on a single thread each with the default builder.
+void BVH::BuildBatch( BVH** bvh, const BuildInput* input, const uint32_t count, ThreadPool* pool )
+{
+	ThreadPool& batchPool = pool ? *pool : ThreadPool::Default();
+	tinybvh_build_batch( batchPool, input, count, [&]( const uint32_t i, const bool large ) {
+		BVH& target = *bvh[i];
+		const BuildInput& in = input[i];
+		if (large)
+		{
+			// build on the batch pool, but don't leave it in the context of the target.
+			const BVHContext ctx = target.context;
+			target.context.threadPool = &batchPool, target.BuildMT( in.vertices, in.indices, in.primCount );
+			target.context = ctx;
+		}
+		else if (in.indices) target.BuildDefault( in.vertices, in.indices, in.primCount );
+		else target.BuildDefault( in.vertices );
+	} );
+}
+
+#endif
+
 // SBVH builder.
 // Besides the regular object splits used in the reference builder, the SBVH
 // algorithm also considers spatial splits, where primitives may be cut in
@@ -1971,6 +2954,8 @@ void BVH::BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, uint32
 
 void BVH::PrepareHQBuild( const bvhvec4slice& vertices, const uint32_t* indices, const uint32_t prims )
 {
+	DiscardLeafTris();
+	DiscardMotion();
 	uint32_t primCount = prims > 0 ? prims : vertices.count / 3;
 	const uint32_t slack = primCount >> 1; // for split prims
 	const uint32_t spaceNeeded = primCount * 3;
@@ -2028,48 +3013,100 @@ void BVH::PrepareHQBuild( const bvhvec4slice& vertices, const uint32_t* indices,
 	bvh_over_indices = indices != nullptr;
 	// all set; actual build happens in BVH::Build.
 }
+// BuildHQ: state shared by the threads that build the subtrees of an SBVH.
+struct BVH::HQBuildState
+{
+	uint32_t* triIdxB;
+	float rootArea;
+	bvhvec3 minDim;
+#ifdef ENABLE_THREADED_BUILDS
+	std::atomic<uint32_t> nextNode, nextFrag;
+	ThreadPool* pool;
+	TaskGroup group;
+#else
+	uint32_t nextNode, nextFrag;
+#endif
+};
+
 void BVH::BuildHQ()
 {
 	const uint32_t slack = triCount >> 1; // for split prims
-	uint32_t* triIdxA = primIdx;
-	uint32_t* triIdxB = (uint32_t*)AlignedAlloc( (triCount + slack) * sizeof( uint32_t ) );
-	memset( triIdxB, 0, (triCount + slack) * 4 );
+	HQBuildState state;
+	state.triIdxB = (uint32_t*)AlignedAlloc( (triCount + slack) * sizeof( uint32_t ) );
+	memset( state.triIdxB, 0, (triCount + slack) * 4 );
 	// reset node pool
-	newNodePtr = 2;
-	uint32_t nextFrag = triCount;
+	state.nextNode = 2, state.nextFrag = triCount;
 	// subdivide recursively
 	BVHNode& root = bvhNode[0];
-	const float rootArea = tinybvh_half_area( root.aabbMax - root.aabbMin );
+	state.rootArea = tinybvh_half_area( root.aabbMax - root.aabbMin );
+	state.minDim = (root.aabbMax - root.aabbMin) * 1e-7f /* don't touch, carefully picked */;
+#ifdef ENABLE_THREADED_BUILDS
+	// large meshes: subtrees are built in parallel, each in its own slice of the
+	// index array, and large nodes are binned and partitioned by all threads. The
+	// final tree does not depend on the number of threads.
+	state.pool = triCount >= MT_BUILD_THRESHOLD ? &GetThreadPool() : 0;
+	BuildHQSubtree( state, 0, 0, triCount + slack );
+	if (state.pool) state.pool->Wait( state.group );
+#else
+	BuildHQSubtree( state, 0, 0, triCount + slack );
+#endif
+	// all done.
+	AlignedFree( state.triIdxB );
+	newNodePtr = state.nextNode;
+	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
+	refittable = false; // can't refit an SBVH
+	may_have_holes = false; // there may be holes in the index list, but not in the node list
+	usedNodes = newNodePtr;
+	Compact(); // also puts the nodes in depth-first order, regardless of build order.
+}
+
+void BVH::BuildHQSubtree( HQBuildState& state, uint32_t nodeIdx, uint32_t sliceStart, uint32_t sliceEnd )
+{
+	uint32_t* triIdxA = primIdx, * triIdxB = state.triIdxB;
+	const float rootArea = state.rootArea;
+	const bvhvec3 minDim = state.minDim;
 	struct Task { uint32_t node, sliceStart, sliceEnd, dummy; };
 	ALIGNED( 64 ) Task task[1024];
-	uint32_t taskCount = 0, nodeIdx = 0, sliceStart = 0, sliceEnd = triCount + slack;
-	const bvhvec3 minDim = (root.aabbMax - root.aabbMin) * 1e-7f /* don't touch, carefully picked */;
+	uint32_t taskCount = 0;
 	bvhvec3 bestLMin = 0, bestLMax = 0, bestRMin = 0, bestRMax = 0;
+	struct SpatialBins { bvhvec3 binMin[HQBVHBINS], binMax[HQBVHBINS]; uint32_t countIn[HQBVHBINS], countOut[HQBVHBINS]; };
+#ifdef ENABLE_THREADED_BUILDS
+	// large nodes are binned and partitioned by all threads; this does not affect the result.
+	ThreadPool* pool = state.pool;
+	const uint32_t chunks = pool ? pool->ThreadCount() : 1;
+	SAHBins<HQBVHBINS>* chunkBins = 0;
+	SpatialBins* chunkSpatialBins = 0;
+	uint32_t* chunkLeft = 0, * chunkRight = 0;
+	if (chunks > 1 && bvhNode[nodeIdx].triCount >= MT_BIN_THRESHOLD)
+		chunkBins = (SAHBins<HQBVHBINS>*)AlignedAlloc( chunks * sizeof( SAHBins<HQBVHBINS> ) ),
+		chunkSpatialBins = (SpatialBins*)AlignedAlloc( chunks * sizeof( SpatialBins ) ),
+		chunkLeft = (uint32_t*)AlignedAlloc( chunks * 2 * sizeof( uint32_t ) ), chunkRight = chunkLeft + chunks;
+#endif
 	while (1)
 	{
 		while (1)
 		{
 			BVHNode& node = bvhNode[nodeIdx];
 			// find optimal object split
-			bvhvec3 binMin[3][HQBVHBINS], binMax[3][HQBVHBINS];
-			for (uint32_t a = 0; a < 3; a++) for (uint32_t i = 0; i < HQBVHBINS; i++) binMin[a][i] = BVH_FAR, binMax[a][i] = -BVH_FAR;
-			uint32_t count[3][HQBVHBINS];
-			memset( count, 0, HQBVHBINS * 3 * sizeof( uint32_t ) );
+			SAHBins<HQBVHBINS> objBins;
+			objBins.Clear();
 			const bvhvec3 rpd3 = bvhvec3( HQBVHBINS / (node.aabbMax - node.aabbMin) ), nmin3 = node.aabbMin;
-			for (uint32_t i = 0; i < node.triCount; i++) // process all tris for x,y and z at once
+		#ifdef ENABLE_THREADED_BUILDS
+			const bool parallel = chunkBins != 0 && node.triCount >= MT_BIN_THRESHOLD;
+			if (parallel)
 			{
-				const uint32_t fi = primIdx[node.leftFirst + i];
-				bvhint3 bi = bvhint3( ((fragment[fi].bmin + fragment[fi].bmax) * 0.5f - nmin3) * rpd3 );
-				bi.x = tinybvh_clamp( bi.x, 0, HQBVHBINS - 1 );
-				bi.y = tinybvh_clamp( bi.y, 0, HQBVHBINS - 1 );
-				bi.z = tinybvh_clamp( bi.z, 0, HQBVHBINS - 1 );
-				binMin[0][bi.x] = tinybvh_min( binMin[0][bi.x], fragment[fi].bmin );
-				binMax[0][bi.x] = tinybvh_max( binMax[0][bi.x], fragment[fi].bmax ), count[0][bi.x]++;
-				binMin[1][bi.y] = tinybvh_min( binMin[1][bi.y], fragment[fi].bmin );
-				binMax[1][bi.y] = tinybvh_max( binMax[1][bi.y], fragment[fi].bmax ), count[1][bi.y]++;
-				binMin[2][bi.z] = tinybvh_min( binMin[2][bi.z], fragment[fi].bmin );
-				binMax[2][bi.z] = tinybvh_max( binMax[2][bi.z], fragment[fi].bmax ), count[2][bi.z]++;
+				pool->ParallelFor( node.triCount, chunks, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+					chunkBins[chunk].Clear();
+					for (uint32_t i = first; i < last; i++) chunkBins[chunk].Add( fragment[primIdx[node.leftFirst + i]], nmin3, rpd3 );
+				} );
+				for (uint32_t i = 0; i < chunks; i++) objBins.Merge( chunkBins[i] );
 			}
+			else
+		#endif
+			for (uint32_t i = 0; i < node.triCount; i++) // process all tris for x,y and z at once
+				objBins.Add( fragment[primIdx[node.leftFirst + i]], nmin3, rpd3 );
+			const bvhvec3 (&binMin)[3][HQBVHBINS] = objBins.binMin, (&binMax)[3][HQBVHBINS] = objBins.binMax;
+			const uint32_t (&count)[3][HQBVHBINS] = objBins.count;
 			// calculate per-split totals
 			float splitCost = 1e30f, rSAV = 1.0f / node.SurfaceArea();
 			uint32_t bestAxis = 0, bestPos = 0;
@@ -2106,35 +3143,54 @@ void BVH::BuildHQ()
 			{
 				for (uint32_t a = 0; a < 3; a++) if ((node.aabbMax[a] - node.aabbMin[a]) > minDim[a])
 				{
-					// setup bins
-					bvhvec3 binaMin[HQBVHBINS], binaMax[HQBVHBINS];
-					for (uint32_t i = 0; i < HQBVHBINS; i++) binaMin[i] = BVH_FAR, binaMax[i] = -BVH_FAR;
-					uint32_t countIn[HQBVHBINS] = { 0 }, countOut[HQBVHBINS] = { 0 };
 					// populate bins with clipped fragments
 					const float planeDist = (node.aabbMax[a] - node.aabbMin[a]) / (HQBVHBINS * 0.9999f);
 					const float rPlaneDist = 1.0f / planeDist, nodeMin = node.aabbMin[a];
-					for (uint32_t i = 0; i < node.triCount; i++)
-					{
-						const uint32_t fragIdx = triIdxA[node.leftFirst + i];
-						const int32_t bin1 = tinybvh_clamp( (int32_t)((fragment[fragIdx].bmin[a] - nodeMin) * rPlaneDist), 0, HQBVHBINS - 1 );
-						const int32_t bin2 = tinybvh_clamp( (int32_t)((fragment[fragIdx].bmax[a] - nodeMin) * rPlaneDist), 0, HQBVHBINS - 1 );
-						countIn[bin1]++, countOut[bin2]++;
-						if (bin2 == bin1) // fragment fits in a single bin
-							binaMin[bin1] = tinybvh_min( binaMin[bin1], fragment[fragIdx].bmin ),
-							binaMax[bin1] = tinybvh_max( binaMax[bin1], fragment[fragIdx].bmax );
-						else for (int32_t j = bin1; j <= bin2; j++)
+					auto binSpatial = [&]( SpatialBins& sb, const uint32_t first, const uint32_t last ) {
+						for (uint32_t i = 0; i < HQBVHBINS; i++) sb.binMin[i] = BVH_FAR, sb.binMax[i] = -BVH_FAR;
+						memset( sb.countIn, 0, sizeof( sb.countIn ) ), memset( sb.countOut, 0, sizeof( sb.countOut ) );
+						for (uint32_t i = first; i < last; i++)
 						{
-							// clip fragment to each bin it overlaps
-							bvhvec3 bmin = node.aabbMin, bmax = node.aabbMax;
-							bmin[a] = nodeMin + planeDist * j;
-							bmax[a] = j == (HQBVHBINS - 2) ? node.aabbMax[a] : (bmin[a] + planeDist);
-							Fragment orig = fragment[fragIdx];
-							Fragment tmpFrag;
-							if (!ClipFrag( orig, tmpFrag, bmin, bmax, minDim, a )) continue;
-							binaMin[j] = tinybvh_min( binaMin[j], tmpFrag.bmin );
-							binaMax[j] = tinybvh_max( binaMax[j], tmpFrag.bmax );
+							const uint32_t fragIdx = triIdxA[node.leftFirst + i];
+							const int32_t bin1 = tinybvh_clamp( (int32_t)((fragment[fragIdx].bmin[a] - nodeMin) * rPlaneDist), 0, HQBVHBINS - 1 );
+							const int32_t bin2 = tinybvh_clamp( (int32_t)((fragment[fragIdx].bmax[a] - nodeMin) * rPlaneDist), 0, HQBVHBINS - 1 );
+							sb.countIn[bin1]++, sb.countOut[bin2]++;
+							if (bin2 == bin1) // fragment fits in a single bin
+								sb.binMin[bin1] = tinybvh_min( sb.binMin[bin1], fragment[fragIdx].bmin ),
+								sb.binMax[bin1] = tinybvh_max( sb.binMax[bin1], fragment[fragIdx].bmax );
+							else for (int32_t j = bin1; j <= bin2; j++)
+							{
+								// clip fragment to each bin it overlaps
+								bvhvec3 bmin = node.aabbMin, bmax = node.aabbMax;
+								bmin[a] = nodeMin + planeDist * j;
+								bmax[a] = j == (HQBVHBINS - 2) ? node.aabbMax[a] : (bmin[a] + planeDist);
+								Fragment orig = fragment[fragIdx];
+								Fragment tmpFrag;
+								if (!ClipFrag( orig, tmpFrag, bmin, bmax, minDim, a )) continue;
+								sb.binMin[j] = tinybvh_min( sb.binMin[j], tmpFrag.bmin );
+								sb.binMax[j] = tinybvh_max( sb.binMax[j], tmpFrag.bmax );
+							}
 						}
+					};
+					SpatialBins spatialBins;
+				#ifdef ENABLE_THREADED_BUILDS
+					if (parallel)
+					{
+						pool->ParallelFor( node.triCount, chunks, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+							binSpatial( chunkSpatialBins[chunk], first, last );
+						} );
+						spatialBins = chunkSpatialBins[0];
+						for (uint32_t c = 1; c < chunks; c++) for (uint32_t i = 0; i < HQBVHBINS; i++)
+							spatialBins.binMin[i] = tinybvh_min( spatialBins.binMin[i], chunkSpatialBins[c].binMin[i] ),
+							spatialBins.binMax[i] = tinybvh_max( spatialBins.binMax[i], chunkSpatialBins[c].binMax[i] ),
+							spatialBins.countIn[i] += chunkSpatialBins[c].countIn[i],
+							spatialBins.countOut[i] += chunkSpatialBins[c].countOut[i];
 					}
+					else
+				#endif
+					binSpatial( spatialBins, 0, node.triCount );
+					const bvhvec3* binaMin = spatialBins.binMin, * binaMax = spatialBins.binMax;
+					const uint32_t* countIn = spatialBins.countIn, * countOut = spatialBins.countOut;
 					// evaluate split candidates
 					bvhvec3 lBMin[HQBVHBINS - 1], rBMin[HQBVHBINS - 1], l1 = BVH_FAR, l2 = -BVH_FAR;
 					bvhvec3 lBMax[HQBVHBINS - 1], rBMax[HQBVHBINS - 1], r1 = BVH_FAR, r2 = -BVH_FAR;
@@ -2176,53 +3232,102 @@ void BVH::BuildHQ()
 				// spatial partitioning
 				const float planeDist = (node.aabbMax[bestAxis] - node.aabbMin[bestAxis]) / (HQBVHBINS * 0.9999f);
 				const float rPlaneDist = 1.0f / planeDist, nodeMin = node.aabbMin[bestAxis];
-				for (uint32_t i = 0; i < node.triCount; i++)
-				{
-					const uint32_t fragIdx = triIdxA[src++];
+				// decide if a fragment goes to the left (0) or right (1) side, or gets split (2).
+				auto classify = [&]( const uint32_t fragIdx ) -> uint32_t {
 					const uint32_t bin1 = (uint32_t)tinybvh_max( (fragment[fragIdx].bmin[bestAxis] - nodeMin) * rPlaneDist, 0.0f );
 					const uint32_t bin2 = (uint32_t)tinybvh_max( (fragment[fragIdx].bmax[bestAxis] - nodeMin) * rPlaneDist, 0.0f );
-					if (bin2 <= bestPos) triIdxB[A++] = fragIdx; else if (bin1 > bestPos) triIdxB[--B] = fragIdx; else
+					if (bin2 <= bestPos) return 0; else if (bin1 > bestPos) return 1;
+				#ifdef SBVH_UNSPLITTING
+					// unsplitting: 1. Calculate what happens if we add this primitive entirely to the left side
+					if (bestNR > 1)
 					{
-					#ifdef SBVH_UNSPLITTING
-						// unsplitting: 1. Calculate what happens if we add this primitive entirely to the left side
-						if (bestNR > 1)
+						bvhvec3 unsplitLMin = tinybvh_min( bestLMin, fragment[fragIdx].bmin );
+						bvhvec3 unsplitLMax = tinybvh_max( bestLMax, fragment[fragIdx].bmax );
+						float AL = tinybvh_half_area( unsplitLMax - unsplitLMin );
+						float AR = tinybvh_half_area( bestRMax - bestRMin );
+						float CunsplitLeft = c_trav + c_int * rSAV * (AL * bestNL + AR * (bestNR - 1));
+						if (CunsplitLeft < splitCost)
 						{
-							bvhvec3 unsplitLMin = tinybvh_min( bestLMin, fragment[fragIdx].bmin );
-							bvhvec3 unsplitLMax = tinybvh_max( bestLMax, fragment[fragIdx].bmax );
-							float AL = tinybvh_half_area( unsplitLMax - unsplitLMin );
-							float AR = tinybvh_half_area( bestRMax - bestRMin );
-							float CunsplitLeft = c_trav + c_int * rSAV * (AL * bestNL + AR * (bestNR - 1));
-							if (CunsplitLeft < splitCost)
-							{
-								bestNR--, splitCost = CunsplitLeft, triIdxB[A++] = fragIdx;
-								bestLMin = unsplitLMin, bestLMax = unsplitLMax;
-								continue;
-							}
+							bestNR--, splitCost = CunsplitLeft;
+							bestLMin = unsplitLMin, bestLMax = unsplitLMax;
+							return 0;
+						}
+					}
+					// 2. Calculate what happens if we add this primitive entirely to the right side
+					if (bestNL > 1)
+					{
+						const bvhvec3 unsplitRMin = tinybvh_min( bestRMin, fragment[fragIdx].bmin );
+						const bvhvec3 unsplitRMax = tinybvh_max( bestRMax, fragment[fragIdx].bmax );
+						const float AL = tinybvh_half_area( bestLMax - bestLMin );
+						const float AR = tinybvh_half_area( unsplitRMax - unsplitRMin );
+						const float CunsplitRight = c_trav + c_int * rSAV * (AL * (bestNL - 1) + AR * bestNR);
+						if (CunsplitRight < splitCost)
+						{
+							bestNL--, splitCost = CunsplitRight;
+							bestRMin = unsplitRMin, bestRMax = unsplitRMax;
+							return 1;
 						}
-						// 2. Calculate what happens if we add this primitive entirely to the right side
-						if (bestNL > 1)
+					}
+				#endif
+					return 2;
+				};
+			#ifdef ENABLE_THREADED_BUILDS
+				if (parallel)
+				{
+					// unsplitting depends on the order of the fragments, so we classify serially,
+					// clip the straddlers in parallel, and then distribute the fragments serially.
+					uint8_t* side = (uint8_t*)AlignedAlloc( node.triCount );
+					uint32_t* straddler = (uint32_t*)AlignedAlloc( node.triCount * sizeof( uint32_t ) ), straddlers = 0;
+					float* splitPos = (float*)AlignedAlloc( node.triCount * sizeof( float ) ); // unsplitting may move it
+					for (uint32_t i = 0; i < node.triCount; i++)
+						if ((side[i] = (uint8_t)classify( triIdxA[src + i] )) == 2)
+							splitPos[straddlers] = bestLMax[bestAxis], straddler[straddlers++] = i;
+					Fragment* part2 = (Fragment*)AlignedAlloc( tinybvh_max( straddlers, 1u ) * sizeof( Fragment ) );
+					pool->ParallelFor( straddlers, chunks, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+						for (uint32_t s = first; s < last; s++)
 						{
-							const bvhvec3 unsplitRMin = tinybvh_min( bestRMin, fragment[fragIdx].bmin );
-							const bvhvec3 unsplitRMax = tinybvh_max( bestRMax, fragment[fragIdx].bmax );
-							const float AL = tinybvh_half_area( bestLMax - bestLMin );
-							const float AR = tinybvh_half_area( unsplitRMax - unsplitRMin );
-							const float CunsplitRight = c_trav + c_int * rSAV * (AL * (bestNL - 1) + AR * bestNR);
-							if (CunsplitRight < splitCost)
-							{
-								bestNL--, splitCost = CunsplitRight, triIdxB[--B] = fragIdx;
-								bestRMin = unsplitRMin, bestRMax = unsplitRMax;
-								continue;
-							}
+							const uint32_t fragIdx = triIdxA[src + straddler[s]];
+							ALIGNED( 64 ) Fragment part1;
+							bool leftOK = false, rightOK = false;
+							SplitFrag( fragment[fragIdx], part1, part2[s], minDim, bestAxis, splitPos[s], leftOK, rightOK );
+							if (leftOK && rightOK) fragment[fragIdx] = part1; // else: didn't work out; unsplit (rare)
+							side[straddler[s]] = leftOK && rightOK ? 2 : (leftOK ? 0 : 1);
 						}
-					#endif
+					} );
+					uint32_t splits = 0;
+					for (uint32_t s = 0; s < straddlers; s++) splits += side[straddler[s]] == 2 ? 1 : 0;
+					uint32_t newFrag = (state.nextFrag += splits) - splits;
+					for (uint32_t s = 0, i = 0; i < node.triCount; i++)
+					{
+						const uint32_t fragIdx = triIdxA[src + i];
+						const bool isStraddler = s < straddlers && straddler[s] == i;
+						if (side[i] == 0) triIdxB[A++] = fragIdx; else if (side[i] == 1) triIdxB[--B] = fragIdx; else
+							fragment[newFrag] = part2[s], triIdxB[A++] = fragIdx, triIdxB[--B] = newFrag++;
+						if (isStraddler) s++;
+					}
+					AlignedFree( part2 );
+					AlignedFree( splitPos );
+					AlignedFree( straddler );
+					AlignedFree( side );
+				}
+				else
+			#endif
+				for (uint32_t i = 0; i < node.triCount; i++)
+				{
+					const uint32_t fragIdx = triIdxA[src++], side = classify( fragIdx );
+					if (side == 0) triIdxB[A++] = fragIdx; else if (side == 1) triIdxB[--B] = fragIdx; else
+					{
 						// split straddler
 						ALIGNED( 64 ) Fragment part1, part2; // keep all clipping in a single cacheline.
 						bool leftOK = false, rightOK = false;
 						float splitPos = bestLMax[bestAxis];
 						SplitFrag( fragment[fragIdx], part1, part2, minDim, bestAxis, splitPos, leftOK, rightOK );
 						if (leftOK && rightOK)
-							fragment[fragIdx] = part1, triIdxB[A++] = fragIdx,
-							fragment[nextFrag] = part2, triIdxB[--B] = nextFrag++;
+						{
+							const uint32_t newFrag = state.nextFrag++;
+							fragment[fragIdx] = part1, triIdxB[A++] = fragIdx;
+							fragment[newFrag] = part2, triIdxB[--B] = newFrag;
+						}
 						else // didn't work out; unsplit (rare)
 							if (leftOK) triIdxB[A++] = fragIdx; else triIdxB[--B] = fragIdx;
 					}
@@ -2240,15 +3345,48 @@ void BVH::BuildHQ()
 			{
 				// object partitioning
 				const float rpd = rpd3[bestAxis], nmin = nmin3[bestAxis];
+				auto goesLeft = [&]( const uint32_t fr ) {
+					int32_t bi = (int32_t)(((fragment[fr].bmin[bestAxis] + fragment[fr].bmax[bestAxis]) * 0.5f - nmin) * rpd);
+					return tinybvh_clamp( bi, 0, HQBVHBINS - 1 ) <= (int32_t)bestPos;
+				};
+			#ifdef ENABLE_THREADED_BUILDS
+				if (parallel)
+				{
+					// count per chunk, then scatter each chunk to the same positions as the serial loop.
+					pool->ParallelFor( node.triCount, chunks, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+						uint32_t n = 0;
+						for (uint32_t i = first; i < last; i++) n += goesLeft( primIdx[src + i] ) ? 1 : 0;
+						chunkLeft[chunk] = n, chunkRight[chunk] = (last - first) - n;
+					} );
+					for (uint32_t c = 0; c < chunks; c++)
+					{
+						const uint32_t nl = chunkLeft[c], nr = chunkRight[c];
+						chunkLeft[c] = A, chunkRight[c] = B, A += nl, B -= nr;
+					}
+					pool->ParallelFor( node.triCount, chunks, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+						uint32_t a = chunkLeft[chunk], b = chunkRight[chunk];
+						for (uint32_t i = first; i < last; i++)
+						{
+							const uint32_t fr = primIdx[src + i];
+							if (goesLeft( fr )) triIdxB[a++] = fr; else triIdxB[--b] = fr;
+						}
+					} );
+				}
+				else
+			#endif
 				for (uint32_t i = 0; i < node.triCount; i++)
 				{
 					const uint32_t fr = primIdx[src + i];
-					int32_t bi = (int32_t)(((fragment[fr].bmin[bestAxis] + fragment[fr].bmax[bestAxis]) * 0.5f - nmin) * rpd);
-					bi = tinybvh_clamp( bi, 0, HQBVHBINS - 1 );
-					if (bi <= (int32_t)bestPos) triIdxB[A++] = fr; else triIdxB[--B] = fr;
+					if (goesLeft( fr )) triIdxB[A++] = fr; else triIdxB[--B] = fr;
 				}
 			}
 			// copy back slice data
+		#ifdef ENABLE_THREADED_BUILDS
+			if (parallel) pool->ParallelFor( sliceEnd - sliceStart, chunks, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+				memcpy( triIdxA + sliceStart + first, triIdxB + sliceStart + first, (last - first) * 4 );
+			} );
+			else
+		#endif
 			memcpy( triIdxA + sliceStart, triIdxB + sliceStart, (sliceEnd - sliceStart) * 4 );
 			// create child nodes
 			uint32_t leftCount = A - sliceStart, rightCount = sliceEnd - B;
@@ -2261,15 +3399,25 @@ void BVH::BuildHQ()
 				node.aabbMax = tinybvh_max( bestLMax, bestRMax );
 				break;
 			}
-			int32_t leftChildIdx = newNodePtr++, rightChildIdx = newNodePtr++;
+			const uint32_t leftChildIdx = (state.nextNode += 2) - 2, rightChildIdx = leftChildIdx + 1;
 			bvhNode[leftChildIdx].aabbMin = bestLMin, bvhNode[leftChildIdx].aabbMax = bestLMax;
 			bvhNode[leftChildIdx].leftFirst = sliceStart, bvhNode[leftChildIdx].triCount = leftCount;
 			bvhNode[rightChildIdx].aabbMin = bestRMin, bvhNode[rightChildIdx].aabbMax = bestRMax;
 			bvhNode[rightChildIdx].leftFirst = B, bvhNode[rightChildIdx].triCount = rightCount;
 			node.leftFirst = leftChildIdx, node.triCount = 0;
-			// recurse
+			// recurse; large right subtrees are handed to another thread.
+			const uint32_t mid = (A + B) >> 1;
+		#ifdef ENABLE_THREADED_BUILDS
+			if (pool && rightCount >= MT_BUILD_THRESHOLD)
+			{
+				const uint32_t end = sliceEnd;
+				pool->Run( state.group, [this, &state, rightChildIdx, mid, end]() { BuildHQSubtree( state, rightChildIdx, mid, end ); } );
+				sliceEnd = mid, nodeIdx = leftChildIdx;
+				continue;
+			}
+		#endif
 			task[taskCount].node = rightChildIdx, task[taskCount].sliceEnd = sliceEnd;
-			task[taskCount++].sliceStart = sliceEnd = (A + B) >> 1, nodeIdx = leftChildIdx;
+			task[taskCount++].sliceStart = sliceEnd = mid, nodeIdx = leftChildIdx;
 		}
 		// fetch subdivision task from stack
 		if (taskCount == 0) break; else
@@ -2277,19 +3425,347 @@ void BVH::BuildHQ()
 			sliceStart = task[taskCount].sliceStart,
 			sliceEnd = task[taskCount].sliceEnd;
 	}
+#ifdef ENABLE_THREADED_BUILDS
+	AlignedFree( chunkLeft );
+	AlignedFree( chunkSpatialBins );
+	AlignedFree( chunkBins );
+#endif
+}
+
+// LBVH builder.
+// Primitives are sorted along a Morton curve, after which the hierarchy is derived
+// directly from the sorted keys, as described in "Maximizing Parallelism in the
+// Construction of BVHs, Octrees, and k-d Trees", Karras, 2012. Every step runs in
+// parallel for large meshes. Tree quality is lower than that of the binned SAH
+// builders, but construction is very fast, which makes this builder suitable for
+// per-frame rebuilds. Leafs contain a single primitive.
+void BVH::BuildLBVH( const bvhvec4* vertices, const uint32_t primCount )
+{
+	BuildLBVH( bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+}
+void BVH::BuildLBVH( const bvhvec4slice& vertices )
+{
+	PrepareBuild( vertices, 0, 0 );
+	BuildLBVH();
+}
+void BVH::BuildLBVH( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims )
+{
+	BuildLBVH( bvhvec4slice{ vertices, prims * 3, sizeof( bvhvec4 ) }, indices, prims );
+}
+void BVH::BuildLBVH( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims )
+{
+	PrepareBuild( vertices, indices, prims );
+	BuildLBVH();
+}
+
+void BVH::SortFragmentsMorton( uint64_t* keys )
+{
+	// calculate a Morton code for the centroid of each fragment, quantized to the
+	// bounds of the root node, and sort primIdx by these codes.
+	constexpr uint32_t bitsPerAxis = LBVH_MORTON_BITS / 3;
+	const BVHNode& root = bvhNode[0];
+	const bvhvec3 extent = root.aabbMax - root.aabbMin;
+	const float maxCell = (float)((1u << bitsPerAxis) - 1);
+	const bvhvec3 scale(
+		extent.x > 0 ? maxCell / extent.x : 0,
+		extent.y > 0 ? maxCell / extent.y : 0,
+		extent.z > 0 ? maxCell / extent.z : 0
+	);
+	const bvhvec3 rootMin2 = root.aabbMin * 2.0f;
+#ifdef ENABLE_THREADED_BUILDS
+	ThreadPool* pool = &GetThreadPool();
+#else
+	ThreadPool* pool = 0;
+#endif
+	tinybvh_parallel_for( pool, triCount, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+		for (uint32_t i = first; i < last; i++)
+		{
+			const uint32_t fi = primIdx[i];
+			const bvhvec3 c = (fragment[fi].bmin + fragment[fi].bmax - rootMin2) * 0.5f * scale;
+			keys[i] = tinybvh_morton( (uint32_t)tinybvh_clamp( c.x, 0.0f, maxCell ),
+				(uint32_t)tinybvh_clamp( c.y, 0.0f, maxCell ), (uint32_t)tinybvh_clamp( c.z, 0.0f, maxCell ) );
+		}
+	} );
+	RadixSort( keys, primIdx, triCount, bitsPerAxis * 3 );
+}
+
+void BVH::BuildLBVH()
+{
+	// a single primitive does not need a hierarchy.
+	BVHNode& root = bvhNode[0];
+	newNodePtr = 2;
+	if (triCount > 1)
+	{
+		// sort primitives along the Morton curve
+		const uint32_t N = triCount;
+		uint64_t* keys = (uint64_t*)AlignedAlloc( N * sizeof( uint64_t ) );
+		SortFragmentsMorton( keys );
+		// internal node i (N - 1 in total) stores its children in the node pair at 2 + 2 * i;
+		// the root is internal node 0 and lives in bvhNode[0]. For the bottom-up bounds
+		// pass we keep track of the parent of each leaf and internal node.
+		uint32_t* parent = (uint32_t*)AlignedAlloc( (N * 3) * sizeof( uint32_t ) ); // leafs, internal nodes, slots
+		uint32_t* internalParent = parent + N, * internalSlot = parent + 2 * N;
+		internalParent[0] = 0, internalSlot[0] = 0;
+		root.leftFirst = 2, root.triCount = 0;
+	#ifdef ENABLE_THREADED_BUILDS
+		ThreadPool* pool = &GetThreadPool();
+		std::atomic<uint32_t>* visits = (std::atomic<uint32_t>*)AlignedAlloc( N * sizeof( std::atomic<uint32_t> ) );
+	#else
+		ThreadPool* pool = 0;
+		uint32_t* visits = (uint32_t*)AlignedAlloc( N * sizeof( uint32_t ) );
+	#endif
+		memset( (void*)visits, 0, N * sizeof( visits[0] ) );
+		// delta: length of the common prefix of keys i and j; ties are broken using the index.
+		auto delta = [&]( const int32_t i, const int32_t j ) -> int32_t {
+			if (j < 0 || j >= (int32_t)N) return -1;
+			const uint64_t a = keys[i], b = keys[j];
+			return a != b ? tinybvh_clz64( a ^ b ) : (64 + tinybvh_clz64( (uint64_t)(i ^ j) ) - 32);
+		};
+		tinybvh_parallel_for( pool, N - 1, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+			for (int32_t i = (int32_t)first; i < (int32_t)last; i++)
+			{
+				// determine direction and extent of the range of keys covered by node i
+				const int32_t d = delta( i, i + 1 ) > delta( i, i - 1 ) ? 1 : -1, deltaMin = delta( i, i - d );
+				int32_t lmax = 2, l = 0;
+				while (delta( i, i + lmax * d ) > deltaMin) lmax *= 2;
+				for (int32_t t = lmax / 2; t >= 1; t /= 2) if (delta( i, i + (l + t) * d ) > deltaMin) l += t;
+				const int32_t j = i + l * d, deltaNode = delta( i, j );
+				// find the split position using binary search
+				int32_t split = 0, t = l;
+				do
+				{
+					t = (t + 1) >> 1;
+					if (delta( i, i + (split + t) * d ) > deltaNode) split += t;
+				} while (t > 1);
+				const int32_t gamma = i + split * d + tinybvh_min( d, 0 );
+				// store the children in the node pair owned by node i
+				const uint32_t slot = 2 + 2 * i;
+				for (int32_t c = 0; c < 2; c++)
+				{
+					BVHNode& child = bvhNode[slot + c];
+					const int32_t idx = gamma + c;
+					if ((c == 0 ? tinybvh_min( i, j ) : tinybvh_max( i, j )) == idx)
+					{
+						const Fragment& f = fragment[primIdx[idx]];
+						child.aabbMin = f.bmin, child.leftFirst = idx;
+						child.aabbMax = f.bmax, child.triCount = 1;
+						parent[idx] = i;
+					}
+					else
+					{
+						child.leftFirst = 2 + 2 * idx, child.triCount = 0;
+						internalParent[idx] = i, internalSlot[idx] = slot + c;
+					}
+				}
+			}
+		} );
+		// bottom-up bounds: the second thread to arrive at a node processes it.
+		tinybvh_parallel_for( pool, N, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+			for (uint32_t i = first; i < last; i++)
+			{
+				uint32_t p = parent[i];
+				while (visits[p]++ > 0)
+				{
+					BVHNode& node = bvhNode[internalSlot[p]];
+					const BVHNode& left = bvhNode[node.leftFirst], & right = bvhNode[node.leftFirst + 1];
+					node.aabbMin = tinybvh_min( left.aabbMin, right.aabbMin );
+					node.aabbMax = tinybvh_max( left.aabbMax, right.aabbMax );
+					if (p == 0) break; else p = internalParent[p];
+				}
+			}
+		} );
+		newNodePtr = 2 * N;
+		AlignedFree( (void*)visits );
+		AlignedFree( parent );
+		AlignedFree( keys );
+	}
+	// all done.
+	aabbMin = root.aabbMin, aabbMax = root.aabbMax;
+	refittable = true; // not using spatial splits: can refit this BVH
+	may_have_holes = false; // internal node i owns node pair 2 + 2 * i; no gaps
+	bvh_over_aabbs = (verts == 0);
+	usedNodes = newNodePtr;
+}
+
+// PLOC builder.
+// Implements "Parallel Locally-Ordered Clustering for Bounding Volume Hierarchy
+// Construction", Meister & Bittner, 2018. Starting with one cluster per primitive
+// in Morton order, each cluster finds the cluster within PLOC_RADIUS positions
+// that minimizes the surface area of their union; mutual nearest neighbours are
+// merged, until a single cluster remains. Every step runs in parallel for large
+// meshes and the result does not depend on the number of threads. Tree quality
+// is well above that of the LBVH builder and close to that of the binned SAH
+// builder, at a fraction of the build time.
+void BVH::BuildPLOC( const bvhvec4* vertices, const uint32_t primCount )
+{
+	BuildPLOC( bvhvec4slice{ vertices, primCount * 3, sizeof( bvhvec4 ) } );
+}
+void BVH::BuildPLOC( const bvhvec4slice& vertices )
+{
+	PrepareBuild( vertices, 0, 0 );
+	BuildPLOC();
+}
+void BVH::BuildPLOC( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims )
+{
+	BuildPLOC( bvhvec4slice{ vertices, prims * 3, sizeof( bvhvec4 ) }, indices, prims );
+}
+void BVH::BuildPLOC( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims )
+{
+	PrepareBuild( vertices, indices, prims );
+	BuildPLOC();
+}
+
+void BVH::BuildPLOC()
+{
+	// a single primitive does not need a hierarchy.
+	BVHNode& root = bvhNode[0];
+	newNodePtr = 2;
+	if (triCount > 1)
+	{
+		// sort primitives along the Morton curve
+		const uint32_t N = triCount;
+		uint64_t* keys = (uint64_t*)AlignedAlloc( N * sizeof( uint64_t ) );
+		SortFragmentsMorton( keys );
+		AlignedFree( keys );
+	#ifdef ENABLE_THREADED_BUILDS
+		ThreadPool* pool = &GetThreadPool();
+	#else
+		ThreadPool* pool = 0;
+	#endif
+		// clusters are stored as nodes; merging two clusters moves them into a new
+		// node pair, so that siblings are adjacent in the final tree.
+		BVHNode* cluster = (BVHNode*)AlignedAlloc( N * 2 * sizeof( BVHNode ) ), * nextCluster = cluster + N;
+		uint32_t* nn = (uint32_t*)AlignedAlloc( N * sizeof( uint32_t ) );
+		const uint32_t maxChunks = tinybvh_chunk_count( pool, N );
+		uint32_t* chunkMerges = (uint32_t*)AlignedAlloc( maxChunks * 2 * sizeof( uint32_t ) ), * chunkKeeps = chunkMerges + maxChunks;
+		tinybvh_parallel_for( pool, N, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+			for (uint32_t i = first; i < last; i++)
+			{
+				const Fragment& f = fragment[primIdx[i]];
+				cluster[i].aabbMin = f.bmin, cluster[i].leftFirst = i;
+				cluster[i].aabbMax = f.bmax, cluster[i].triCount = 1;
+			}
+		} );
+		for (uint32_t C = N; C > 1; )
+		{
+			// find the nearest neighbour of each cluster. Scanning candidates in order
+			// and only accepting strictly better ones guarantees that the best pair
+			// is mutual, so at least one merge happens in each iteration.
+			tinybvh_parallel_for( pool, C, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+				for (uint32_t i = first; i < last; i++)
+				{
+					const BVHNode& a = cluster[i];
+					const uint32_t jmin = i > PLOC_RADIUS ? (i - PLOC_RADIUS) : 0, jmax = tinybvh_min( C - 1, i + PLOC_RADIUS );
+					float bestArea = BVH_FAR;
+					uint32_t best = i;
+					for (uint32_t j = jmin; j <= jmax; j++) if (j != i)
+					{
+						const BVHNode& b = cluster[j];
+						const float area = tinybvh_half_area( tinybvh_max( a.aabbMax, b.aabbMax ) - tinybvh_min( a.aabbMin, b.aabbMin ) );
+						if (area < bestArea) bestArea = area, best = j;
+					}
+					nn[i] = best;
+				}
+			} );
+			// count merges and surviving clusters per chunk, to assign node pairs and
+			// cluster slots in a deterministic order.
+			const uint32_t chunks = tinybvh_chunk_count( pool, C );
+			tinybvh_parallel_for( pool, C, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+				uint32_t merges = 0, keeps = 0;
+				for (uint32_t i = first; i < last; i++)
+				{
+					const uint32_t j = nn[i];
+					if (nn[j] != i) keeps++; else if (i < j) merges++, keeps++;
+				}
+				chunkMerges[chunk] = merges, chunkKeeps[chunk] = keeps;
+			} );
+			uint32_t mergeSum = 0, keepSum = 0;
+			for (uint32_t c = 0; c < chunks; c++)
+			{
+				const uint32_t merges = chunkMerges[c], keeps = chunkKeeps[c];
+				chunkMerges[c] = newNodePtr + mergeSum * 2, chunkKeeps[c] = keepSum;
+				mergeSum += merges, keepSum += keeps;
+			}
+			// merge mutual nearest neighbours; the merged cluster takes the place of the first.
+			tinybvh_parallel_for( pool, C, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+				uint32_t pair = chunkMerges[chunk], slot = chunkKeeps[chunk];
+				for (uint32_t i = first; i < last; i++)
+				{
+					const uint32_t j = nn[i];
+					if (nn[j] != i) { nextCluster[slot++] = cluster[i]; continue; }
+					if (j < i) continue;
+					const BVHNode& a = cluster[i], & b = cluster[j];
+					BVHNode& merged = nextCluster[slot++];
+					bvhNode[pair] = a, bvhNode[pair + 1] = b;
+					merged.aabbMin = tinybvh_min( a.aabbMin, b.aabbMin ), merged.leftFirst = pair;
+					merged.aabbMax = tinybvh_max( a.aabbMax, b.aabbMax ), merged.triCount = 0;
+					pair += 2;
+				}
+			} );
+			newNodePtr += mergeSum * 2, C = keepSum;
+			tinybvh_swap( cluster, nextCluster );
+		}
+		root = cluster[0];
+		AlignedFree( chunkMerges );
+		AlignedFree( nn );
+		AlignedFree( cluster < nextCluster ? cluster : nextCluster );
+		// collapse subtrees into leafs where this reduces the SAH cost. A node pair is
+		// always allocated after the pair that holds its children, so a forward sweep
+		// over the nodes visits children before their parents.
+		float* cost = (float*)AlignedAlloc( newNodePtr * sizeof( float ) );
+		uint32_t* count = (uint32_t*)AlignedAlloc( newNodePtr * sizeof( uint32_t ) );
+		for (uint32_t i = 2; i <= newNodePtr; i++)
+		{
+			const uint32_t nodeIdx = i == newNodePtr ? 0 : i;
+			const BVHNode& node = bvhNode[nodeIdx];
+			const float area = node.SurfaceArea();
+			if (node.isLeaf()) { count[nodeIdx] = node.triCount, cost[nodeIdx] = c_int * area * node.triCount; continue; }
+			const uint32_t l = node.leftFirst;
+			count[nodeIdx] = count[l] + count[l + 1];
+			cost[nodeIdx] = tinybvh_min( c_int * area * count[nodeIdx], c_trav * area + cost[l] + cost[l + 1] );
+		}
+		uint32_t* newIdx = (uint32_t*)AlignedAlloc( triCount * sizeof( uint32_t ) );
+		uint32_t stack[128], stackPtr = 0, nodeIdx = 0, newIdxPtr = 0;
+		while (1)
+		{
+			BVHNode& node = bvhNode[nodeIdx];
+			if (!node.isLeaf() && c_int * node.SurfaceArea() * count[nodeIdx] > cost[nodeIdx])
+			{
+				nodeIdx = node.leftFirst, stack[stackPtr++] = node.leftFirst + 1;
+				continue;
+			}
+			// gather the primitives of the (collapsed) subtree
+			const uint32_t start = newIdxPtr;
+			uint32_t subStack[128], subPtr = 0, subIdx = nodeIdx;
+			while (1)
+			{
+				const BVHNode& sub = bvhNode[subIdx];
+				if (!sub.isLeaf()) { subIdx = sub.leftFirst, subStack[subPtr++] = sub.leftFirst + 1; continue; }
+				for (uint32_t i = 0; i < sub.triCount; i++) newIdx[newIdxPtr++] = primIdx[sub.leftFirst + i];
+				if (subPtr == 0) break; else subIdx = subStack[--subPtr];
+			}
+			node.leftFirst = start, node.triCount = count[nodeIdx];
+			if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
+		}
+		AlignedFree( count );
+		AlignedFree( cost );
+		AlignedFree( primIdx );
+		primIdx = newIdx;
+		// remove the nodes of collapsed subtrees.
+		if (root.isLeaf()) newNodePtr = 2; else Compact();
+	}
 	// all done.
-	AlignedFree( triIdxB );
 	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
-	refittable = false; // can't refit an SBVH
-	may_have_holes = false; // there may be holes in the index list, but not in the node list
+	refittable = true; // not using spatial splits: can refit this BVH
+	may_have_holes = false; // compacted
+	bvh_over_aabbs = (verts == 0);
 	usedNodes = newNodePtr;
-	Compact();
 }
 
 // Optimize: Will happen via BVH_Verbose.
 void BVH::Optimize( const uint32_t iterations, bool extreme )
 {
-	BVH_Verbose* verbose = new BVH_Verbose();
+	BVH_Verbose* verbose = new BVH_Verbose( context );
 	verbose->ConvertFrom( *this );
 	verbose->Optimize( iterations, extreme );
 	ConvertFrom( *verbose );
@@ -2299,55 +3775,196 @@ void BVH::Optimize( const uint32_t iterations, bool extreme )
 // includes trees waving in the wind, or subsequent frames for skinned
 // animations. Repeated refitting tends to lead to deteriorated BVHs and
 // slower ray tracing. Rebuild when this happens.
-void BVH::Refit( const uint32_t /* unused */ )
+// The tree is traversed rather than scanned, so node order and unused nodes
+// (e.g. after BuildMT) do not matter. Large trees are refitted by all threads.
+void BVH::Refit( const uint32_t nodeIdx )
 {
 	FATAL_ERROR_IF( !refittable, "BVH::Refit( .. ), refitting an SBVH." );
 	FATAL_ERROR_IF( bvhNode == 0, "BVH::Refit( .. ), bvhNode == 0." );
-	FATAL_ERROR_IF( may_have_holes, "BVH::Refit( .. ), bvh may have holes." );
-	for (int32_t i = usedNodes - 1; i >= 0; i--) if (i != 1)
+	if (bvhNode1)
+	{
+		// deformation blur: refit the time 1 bounds against verts1 first.
+		BVHNode* nodes0 = bvhNode;
+		bvhNode = bvhNode1, bvhNode1 = 0, tinybvh_swap( verts, verts1 );
+		Refit( nodeIdx );
+		bvhNode1 = bvhNode, bvhNode = nodes0, tinybvh_swap( verts, verts1 );
+	}
+#ifdef ENABLE_THREADED_BUILDS
+	if (nodeIdx == 0 && usedNodes >= MT_BIN_THRESHOLD) tinybvh_parallel_refit( *this,
+		[&]( const uint32_t idx, uint32_t* child ) -> uint32_t {
+			const BVHNode& node = bvhNode[idx];
+			if (node.isLeaf()) return 0;
+			child[0] = node.leftFirst, child[1] = node.leftFirst + 1;
+			return 2;
+		},
+		[&]( const uint32_t idx ) { RefitSubtree( idx ); },
+		[&]( const uint32_t idx ) {
+			BVHNode& node = bvhNode[idx];
+			const BVHNode& left = bvhNode[node.leftFirst], & right = bvhNode[node.leftFirst + 1];
+			node.aabbMin = tinybvh_min( left.aabbMin, right.aabbMin );
+			node.aabbMax = tinybvh_max( left.aabbMax, right.aabbMax );
+		} );
+	else
+#endif
+	RefitSubtree( nodeIdx );
+	if (nodeIdx == 0) aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
+	if (nodeIdx == 0 && bvhNode1) // instances of this BLAS are bounded over the full time range.
+		aabbMin = tinybvh_min( aabbMin, bvhNode1[0].aabbMin ), aabbMax = tinybvh_max( aabbMax, bvhNode1[0].aabbMax );
+}
+
+void BVH::RefitSubtree( const uint32_t nodeIdx )
+{
+	BVHNode& node = bvhNode[nodeIdx];
+	if (node.isLeaf() && instList) // TLAS leaf: adjust to current instance bounds
+	{
+		node.aabbMin = bvhvec3( BVH_FAR ), node.aabbMax = bvhvec3( -BVH_FAR );
+		for (uint32_t j = 0; j < node.triCount; j++)
+		{
+			const BLASInstance& inst = instList[primIdx[node.leftFirst + j]];
+			node.aabbMin = tinybvh_min( node.aabbMin, inst.aabbMin );
+			node.aabbMax = tinybvh_max( node.aabbMax, inst.aabbMax );
+		}
+		return;
+	}
+	if (node.isLeaf()) // leaf: adjust to current triangle vertex positions
+	{
+		bvhvec4 bmin( BVH_FAR ), bmax( -BVH_FAR );
+		if (vertIdx)
+		{
+			for (uint32_t first = node.leftFirst, j = 0; j < node.triCount; j++)
+			{
+				const uint32_t vidx = primIdx[first + j] * 3;
+				const uint32_t i0 = vertIdx[vidx], i1 = vertIdx[vidx + 1], i2 = vertIdx[vidx + 2];
+				const bvhvec4 v0 = verts[i0], v1 = verts[i1], v2 = verts[i2];
+				const bvhvec4 t1 = tinybvh_min( v0, bmin );
+				const bvhvec4 t2 = tinybvh_max( v0, bmax );
+				const bvhvec4 t3 = tinybvh_min( v1, v2 );
+				const bvhvec4 t4 = tinybvh_max( v1, v2 );
+				bmin = tinybvh_min( t1, t3 );
+				bmax = tinybvh_max( t2, t4 );
+			}
+		}
+		else
+		{
+			for (uint32_t first = node.leftFirst, j = 0; j < node.triCount; j++)
+			{
+				const uint32_t vidx = primIdx[first + j] * 3;
+				const bvhvec4 v0 = verts[vidx], v1 = verts[vidx + 1], v2 = verts[vidx + 2];
+				const bvhvec4 t1 = tinybvh_min( v0, bmin );
+				const bvhvec4 t2 = tinybvh_max( v0, bmax );
+				const bvhvec4 t3 = tinybvh_min( v1, v2 );
+				const bvhvec4 t4 = tinybvh_max( v1, v2 );
+				bmin = tinybvh_min( t1, t3 );
+				bmax = tinybvh_max( t2, t4 );
+			}
+		}
+		node.aabbMin = bmin, node.aabbMax = bmax;
+		if (leafTris) PackTri4Leafs( leafTris + leafTriBlock[nodeIdx], verts, vertIdx, primIdx + node.leftFirst, node.triCount );
+		return;
+	}
+	// interior node: adjust to child bounds
+	RefitSubtree( node.leftFirst );
+	RefitSubtree( node.leftFirst + 1 );
+	const BVHNode& left = bvhNode[node.leftFirst], & right = bvhNode[node.leftFirst + 1];
+	node.aabbMin = tinybvh_min( left.aabbMin, right.aabbMin );
+	node.aabbMax = tinybvh_max( left.aabbMax, right.aabbMax );
+}
+
+// UpdateTLAS: Bring a TLAS up to date after some of its instances moved. Only
+// instances flagged as dirty (see BLASInstance::SetTransform) are updated; the
+// leaf of each such instance and its ancestors are then refitted bottom-up,
+// stopping as soon as a node's bounds do not change. The SAH cost is tracked
+// during the refit; once it exceeds maxCostGrowth times the cost after the last
+// full build, the TLAS is rebuilt from the current instance bounds.
+bool BVH::UpdateTLAS( const float maxCostGrowth )
+{
+	FATAL_ERROR_IF( !isTLAS(), "BVH::UpdateTLAS( .. ), not a TLAS." );
+	FATAL_ERROR_IF( !refittable, "BVH::UpdateTLAS( .. ), refitting an SBVH." );
+	if (tlasCost == 0) LinkTLAS();
+	// update the dirty instances. If blasList is a null pointer, we'll assume the
+	// BLASInstances have been updated elsewhere, as in BVH::Build.
+	if (blasList)
+	{
+	#ifdef ENABLE_THREADED_BUILDS
+		ThreadPool* pool = triCount >= MT_BIN_THRESHOLD ? &GetThreadPool() : 0;
+	#else
+		ThreadPool* pool = 0;
+	#endif
+		tinybvh_parallel_for( pool, triCount, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+			for (uint32_t i = first; i < last; i++) if (instList[i].dirty) instList[i].Update( blasList[instList[i].blasIdx] );
+		} );
+	}
+	// refit the paths from the affected leafs to the root.
+	for (uint32_t i = 0; i < triCount; i++) if (instList[i].dirty)
 	{
-		BVHNode& node = bvhNode[i];
-		if (node.isLeaf()) // leaf: adjust to current triangle vertex positions
+		instList[i].dirty = 0, instData[i].Set( instList[i] );
+		uint32_t nodeIdx = tlasInstLeaf[i];
+		while (1)
 		{
-			bvhvec4 bmin( BVH_FAR ), bmax( -BVH_FAR );
-			if (vertIdx)
+			BVHNode& node = bvhNode[nodeIdx];
+			bvhvec3 bmin( BVH_FAR ), bmax( -BVH_FAR );
+			float weight = c_trav;
+			if (node.isLeaf())
 			{
-				for (uint32_t first = node.leftFirst, j = 0; j < node.triCount; j++)
+				for (uint32_t j = 0; j < node.triCount; j++)
 				{
-					const uint32_t vidx = primIdx[first + j] * 3;
-					const uint32_t i0 = vertIdx[vidx], i1 = vertIdx[vidx + 1], i2 = vertIdx[vidx + 2];
-					const bvhvec4 v0 = verts[i0], v1 = verts[i1], v2 = verts[i2];
-					const bvhvec4 t1 = tinybvh_min( v0, bmin );
-					const bvhvec4 t2 = tinybvh_max( v0, bmax );
-					const bvhvec4 t3 = tinybvh_min( v1, v2 );
-					const bvhvec4 t4 = tinybvh_max( v1, v2 );
-					bmin = tinybvh_min( t1, t3 );
-					bmax = tinybvh_max( t2, t4 );
+					const BLASInstance& inst = instList[primIdx[node.leftFirst + j]];
+					bmin = tinybvh_min( bmin, inst.aabbMin ), bmax = tinybvh_max( bmax, inst.aabbMax );
 				}
+				weight = c_int * node.triCount;
 			}
 			else
 			{
-				for (uint32_t first = node.leftFirst, j = 0; j < node.triCount; j++)
-				{
-					const uint32_t vidx = primIdx[first + j] * 3;
-					const bvhvec4 v0 = verts[vidx], v1 = verts[vidx + 1], v2 = verts[vidx + 2];
-					const bvhvec4 t1 = tinybvh_min( v0, bmin );
-					const bvhvec4 t2 = tinybvh_max( v0, bmax );
-					const bvhvec4 t3 = tinybvh_min( v1, v2 );
-					const bvhvec4 t4 = tinybvh_max( v1, v2 );
-					bmin = tinybvh_min( t1, t3 );
-					bmax = tinybvh_max( t2, t4 );
-				}
+				const BVHNode& left = bvhNode[node.leftFirst], & right = bvhNode[node.leftFirst + 1];
+				bmin = tinybvh_min( left.aabbMin, right.aabbMin );
+				bmax = tinybvh_max( left.aabbMax, right.aabbMax );
 			}
-			node.aabbMin = aabbMin, node.aabbMax = aabbMax;
-			continue;
+			if (bmin.x == node.aabbMin.x && bmin.y == node.aabbMin.y && bmin.z == node.aabbMin.z &&
+				bmax.x == node.aabbMax.x && bmax.y == node.aabbMax.y && bmax.z == node.aabbMax.z) break;
+			tlasCost += weight * (SA( bmin, bmax ) - node.SurfaceArea());
+			node.aabbMin = bmin, node.aabbMax = bmax;
+			if (nodeIdx == 0) break;
+			nodeIdx = tlasParent[nodeIdx];
 		}
-		// interior node: adjust to child bounds
-		const BVHNode& left = bvhNode[node.leftFirst], & right = bvhNode[node.leftFirst + 1];
-		node.aabbMin = tinybvh_min( left.aabbMin, right.aabbMin );
-		node.aabbMax = tinybvh_max( left.aabbMax, right.aabbMax );
 	}
 	aabbMin = bvhNode[0].aabbMin, aabbMax = bvhNode[0].aabbMax;
+	if (tlasCost / bvhNode[0].SurfaceArea() <= maxCostGrowth * tlasBuildCost) return false;
+	// the tree has degraded too much: rebuild over the (already updated) instances.
+	BVHBase** blasses = blasList;
+	const uint32_t bCount = blasCount;
+	Build( instList, triCount, 0, 0 );
+	blasList = blasses, blasCount = bCount;
+	return true;
+}
+
+// LinkTLAS (helper): store the parent of each node and the leaf of each instance,
+// and the SAH cost of the tree, for UpdateTLAS.
+void BVH::LinkTLAS()
+{
+	AlignedFree( tlasParent );
+	AlignedFree( tlasInstLeaf );
+	tlasParent = (uint32_t*)AlignedAlloc( allocatedNodes * sizeof( uint32_t ) );
+	tlasInstLeaf = (uint32_t*)AlignedAlloc( triCount * sizeof( uint32_t ) );
+	uint32_t nodeIdx = 0, stack[64], stackPtr = 0;
+	float cost = 0;
+	tlasParent[0] = 0;
+	while (1)
+	{
+		const BVHNode& node = bvhNode[nodeIdx];
+		if (node.isLeaf())
+		{
+			for (uint32_t j = 0; j < node.triCount; j++) tlasInstLeaf[primIdx[node.leftFirst + j]] = nodeIdx;
+			cost += c_int * node.SurfaceArea() * node.triCount;
+			if (!stackPtr) break;
+			nodeIdx = stack[--stackPtr];
+			continue;
+		}
+		cost += c_trav * node.SurfaceArea();
+		tlasParent[node.leftFirst] = tlasParent[node.leftFirst + 1] = nodeIdx;
+		stack[stackPtr++] = node.leftFirst + 1;
+		nodeIdx = node.leftFirst;
+	}
+	tlasCost = cost, tlasBuildCost = cost / bvhNode[0].SurfaceArea();
 }
 
 #define FIX_COMBINE_LEAFS 1
@@ -2356,6 +3973,7 @@ void BVH::Refit( const uint32_t /* unused */ )
 // exceed the specified number. For BVH8_CPU construction.
 void BVH::CombineLeafs( const uint32_t primCount )
 {
+	DiscardLeafTris();
 	for (uint32_t i = 0; i < primCount - 1; i++)
 	{
 		uint32_t stackPtr = 1, stack[64];
@@ -2386,6 +4004,62 @@ void BVH::CombineLeafs( const uint32_t primCount )
 			}
 		}
 	}
+	if (hasMotion()) RefitMotion();
+}
+
+// PrecomputeLeafTris: Store the triangles of each leaf in blocks of four, in the
+// SoA layout used by BVH8_CPU, so that Intersect and IsOccluded can process a
+// leaf with SIMD code. The blocks are updated by Refit; a rebuild discards them.
+void BVH::PrecomputeLeafTris()
+{
+	FATAL_ERROR_IF( bvhNode == 0, "BVH::PrecomputeLeafTris(), bvhNode == 0." );
+	FATAL_ERROR_IF( isTLAS() || hasCustomGeom() || bvh_over_aabbs, "BVH::PrecomputeLeafTris(), BVH is not over triangles." );
+	FATAL_ERROR_IF( hasMotion(), "BVH::PrecomputeLeafTris(), BVH has deformation blur." );
+#ifndef BVH_USEAVX2
+	FATAL_ERROR( "BVH::PrecomputeLeafTris(), requires BVH_USEAVX2." );
+#endif
+	DiscardLeafTris();
+	leafTriBlock = (uint32_t*)AlignedAlloc( allocatedNodes * sizeof( uint32_t ) );
+	uint32_t blockCount = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		// first pass assigns blocks to leafs, second pass fills them.
+		if (pass == 1) leafTris = (BVHTri4Leaf*)AlignedAlloc( blockCount * sizeof( BVHTri4Leaf ) );
+		uint32_t stack[64], stackPtr = 0, nodeIdx = 0;
+		while (1)
+		{
+			const BVHNode& node = bvhNode[nodeIdx];
+			if (!node.isLeaf()) { stack[stackPtr++] = node.leftFirst + 1, nodeIdx = node.leftFirst; continue; }
+			if (pass == 0) leafTriBlock[nodeIdx] = blockCount, blockCount += (node.triCount + 3) >> 2;
+			else PackTri4Leafs( leafTris + leafTriBlock[nodeIdx], verts, vertIdx, primIdx + node.leftFirst, node.triCount );
+			if (!stackPtr) break;
+			nodeIdx = stack[--stackPtr];
+		}
+	}
+}
+
+void BVH::DiscardLeafTris()
+{
+	AlignedFree( leafTris );
+	AlignedFree( leafTriBlock );
+	leafTris = 0, leafTriBlock = 0;
+}
+
+// RefitMotion: the time 1 bounds of a deformation blur BVH share the topology of
+// the regular nodes. After a topology change they are recreated by copy and refit.
+void BVH::RefitMotion()
+{
+	FATAL_ERROR_IF( verts1.count != verts.count, "BVH::RefitMotion(), vertex buffers differ in size." );
+	AlignedFree( bvhNode1 );
+	bvhNode1 = (BVHNode*)AlignedAlloc( allocatedNodes * sizeof( BVHNode ) );
+	memcpy( bvhNode1, bvhNode, allocatedNodes * sizeof( BVHNode ) );
+	Refit();
+}
+
+void BVH::DiscardMotion()
+{
+	AlignedFree( bvhNode1 );
+	bvhNode1 = 0, verts1 = {};
 }
 
 bool BVH::IntersectSphere( const bvhvec3& pos, const float r ) const
@@ -2451,9 +4125,64 @@ bool BVH::IntersectSphere( const bvhvec3& pos, const float r ) const
 	return false;
 }
 
+#ifdef BVH_USEAVX2
+// SIMD intersection of the four triangles in a leaf block; see the AVX2 section.
+inline void IntersectTri4Leaf( Ray& ray, const BVHTri4Leaf* leaf );
+inline bool Tri4LeafOccludes( const Ray& ray, const BVHTri4Leaf* leaf );
+inline void IntersectWoop4Leaf( Ray& ray, const BVHWoop4Leaf* leaf );
+inline bool Woop4LeafOccludes( const Ray& ray, const BVHWoop4Leaf* leaf );
+#endif
+
 int32_t BVH::Intersect( Ray& ray ) const
 {
 	if (isTLAS()) return IntersectTLAS( ray );
+	if (hasMotion()) return IntersectMotion( ray );
+	return (this->*intersectKernel[RayOctant( ray )])(ray);
+}
+
+void BVH::IntersectBatch( Ray* rays, const uint32_t count ) const
+{
+	if (isTLAS()) { for (uint32_t i = 0; i < count; i++) IntersectTLAS( rays[i] ); return; }
+	if (hasMotion()) { for (uint32_t i = 0; i < count; i++) IntersectMotion( rays[i] ); return; }
+	OCTANT_BATCH( rays, count );
+}
+
+void BVH::IntersectSorted( Ray* rays, const uint32_t count, SortStats* stats, const uint32_t dirBits ) const
+{
+	// Incoherent rays traced in buffer order touch nodes all over the tree. Traced in
+	// sorted order, consecutive rays share most of their path through the TLAS and the
+	// BLASses. Sorting is not free; stats reports the cost of each stage separately.
+	if (count == 0) return;
+#ifdef ENABLE_THREADED_BUILDS
+	ThreadPool* pool = count >= MT_BIN_THRESHOLD ? &GetThreadPool() : 0;
+#else
+	ThreadPool* pool = 0;
+#endif
+	typedef std::chrono::high_resolution_clock clock;
+	const auto t0 = clock::now();
+	uint32_t* order = (uint32_t*)AlignedAlloc( count * sizeof( uint32_t ) );
+	Ray* sorted = (Ray*)AlignedAlloc( count * sizeof( Ray ) );
+	SortRays( rays, count, order, dirBits );
+	tinybvh_parallel_for( pool, count, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+		for (uint32_t i = first; i < last; i++) sorted[i] = rays[order[i]];
+	} );
+	const auto t1 = clock::now();
+	IntersectBatch( sorted, count );
+	const auto t2 = clock::now();
+	tinybvh_parallel_for( pool, count, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+		for (uint32_t i = first; i < last; i++) rays[order[i]].hit = sorted[i].hit;
+	} );
+	const auto t3 = clock::now();
+	AlignedFree( sorted );
+	AlignedFree( order );
+	if (stats)
+		stats->sortTime = std::chrono::duration<float>( t1 - t0 ).count(),
+		stats->traceTime = std::chrono::duration<float>( t2 - t1 ).count(),
+		stats->scatterTime = std::chrono::duration<float>( t3 - t2 ).count();
+}
+
+template <bool posX, bool posY, bool posZ> int32_t BVH::Intersect( Ray& ray ) const
+{
 	BVHNode* node = &bvhNode[0], * stack[64];
 	uint32_t stackPtr = 0;
 	float cost = 0;
@@ -2466,39 +4195,143 @@ int32_t BVH::Intersect( Ray& ray ) const
 			// geometry (ENABLE_CUSTOM_GEOMETRY) are both disabled, this leaf code reduces
 			// to a regular loop over triangles. Otherwise, the extra flexibility comes at
 			// a small performance cost.
+		#ifdef BVH_USEAVX2
+			if (leafTris)
+			{
+				const BVHTri4Leaf* leaf = leafTris + leafTriBlock[node - bvhNode];
+			#ifdef WATERTIGHT_TRIS
+				for (uint32_t i = 0; i < node->triCount; i += 4) IntersectWoop4Leaf( ray, (const BVHWoop4Leaf*)leaf++ );
+			#else
+				for (uint32_t i = 0; i < node->triCount; i += 4) IntersectTri4Leaf( ray, leaf++ );
+			#endif
+				cost += c_int * node->triCount;
+			}
+			else
+		#endif
 			if (indexedEnabled && vertIdx != 0) for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
 				IntersectTriIndexed( ray, verts, vertIdx, primIdx[node->leftFirst + i] );
 			else if (customEnabled && customIntersect != 0) for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
 			{
-				if ((*customIntersect)(ray, primIdx[node->leftFirst + i]))
-				{
-				#if INST_IDX_BITS == 32
-					ray.hit.inst = ray.instIdx;
-				#else
-					ray.hit.prim = (ray.hit.prim & PRIM_IDX_MASK) + ray.instIdx;
-				#endif
-				}
+				if ((*customIntersect)(ray, primIdx[node->leftFirst + i]))
+				{
+				#if INST_IDX_BITS == 32
+					ray.hit.inst = ray.instIdx;
+				#else
+					ray.hit.prim = (ray.hit.prim & PRIM_IDX_MASK) + ray.instIdx;
+				#endif
+				}
+			}
+			else for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
+				IntersectTri( ray, verts, primIdx[node->leftFirst + i] );
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			continue;
+		}
+		BVHNode* child1 = &bvhNode[node->leftFirst];
+		BVHNode* child2 = &bvhNode[node->leftFirst + 1];
+		float dist1 = IntersectAABB<posX, posY, posZ>( ray, child1->aabbMin, child1->aabbMax );
+		float dist2 = IntersectAABB<posX, posY, posZ>( ray, child2->aabbMin, child2->aabbMax );
+		if (dist1 > dist2) { tinybvh_swap( dist1, dist2 ); tinybvh_swap( child1, child2 ); }
+		if (dist1 == BVH_FAR /* missed both child nodes */)
+		{
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+		}
+		else /* hit at least one node */
+		{
+			node = child1; /* continue with the nearest */
+			if (dist2 != BVH_FAR) stack[stackPtr++] = child2; /* push far child */
+		}
+	}
+	return (int32_t)cost; // cast to not break interface.
+}
+
+// MotionTri (helper): the vertices of a triangle, interpolated to the ray time.
+void BVH::MotionTri( const uint32_t prim, const float time, bvhvec4* tri ) const
+{
+	for (uint32_t j = 0; j < 3; j++)
+	{
+		const uint32_t v = (indexedEnabled && vertIdx != 0) ? vertIdx[prim * 3 + j] : (prim * 3 + j);
+		tri[j] = verts[v] + (verts1[v] - verts[v]) * time;
+	}
+}
+
+// IntersectMotion: deformation blur. Node bounds are interpolated between bvhNode
+// and bvhNode1, which bounds the interpolated triangles at the same time.
+int32_t BVH::IntersectMotion( Ray& ray ) const
+{
+	uint32_t nodeIdx = 0, stack[64], stackPtr = 0;
+	const float t = ray.time;
+	bvhvec4 tri[3];
+	float cost = 0;
+	while (1)
+	{
+		cost += c_trav;
+		const BVHNode& node = bvhNode[nodeIdx];
+		if (node.isLeaf())
+		{
+			for (uint32_t i = 0; i < node.triCount; i++, cost += c_int)
+			{
+				// IntersectTri registers a hit for index 0; add the actual primitive index.
+				const uint32_t prim = primIdx[node.leftFirst + i];
+				const float tmax = ray.hit.t;
+				MotionTri( prim, t, tri );
+				IntersectTri( ray, bvhvec4slice( tri, 3, sizeof( bvhvec4 ) ), 0 );
+				if (ray.hit.t < tmax) ray.hit.prim += prim;
+			}
+			if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
+			continue;
+		}
+		uint32_t child1 = node.leftFirst, child2 = node.leftFirst + 1;
+		const BVHNode& a0 = bvhNode[child1], & a1 = bvhNode1[child1], & b0 = bvhNode[child2], & b1 = bvhNode1[child2];
+		float dist1 = IntersectAABB( ray, a0.aabbMin + (a1.aabbMin - a0.aabbMin) * t, a0.aabbMax + (a1.aabbMax - a0.aabbMax) * t );
+		float dist2 = IntersectAABB( ray, b0.aabbMin + (b1.aabbMin - b0.aabbMin) * t, b0.aabbMax + (b1.aabbMax - b0.aabbMax) * t );
+		if (dist1 > dist2) { tinybvh_swap( dist1, dist2 ); tinybvh_swap( child1, child2 ); }
+		if (dist1 == BVH_FAR /* missed both child nodes */)
+		{
+			if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
+		}
+		else /* hit at least one node */
+		{
+			nodeIdx = child1; /* continue with the nearest */
+			if (dist2 != BVH_FAR) stack[stackPtr++] = child2; /* push far child */
+		}
+	}
+	return (int32_t)cost;
+}
+
+bool BVH::IsOccludedMotion( const Ray& ray ) const
+{
+	uint32_t nodeIdx = 0, stack[64], stackPtr = 0;
+	const float t = ray.time;
+	bvhvec4 tri[3];
+	while (1)
+	{
+		const BVHNode& node = bvhNode[nodeIdx];
+		if (node.isLeaf())
+		{
+			for (uint32_t i = 0; i < node.triCount; i++)
+			{
+				MotionTri( primIdx[node.leftFirst + i], t, tri );
+				if (TriOccludes( ray, bvhvec4slice( tri, 3, sizeof( bvhvec4 ) ), 0 )) return true;
 			}
-			else for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
-				IntersectTri( ray, verts, primIdx[node->leftFirst + i] );
-			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
 			continue;
 		}
-		BVHNode* child1 = &bvhNode[node->leftFirst];
-		BVHNode* child2 = &bvhNode[node->leftFirst + 1];
-		float dist1 = child1->Intersect( ray ), dist2 = child2->Intersect( ray );
+		uint32_t child1 = node.leftFirst, child2 = node.leftFirst + 1;
+		const BVHNode& a0 = bvhNode[child1], & a1 = bvhNode1[child1], & b0 = bvhNode[child2], & b1 = bvhNode1[child2];
+		float dist1 = IntersectAABB( ray, a0.aabbMin + (a1.aabbMin - a0.aabbMin) * t, a0.aabbMax + (a1.aabbMax - a0.aabbMax) * t );
+		float dist2 = IntersectAABB( ray, b0.aabbMin + (b1.aabbMin - b0.aabbMin) * t, b0.aabbMax + (b1.aabbMax - b0.aabbMax) * t );
 		if (dist1 > dist2) { tinybvh_swap( dist1, dist2 ); tinybvh_swap( child1, child2 ); }
 		if (dist1 == BVH_FAR /* missed both child nodes */)
 		{
-			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
 		}
 		else /* hit at least one node */
 		{
-			node = child1; /* continue with the nearest */
+			nodeIdx = child1; /* continue with the nearest */
 			if (dist2 != BVH_FAR) stack[stackPtr++] = child2; /* push far child */
 		}
 	}
-	return (int32_t)cost; // cast to not break interface.
+	return false;
 }
 
 int32_t BVH::IntersectTLAS( Ray& ray ) const
@@ -2511,42 +4344,7 @@ int32_t BVH::IntersectTLAS( Ray& ray ) const
 		cost += c_trav;
 		if (node->isLeaf())
 		{
-			Ray tmp;
-			for (uint32_t i = 0; i < node->triCount; i++)
-			{
-				// BLAS traversal
-				const uint32_t instIdx = primIdx[node->leftFirst + i];
-				const BLASInstance& inst = instList[instIdx];
-				const BVHBase* blas = blasList[inst.blasIdx];
-				// 1. Transform ray with the inverse of the instance transform
-				tmp.O = tinybvh_transform_point( ray.O, inst.invTransform );
-				tmp.D = tinybvh_transform_vector( ray.D, inst.invTransform );
-				tmp.instIdx = instIdx << (32 - INST_IDX_BITS);
-				tmp.hit = ray.hit;
-				tmp.rD = tinybvh_safercp( tmp.D );
-				// 2. Traverse BLAS with the transformed ray
-				// Note: Valid BVH layout options for BLASses are the regular BVH layout,
-				// the AVX-optimized BVH_SOA layout and the wide BVH4_CPU layout. If all
-				// BLASses are of the same layout this reduces to nearly zero cost for
-				// a small set of predictable branches.
-				assert( blas->layout == LAYOUT_BVH || blas->layout == LAYOUT_BVH4_CPU ||
-					blas->layout == LAYOUT_BVH_SOA || blas->layout == LAYOUT_BVH8_AVX2 || blas->layout == LAYOUT_BVH4_AVX2 );
-				if (blas->layout == LAYOUT_BVH)
-				{
-					// regular (triangle) BVH traversal
-					cost += ((BVH*)blas)->Intersect( tmp );
-				}
-				else
-				{
-					if (blas->layout == LAYOUT_BVH4_CPU) cost += ((BVH4_CPU*)blas)->Intersect( tmp );
-					else if (blas->layout == LAYOUT_BVH_SOA) cost += ((BVH_SoA*)blas)->Intersect( tmp );
-				#ifdef BVH_USEAVX2
-					else if (blas->layout == LAYOUT_BVH8_AVX2) cost += ((BVH8_CPU*)blas)->Intersect( tmp );
-				#endif
-				}
-				// 3. Restore ray
-				ray.hit = tmp.hit;
-			}
+			cost += IntersectInstances( ray, instList, instData, blasList, primIdx + node->leftFirst, node->triCount );
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
 		}
@@ -2570,12 +4368,30 @@ int32_t BVH::IntersectTLAS( Ray& ray ) const
 bool BVH::IsOccluded( const Ray& ray ) const
 {
 	if (isTLAS()) return IsOccludedTLAS( ray );
+	if (hasMotion()) return IsOccludedMotion( ray );
+	return (this->*occlusionKernel[RayOctant( ray )])(ray);
+}
+
+template <bool posX, bool posY, bool posZ> bool BVH::IsOccluded( const Ray& ray ) const
+{
 	BVHNode* node = &bvhNode[0], * stack[64];
 	uint32_t stackPtr = 0;
 	while (1)
 	{
 		if (node->isLeaf())
 		{
+		#ifdef BVH_USEAVX2
+			if (leafTris)
+			{
+				const BVHTri4Leaf* leaf = leafTris + leafTriBlock[node - bvhNode];
+			#ifdef WATERTIGHT_TRIS
+				for (uint32_t i = 0; i < node->triCount; i += 4) if (Woop4LeafOccludes( ray, (const BVHWoop4Leaf*)leaf++ )) return true;
+			#else
+				for (uint32_t i = 0; i < node->triCount; i += 4) if (Tri4LeafOccludes( ray, leaf++ )) return true;
+			#endif
+			}
+			else
+		#endif
 			if (indexedEnabled && vertIdx != 0)
 			{
 				for (uint32_t i = 0; i < node->triCount; i++)
@@ -2596,7 +4412,8 @@ bool BVH::IsOccluded( const Ray& ray ) const
 		}
 		BVHNode* child1 = &bvhNode[node->leftFirst];
 		BVHNode* child2 = &bvhNode[node->leftFirst + 1];
-		float dist1 = child1->Intersect( ray ), dist2 = child2->Intersect( ray );
+		float dist1 = IntersectAABB<posX, posY, posZ>( ray, child1->aabbMin, child1->aabbMax );
+		float dist2 = IntersectAABB<posX, posY, posZ>( ray, child2->aabbMin, child2->aabbMax );
 		if (dist1 > dist2) { tinybvh_swap( dist1, dist2 ); tinybvh_swap( child1, child2 ); }
 		if (dist1 == BVH_FAR /* missed both child nodes */)
 		{
@@ -2611,42 +4428,18 @@ bool BVH::IsOccluded( const Ray& ray ) const
 	return false;
 }
 
+const BVH::IntersectKernel BVH::intersectKernel[8] = OCTANT_KERNELS( BVH::Intersect );
+const BVH::OcclusionKernel BVH::occlusionKernel[8] = OCTANT_KERNELS( BVH::IsOccluded );
+
 bool BVH::IsOccludedTLAS( const Ray& ray ) const
 {
 	BVHNode* node = &bvhNode[0], * stack[64];
 	uint32_t stackPtr = 0;
-	Ray tmp;
 	while (1)
 	{
 		if (node->isLeaf())
 		{
-			for (uint32_t i = 0; i < node->triCount; i++)
-			{
-				// BLAS traversal
-				BLASInstance& inst = instList[primIdx[node->leftFirst + i]];
-				const BVHBase* blas = blasList[inst.blasIdx];
-				// 1. Transform ray with the inverse of the instance transform
-				tmp.O = tinybvh_transform_point( ray.O, inst.invTransform );
-				tmp.D = tinybvh_transform_vector( ray.D, inst.invTransform );
-				tmp.hit.t = ray.hit.t;
-				tmp.rD = tinybvh_safercp( tmp.D );
-				// 2. Traverse BLAS with the transformed ray
-				assert( blas->layout == LAYOUT_BVH || blas->layout == LAYOUT_BVH4_CPU ||
-					blas->layout == LAYOUT_BVH_SOA || blas->layout == LAYOUT_BVH8_AVX2 || blas->layout == LAYOUT_BVH4_AVX2 );
-				if (blas->layout == LAYOUT_BVH)
-				{
-					// regular (triangle) BVH traversal
-					if (((BVH*)blas)->IsOccluded( tmp )) return true;
-				}
-				else
-				{
-					if (blas->layout == LAYOUT_BVH4_CPU) { if (((BVH4_CPU*)blas)->IsOccluded( tmp )) return true; }
-					else if (blas->layout == LAYOUT_BVH_SOA) { if (((BVH_SoA*)blas)->IsOccluded( tmp )) return true; }
-				#ifdef BVH_USEAVX2
-					else if (blas->layout == LAYOUT_BVH8_AVX2) { if (((BVH8_CPU*)blas)->IsOccluded( tmp )) return true; }
-				#endif
-				}
-			}
+			if (InstancesOcclude( ray, instList, instData, blasList, primIdx + node->leftFirst, node->triCount )) return true;
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
 		}
@@ -2667,6 +4460,206 @@ bool BVH::IsOccludedTLAS( const Ray& ray ) const
 	return false;
 }
 
+// CompactInstance implementation
+// ----------------------------------------------------------------------------
+
+void CompactInstance::Set( const BLASInstance& inst )
+{
+	// store the inverse transform per column; the bottom row of an affine matrix is 0, 0, 0, 1.
+	const float* T = inst.invTransform;
+#ifdef TLAS_HALF_TRANSFORMS
+	FATAL_ERROR_IF( inst.blasIdx > 0x7fff, "CompactInstance::Set( .. ), blasIdx exceeds 15 bits." );
+	for (int i = 0; i < 3; i++) for (int j = 0; j < 3; j++) invT[i * 3 + j] = tinybvh_float_to_half( T[j * 4 + i] );
+	blasIdx = (uint16_t)inst.blasIdx, moving = inst.keyCount > 1 ? 1 : 0;
+	position = bvhvec3( inst.transform[3], inst.transform[7], inst.transform[11] );
+#else
+	col0 = bvhvec3( T[0], T[4], T[8] ), col1 = bvhvec3( T[1], T[5], T[9] );
+	col2 = bvhvec3( T[2], T[6], T[10] ), col3 = bvhvec3( T[3], T[7], T[11] );
+	blasIdx = inst.blasIdx, moving = inst.keyCount > 1 ? 1 : 0, dummy2 = dummy3 = 0;
+#endif
+}
+
+#ifdef BVH_USEAVX
+
+// four half floats, packed in the low 64 bits, to floats.
+inline __m128 tinybvh_half4_to_float4( const __m128i h )
+{
+#ifdef __F16C__
+	return _mm_cvtph_ps( h );
+#else
+	const __m128i h32 = _mm_unpacklo_epi16( h, _mm_setzero_si128() );
+	const __m128i e = _mm_slli_epi32( _mm_and_si128( h32, _mm_set1_epi32( 0x7fff ) ), 13 );
+	const __m128 f = _mm_mul_ps( _mm_castsi128_ps( e ), _mm_set1_ps( 5.192296858534828e33f ) ); // 2^112
+	return _mm_or_ps( f, _mm_castsi128_ps( _mm_slli_epi32( _mm_and_si128( h32, _mm_set1_epi32( 0x8000 ) ), 16 ) ) );
+#endif
+}
+
+#endif
+
+__FORCEINLINE void CompactInstance::TransformRay( const Ray& ray, Ray& tmp ) const
+{
+#ifdef BVH_USEAVX
+	// O' = c0 * O.x + c1 * O.y + c2 * O.z + c3, D' = c0 * D.x + c1 * D.y + c2 * D.z.
+	__m128 O4 = _mm_load_ps( &ray.O.x ), D4 = _mm_load_ps( &ray.D.x );
+#ifdef TLAS_HALF_TRANSFORMS
+	const __m128i h = _mm_load_si128( (__m128i*)invT );
+	const __m128 lo = tinybvh_half4_to_float4( h ), hi = tinybvh_half4_to_float4( _mm_srli_si128( h, 8 ) );
+	const __m128 m22 = _mm_set1_ps( tinybvh_half_to_float( invT[8] ) );
+	const __m128 c0 = lo, t = _mm_shuffle_ps( lo, hi, _MM_SHUFFLE( 0, 0, 3, 3 ) );
+	const __m128 c1 = _mm_shuffle_ps( t, hi, _MM_SHUFFLE( 1, 1, 2, 0 ) );
+	const __m128 c2 = _mm_shuffle_ps( hi, m22, _MM_SHUFFLE( 0, 0, 3, 2 ) );
+	const __m128 c3 = _mm_setzero_ps();
+	O4 = _mm_sub_ps( O4, _mm_setr_ps( position.x, position.y, position.z, 0 ) );
+#else
+	const __m128 c0 = _mm_load_ps( &col0.x ), c1 = _mm_load_ps( &col1.x );
+	const __m128 c2 = _mm_load_ps( &col2.x ), c3 = _mm_load_ps( &col3.x );
+#endif
+	const __m128 O = _mm_add_ps( _mm_add_ps( _mm_mul_ps( c0, _mm_shuffle_ps( O4, O4, 0 ) ), _mm_mul_ps( c1, _mm_shuffle_ps( O4, O4, 85 ) ) ),
+		_mm_add_ps( _mm_mul_ps( c2, _mm_shuffle_ps( O4, O4, 170 ) ), c3 ) );
+	const __m128 D = _mm_add_ps( _mm_add_ps( _mm_mul_ps( c0, _mm_shuffle_ps( D4, D4, 0 ) ), _mm_mul_ps( c1, _mm_shuffle_ps( D4, D4, 85 ) ) ),
+		_mm_mul_ps( c2, _mm_shuffle_ps( D4, D4, 170 ) ) );
+	// note: this overwrites the w lanes, tmp.time and tmp.instIdx.
+	_mm_store_ps( &tmp.O.x, O ), _mm_store_ps( &tmp.D.x, D );
+#else
+#ifdef TLAS_HALF_TRANSFORMS
+	const bvhvec3 c0( tinybvh_half_to_float( invT[0] ), tinybvh_half_to_float( invT[1] ), tinybvh_half_to_float( invT[2] ) );
+	const bvhvec3 c1( tinybvh_half_to_float( invT[3] ), tinybvh_half_to_float( invT[4] ), tinybvh_half_to_float( invT[5] ) );
+	const bvhvec3 c2( tinybvh_half_to_float( invT[6] ), tinybvh_half_to_float( invT[7] ), tinybvh_half_to_float( invT[8] ) );
+	const bvhvec3 c3( 0 ), O = ray.O - position;
+#else
+	const bvhvec3 c0 = col0, c1 = col1, c2 = col2, c3 = col3, O = ray.O;
+#endif
+	tmp.O = c0 * O.x + c1 * O.y + c2 * O.z + c3;
+	tmp.D = c0 * ray.D.x + c1 * ray.D.y + c2 * ray.D.z;
+#endif
+	tmp.rD = tinybvh_safercp( tmp.D ), tmp.time = ray.time;
+}
+
+// IntersectInstances (helper): TLAS leaf for BVH, BVH4_CPU and BVH8_CPU.
+int32_t BVHBase::IntersectInstances( Ray& ray, const BLASInstance* instList, const CompactInstance* instData, BVHBase* const* blasList, const uint32_t* instIdx, const uint32_t count )
+{
+	Ray tmp;
+	int32_t cost = 0;
+#if INST_MAX_LEVELS > 1
+	// instPath has room for INST_MAX_LEVELS entries; a deeper hierarchy would overwrite the ray.
+	FATAL_ERROR_IF( ray.instLevel >= INST_MAX_LEVELS, "BVHBase::IntersectInstances( .. ), TLAS nesting exceeds INST_MAX_LEVELS." );
+#endif
+	for (uint32_t i = 0; i < count; i++)
+	{
+		// BLAS traversal
+		const CompactInstance& inst = instData[instIdx[i]];
+		const BVHBase* blas = blasList[inst.blasIdx];
+		// 1. Transform ray with the inverse of the instance transform
+		if (inst.moving) instList[instIdx[i]].TransformRay( ray, tmp ); else inst.TransformRay( ray, tmp );
+		tmp.instIdx = instIdx[i] << (32 - INST_IDX_BITS);
+		tmp.hit = ray.hit;
+	#if INST_MAX_LEVELS > 1
+		tmp.instLevel = ray.instLevel + 1, tmp.hit.instLevels = tmp.instLevel; // a nested TLAS overwrites this.
+	#endif
+		// 2. Traverse BLAS with the transformed ray
+		// Note: Valid BVH layout options for BLASses are the regular BVH layout,
+		// the AVX-optimized BVH_SOA layout and the wide BVH4_CPU layout. If all
+		// BLASses are of the same layout this reduces to nearly zero cost for
+		// a small set of predictable branches. BVH, BVH4_CPU and BVH8_CPU may
+		// themselves be a TLAS; the ray is then transformed again for each level.
+		assert( blas->layout == LAYOUT_BVH || blas->layout == LAYOUT_BVH4_CPU ||
+			blas->layout == LAYOUT_BVH_SOA || blas->layout == LAYOUT_BVH8_AVX2 || blas->layout == LAYOUT_BVH4_AVX2 );
+		if (blas->layout == LAYOUT_BVH)
+		{
+			// regular (triangle) BVH traversal
+			cost += ((BVH*)blas)->Intersect( tmp );
+		}
+		else
+		{
+			if (blas->layout == LAYOUT_BVH4_CPU) cost += ((BVH4_CPU*)blas)->Intersect( tmp );
+			else if (blas->layout == LAYOUT_BVH_SOA) cost += ((BVH_SoA*)blas)->Intersect( tmp );
+		#ifdef BVH_USEAVX2
+			else if (blas->layout == LAYOUT_BVH8_AVX2) cost += ((BVH8_CPU*)blas)->Intersect( tmp );
+		#endif
+		}
+		// 3. Restore ray
+	#if INST_MAX_LEVELS > 1
+		// the hit path is completed on the way out: each level adds its own instance.
+		if (tmp.hit.t < ray.hit.t) tmp.hit.instPath[ray.instLevel] = instIdx[i], ray.hit = tmp.hit;
+	#else
+		ray.hit = tmp.hit;
+	#endif
+	}
+	return cost;
+}
+
+// GetInstances (helper): instance and blas arrays of a TLAS, or null for a BLAS.
+const BLASInstance* BVHBase::GetInstances( const BVHBase* bvh, BVHBase* const** blasList )
+{
+	const BLASInstance* instList = 0;
+	BVHBase* const* blas = 0;
+	if (bvh->layout == LAYOUT_BVH) instList = ((BVH*)bvh)->instList, blas = ((BVH*)bvh)->blasList;
+	else if (bvh->layout == LAYOUT_BVH4_CPU) instList = ((BVH4_CPU*)bvh)->instList, blas = ((BVH4_CPU*)bvh)->blasList;
+#ifdef BVH_USEAVX2
+	else if (bvh->layout == LAYOUT_BVH8_AVX2) instList = ((BVH8_CPU*)bvh)->instList, blas = ((BVH8_CPU*)bvh)->blasList;
+#endif
+	if (blasList) *blasList = blas;
+	return instList;
+}
+
+#if INST_MAX_LEVELS > 1
+
+// GetInstanceTransform: accumulate the instance transforms along the path of a hit,
+// from the outermost TLAS to the instance that holds the hit primitive. Pass the
+// time of the ray for instances with keyframes.
+void BVHBase::GetInstanceTransform( const BVHBase* tlas, const Intersection& hit, float* T, const float time )
+{
+	static const float identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+	memcpy( T, identity, sizeof( identity ) );
+	const BVHBase* bvh = tlas;
+	for (uint32_t level = 0; level < hit.instLevels; level++)
+	{
+		BVHBase* const* blasList;
+		const BLASInstance* instList = GetInstances( bvh, &blasList );
+		FATAL_ERROR_IF( instList == 0, "BVHBase::GetInstanceTransform( .. ), instance path enters a BLAS." );
+		const BLASInstance& inst = instList[hit.instPath[level]];
+		float M[16], R[16];
+		inst.GetTransform( time, M );
+		for (int i = 0; i < 4; i++) for (int j = 0; j < 4; j++)
+			R[i * 4 + j] = T[i * 4] * M[j] + T[i * 4 + 1] * M[4 + j] + T[i * 4 + 2] * M[8 + j] + T[i * 4 + 3] * M[12 + j];
+		memcpy( T, R, sizeof( R ) );
+		bvh = blasList[inst.blasIdx];
+	}
+}
+
+#endif
+
+bool BVHBase::InstancesOcclude( const Ray& ray, const BLASInstance* instList, const CompactInstance* instData, BVHBase* const* blasList, const uint32_t* instIdx, const uint32_t count )
+{
+	Ray tmp;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		// BLAS traversal
+		const CompactInstance& inst = instData[instIdx[i]];
+		const BVHBase* blas = blasList[inst.blasIdx];
+		// 1. Transform ray with the inverse of the instance transform
+		if (inst.moving) instList[instIdx[i]].TransformRay( ray, tmp ); else inst.TransformRay( ray, tmp );
+		tmp.hit.t = ray.hit.t;
+		// 2. Traverse BLAS with the transformed ray
+		assert( blas->layout == LAYOUT_BVH || blas->layout == LAYOUT_BVH4_CPU ||
+			blas->layout == LAYOUT_BVH_SOA || blas->layout == LAYOUT_BVH8_AVX2 || blas->layout == LAYOUT_BVH4_AVX2 );
+		if (blas->layout == LAYOUT_BVH)
+		{
+			// regular (triangle) BVH traversal
+			if (((BVH*)blas)->IsOccluded( tmp )) return true;
+		}
+		else
+		{
+			if (blas->layout == LAYOUT_BVH4_CPU) { if (((BVH4_CPU*)blas)->IsOccluded( tmp )) return true; }
+			else if (blas->layout == LAYOUT_BVH_SOA) { if (((BVH_SoA*)blas)->IsOccluded( tmp )) return true; }
+		#ifdef BVH_USEAVX2
+			else if (blas->layout == LAYOUT_BVH8_AVX2) { if (((BVH8_CPU*)blas)->IsOccluded( tmp )) return true; }
+		#endif
+		}
+	}
+	return false;
+}
+
 // Intersect a WALD_32BYTE BVH with a ray packet.
 // The 256 rays travel together to better utilize the caches and to amortize the cost
 // of memory transfers over the rays in the bundle.
@@ -2676,6 +4669,14 @@ bool BVH::IsOccludedTLAS( const Ray& ray ) const
 // extended with sorted traversal and reduced stack traffic.
 void BVH::Intersect256Rays( Ray* packet ) const
 {
+	// deformation blur: packet bounds would be for time 0 only; trace the rays one by one.
+	if (hasMotion()) { for (int32_t i = 0; i < 256; i++) IntersectMotion( packet[i] ); return; }
+	// packets with distinct origins (thin lens, area lights) take the interval path.
+	for (int32_t i = 1; i < 256; i++) if (packet[i].O.x != packet[0].O.x || packet[i].O.y != packet[0].O.y || packet[i].O.z != packet[0].O.z)
+	{
+		Intersect256RaysSpread( packet );
+		return;
+	}
 	// convenience macro
 #define CALC_TMIN_TMAX_WITH_SLABTEST_ON_RAY( r ) const bvhvec3 rD = packet[r].rD, t1 = o1 * rD, t2 = o2 * rD; \
 	const float tmin = tinybvh_max( tinybvh_max( tinybvh_min( t1.x, t2.x ), tinybvh_min( t1.y, t2.y ) ), tinybvh_min( t1.z, t2.z ) ); \
@@ -2846,6 +4847,136 @@ void BVH::Intersect256Rays( Ray* packet ) const
 	}
 }
 
+// Packet traversal for rays that do not share an origin, e.g. for thin lens depth of
+// field or area light shadow rays. The four frustum planes of Intersect256Rays are
+// replaced by a conservative interval frustum: at distance t, every ray of the packet
+// lies in the box [omin + t * dmin, omax + t * dmax], so a node that this box never
+// overlaps for t in [0, tfar] is skipped by the entire packet. Packets that are not
+// coherent, i.e. with mixed direction signs or widely spread origins, are traced ray
+// by ray.
+void BVH::Intersect256RaysSpread( Ray* packet ) const
+{
+	if (hasMotion()) { for (int32_t i = 0; i < 256; i++) IntersectMotion( packet[i] ); return; }
+	bvhvec3 omin = packet[0].O, omax = packet[0].O, dmin = packet[0].D, dmax = packet[0].D;
+	float tfar = packet[0].hit.t;
+	for (int32_t i = 1; i < 256; i++)
+	{
+		omin = tinybvh_min( omin, packet[i].O ), omax = tinybvh_max( omax, packet[i].O );
+		dmin = tinybvh_min( dmin, packet[i].D ), dmax = tinybvh_max( dmax, packet[i].D );
+		tfar = tinybvh_max( tfar, packet[i].hit.t );
+	}
+	const bvhvec3 originExtent = omax - omin, sceneExtent = bvhNode[0].aabbMax - bvhNode[0].aabbMin;
+	const bool sameOctant = dmin.x * dmax.x >= 0 && dmin.y * dmax.y >= 0 && dmin.z * dmax.z >= 0;
+	if (!sameOctant || tinybvh_max( tinybvh_max( originExtent.x, originExtent.y ), originExtent.z ) >
+		0.05f * tinybvh_max( tinybvh_max( sceneExtent.x, sceneExtent.y ), sceneExtent.z ))
+	{
+		for (int32_t i = 0; i < 256; i++) Intersect( packet[i] );
+		return;
+	}
+	const auto slabTest = [&]( const BVHNode* node, const int32_t r, float& dist ) {
+		const Ray& ray = packet[r];
+		const bvhvec3 t1 = (node->aabbMin - ray.O) * ray.rD, t2 = (node->aabbMax - ray.O) * ray.rD;
+		const float tmin = tinybvh_max( tinybvh_max( tinybvh_min( t1.x, t2.x ), tinybvh_min( t1.y, t2.y ) ), tinybvh_min( t1.z, t2.z ) );
+		float tmax = tinybvh_min( tinybvh_min( tinybvh_max( t1.x, t2.x ), tinybvh_max( t1.y, t2.y ) ), tinybvh_max( t1.z, t2.z ) );
+#ifdef WATERTIGHT_TRIS
+		tmax *= BVH_CONSERVATIVE_TMAX;
+#endif
+		dist = tmin;
+		return tmax >= tmin && tmin < ray.hit.t && tmax >= 0;
+	};
+	const auto outsideFrustum = [&]( const BVHNode* node ) {
+		float t0 = 0, t1 = tfar;
+		for (int32_t a = 0; a < 3; a++)
+		{
+			// lower bound omin + t * dmin must stay below aabbMax, upper bound omax + t * dmax above aabbMin.
+			if (dmin[a] == 0) { if (omin[a] > node->aabbMax[a]) return true; }
+			else if (dmin[a] > 0) t1 = tinybvh_min( t1, (node->aabbMax[a] - omin[a]) / dmin[a] );
+			else t0 = tinybvh_max( t0, (node->aabbMax[a] - omin[a]) / dmin[a] );
+			if (dmax[a] == 0) { if (omax[a] < node->aabbMin[a]) return true; }
+			else if (dmax[a] > 0) t0 = tinybvh_max( t0, (node->aabbMin[a] - omax[a]) / dmax[a] );
+			else t1 = tinybvh_min( t1, (node->aabbMin[a] - omax[a]) / dmax[a] );
+		}
+#ifdef WATERTIGHT_TRIS
+		t1 *= BVH_CONSERVATIVE_TMAX;
+#endif
+		return t0 > t1;
+	};
+	const auto visitChild = [&]( const BVHNode* child, int32_t first, int32_t& childFirst, int32_t& childLast, float& dist ) {
+		// early-in for the first active ray, early-out for the interval frustum, else shrink the range.
+		if (slabTest( child, first, dist )) return true;
+		if (outsideFrustum( child )) return false;
+		float lastDist;
+		for (; childFirst <= childLast; childFirst++) if (slabTest( child, childFirst, dist )) break;
+		for (; childLast > childFirst; childLast--) if (slabTest( child, childLast, lastDist )) break;
+		return childFirst <= childLast;
+	};
+	int32_t first = 0, last = 255; // first and last active ray in the packet
+	const BVHNode* node = &bvhNode[0];
+	ALIGNED( 64 ) uint32_t stack[64], stackPtr = 0;
+	while (1)
+	{
+		if (node->isLeaf())
+		{
+			for (uint32_t j = 0; j < node->triCount; j++)
+			{
+				const uint32_t idx = primIdx[node->leftFirst + j], vid = idx * 3;
+				const bvhvec3 edge1 = verts[vid + 1] - verts[vid], edge2 = verts[vid + 2] - verts[vid];
+				for (int32_t i = first; i <= last; i++)
+				{
+					Ray& ray = packet[i];
+					const bvhvec3 h = tinybvh_cross( ray.D, edge2 );
+					const float a = tinybvh_dot( edge1, h );
+					if (fabs( a ) < 0.0000001f) continue; // ray parallel to triangle
+					const bvhvec3 s = ray.O - bvhvec3( verts[vid] );
+					const float f = 1 / a, u = f * tinybvh_dot( s, h );
+					if (u < 0 || u > 1) continue;
+					const bvhvec3 q = tinybvh_cross( s, edge1 );
+					const float v = f * tinybvh_dot( ray.D, q );
+					if (v < 0 || u + v > 1) continue;
+					const float t = f * tinybvh_dot( edge2, q );
+					if (t <= 0 || t >= ray.hit.t) continue;
+					ray.hit.t = t, ray.hit.u = u, ray.hit.v = v;
+				#if INST_IDX_BITS == 32
+					ray.hit.prim = idx;
+					ray.hit.inst = ray.instIdx;
+				#else
+					ray.hit.prim = idx + ray.instIdx;
+				#endif
+				}
+			}
+			if (stackPtr == 0) break; else // pop
+				last = stack[--stackPtr], node = bvhNode + stack[--stackPtr],
+				first = last >> 8, last &= 255;
+			continue;
+		}
+		const BVHNode* left = bvhNode + node->leftFirst, * right = left + 1;
+		int32_t leftFirst = first, leftLast = last, rightFirst = first, rightLast = last;
+		float distLeft, distRight;
+		const bool visitLeft = visitChild( left, first, leftFirst, leftLast, distLeft );
+		const bool visitRight = visitChild( right, first, rightFirst, rightLast, distRight );
+		if (visitLeft && visitRight)
+		{
+			if (distLeft < distRight) // push right, continue with left
+			{
+				stack[stackPtr++] = node->leftFirst + 1;
+				stack[stackPtr++] = (rightFirst << 8) + rightLast;
+				node = left, first = leftFirst, last = leftLast;
+			}
+			else // push left, continue with right
+			{
+				stack[stackPtr++] = node->leftFirst;
+				stack[stackPtr++] = (leftFirst << 8) + leftLast;
+				node = right, first = rightFirst, last = rightLast;
+			}
+		}
+		else if (visitLeft) node = left, first = leftFirst, last = leftLast;
+		else if (visitRight) node = right, first = rightFirst, last = rightLast;
+		else if (stackPtr == 0) break; else // pop
+			last = stack[--stackPtr], node = bvhNode + stack[--stackPtr],
+			first = last >> 8, last &= 255;
+	}
+}
+
 int32_t BVH::NodeCount() const
 {
 	// Determine the number of nodes in the tree. Typically the result should
@@ -2884,6 +5015,7 @@ int32_t BVH::LeafCount() const
 void BVH::Compact()
 {
 	FATAL_ERROR_IF( bvhNode == 0, "BVH::Compact(), bvhNode == 0." );
+	DiscardLeafTris();
 	if (bvhNode[0].isLeaf()) return; // nothing to compact.
 	BVHNode* tmp = (BVHNode*)AlignedAlloc( sizeof( BVHNode ) * allocatedNodes /* do *not* trim */ );
 	uint32_t* idx = (uint32_t*)AlignedAlloc( sizeof( uint32_t ) * idxCount );
@@ -2914,10 +5046,13 @@ void BVH::Compact()
 		}
 	}
 	usedNodes = newNodePtr;
+	may_have_holes = false;
+	tlasCost = 0; // nodes moved; UpdateTLAS needs to relink.
 	AlignedFree( bvhNode );
 	AlignedFree( primIdx );
 	bvhNode = tmp;
 	primIdx = idx;
+	if (hasMotion()) RefitMotion();
 }
 
 // BVH_Verbose implementation
@@ -3079,6 +5214,9 @@ void BVH_Verbose::Compact()
 
 void BVH_Verbose::Optimize( const uint32_t iterations, const bool extreme )
 {
+#ifdef ENABLE_THREADED_BUILDS
+	if (usedNodes >= MT_BIN_THRESHOLD) { OptimizeMT( iterations, extreme ); return; }
+#endif
 	// allocate array for sorting; size is upper-bound.
 	SortItem* sortList = (SortItem*)AlignedAlloc( usedNodes * sizeof( SortItem ) );
 	// optimize by reinserting subtrees with a high cost - Section 3.4 of the paper.
@@ -3121,62 +5259,200 @@ void BVH_Verbose::Optimize( const uint32_t iterations, const bool extreme )
 			last = pivot - 1;
 		}
 		// reinsert selected nodes
-		BVHNode bckp[5];
 		for (int j = 0; j < limit; j += step)
 		{
-			// prepare change
 			const uint32_t Nid = sortList[j].idx;
-			BVHNode& N = bvhNode[Nid];
-			if (N.parent == 0) continue;
-			const uint32_t Pid = N.parent;
-			BVHNode& P = bvhNode[Pid];
-			if (P.parent == 0) continue;
-			const uint32_t X1 = P.parent, X2 = (P.left == Nid ? P.right : P.left);
-			// compute SAH before change
-			float sahBefore = SAHCostUp( Nid );
-			// execute change
-			bckp[0] = bvhNode[X1];
-			if (bvhNode[X1].left == Pid) bvhNode[X1].left = X2;
-			else /* verbose[X1].right == Pid */ bvhNode[X1].right = X2;
-			const uint32_t p2 = bvhNode[X2].parent;
-			bvhNode[X2].parent = X1;
-			const uint32_t Lid = N.left, Rid = N.right;
-			RefitUp( X2 );
-			// ReinsertNode( L, Nid ); ReinsertNode( R, Pid );
-			const uint32_t Xbest1 = FindBestNewPosition( Lid ), XA = bvhNode[Xbest1].parent;
-			sahBefore += SAHCostUp( Xbest1 );
-			bckp[1] = bvhNode[Nid];
-			N.left = Xbest1, N.right = Lid, N.parent = XA;
-			bckp[2] = bvhNode[XA];
-			if (bvhNode[XA].left == Xbest1) bvhNode[XA].left = Nid; else bvhNode[XA].right = Nid;
-			const uint32_t p3 = bvhNode[Xbest1].parent, p4 = bvhNode[Lid].parent;
-			bvhNode[Xbest1].parent = Nid, bvhNode[Lid].parent = Nid;
-			RefitUp( Nid );
-			const uint32_t Xbest2 = FindBestNewPosition( Rid ), XB = bvhNode[Xbest2].parent;
-			sahBefore += SAHCostUp( Xbest2 );
-			bckp[3] = bvhNode[Pid];
-			P.left = Xbest2, P.right = Rid, P.parent = XB;
-			bckp[4] = bvhNode[XB];
-			if (bvhNode[XB].left == Xbest2) bvhNode[XB].left = Pid; else bvhNode[XB].right = Pid;
-			const uint32_t p1 = bvhNode[Xbest2].parent, p0 = bvhNode[Rid].parent;
-			bvhNode[Xbest2].parent = Pid, bvhNode[Rid].parent = Pid;
-			RefitUp( Pid );
-			// compute SAH after change
-			float sahAfter = SAHCostUp( X1 ) + SAHCostUp( Nid ) + SAHCostUp( Pid );
-			if (sahAfter <= sahBefore) continue;
-			// undo change, mind the order.
-			bvhNode[Rid].parent = p0, bvhNode[Xbest2].parent = p1, bvhNode[XB] = bckp[4];
-			bvhNode[Pid] = bckp[3], bvhNode[Lid].parent = p4, bvhNode[Xbest1].parent = p3;
-			bvhNode[XA] = bckp[2], bvhNode[Nid] = bckp[1], bvhNode[X2].parent = p2, bvhNode[X1] = bckp[0];
-			RefitUp( XB );
-			RefitUp( XA );
-			RefitUp( Nid );
+			const BVHNode& N = bvhNode[Nid];
+			if (N.parent == 0 || bvhNode[N.parent].parent == 0) continue;
+			ReinsertChildren( Nid );
+		}
+		Refit( 0, true );
+	}
+	AlignedFree( sortList );
+}
+
+// ReinsertChildren: Remove node N and its parent P from the tree, and reinsert the
+// children of N, using N and P as their new parents. New positions are either
+// specified by the caller, or found using FindBestNewPosition. The change is undone
+// if it does not reduce the SAH cost.
+void BVH_Verbose::ReinsertChildren( const uint32_t Nid, uint32_t Xbest1, uint32_t Xbest2 )
+{
+	// prepare change
+	BVHNode bckp[5];
+	BVHNode& N = bvhNode[Nid];
+	const uint32_t Pid = N.parent;
+	BVHNode& P = bvhNode[Pid];
+	const uint32_t X1 = P.parent, X2 = (P.left == Nid ? P.right : P.left);
+	// positions given by the caller were found in an older tree (see OptimizeMT), which
+	// the estimate below does not tolerate well. Measure the exact change instead: only
+	// nodes on the paths from N and both targets to the root change size.
+	uint32_t path[256], pathLen = 0;
+	float exactBefore = 0;
+	if (Xbest1 && Xbest2) for (uint32_t x : { Nid, Xbest1, Xbest2 })
+	{
+		for (; x != 0xffffffff && pathLen < 256; x = bvhNode[x].parent)
+		{
+			bool seen = false; // paths join; the rest of this one is in the list already.
+			for (uint32_t k = 0; k < pathLen && !seen; k++) seen = path[k] == x;
+			if (seen) break;
+			path[pathLen++] = x, exactBefore += bvhNode[x].SA();
+		}
+	}
+	const bool exact = pathLen > 0 && pathLen < 256;
+	// compute SAH before change
+	float sahBefore = SAHCostUp( Nid );
+	// execute change
+	bckp[0] = bvhNode[X1];
+	if (bvhNode[X1].left == Pid) bvhNode[X1].left = X2;
+	else /* verbose[X1].right == Pid */ bvhNode[X1].right = X2;
+	const uint32_t p2 = bvhNode[X2].parent;
+	bvhNode[X2].parent = X1;
+	const uint32_t Lid = N.left, Rid = N.right;
+	RefitUp( X2 );
+	// ReinsertNode( L, Nid ); ReinsertNode( R, Pid );
+	if (!Xbest1) Xbest1 = FindBestNewPosition( Lid );
+	const uint32_t XA = bvhNode[Xbest1].parent;
+	sahBefore += SAHCostUp( Xbest1 );
+	bckp[1] = bvhNode[Nid];
+	N.left = Xbest1, N.right = Lid, N.parent = XA;
+	bckp[2] = bvhNode[XA];
+	if (bvhNode[XA].left == Xbest1) bvhNode[XA].left = Nid; else bvhNode[XA].right = Nid;
+	const uint32_t p3 = bvhNode[Xbest1].parent, p4 = bvhNode[Lid].parent;
+	bvhNode[Xbest1].parent = Nid, bvhNode[Lid].parent = Nid;
+	RefitUp( Nid );
+	if (!Xbest2) Xbest2 = FindBestNewPosition( Rid );
+	const uint32_t XB = bvhNode[Xbest2].parent;
+	sahBefore += SAHCostUp( Xbest2 );
+	bckp[3] = bvhNode[Pid];
+	P.left = Xbest2, P.right = Rid, P.parent = XB;
+	bckp[4] = bvhNode[XB];
+	if (bvhNode[XB].left == Xbest2) bvhNode[XB].left = Pid; else bvhNode[XB].right = Pid;
+	const uint32_t p1 = bvhNode[Xbest2].parent, p0 = bvhNode[Rid].parent;
+	bvhNode[Xbest2].parent = Pid, bvhNode[Rid].parent = Pid;
+	RefitUp( Pid );
+	// compute SAH after change
+	float sahAfter = SAHCostUp( X1 ) + SAHCostUp( Nid ) + SAHCostUp( Pid );
+	if (exact)
+	{
+		sahBefore = exactBefore, sahAfter = 0;
+		for (uint32_t k = 0; k < pathLen; k++) sahAfter += bvhNode[path[k]].SA();
+	}
+	if (sahAfter <= sahBefore) return;
+	// undo change, mind the order.
+	bvhNode[Rid].parent = p0, bvhNode[Xbest2].parent = p1, bvhNode[XB] = bckp[4];
+	bvhNode[Pid] = bckp[3], bvhNode[Lid].parent = p4, bvhNode[Xbest1].parent = p3;
+	bvhNode[XA] = bckp[2], bvhNode[Nid] = bckp[1], bvhNode[X2].parent = p2, bvhNode[X1] = bckp[0];
+	RefitUp( XB );
+	RefitUp( XA );
+	RefitUp( Nid );
+}
+
+#ifdef ENABLE_THREADED_BUILDS
+
+// OptimizeMT: Multi-threaded Optimize, for large trees. Node costs are calculated
+// by all threads; only the most expensive nodes are sorted. Selected nodes are then
+// processed in batches: for each node in a batch, new positions for its children are
+// searched in parallel, in the tree as it is at the start of the batch, with the node
+// and its parent removed. Next, the reinsertions are applied in order. A reinsertion
+// that involves a node touched earlier in the same batch searches again, in the
+// current tree. The result does not depend on the number of threads.
+void BVH_Verbose::OptimizeMT( const uint32_t iterations, const bool extreme )
+{
+	constexpr uint32_t batchSize = 128;
+	ThreadPool& pool = GetThreadPool();
+	const uint32_t chunks = pool.ThreadCount(), nodeCount = usedNodes - 2;
+	uint64_t* keys = (uint64_t*)AlignedAlloc( nodeCount * sizeof( uint64_t ) );
+	uint32_t* sortList = (uint32_t*)AlignedAlloc( nodeCount * sizeof( uint32_t ) );
+	uint32_t* chunkCount = (uint32_t*)AlignedAlloc( chunks * sizeof( uint32_t ) );
+	uint32_t* stamp = (uint32_t*)AlignedAlloc( usedNodes * sizeof( uint32_t ) ), batchIdx = 0;
+	uint32_t* histogram = (uint32_t*)AlignedAlloc( 65536 * sizeof( uint32_t ) );
+	uint32_t target[batchSize * 2];
+	memset( stamp, 0, usedNodes * sizeof( uint32_t ) );
+	for (uint32_t i = 0; i < iterations; i++)
+	{
+		// calculate combined cost for all nodes; nodes that can't be moved sort last.
+		pool.ParallelFor( nodeCount, chunks, [&]( const uint32_t chunk, const uint32_t first, const uint32_t last ) {
+			uint32_t candidates = 0;
+			for (uint32_t k = first; k < last; k++)
+			{
+				const uint32_t j = k + 2;
+				const BVHNode& node = bvhNode[j];
+				sortList[k] = j, keys[k] = 0xffffffff;
+				if (node.isLeaf() || node.parent == 0 || bvhNode[node.parent].parent == 0) continue;
+				const float A = node.SA(), AL = bvhNode[node.left].SA(), AR = bvhNode[node.right].SA();
+				float Mmin = A / tinybvh_min( 1e-10f, tinybvh_min( AL, AR ) );
+				float Msum = A / tinybvh_min( 1e-10f, 0.5f * (AL + AR) );
+				float Mcomb = A * Msum * Mmin;
+				uint32_t bits;
+				memcpy( &bits, &Mcomb, 4 );
+				keys[k] = 0x7fffffff - (bits & 0x7fffffff), candidates++; // descending cost
+			}
+			chunkCount[chunk] = candidates;
+		} );
+		uint32_t interiorNodes = 0;
+		for (uint32_t c = 0; c < chunks; c++) interiorNodes += chunkCount[c];
+		// last couple of iterations we will process more nodes.
+		const float portion = extreme ? (0.01f + (0.6f * (float)i) / (float)iterations) : 0.01f;
+		const uint32_t limit = (uint32_t)(portion * (float)interiorNodes);
+		const uint32_t step = (uint32_t)tinybvh_max( 1, (int)(portion / 0.02f) );
+		// only the first 'limit' nodes are used: find the key bucket that contains the
+		// last of these, and sort just the nodes up to and including that bucket.
+		memset( histogram, 0, 65536 * sizeof( uint32_t ) );
+		for (uint32_t k = 0; k < nodeCount; k++) histogram[keys[k] >> 16]++;
+		uint32_t cutoff = 0;
+		for (uint32_t sum = 0; cutoff < 65535 && sum + histogram[cutoff] < limit; cutoff++) sum += histogram[cutoff];
+		uint32_t selected = 0;
+		for (uint32_t k = 0; k < nodeCount; k++) if ((keys[k] >> 16) <= cutoff)
+			keys[selected] = keys[k], sortList[selected++] = sortList[k];
+		RadixSort( keys, sortList, selected, 32 );
+		// reinsert selected nodes, in batches
+		for (uint32_t j = 0; j < limit; j += batchSize * step)
+		{
+			const uint32_t count = tinybvh_min( batchSize, (limit - j + step - 1) / step );
+			pool.ParallelFor( count, chunks, [&]( const uint32_t, const uint32_t first, const uint32_t last ) {
+				for (uint32_t b = first; b < last; b++)
+				{
+					const uint32_t Nid = sortList[j + b * step];
+					const BVHNode& N = bvhNode[Nid];
+					target[b * 2] = FindBestNewPosition( N.left, Nid );
+					target[b * 2 + 1] = FindBestNewPosition( N.right, Nid );
+				}
+			} );
+			batchIdx++;
+			for (uint32_t b = 0; b < count; b++)
+			{
+				const uint32_t Nid = sortList[j + b * step], Xbest1 = target[b * 2], Xbest2 = target[b * 2 + 1];
+				const BVHNode& N = bvhNode[Nid];
+				const uint32_t Pid = N.parent, X1 = bvhNode[Pid].parent;
+				if (Pid == 0 || X1 == 0 || Xbest1 == 0 || Xbest2 == 0) continue;
+				const uint32_t X2 = bvhNode[Pid].left == Nid ? bvhNode[Pid].right : bvhNode[Pid].left;
+				const uint32_t touched[10] = {
+					X1, Pid, Nid, X2, N.left, N.right,
+					Xbest1, bvhNode[Xbest1].parent, Xbest2, bvhNode[Xbest2].parent
+				};
+				bool conflict = false;
+				for (uint32_t t = 0; t < 10; t++) if (stamp[touched[t]] == batchIdx) conflict = true;
+				// the new positions must not be in the subtree that is being moved. Targets
+				// under X2 are fine: X2 takes the place of P when N and P are removed.
+				for (uint32_t x = Xbest1, prev = 0; x != 0 && !conflict; prev = x, x = bvhNode[x].parent)
+					if (x == Nid || (x == Pid && prev != X2)) conflict = true;
+				for (uint32_t x = Xbest2, prev = 0; x != 0 && !conflict; prev = x, x = bvhNode[x].parent)
+					if (x == Nid || (x == Pid && prev != X2)) conflict = true;
+				for (uint32_t t = 0; t < (conflict ? 6u : 10u); t++) stamp[touched[t]] = batchIdx;
+				if (conflict) ReinsertChildren( Nid ); /* stale search result */ else ReinsertChildren( Nid, Xbest1, Xbest2 );
+			}
 		}
 		Refit( 0, true );
 	}
+	AlignedFree( histogram );
+	AlignedFree( stamp );
+	AlignedFree( chunkCount );
 	AlignedFree( sortList );
+	AlignedFree( keys );
 }
 
+#endif
+
 // Single-primitive leafs: Prepare the BVH for optimization. While it is not strictly
 // necessary to have a single primitive per leaf, it will yield a slightly better
 // optimized BVH. The leafs of the optimized BVH should be collapsed ('MergeLeafs')
@@ -3344,6 +5620,7 @@ void BVH_GPU::Optimize( const uint32_t iterations, bool extreme )
 
 void BVH_GPU::ConvertFrom( const BVH& original, bool compact )
 {
+	FATAL_ERROR_IF( original.hasMotion(), "BVH_GPU::ConvertFrom( .. ), deformation blur requires the BVH layout." );
 	// get a copy of the original bvh
 	if (&original != &bvh) ownBVH = false; // bvh isn't ours; don't delete in destructor.
 	bvh = original;
@@ -3438,6 +5715,58 @@ int32_t BVH_GPU::Intersect( Ray& ray ) const
 	return (int32_t)cost; // cast to not break interface.
 }
 
+bool BVH_GPU::IsOccluded( const Ray& ray ) const
+{
+	BVHNode* node = &bvhNode[0], * stack[64];
+	const bvhvec4slice& verts = bvh.verts;
+	const uint32_t* primIdx = bvh.primIdx;
+	uint32_t stackPtr = 0;
+	while (1)
+	{
+		if (node->isLeaf())
+		{
+			if (indexedEnabled && bvh.vertIdx != 0)
+			{
+				for (uint32_t i = 0; i < node->triCount; i++)
+					if (IndexedTriOccludes( ray, verts, bvh.vertIdx, primIdx[node->firstTri + i] )) return true;
+			}
+			else if (customEnabled && bvh.customIsOccluded != 0)
+			{
+				for (uint32_t i = 0; i < node->triCount; i++)
+					if ((*bvh.customIsOccluded)(ray, primIdx[node->firstTri + i])) return true;
+			}
+			else
+			{
+				for (uint32_t i = 0; i < node->triCount; i++)
+					if (TriOccludes( ray, verts, primIdx[node->firstTri + i] )) return true;
+			}
+			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			continue;
+		}
+		const bvhvec3 lmin = node->lmin - ray.O, lmax = node->lmax - ray.O;
+		const bvhvec3 rmin = node->rmin - ray.O, rmax = node->rmax - ray.O;
+		const bvhvec3 t1a = lmin * ray.rD, t2a = lmax * ray.rD;
+		const bvhvec3 t1b = rmin * ray.rD, t2b = rmax * ray.rD;
+		const float tmina = tinybvh_max( tinybvh_max( tinybvh_min( t1a.x, t2a.x ), tinybvh_min( t1a.y, t2a.y ) ), tinybvh_min( t1a.z, t2a.z ) );
+		const float tmaxa = tinybvh_min( tinybvh_min( tinybvh_max( t1a.x, t2a.x ), tinybvh_max( t1a.y, t2a.y ) ), tinybvh_max( t1a.z, t2a.z ) );
+		const float tminb = tinybvh_max( tinybvh_max( tinybvh_min( t1b.x, t2b.x ), tinybvh_min( t1b.y, t2b.y ) ), tinybvh_min( t1b.z, t2b.z ) );
+		const float tmaxb = tinybvh_min( tinybvh_min( tinybvh_max( t1b.x, t2b.x ), tinybvh_max( t1b.y, t2b.y ) ), tinybvh_max( t1b.z, t2b.z ) );
+		const bool hitLeft = tmaxa >= tmina && tmina < ray.hit.t && tmaxa >= 0;
+		const bool hitRight = tmaxb >= tminb && tminb < ray.hit.t && tmaxb >= 0;
+		if (hitLeft && hitRight)
+		{
+			// any hit terminates the query, but the near child is still the likelier blocker.
+			const bool leftFirst = tmina <= tminb;
+			stack[stackPtr++] = bvhNode + (leftFirst ? node->right : node->left);
+			node = bvhNode + (leftFirst ? node->left : node->right);
+		}
+		else if (hitLeft) node = bvhNode + node->left;
+		else if (hitRight) node = bvhNode + node->right;
+		else if (stackPtr == 0) break; else node = stack[--stackPtr];
+	}
+	return false;
+}
+
 // BVH_SoA implementation
 // ----------------------------------------------------------------------------
 
@@ -3445,6 +5774,7 @@ BVH_SoA::~BVH_SoA()
 {
 	if (!ownBVH) bvh = BVH(); // clear out pointers we don't own.
 	AlignedFree( bvhNode );
+	DiscardLeafTris();
 }
 
 void BVH_SoA::Build( const bvhvec4* vertices, const uint32_t primCount )
@@ -3527,6 +5857,8 @@ bool BVH_SoA::Load( const char* fileName, const bvhvec4slice& vertices, const ui
 
 void BVH_SoA::ConvertFrom( const BVH& original, bool compact )
 {
+	FATAL_ERROR_IF( original.hasMotion(), "BVH_SoA::ConvertFrom( .. ), deformation blur requires the BVH layout." );
+	DiscardLeafTris();
 	// get a copy of the original bvh
 	if (&original != &bvh) ownBVH = false; // bvh isn't ours; don't delete in destructor.
 	bvh = original;
@@ -3573,6 +5905,30 @@ void BVH_SoA::ConvertFrom( const BVH& original, bool compact )
 	usedNodes = newAlt2Node;
 }
 
+// PrecomputeLeafTris: BVH_SoA version of BVH::PrecomputeLeafTris. The index of the
+// first block of a leaf is stored in the (otherwise unused) 'left' field.
+void BVH_SoA::PrecomputeLeafTris()
+{
+	FATAL_ERROR_IF( bvhNode == 0, "BVH_SoA::PrecomputeLeafTris(), bvhNode == 0." );
+	FATAL_ERROR_IF( bvh.hasCustomGeom() || bvh.bvh_over_aabbs, "BVH_SoA::PrecomputeLeafTris(), BVH is not over triangles." );
+#ifndef BVH_USEAVX2
+	FATAL_ERROR( "BVH_SoA::PrecomputeLeafTris(), requires BVH_USEAVX2." );
+#endif
+	DiscardLeafTris();
+	uint32_t blockCount = 0;
+	for (uint32_t i = 0; i < usedNodes; i++) if (bvhNode[i].isLeaf())
+		bvhNode[i].left = blockCount, blockCount += (bvhNode[i].triCount + 3) >> 2;
+	leafTris = (BVHTri4Leaf*)AlignedAlloc( blockCount * sizeof( BVHTri4Leaf ) );
+	for (uint32_t i = 0; i < usedNodes; i++) if (bvhNode[i].isLeaf())
+		PackTri4Leafs( leafTris + bvhNode[i].left, bvh.verts, bvh.vertIdx, bvh.primIdx + bvhNode[i].firstTri, bvhNode[i].triCount );
+}
+
+void BVH_SoA::DiscardLeafTris()
+{
+	AlignedFree( leafTris );
+	leafTris = 0;
+}
+
 // BVH_SoA::Intersect can be found in the BVH_USEAVX section later in this file.
 
 // Generic (templated) MBVH implementation
@@ -3650,6 +6006,30 @@ template<int M> uint32_t MBVH<M>::LeafCount( const uint32_t nodeIdx ) const
 }
 
 template<int M> void MBVH<M>::Refit( const uint32_t nodeIdx )
+{
+#ifdef ENABLE_THREADED_BUILDS
+	if (nodeIdx == 0 && usedNodes >= MT_BIN_THRESHOLD) tinybvh_parallel_refit( *this,
+		[&]( const uint32_t idx, uint32_t* child ) -> uint32_t {
+			const MBVHNode& node = mbvhNode[idx];
+			if (node.isLeaf()) return 0;
+			for (uint32_t i = 0; i < node.childCount; i++) child[i] = node.child[i];
+			return node.childCount;
+		},
+		[&]( const uint32_t idx ) { RefitSubtree( idx ); },
+		[&]( const uint32_t idx ) {
+			MBVHNode& node = mbvhNode[idx];
+			node.aabbMin = bvhvec3( BVH_FAR ), node.aabbMax = bvhvec3( -BVH_FAR );
+			for (uint32_t i = 0; i < node.childCount; i++)
+				node.aabbMin = tinybvh_min( node.aabbMin, mbvhNode[node.child[i]].aabbMin ),
+				node.aabbMax = tinybvh_max( node.aabbMax, mbvhNode[node.child[i]].aabbMax );
+		} );
+	else
+#endif
+	RefitSubtree( nodeIdx );
+	if (nodeIdx == 0) aabbMin = mbvhNode[0].aabbMin, aabbMax = mbvhNode[0].aabbMax;
+}
+
+template<int M> void MBVH<M>::RefitSubtree( const uint32_t nodeIdx )
 {
 	MBVHNode& node = mbvhNode[nodeIdx];
 	if (node.isLeaf())
@@ -3680,7 +6060,7 @@ template<int M> void MBVH<M>::Refit( const uint32_t nodeIdx )
 	}
 	else
 	{
-		for (unsigned i = 0; i < node.childCount; i++) Refit( node.child[i] );
+		for (unsigned i = 0; i < node.childCount; i++) RefitSubtree( node.child[i] );
 		MBVHNode& firstChild = mbvhNode[node.child[0]];
 		bvhvec3 bmin = firstChild.aabbMin, bmax = firstChild.aabbMax;
 		for (unsigned i = 1; i < node.childCount; i++)
@@ -3689,8 +6069,8 @@ template<int M> void MBVH<M>::Refit( const uint32_t nodeIdx )
 			bmin = tinybvh_min( bmin, child.aabbMin );
 			bmax = tinybvh_max( bmax, child.aabbMax );
 		}
+		node.aabbMin = bmin, node.aabbMax = bmax;
 	}
-	if (nodeIdx == 0) aabbMin = node.aabbMin, aabbMax = node.aabbMax;
 }
 
 template<int M> float MBVH<M>::SAHCost( const uint32_t nodeIdx ) const
@@ -3707,6 +6087,7 @@ template<int M> float MBVH<M>::SAHCost( const uint32_t nodeIdx ) const
 
 template<int M> void MBVH<M>::ConvertFrom( const BVH& original, bool compact )
 {
+	FATAL_ERROR_IF( original.hasMotion(), "MBVH::ConvertFrom( .. ), deformation blur requires the BVH layout." );
 	// get a copy of the original bvh
 	if (&original != &bvh) ownBVH = false; // bvh isn't ours; don't delete in destructor.
 	bvh = original;
@@ -3840,12 +6221,114 @@ void BVH4_CPU::BuildHQ( const bvhvec4slice& vertices, const uint32_t* indices, u
 	ConvertFrom( bvh4, true );
 }
 
+#ifdef ENABLE_THREADED_BUILDS
+
+void BVH4_CPU::BuildMT( const bvhvec4* vertices, const uint32_t primCount )
+{
+	BuildMT( bvhvec4slice( vertices, primCount * 3, sizeof( bvhvec4 ) ) );
+}
+
+void BVH4_CPU::BuildMT( const bvhvec4slice& vertices )
+{
+	BuildMT( vertices, 0, 0 );
+}
+
+void BVH4_CPU::BuildMT( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims )
+{
+	BuildMT( bvhvec4slice{ vertices, prims * 3, sizeof( bvhvec4 ) }, indices, prims );
+}
+
+void BVH4_CPU::BuildMT( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims )
+{
+	bvh4.bvh.context = bvh4.context = context;
+	bvh4.bvh.BuildMT( vertices, indices, prims );
+	if (bvh4.bvh.may_have_holes) bvh4.bvh.Compact();
+	bvh4.ConvertFrom( bvh4.bvh, true );
+	ConvertFrom( bvh4, true );
+}
+
+void BVH4_CPU::BuildBatch( BVH4_CPU** bvh, const BuildInput* input, const uint32_t count, ThreadPool* pool )
+{
+	// see BVH::BuildBatch.
+	ThreadPool& batchPool = pool ? *pool : ThreadPool::Default();
+	tinybvh_build_batch( batchPool, input, count, [&]( const uint32_t i, const bool large ) {
+		BVH4_CPU& target = *bvh[i];
+		const BuildInput& in = input[i];
+		if (large)
+		{
+			const BVHContext ctx = target.context;
+			target.context.threadPool = &batchPool, target.BuildMT( in.vertices, in.indices, in.primCount );
+			target.context = target.bvh4.context = target.bvh4.bvh.context = ctx;
+		}
+		else if (in.indices) target.Build( in.vertices, in.indices, in.primCount );
+		else target.Build( in.vertices );
+	} );
+}
+
+#endif
+
 void BVH4_CPU::Optimize( const uint32_t iterations, bool extreme )
 {
 	bvh4.Optimize( iterations, extreme );
 	ConvertFrom( bvh4, true );
 }
 
+void BVH4_CPU::Build( BLASInstance* instances, const uint32_t instCount, BVHBase** blasses, const uint32_t bCount )
+{
+	// build a 4-wide TLAS over the instances; leafs store instance indices.
+	bvh4.bvh.context = bvh4.context = context;
+	bvh4.bvh.Build( instances, instCount, blasses, bCount );
+	bvh4.ConvertFrom( bvh4.bvh, true );
+	ConvertFrom( bvh4, true );
+}
+
+void BVH4_CPU::Refit()
+{
+	// update node bounds and triangle data in place; the MBVH used for
+	// conversion is left untouched.
+	FATAL_ERROR_IF( !refittable, "BVH4_CPU::Refit( .. ), refitting an SBVH." );
+	FATAL_ERROR_IF( bvh4Node == 0, "BVH4_CPU::Refit( .. ), bvh4Node == 0." );
+	FATAL_ERROR_IF( isTLAS(), "BVH4_CPU::Refit( .. ), refitting a TLAS; rebuild it instead." );
+	RefitSubtree( 0, aabbMin, aabbMax );
+}
+
+void BVH4_CPU::RefitSubtree( const uint32_t nodeIdx, bvhvec3& bmin, bvhvec3& bmax )
+{
+	BVHNode& node = bvh4Node[nodeIdx];
+	bmin = bvhvec3( BVH_FAR ), bmax = bvhvec3( -BVH_FAR );
+	for (int32_t i = 0; i < 4; i++) if (node.triCount[i] + node.childFirst[i] > 0)
+	{
+		bvhvec3 cmin( BVH_FAR ), cmax( -BVH_FAR );
+		if (!node.triCount[i]) RefitSubtree( node.childFirst[i], cmin, cmax ); else
+		{
+			// leaf: triangles are stored by value; primIdx lives in the w of the 4th vector.
+			for (uint32_t triPtr = node.childFirst[i], j = 0; j < node.triCount[i]; j++, triPtr += 4)
+			{
+				const uint32_t fi = *(uint32_t*)&bvh4Tris[triPtr + 3].w;
+				uint32_t ti0, ti1, ti2;
+				if (bvh4.bvh.vertIdx)
+					ti0 = bvh4.bvh.vertIdx[fi * 3],
+					ti1 = bvh4.bvh.vertIdx[fi * 3 + 1],
+					ti2 = bvh4.bvh.vertIdx[fi * 3 + 2];
+				else
+					ti0 = fi * 3, ti1 = fi * 3 + 1, ti2 = fi * 3 + 2;
+				const bvhvec3 v0 = bvh4.bvh.verts[ti0], v1 = bvh4.bvh.verts[ti1], v2 = bvh4.bvh.verts[ti2];
+			#ifdef WATERTIGHT_TRIS
+				bvh4Tris[triPtr] = bvhvec4( v0, 0 ), bvh4Tris[triPtr + 1] = bvhvec4( v1, 0 ), bvh4Tris[triPtr + 2] = bvhvec4( v2, 0 );
+			#else
+				PrecomputeTriangle( bvh4.bvh.verts, ti0, ti1, ti2, (float*)&bvh4Tris[triPtr] );
+			#endif
+				cmin = tinybvh_min( cmin, tinybvh_min( tinybvh_min( v0, v1 ), v2 ) );
+				cmax = tinybvh_max( cmax, tinybvh_max( tinybvh_max( v0, v1 ), v2 ) );
+			}
+		}
+		((float*)&node.xmin4)[i] = cmin.x, ((float*)&node.xmax4)[i] = cmax.x;
+		((float*)&node.ymin4)[i] = cmin.y, ((float*)&node.ymax4)[i] = cmax.y;
+		((float*)&node.zmin4)[i] = cmin.z, ((float*)&node.zmax4)[i] = cmax.z;
+		bmin = tinybvh_min( bmin, cmin ), bmax = tinybvh_max( bmax, cmax );
+	}
+}
+
 float BVH4_CPU::SAHCost( const uint32_t nodeIdx ) const
 {
 	return bvh4.SAHCost( nodeIdx );
@@ -3907,6 +6390,8 @@ void BVH4_CPU::ConvertFrom( const MBVH<4>& original, bool compact )
 	}
 	memset( bvh4Node, 0, spaceNeeded * sizeof( BVHNode ) );
 	CopyBasePropertiesFrom( bvh4 );
+	instList = bvh4.bvh.instList, blasList = bvh4.bvh.blasList, instIdx = bvh4.bvh.primIdx;
+	instData = bvh4.bvh.instData;
 	// start conversion
 	uint32_t newAlt4Ptr = 0, nodeIdx = 0, stack[128], stackPtr = 0;
 	while (1)
@@ -3943,6 +6428,8 @@ void BVH4_CPU::ConvertFrom( const MBVH<4>& original, bool compact )
 		uint32_t offset = stack[--stackPtr];
 		((uint32_t*)bvh4Node)[offset] = newAlt4Ptr;
 	}
+	usedNodes = newAlt4Ptr;
+	if (isTLAS()) return; // TLAS leafs keep referring to the instance index array.
 	// Convert index list: store primitives 'by value'.
 	// This also allows us to compact and reorder them for best performance.
 	stackPtr = 0, nodeIdx = 0;
@@ -3968,7 +6455,14 @@ void BVH4_CPU::ConvertFrom( const MBVH<4>& original, bool compact )
 						ti2 = bvh4.bvh.vertIdx[fi * 3 + 2];
 					else
 						ti0 = fi * 3, ti1 = fi * 3 + 1, ti2 = fi * 3 + 2;
+				#ifdef WATERTIGHT_TRIS
+					// the watertight test needs the original vertices.
+					bvh4Tris[triPtr] = bvh4.bvh.verts[ti0];
+					bvh4Tris[triPtr + 1] = bvh4.bvh.verts[ti1];
+					bvh4Tris[triPtr + 2] = bvh4.bvh.verts[ti2];
+				#else
 					PrecomputeTriangle( bvh4.bvh.verts, ti0, ti1, ti2, (float*)&bvh4Tris[triPtr] );
+				#endif
 					bvh4Tris[triPtr + 3] = bvhvec4( 0, 0, 0, *(float*)&fi );
 					triPtr += 4;
 				}
@@ -4162,11 +6656,8 @@ void BVH4_GPU::ConvertFrom( const MBVH<4>& original, bool compact )
 			slot2[3] = (uint8_t)floorf( relBMin.y * scale.y ), slot2[7] = (uint8_t)ceilf( relBMax.y * scale.y );
 			slot2[11] = (uint8_t)floorf( relBMin.z * scale.z ), slot2[15] = (uint8_t)ceilf( relBMax.z * scale.z );
 		}
-		// finalize node
-		nodeBase[3] = bvhvec4(
-			*(float*)&childInfo[0], *(float*)&childInfo[1],
-			*(float*)&childInfo[2], *(float*)&childInfo[3]
-		);
+		// finalize node; memcpy, as reading childInfo through a float pointer breaks strict aliasing.
+		memcpy( &nodeBase[3], childInfo, sizeof( childInfo ) );
 		// pop new work from the stack
 		if (retValPos > 0) ((uint32_t*)bvh4Data)[retValPos] = baseAlt4Ptr;
 		if (stackPtr == 0) break;
@@ -4285,6 +6776,63 @@ int32_t BVH4_GPU::Intersect( Ray& ray ) const
 	return (int32_t)cost; // cast to not break interface.
 }
 
+bool BVH4_GPU::IsOccluded( const Ray& ray ) const
+{
+	// any-hit variant of Intersect: leaves are tested as soon as they are found, and
+	// the first triangle that blocks the ray ends the query.
+	uint32_t offset = 0, stack[128], stackPtr = 0;
+	while (1)
+	{
+		const bvhvec4 data0 = bvh4Data[offset + 0], data1 = bvh4Data[offset + 1];
+		const bvhvec4 data2 = bvh4Data[offset + 2], data3 = bvh4Data[offset + 3];
+		const bvhvec3 bmin = data0, extent = data1;
+		const uchar4 d0 = as_uchar4( data0.w ), d1 = as_uchar4( data1.w ), d2 = as_uchar4( data2.x );
+		const uchar4 d3 = as_uchar4( data2.y ), d4 = as_uchar4( data2.z ), d5 = as_uchar4( data2.w );
+		const bvhvec3 cmin[4] = {
+			bmin + extent * bvhvec3( d0.x, d2.x, d4.x ), bmin + extent * bvhvec3( d0.y, d2.y, d4.y ),
+			bmin + extent * bvhvec3( d0.z, d2.z, d4.z ), bmin + extent * bvhvec3( d0.w, d2.w, d4.w )
+		};
+		const bvhvec3 cmax[4] = {
+			bmin + extent * bvhvec3( d1.x, d3.x, d5.x ), bmin + extent * bvhvec3( d1.y, d3.y, d5.y ),
+			bmin + extent * bvhvec3( d1.z, d3.z, d5.z ), bmin + extent * bvhvec3( d1.w, d3.w, d5.w )
+		};
+		const uint32_t info[4] = { as_uint( data3.x ), as_uint( data3.y ), as_uint( data3.z ), as_uint( data3.w ) };
+		for (uint32_t i = 0; i < 4; i++)
+		{
+			if (!info[i]) continue;
+			const bvhvec3 t1 = (cmin[i] - ray.O) * ray.rD, t2 = (cmax[i] - ray.O) * ray.rD;
+			const bvhvec3 tmin3 = tinybvh_min( t1, t2 ), tmax3 = tinybvh_max( t1, t2 );
+			const float tmin = tinybvh_max( tinybvh_max( tinybvh_max( tmin3.x, tmin3.y ), tmin3.z ), 0.0f );
+			const float tmax = tinybvh_min( tinybvh_min( tinybvh_min( tmax3.x, tmax3.y ), tmax3.z ), ray.hit.t );
+			if (tmin > tmax) continue;
+			if (!(info[i] & 0x80000000)) { stack[stackPtr++] = info[i]; continue; }
+			const uint32_t N = (info[i] >> 16) & 0x7fff;
+			uint32_t triStart = offset + (info[i] & 0xffff);
+			for (uint32_t j = 0; j < N; j++, triStart += 3)
+			{
+				const bvhvec3 edge2 = bvhvec3( bvh4Data[triStart + 2] );
+				const bvhvec3 edge1 = bvhvec3( bvh4Data[triStart + 1] );
+				const bvhvec3 v0 = bvh4Data[triStart + 0];
+				const bvhvec3 h = tinybvh_cross( ray.D, edge2 );
+				const float a = tinybvh_dot( edge1, h );
+				if (fabs( a ) < 0.0000001f) continue;
+				const float f = 1 / a;
+				const bvhvec3 s = ray.O - v0;
+				const float u = f * tinybvh_dot( s, h );
+				if (u < 0 || u > 1) continue;
+				const bvhvec3 q = tinybvh_cross( s, edge1 );
+				const float v = f * tinybvh_dot( ray.D, q );
+				if (v < 0 || u + v > 1) continue;
+				const float d = f * tinybvh_dot( edge2, q );
+				if (d > 0.0f && d < ray.hit.t) return true;
+			}
+		}
+		if (!stackPtr) break;
+		offset = stack[--stackPtr];
+	}
+	return false;
+}
+
 // BVH4_AVX2_WIP implementation
 // ----------------------------------------------------------------------------
 
@@ -4567,6 +7115,54 @@ bool BVH8_CPU::Load( const char* fileName, const uint32_t expectedTris )
 	return true;
 }
 
+#ifdef ENABLE_THREADED_BUILDS
+
+void BVH8_CPU::BuildMT( const bvhvec4* vertices, const uint32_t primCount )
+{
+	BuildMT( bvhvec4slice( vertices, primCount * 3, sizeof( bvhvec4 ) ) );
+}
+
+void BVH8_CPU::BuildMT( const bvhvec4slice& vertices )
+{
+	BuildMT( vertices, 0, 0 );
+}
+
+void BVH8_CPU::BuildMT( const bvhvec4* vertices, const uint32_t* indices, const uint32_t prims )
+{
+	BuildMT( bvhvec4slice{ vertices, prims * 3, sizeof( bvhvec4 ) }, indices, prims );
+}
+
+void BVH8_CPU::BuildMT( const bvhvec4slice& vertices, const uint32_t* indices, uint32_t prims )
+{
+	bvh8.bvh.context = bvh8.context = context;
+	bvh8.bvh.BuildMT( vertices, indices, prims );
+	if (bvh8.bvh.may_have_holes) bvh8.bvh.Compact();
+	bvh8.bvh.CombineLeafs( 4 );
+	bvh8.bvh.SplitLeafs( 4 );
+	bvh8.ConvertFrom( bvh8.bvh, true );
+	ConvertFrom( bvh8 );
+}
+
+void BVH8_CPU::BuildBatch( BVH8_CPU** bvh, const BuildInput* input, const uint32_t count, ThreadPool* pool )
+{
+	// see BVH::BuildBatch.
+	ThreadPool& batchPool = pool ? *pool : ThreadPool::Default();
+	tinybvh_build_batch( batchPool, input, count, [&]( const uint32_t i, const bool large ) {
+		BVH8_CPU& target = *bvh[i];
+		const BuildInput& in = input[i];
+		if (large)
+		{
+			const BVHContext ctx = target.context;
+			target.context.threadPool = &batchPool, target.BuildMT( in.vertices, in.indices, in.primCount );
+			target.context = target.bvh8.context = target.bvh8.bvh.context = ctx;
+		}
+		else if (in.indices) target.Build( in.vertices, in.indices, in.primCount );
+		else target.Build( in.vertices );
+	} );
+}
+
+#endif
+
 void BVH8_CPU::Optimize( const uint32_t iterations, bool extreme )
 {
 	bvh8.Optimize( iterations, extreme );
@@ -4575,12 +7171,115 @@ void BVH8_CPU::Optimize( const uint32_t iterations, bool extreme )
 	ConvertFrom( bvh8 );
 }
 
-void BVH8_CPU::Refit()
+void BVH8_CPU::Build( BLASInstance* instances, const uint32_t instCount, BVHBase** blasses, const uint32_t bCount )
 {
-	bvh8.Refit();
+	// build an 8-wide TLAS over the instances; leafs store up to four instance indices.
+	bvh8.bvh.context = bvh8.context = context;
+	bvh8.bvh.Build( instances, instCount, blasses, bCount );
+	bvh8.bvh.CombineLeafs( 4 );
+	bvh8.bvh.SplitLeafs( 4 );
+	bvh8.bvh.Refit(); // SplitLeafs copies the bounds of the original leaf.
+	bvh8.ConvertFrom( bvh8.bvh, true );
 	ConvertFrom( bvh8 );
 }
 
+void BVH8_CPU::Refit()
+{
+	// update child bounds and leaf triangles in place, keeping the interleaved
+	// layout; the MBVH used for conversion is left untouched.
+	FATAL_ERROR_IF( !refittable, "BVH8_CPU::Refit( .. ), refitting an SBVH." );
+	FATAL_ERROR_IF( bvh8Data == 0, "BVH8_CPU::Refit( .. ), bvh8Data == 0." );
+	FATAL_ERROR_IF( isTLAS(), "BVH8_CPU::Refit( .. ), refitting a TLAS; rebuild it instead." );
+	RefitSubtree( 0, aabbMin, aabbMax );
+}
+
+void BVH8_CPU::RefitSubtree( const uint32_t blockIdx, bvhvec3& bmin, bvhvec3& bmax )
+{
+#ifdef BVH8_CPU_COMPACT
+	BVHNodeCompact* compact = (BVHNodeCompact*)(bvh8Data + blockIdx);
+	BVHNode tmp;
+	BVHNode* node = &tmp;
+	tmp.child8 = compact->child8;
+	for (int i = 0; i < 8; i++) ((uint32_t*)&tmp.perm8)[i] = ((uint32_t*)&compact->perm8)[i] & 0xffffff;
+#else
+	BVHNode* node = (BVHNode*)(bvh8Data + blockIdx);
+#endif
+	bmin = bvhvec3( BVH_FAR ), bmax = bvhvec3( -BVH_FAR );
+	for (int32_t i = 0; i < 8; i++)
+	{
+		const uint32_t child = ((uint32_t*)&node->child8)[i];
+		if (!child) continue;
+		bvhvec3 cmin( BVH_FAR ), cmax( -BVH_FAR );
+		if (!(child & LEAF_BIT)) RefitSubtree( child, cmin, cmax ); else
+		{
+			// leaf: lanes beyond the triangle count repeat the last triangle.
+		#ifdef BVH8_WOOP_TRIS
+			BVHWoop4Leaf* leaf = (BVHWoop4Leaf*)(bvh8Data + (child & 0x1fffffff));
+		#else
+			BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh8Data + (child & 0x1fffffff));
+		#endif
+			for (uint32_t l = 0; l < 4; l++)
+			{
+				const uint32_t primIdx = leaf->primIdx[l];
+				uint32_t i0, i1, i2;
+				if (indexedEnabled && bvh8.bvh.vertIdx != 0)
+					i0 = bvh8.bvh.vertIdx[primIdx * 3], i1 = bvh8.bvh.vertIdx[primIdx * 3 + 1], i2 = bvh8.bvh.vertIdx[primIdx * 3 + 2];
+				else
+					i0 = primIdx * 3, i1 = primIdx * 3 + 1, i2 = primIdx * 3 + 2;
+				const bvhvec3 v0 = bvh8.bvh.verts[i0], v1 = bvh8.bvh.verts[i1], v2 = bvh8.bvh.verts[i2];
+				((float*)&leaf->v0x4)[l] = v0.x, ((float*)&leaf->v0y4)[l] = v0.y, ((float*)&leaf->v0z4)[l] = v0.z;
+			#ifdef BVH8_WOOP_TRIS
+				((float*)&leaf->v1x4)[l] = v1.x, ((float*)&leaf->v1y4)[l] = v1.y, ((float*)&leaf->v1z4)[l] = v1.z;
+				((float*)&leaf->v2x4)[l] = v2.x, ((float*)&leaf->v2y4)[l] = v2.y, ((float*)&leaf->v2z4)[l] = v2.z;
+			#else
+				const bvhvec3 e1 = v1 - v0, e2 = v2 - v0;
+				((float*)&leaf->e1x4)[l] = e1.x, ((float*)&leaf->e1y4)[l] = e1.y, ((float*)&leaf->e1z4)[l] = e1.z;
+				((float*)&leaf->e2x4)[l] = e2.x, ((float*)&leaf->e2y4)[l] = e2.y, ((float*)&leaf->e2z4)[l] = e2.z;
+			#endif
+				cmin = tinybvh_min( cmin, tinybvh_min( tinybvh_min( v0, v1 ), v2 ) );
+				cmax = tinybvh_max( cmax, tinybvh_max( tinybvh_max( v0, v1 ), v2 ) );
+			}
+		}
+		((float*)&node->xmin8)[i] = cmin.x, ((float*)&node->xmax8)[i] = cmax.x;
+		((float*)&node->ymin8)[i] = cmin.y, ((float*)&node->ymax8)[i] = cmax.y;
+		((float*)&node->zmin8)[i] = cmin.z, ((float*)&node->zmax8)[i] = cmax.z;
+		bmin = tinybvh_min( bmin, cmin ), bmax = tinybvh_max( bmax, cmax );
+	}
+#ifdef BVH8_CPU_COMPACT
+	// re-quantize child bounds against the updated node bounds.
+	QuantizeNode( compact, node, bmin, bmax );
+#endif
+}
+
+#ifdef BVH8_CPU_COMPACT
+
+void BVH8_CPU::QuantizeNode( BVHNodeCompact* compact, const BVHNode* node, const bvhvec3& bmin, const bvhvec3& bmax )
+{
+	// convert node data to compact layout; perm8 of 'node' must not contain cbmaxx8.
+	compact->perm8 = node->perm8;
+	compact->bextx = (bmax.x - bmin.x) * 1.004f, compact->bminx = bmin.x - compact->bextx;
+	compact->bexty = (bmax.y - bmin.y) * 1.004f, compact->bminy = bmin.y - compact->bexty;
+	compact->bextz = (bmax.z - bmin.z) * 1.004f, compact->bminz = bmin.z - compact->bextz;
+	for (int i = 0; i < 8; i++) if (((uint32_t*)&node->child8)[i])
+	{
+		unsigned qxmin = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&node->xmin8)[i] - bmin.x) / compact->bextx), 0, 255 );
+		unsigned qymin = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&node->ymin8)[i] - bmin.y) / compact->bexty), 0, 255 );
+		unsigned qzmin = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&node->zmin8)[i] - bmin.z) / compact->bextz), 0, 255 );
+		unsigned qxmax = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&node->xmax8)[i] - bmin.x) / compact->bextx) + 1, 0, 255 );
+		unsigned qymax = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&node->ymax8)[i] - bmin.y) / compact->bexty) + 1, 0, 255 );
+		unsigned qzmax = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&node->zmax8)[i] - bmin.z) / compact->bextz) + 1, 0, 255 );
+		((unsigned char*)&compact->cbminx8)[i] = qxmin;
+		((uint32_t*)&compact->perm8)[i] |= qxmax << 24;
+		((uint32_t*)&compact->cbminmaxyz8)[i] = qzmax + (qzmin << 8) + (qymax << 16) + (qymin << 24);
+	}
+	else // mark node as invalid.
+		((unsigned char*)&compact->cbminx8)[i] = 255,
+		((unsigned char*)&compact->perm8)[i] &= 0xffffff;
+	compact->child8 = node->child8;
+}
+
+#endif
+
 float BVH8_CPU::SAHCost( const uint32_t nodeIdx ) const
 {
 	return bvh8.SAHCost( nodeIdx );
@@ -4613,6 +7312,8 @@ void BVH8_CPU::ConvertFrom( const MBVH<8>& original )
 		allocatedBlocks = blocksNeeded;
 	}
 	CopyBasePropertiesFrom( bvh8 );
+	instList = bvh8.bvh.instList, blasList = bvh8.bvh.blasList, instIdx = bvh8.bvh.primIdx;
+	instData = bvh8.bvh.instData;
 	// start conversion
 	uint32_t newBlockPtr = 0, nodeIdx = 0, stack[128], stackPtr = 0;
 	while (1)
@@ -4658,7 +7359,12 @@ void BVH8_CPU::ConvertFrom( const MBVH<8>& original )
 			((float*)&newNode->xmax8)[cidx] = child.aabbMax.x;
 			((float*)&newNode->ymax8)[cidx] = child.aabbMax.y;
 			((float*)&newNode->zmax8)[cidx] = child.aabbMax.z;
-			if (child.isLeaf())
+			if (child.isLeaf() && isTLAS())
+			{
+				// TLAS leaf: up to 4 instances, stored as an offset in the instance index array.
+				((uint32_t*)&newNode->child8)[cidx] = child.firstTri + ((child.triCount - 1) << 29) + LEAF_BIT;
+			}
+			else if (child.isLeaf())
 			{
 				// emit leaf node: group of up to 4 triangles in AoS format.
 				((uint32_t*)&newNode->child8)[cidx] = newBlockPtr + ((child.triCount - 1) << 29) + LEAF_BIT;
@@ -4712,27 +7418,7 @@ void BVH8_CPU::ConvertFrom( const MBVH<8>& original )
 			((float*)&newNode->zmin8)[cidx] = 1e30f, ((float*)&newNode->zmax8)[cidx] = 1.00001e30f;
 		}
 	#ifdef BVH8_CPU_COMPACT
-		// convert node data to compact layout
-		compact->perm8 = newNode->perm8;
-		compact->bextx = (orig.aabbMax.x - orig.aabbMin.x) * 1.004f, compact->bminx = orig.aabbMin.x - compact->bextx;
-		compact->bexty = (orig.aabbMax.y - orig.aabbMin.y) * 1.004f, compact->bminy = orig.aabbMin.y - compact->bexty;
-		compact->bextz = (orig.aabbMax.z - orig.aabbMin.z) * 1.004f, compact->bminz = orig.aabbMin.z - compact->bextz;
-		for (int i = 0; i < 8; i++) if (((uint32_t*)&newNode->child8)[i])
-		{
-			unsigned qxmin = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&newNode->xmin8)[i] - orig.aabbMin.x) / compact->bextx), 0, 255 );
-			unsigned qymin = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&newNode->ymin8)[i] - orig.aabbMin.y) / compact->bexty), 0, 255 );
-			unsigned qzmin = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&newNode->zmin8)[i] - orig.aabbMin.z) / compact->bextz), 0, 255 );
-			unsigned qxmax = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&newNode->xmax8)[i] - orig.aabbMin.x) / compact->bextx) + 1, 0, 255 );
-			unsigned qymax = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&newNode->ymax8)[i] - orig.aabbMin.y) / compact->bexty) + 1, 0, 255 );
-			unsigned qzmax = (unsigned)tinybvh_clamp( (int)(256.0f * (((float*)&newNode->zmax8)[i] - orig.aabbMin.z) / compact->bextz) + 1, 0, 255 );
-			((unsigned char*)&compact->cbminx8)[i] = qxmin;
-			((uint32_t*)&compact->perm8)[i] |= qxmax << 24;
-			((uint32_t*)&compact->cbminmaxyz8)[i] = qzmax + (qzmin << 8) + (qymax << 16) + (qymin << 24);
-		}
-		else // mark node as invalid.
-			((unsigned char*)&compact->cbminx8)[i] = 255,
-			((unsigned char*)&compact->perm8)[i] &= 0xffffff;
-		compact->child8 = newNode->child8;
+		QuantizeNode( compact, newNode, orig.aabbMin, orig.aabbMax );
 	#endif
 		// pop next task
 		if (!stackPtr) break;
@@ -5078,8 +7764,8 @@ void BVH::PrepareAVXBuild( const bvhvec4slice& vertices, const uint32_t* indices
 {
 	FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareAVXBuild( .. ), primCount == 0." );
 	FATAL_ERROR_IF( vertices.stride & 15, "BVH::PrepareAVXBuild( .. ), stride must be multiple of 16." );
-	// some constants
-	static const __m128 min4 = _mm_set1_ps( BVH_FAR ), max4 = _mm_set1_ps( -BVH_FAR );
+	DiscardLeafTris();
+	DiscardMotion();
 	// reset node pool
 	uint32_t primCount = prims > 0 ? prims : vertices.count / 3;
 	const uint32_t spaceNeeded = primCount * 2;
@@ -5099,45 +7785,10 @@ void BVH::PrepareAVXBuild( const bvhvec4slice& vertices, const uint32_t* indices
 	vertIdx = (uint32_t*)indices;
 	triCount = idxCount = primCount;
 	newNodePtr = 2;
-	struct FragSSE { __m128 bmin4, bmax4; };
-	FragSSE* frag4 = (FragSSE*)fragment;
-	const __m128* verts4 = (__m128*)verts.data; // that's why it must be 16-byte aligned.
-	// assign all triangles to the root node
-	BVHNode& root = bvhNode[0];
-	root.leftFirst = 0, root.triCount = triCount;
-	// initialize fragments and update root bounds
-	__m128 rootMin = min4, rootMax = max4;
-	uint32_t stride4 = verts.stride / 16;
-	if (indices)
-	{
-		FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareAVXBuild( .. ), empty vertex slice." );
-		FATAL_ERROR_IF( prims == 0, "BVH::PrepareAVXBuild( .. ), prims == 0." );
-		// build the BVH over indexed triangles
-		for (uint32_t i = 0; i < triCount; i++)
-		{
-			const uint32_t i0 = indices[i * 3], i1 = indices[i * 3 + 1], i2 = indices[i * 3 + 2];
-			const __m128 v0 = verts4[i0 * stride4], v1 = verts4[i1 * stride4], v2 = verts4[i2 * stride4];
-			const __m128 t1 = _mm_min_ps( _mm_min_ps( v0, v1 ), v2 );
-			const __m128 t2 = _mm_max_ps( _mm_max_ps( v0, v1 ), v2 );
-			frag4[i].bmin4 = t1, frag4[i].bmax4 = t2, rootMin = _mm_min_ps( rootMin, t1 ), rootMax = _mm_max_ps( rootMax, t2 );
-			primIdx[i] = i;
-		}
-	}
-	else
-	{
-		FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareAVXBuild( .. ), empty vertex slice." );
-		FATAL_ERROR_IF( prims != 0, "BVH::PrepareAVXBuild( .. ), indices == 0." );
-		// build the BVH over a list of vertices: three per triangle
-		for (uint32_t i = 0; i < triCount; i++)
-		{
-			const __m128 v0 = verts4[(i * 3) * stride4], v1 = verts4[(i * 3 + 1) * stride4], v2 = verts4[(i * 3 + 2) * stride4];
-			const __m128 t1 = _mm_min_ps( _mm_min_ps( v0, v1 ), v2 );
-			const __m128 t2 = _mm_max_ps( _mm_max_ps( v0, v1 ), v2 );
-			frag4[i].bmin4 = t1, frag4[i].bmax4 = t2, rootMin = _mm_min_ps( rootMin, t1 ), rootMax = _mm_max_ps( rootMax, t2 );
-			primIdx[i] = i;
-		}
-	}
-	root.aabbMin = *(bvhvec3*)&rootMin, root.aabbMax = *(bvhvec3*)&rootMax;
+	// initialize fragments and assign all triangles to the root node
+	FATAL_ERROR_IF( indices && prims == 0, "BVH::PrepareAVXBuild( .. ), prims == 0." );
+	FATAL_ERROR_IF( !indices && prims != 0, "BVH::PrepareAVXBuild( .. ), indices == 0." );
+	PrepareFragments( indices );
 	bvh_over_indices = indices != nullptr;
 }
 void BVH::BuildAVX()
@@ -5273,6 +7924,14 @@ void BVH::BuildAVX()
 // with groups of 8 rays at a time - TODO.
 void BVH::Intersect256RaysSSE( Ray* packet ) const
 {
+	// deformation blur: packet bounds would be for time 0 only; trace the rays one by one.
+	if (hasMotion()) { for (int32_t i = 0; i < 256; i++) IntersectMotion( packet[i] ); return; }
+	// packets with distinct origins (thin lens, area lights) take the interval path.
+	for (int32_t i = 1; i < 256; i++) if (packet[i].O.x != packet[0].O.x || packet[i].O.y != packet[0].O.y || packet[i].O.z != packet[0].O.z)
+	{
+		Intersect256RaysSpread( packet );
+		return;
+	}
 	// Corner rays are: 0, 51, 204 and 255
 	// Construct the bounding planes, with normals pointing outwards
 	bvhvec3 O = packet[0].O; // same for all rays in this case
@@ -5472,12 +8131,18 @@ void BVH::Intersect256RaysSSE( Ray* packet ) const
 
 // Traverse the 'structure of arrays' BVH layout.
 int32_t BVH_SoA::Intersect( Ray& ray ) const
+{
+	return (this->*intersectKernel[RayOctant( ray )])(ray);
+}
+
+template <bool posX, bool posY, bool posZ> int32_t BVH_SoA::Intersect( Ray& ray ) const
 {
 	BVHNode* node = &bvhNode[0], * stack[64];
 	const bvhvec4slice& verts = bvh.verts;
 	const uint32_t* primIdx = bvh.primIdx;
 	uint32_t stackPtr = 0;
 	float cost = 0;
+	constexpr int nx = posX ? 0 : 1, ny = posY ? 0 : 1, nz = posZ ? 0 : 1;
 	const __m128 Ox4 = _mm_set1_ps( ray.O.x ), rDx4 = _mm_set1_ps( ray.rD.x );
 	const __m128 Oy4 = _mm_set1_ps( ray.O.y ), rDy4 = _mm_set1_ps( ray.rD.y );
 	const __m128 Oz4 = _mm_set1_ps( ray.O.z ), rDz4 = _mm_set1_ps( ray.rD.z );
@@ -5486,6 +8151,19 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 		cost += c_trav;
 		if (node->isLeaf())
 		{
+		#ifdef BVH_USEAVX2
+			if (leafTris)
+			{
+				const BVHTri4Leaf* leaf = leafTris + node->left;
+			#ifdef WATERTIGHT_TRIS
+				for (uint32_t i = 0; i < node->triCount; i += 4) IntersectWoop4Leaf( ray, (const BVHWoop4Leaf*)leaf++ );
+			#else
+				for (uint32_t i = 0; i < node->triCount; i += 4) IntersectTri4Leaf( ray, leaf++ );
+			#endif
+				cost += c_int * node->triCount;
+			}
+			else
+		#endif
 			if (indexedEnabled && bvh.vertIdx != 0) for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
 				IntersectTriIndexed( ray, verts, bvh.vertIdx, primIdx[node->firstTri + i] );
 			else if (customEnabled && bvh.customIntersect != 0) for (uint32_t i = 0; i < node->triCount; i++, cost += c_int)
@@ -5495,42 +8173,24 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
 		}
-		__m128 x4 = _mm_mul_ps( _mm_sub_ps( node->xxxx, Ox4 ), rDx4 );
-		__m128 y4 = _mm_mul_ps( _mm_sub_ps( node->yyyy, Oy4 ), rDy4 );
-		__m128 z4 = _mm_mul_ps( _mm_sub_ps( node->zzzz, Oz4 ), rDz4 );
-		// transpose
-		__m128 t0 = _mm_unpacklo_ps( x4, y4 ), t2 = _mm_unpacklo_ps( z4, z4 );
-		__m128 t1 = _mm_unpackhi_ps( x4, y4 ), t3 = _mm_unpackhi_ps( z4, z4 );
-		__m128 xyzw1a = _mm_shuffle_ps( t0, t2, _MM_SHUFFLE( 1, 0, 1, 0 ) );
-		__m128 xyzw2a = _mm_shuffle_ps( t0, t2, _MM_SHUFFLE( 3, 2, 3, 2 ) );
-		__m128 xyzw1b = _mm_shuffle_ps( t1, t3, _MM_SHUFFLE( 1, 0, 1, 0 ) );
-		__m128 xyzw2b = _mm_shuffle_ps( t1, t3, _MM_SHUFFLE( 3, 2, 3, 2 ) );
-		// process
-		__m128 tmina4 = _mm_min_ps( xyzw1a, xyzw2a ), tmaxa4 = _mm_max_ps( xyzw1a, xyzw2a );
-		__m128 tminb4 = _mm_min_ps( xyzw1b, xyzw2b ), tmaxb4 = _mm_max_ps( xyzw1b, xyzw2b );
-		// transpose back
-		t0 = _mm_unpacklo_ps( tmina4, tmaxa4 ), t2 = _mm_unpacklo_ps( tminb4, tmaxb4 );
-		t1 = _mm_unpackhi_ps( tmina4, tmaxa4 ), t3 = _mm_unpackhi_ps( tminb4, tmaxb4 );
-		x4 = _mm_shuffle_ps( t0, t2, _MM_SHUFFLE( 1, 0, 1, 0 ) );
-		y4 = _mm_shuffle_ps( t0, t2, _MM_SHUFFLE( 3, 2, 3, 2 ) );
-		z4 = _mm_shuffle_ps( t1, t3, _MM_SHUFFLE( 1, 0, 1, 0 ) );
+		const __m128 x4 = _mm_mul_ps( _mm_sub_ps( node->xxxx, Ox4 ), rDx4 );
+		const __m128 y4 = _mm_mul_ps( _mm_sub_ps( node->yyyy, Oy4 ), rDy4 );
+		const __m128 z4 = _mm_mul_ps( _mm_sub_ps( node->zzzz, Oz4 ), rDz4 );
+		// lanes hold (lmin, lmax, rmin, rmax); the octant tells which of these are near planes.
+		const __m128 nearxy4 = _mm_shuffle_ps( x4, y4, _MM_SHUFFLE( ny + 2, ny, nx + 2, nx ) );
+		const __m128 farxy4 = _mm_shuffle_ps( x4, y4, _MM_SHUFFLE( 3 - ny, 1 - ny, 3 - nx, 1 - nx ) );
+		const __m128 nearz4 = _mm_shuffle_ps( z4, z4, _MM_SHUFFLE( nz + 2, nz, nz + 2, nz ) );
+		const __m128 farz4 = _mm_shuffle_ps( z4, z4, _MM_SHUFFLE( 3 - nz, 1 - nz, 3 - nz, 1 - nz ) );
+		__m128 min4 = _mm_max_ps( nearxy4, nearz4 ), max4 = _mm_min_ps( farxy4, farz4 );
+		min4 = _mm_max_ps( _mm_max_ps( min4, _mm_movehl_ps( min4, min4 ) ), _mm_setzero_ps() );
+		max4 = _mm_min_ps( _mm_min_ps( max4, _mm_movehl_ps( max4, max4 ) ), _mm_set1_ps( ray.hit.t ) );
+#ifdef WATERTIGHT_TRIS
+		max4 = _mm_mul_ps( max4, _mm_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
 		uint32_t lidx = node->left, ridx = node->right;
-		const __m128 min4 = _mm_max_ps( _mm_max_ps( _mm_max_ps( x4, y4 ), z4 ), _mm_setzero_ps() );
-		const __m128 max4 = _mm_min_ps( _mm_min_ps( _mm_min_ps( x4, y4 ), z4 ), _mm_set1_ps( ray.hit.t ) );
-	#if 0
-		// TODO: why is this slower on gen14?
-		const float tmina_0 = LANE( min4, 0 ), tmaxa_1 = LANE( max4, 1 );
-		const float tminb_2 = LANE( min4, 2 ), tmaxb_3 = LANE( max4, 3 );
-		t0 = _mm_shuffle_ps( max4, max4, _MM_SHUFFLE( 1, 3, 1, 3 ) );
-		t1 = _mm_shuffle_ps( min4, min4, _MM_SHUFFLE( 0, 2, 0, 2 ) );
-		t0 = _mm_blendv_ps( inf4, t1, _mm_cmpge_ps( t0, t1 ) );
-		float dist1 = LANE( t0, 1 ), dist2 = LANE( t0, 0 );
-	#else
-		const float tmina_0 = LANE( min4, 0 ), tmaxa_1 = LANE( max4, 1 );
-		const float tminb_2 = LANE( min4, 2 ), tmaxb_3 = LANE( max4, 3 );
-		float dist1 = tmaxa_1 >= tmina_0 ? tmina_0 : BVH_FAR;
-		float dist2 = tmaxb_3 >= tminb_2 ? tminb_2 : BVH_FAR;
-	#endif
+		const float tmina = LANE( min4, 0 ), tminb = LANE( min4, 1 );
+		float dist1 = LANE( max4, 0 ) >= tmina ? tmina : BVH_FAR;
+		float dist2 = LANE( max4, 1 ) >= tminb ? tminb : BVH_FAR;
 		if (dist1 > dist2)
 		{
 			float t = dist1; dist1 = dist2; dist2 = t;
@@ -5551,11 +8211,17 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 
 // Find occlusions in the second alternative BVH layout (ALT_SOA).
 bool BVH_SoA::IsOccluded( const Ray& ray ) const
+{
+	return (this->*occlusionKernel[RayOctant( ray )])(ray);
+}
+
+template <bool posX, bool posY, bool posZ> bool BVH_SoA::IsOccluded( const Ray& ray ) const
 {
 	BVHNode* node = &bvhNode[0], * stack[64];
 	const bvhvec4slice& verts = bvh.verts;
 	const uint32_t* primIdx = bvh.primIdx;
 	uint32_t stackPtr = 0;
+	constexpr int nx = posX ? 0 : 1, ny = posY ? 0 : 1, nz = posZ ? 0 : 1;
 	const __m128 Ox4 = _mm_set1_ps( ray.O.x ), rDx4 = _mm_set1_ps( ray.rD.x );
 	const __m128 Oy4 = _mm_set1_ps( ray.O.y ), rDy4 = _mm_set1_ps( ray.rD.y );
 	const __m128 Oz4 = _mm_set1_ps( ray.O.z ), rDz4 = _mm_set1_ps( ray.rD.z );
@@ -5563,6 +8229,18 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 	{
 		if (node->isLeaf())
 		{
+		#ifdef BVH_USEAVX2
+			if (leafTris)
+			{
+				const BVHTri4Leaf* leaf = leafTris + node->left;
+			#ifdef WATERTIGHT_TRIS
+				for (uint32_t i = 0; i < node->triCount; i += 4) if (Woop4LeafOccludes( ray, (const BVHWoop4Leaf*)leaf++ )) return true;
+			#else
+				for (uint32_t i = 0; i < node->triCount; i += 4) if (Tri4LeafOccludes( ray, leaf++ )) return true;
+			#endif
+			}
+			else
+		#endif
 			if (indexedEnabled && bvh.vertIdx != 0)
 			{
 				for (uint32_t i = 0; i < node->triCount; i++)
@@ -5581,32 +8259,24 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
 		}
-		__m128 x4 = _mm_mul_ps( _mm_sub_ps( node->xxxx, Ox4 ), rDx4 );
-		__m128 y4 = _mm_mul_ps( _mm_sub_ps( node->yyyy, Oy4 ), rDy4 );
-		__m128 z4 = _mm_mul_ps( _mm_sub_ps( node->zzzz, Oz4 ), rDz4 );
-		// transpose
-		__m128 t0 = _mm_unpacklo_ps( x4, y4 ), t2 = _mm_unpacklo_ps( z4, z4 );
-		__m128 t1 = _mm_unpackhi_ps( x4, y4 ), t3 = _mm_unpackhi_ps( z4, z4 );
-		__m128 xyzw1a = _mm_shuffle_ps( t0, t2, _MM_SHUFFLE( 1, 0, 1, 0 ) );
-		__m128 xyzw2a = _mm_shuffle_ps( t0, t2, _MM_SHUFFLE( 3, 2, 3, 2 ) );
-		__m128 xyzw1b = _mm_shuffle_ps( t1, t3, _MM_SHUFFLE( 1, 0, 1, 0 ) );
-		__m128 xyzw2b = _mm_shuffle_ps( t1, t3, _MM_SHUFFLE( 3, 2, 3, 2 ) );
-		// process
-		__m128 tmina4 = _mm_min_ps( xyzw1a, xyzw2a ), tmaxa4 = _mm_max_ps( xyzw1a, xyzw2a );
-		__m128 tminb4 = _mm_min_ps( xyzw1b, xyzw2b ), tmaxb4 = _mm_max_ps( xyzw1b, xyzw2b );
-		// transpose back
-		t0 = _mm_unpacklo_ps( tmina4, tmaxa4 ), t2 = _mm_unpacklo_ps( tminb4, tmaxb4 );
-		t1 = _mm_unpackhi_ps( tmina4, tmaxa4 ), t3 = _mm_unpackhi_ps( tminb4, tmaxb4 );
-		x4 = _mm_shuffle_ps( t0, t2, _MM_SHUFFLE( 1, 0, 1, 0 ) );
-		y4 = _mm_shuffle_ps( t0, t2, _MM_SHUFFLE( 3, 2, 3, 2 ) );
-		z4 = _mm_shuffle_ps( t1, t3, _MM_SHUFFLE( 1, 0, 1, 0 ) );
+		const __m128 x4 = _mm_mul_ps( _mm_sub_ps( node->xxxx, Ox4 ), rDx4 );
+		const __m128 y4 = _mm_mul_ps( _mm_sub_ps( node->yyyy, Oy4 ), rDy4 );
+		const __m128 z4 = _mm_mul_ps( _mm_sub_ps( node->zzzz, Oz4 ), rDz4 );
+		// lanes hold (lmin, lmax, rmin, rmax); the octant tells which of these are near planes.
+		const __m128 nearxy4 = _mm_shuffle_ps( x4, y4, _MM_SHUFFLE( ny + 2, ny, nx + 2, nx ) );
+		const __m128 farxy4 = _mm_shuffle_ps( x4, y4, _MM_SHUFFLE( 3 - ny, 1 - ny, 3 - nx, 1 - nx ) );
+		const __m128 nearz4 = _mm_shuffle_ps( z4, z4, _MM_SHUFFLE( nz + 2, nz, nz + 2, nz ) );
+		const __m128 farz4 = _mm_shuffle_ps( z4, z4, _MM_SHUFFLE( 3 - nz, 1 - nz, 3 - nz, 1 - nz ) );
+		__m128 min4 = _mm_max_ps( nearxy4, nearz4 ), max4 = _mm_min_ps( farxy4, farz4 );
+		min4 = _mm_max_ps( _mm_max_ps( min4, _mm_movehl_ps( min4, min4 ) ), _mm_setzero_ps() );
+		max4 = _mm_min_ps( _mm_min_ps( max4, _mm_movehl_ps( max4, max4 ) ), _mm_set1_ps( ray.hit.t ) );
+#ifdef WATERTIGHT_TRIS
+		max4 = _mm_mul_ps( max4, _mm_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
 		uint32_t lidx = node->left, ridx = node->right;
-		const __m128 min4 = _mm_max_ps( _mm_max_ps( _mm_max_ps( x4, y4 ), z4 ), _mm_setzero_ps() );
-		const __m128 max4 = _mm_min_ps( _mm_min_ps( _mm_min_ps( x4, y4 ), z4 ), _mm_set1_ps( ray.hit.t ) );
-		const float tmina_0 = LANE( min4, 0 ), tmaxa_1 = LANE( max4, 1 );
-		const float tminb_2 = LANE( min4, 2 ), tmaxb_3 = LANE( max4, 3 );
-		float dist1 = tmaxa_1 >= tmina_0 ? tmina_0 : BVH_FAR;
-		float dist2 = tmaxb_3 >= tminb_2 ? tminb_2 : BVH_FAR;
+		const float tmina = LANE( min4, 0 ), tminb = LANE( min4, 1 );
+		float dist1 = LANE( max4, 0 ) >= tmina ? tmina : BVH_FAR;
+		float dist2 = LANE( max4, 1 ) >= tminb ? tminb : BVH_FAR;
 		if (dist1 > dist2)
 		{
 			float t = dist1; dist1 = dist2; dist2 = t;
@@ -5625,6 +8295,9 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 	return false;
 }
 
+const BVH_SoA::IntersectKernel BVH_SoA::intersectKernel[8] = OCTANT_KERNELS( BVH_SoA::Intersect );
+const BVH_SoA::OcclusionKernel BVH_SoA::occlusionKernel[8] = OCTANT_KERNELS( BVH_SoA::IsOccluded );
+
 // Intersect_CWBVH:
 // Intersect a compressed 8-wide BVH with a ray. For debugging only, not efficient.
 // Not technically limited to BVH_USEAVX, but __lzcnt and __popcnt will require
@@ -5651,7 +8324,7 @@ inline uint32_t sign_extend_s8x4( const uint32_t i )
 	uint32_t b3 = (i & 0b00000000000000000000000010000000) ? 0x000000ff : 0;
 	return b0 + b1 + b2 + b3; // probably can do better than this.
 }
-int32_t BVH8_CWBVH::Intersect( Ray& ray ) const
+template <bool anyHit> bool BVH8_CWBVH::Traverse( const Ray& ray, Intersection& hit ) const
 {
 	bvhuint2 traversalStack[128];
 	uint32_t hitAddr = 0, stackPtr = 0;
@@ -5748,13 +8421,16 @@ int32_t BVH8_CWBVH::Intersect( Ray& ray ) const
 			const float transS = T[8] * ray.O.x + T[9] * ray.O.y + T[10] * ray.O.z + T[11];
 			const float transD = T[8] * ray.D.x + T[9] * ray.D.y + T[10] * ray.D.z;
 			const float ta = -transS / transD;
-			if (ta > 0 && ta < ray.hit.t)
+			if (ta > 0 && ta < tmax)
 			{
 				const bvhvec3 wr = ray.O + ta * ray.D;
 				const float u = T[0] * wr.x + T[1] * wr.y + T[2] * wr.z + T[3];
 				const float v = T[4] * wr.x + T[5] * wr.y + T[6] * wr.z + T[7];
-				const bool hit = u >= 0 && v >= 0 && u + v < 1;
-				if (hit) triangleuv = bvhvec2( u, v ), tmax = ta, hitAddr = *(uint32_t*)&T[15];
+				if (u >= 0 && v >= 0 && u + v < 1)
+				{
+					if (anyHit) return true;
+					triangleuv = bvhvec2( u, v ), tmax = ta, hitAddr = *(uint32_t*)&T[15];
+				}
 			}
 		#else
 			int32_t triAddr = tgroup.x + triangleIndex * 3;
@@ -5777,6 +8453,7 @@ int32_t BVH8_CWBVH::Intersect( Ray& ray ) const
 						const float d = f * tinybvh_dot( edge2, q );
 						if (d > 0.0f && d < tmax)
 						{
+							if (anyHit) return true;
 							triangleuv = bvhvec2( u, v ), tmax = d;
 							hitAddr = as_uint( blasTris[triAddr + 2].w );
 						}
@@ -5791,20 +8468,38 @@ int32_t BVH8_CWBVH::Intersect( Ray& ray ) const
 			if (stackPtr > 0) { STACK_POP( /* nodeGroup */ ); }
 			else
 			{
-				ray.hit.t = tmax;
+				if (anyHit) return false;
+				hit.t = tmax;
 				if (tmax < BVH_FAR)
-					ray.hit.u = triangleuv.x, ray.hit.v = triangleuv.y;
-				ray.hit.prim = hitAddr;
+					hit.u = triangleuv.x, hit.v = triangleuv.y;
+				hit.prim = hitAddr;
 				break;
 			}
 		}
 	} while (true);
+	return false;
+}
+
+int32_t BVH8_CWBVH::Intersect( Ray& ray ) const
+{
+	Traverse<false>( ray, ray.hit );
 	return 0;
 }
 
+bool BVH8_CWBVH::IsOccluded( const Ray& ray ) const
+{
+	Intersection unused;
+	return Traverse<true>( ray, unused );
+}
+
 // Traverse a 4-way BVH stored in 'Atilla Áfra' layout.
 inline void IntersectCompactTri( Ray& r, __m128& t4, const float* T )
 {
+#ifdef WATERTIGHT_TRIS
+	// T holds the original vertices, see BVH4_CPU::ConvertFrom.
+	float ta, u, v;
+	const bool hit = IntersectWatertight( r, bvhvec3( T[0], T[1], T[2] ), bvhvec3( T[4], T[5], T[6] ), bvhvec3( T[8], T[9], T[10] ), ta, u, v );
+#else
 	const float transS = T[8] * r.O.x + T[9] * r.O.y + T[10] * r.O.z + T[11];
 	const float transD = T[8] * r.D.x + T[9] * r.D.y + T[10] * r.D.z;
 	const float ta = -transS / transD;
@@ -5813,13 +8508,22 @@ inline void IntersectCompactTri( Ray& r, __m128& t4, const float* T )
 	const float u = T[0] * wr.x + T[1] * wr.y + T[2] * wr.z + T[3];
 	const float v = T[4] * wr.x + T[5] * wr.y + T[6] * wr.z + T[7];
 	const bool hit = u >= 0 && v >= 0 && u + v < 1;
+#endif
+	// set fields one by one: an aggregate would also clear auxData and the instance path.
+	if (!hit) return;
+	r.hit.t = ta, r.hit.u = u, r.hit.v = v, t4 = _mm_set1_ps( ta );
 #if INST_IDX_BITS == 32
-	if (hit) r.hit = { r.instIdx, ta, u, v, *(uint32_t*)&T[15] }, t4 = _mm_set1_ps( ta );
+	r.hit.prim = *(uint32_t*)&T[15], r.hit.inst = r.instIdx;
 #else
-	if (hit) r.hit = { ta, u, v, *(uint32_t*)&T[15] + r.instIdx }, t4 = _mm_set1_ps( ta );
+	r.hit.prim = *(uint32_t*)&T[15] + r.instIdx;
 #endif
 }
 int32_t BVH4_CPU::Intersect( Ray& ray ) const
+{
+	return (this->*intersectKernel[RayOctant( ray )])(ray);
+}
+
+template <bool posX, bool posY, bool posZ> int32_t BVH4_CPU::Intersect( Ray& ray ) const
 {
 	uint32_t nodeIdx = 0, stack[1024], stackPtr = 0;
 	float cost = 0;
@@ -5834,20 +8538,18 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 	{
 		cost += c_trav;
 		const BVHNode& node = bvh4Node[nodeIdx];
-		// intersect the ray with four AABBs
-		const __m128 xmin4 = node.xmin4, xmax4 = node.xmax4;
-		const __m128 ymin4 = node.ymin4, ymax4 = node.ymax4;
-		const __m128 zmin4 = node.zmin4, zmax4 = node.zmax4;
-		const __m128 x0 = _mm_sub_ps( xmin4, ox4 ), x1 = _mm_sub_ps( xmax4, ox4 );
-		const __m128 y0 = _mm_sub_ps( ymin4, oy4 ), y1 = _mm_sub_ps( ymax4, oy4 );
-		const __m128 z0 = _mm_sub_ps( zmin4, oz4 ), z1 = _mm_sub_ps( zmax4, oz4 );
+		// intersect the ray with four AABBs; near and far planes follow from the octant.
+		const __m128 x0 = _mm_sub_ps( posX ? node.xmin4 : node.xmax4, ox4 ), x1 = _mm_sub_ps( posX ? node.xmax4 : node.xmin4, ox4 );
+		const __m128 y0 = _mm_sub_ps( posY ? node.ymin4 : node.ymax4, oy4 ), y1 = _mm_sub_ps( posY ? node.ymax4 : node.ymin4, oy4 );
+		const __m128 z0 = _mm_sub_ps( posZ ? node.zmin4 : node.zmax4, oz4 ), z1 = _mm_sub_ps( posZ ? node.zmax4 : node.zmin4, oz4 );
 		const __m128 tx1 = _mm_mul_ps( x0, rdx4 ), tx2 = _mm_mul_ps( x1, rdx4 );
 		const __m128 ty1 = _mm_mul_ps( y0, rdy4 ), ty2 = _mm_mul_ps( y1, rdy4 );
 		const __m128 tz1 = _mm_mul_ps( z0, rdz4 ), tz2 = _mm_mul_ps( z1, rdz4 );
-		const __m128 txmin = _mm_min_ps( tx1, tx2 ), tymin = _mm_min_ps( ty1, ty2 ), tzmin = _mm_min_ps( tz1, tz2 );
-		const __m128 txmax = _mm_max_ps( tx1, tx2 ), tymax = _mm_max_ps( ty1, ty2 ), tzmax = _mm_max_ps( tz1, tz2 );
-		const __m128 tmin = _mm_max_ps( _mm_max_ps( txmin, tymin ), tzmin );
-		const __m128 tmax = _mm_min_ps( _mm_min_ps( txmax, tymax ), tzmax );
+		const __m128 tmin = _mm_max_ps( _mm_max_ps( tx1, ty1 ), tz1 );
+		__m128 tmax = _mm_min_ps( _mm_min_ps( tx2, ty2 ), tz2 );
+#ifdef WATERTIGHT_TRIS
+		tmax = _mm_mul_ps( tmax, _mm_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
 		const __m128 hit = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( tmax, tmin ), _mm_cmplt_ps( tmin, t4 ) ), _mm_cmpge_ps( tmax, zero4 ) );
 		const int32_t hitBits = _mm_movemask_ps( hit ), hits = __popc( hitBits );
 		if (hits == 1 /* 43% */)
@@ -5857,6 +8559,7 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 			if (count == 0) nodeIdx = node.childFirst[lane]; else
 			{
 				const uint32_t first = node.childFirst[lane];
+				if (instList) cost += IntersectInstances( ray, instList, instData, blasList, instIdx + first, count ), t4 = _mm_set1_ps( ray.hit.t ); else
 				for (uint32_t j = 0; j < count; j++, cost += c_int) // TODO: aim for 4 prims per leaf
 					IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
 				if (stackPtr == 0) break;
@@ -5885,6 +8588,7 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 			if (triCount0 == 0) nodeIdx = node.childFirst[lane0]; else
 			{
 				const uint32_t first = node.childFirst[lane0];
+				if (instList) cost += IntersectInstances( ray, instList, instData, blasList, instIdx + first, triCount0 ), t4 = _mm_set1_ps( ray.hit.t ); else
 				for (uint32_t j = 0; j < triCount0; j++, cost += c_int) // TODO: aim for 4 prims per leaf
 					IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
 				nodeIdx = 0;
@@ -5898,6 +8602,7 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 			else
 			{
 				const uint32_t first = node.childFirst[lane1];
+				if (instList) cost += IntersectInstances( ray, instList, instData, blasList, instIdx + first, triCount1 ), t4 = _mm_set1_ps( ray.hit.t ); else
 				for (uint32_t j = 0; j < triCount1; j++, cost += c_int) // TODO: aim for 4 prims per leaf
 					IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
 			}
@@ -5927,6 +8632,7 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 					continue;
 				}
 				const uint32_t first = node.childFirst[lane], count = node.triCount[lane];
+				if (instList) cost += IntersectInstances( ray, instList, instData, blasList, instIdx + first, count ), t4 = _mm_set1_ps( ray.hit.t ); else
 				for (uint32_t j = 0; j < count; j++, cost += c_int) // TODO: aim for 4 prims per leaf
 					IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
 			}
@@ -5957,6 +8663,7 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 					continue;
 				}
 				const uint32_t first = node.childFirst[lane], count = node.triCount[lane];
+				if (instList) cost += IntersectInstances( ray, instList, instData, blasList, instIdx + first, count ), t4 = _mm_set1_ps( ray.hit.t ); else
 				for (uint32_t j = 0; j < count; j++, cost += c_int) // TODO: aim for 4 prims per leaf
 					IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
 			}
@@ -5971,6 +8678,10 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 // Find occlusions in a 4-way BVH stored in 'Atilla Áfra' layout.
 inline bool OccludedCompactTri( const Ray& r, const float* T )
 {
+#ifdef WATERTIGHT_TRIS
+	float ta, u, v;
+	return IntersectWatertight( r, bvhvec3( T[0], T[1], T[2] ), bvhvec3( T[4], T[5], T[6] ), bvhvec3( T[8], T[9], T[10] ), ta, u, v );
+#else
 	const float transS = T[8] * r.O.x + T[9] * r.O.y + T[10] * r.O.z + T[11];
 	const float transD = T[8] * r.D.x + T[9] * r.D.y + T[10] * r.D.z;
 	const float ta = -transS / transD;
@@ -5979,12 +8690,18 @@ inline bool OccludedCompactTri( const Ray& r, const float* T )
 	const float u = T[0] * wr.x + T[1] * wr.y + T[2] * wr.z + T[3];
 	const float v = T[4] * wr.x + T[5] * wr.y + T[6] * wr.z + T[7];
 	return u >= 0 && v >= 0 && u + v < 1;
+#endif
 }
 #ifdef __GNUC__
 #pragma GCC push_options
 #pragma GCC optimize ("-O1") // TODO: I must be doing something wrong, figure out what.
 #endif
 bool BVH4_CPU::IsOccluded( const Ray& ray ) const
+{
+	return (this->*occlusionKernel[RayOctant( ray )])(ray);
+}
+
+template <bool posX, bool posY, bool posZ> bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 {
 	uint32_t nodeIdx = 0, stack[1024], stackPtr = 0;
 	const __m128 ox4 = _mm_set1_ps( ray.O.x ), rdx4 = _mm_set1_ps( ray.rD.x );
@@ -5997,20 +8714,18 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 	while (1)
 	{
 		const BVHNode& node = bvh4Node[nodeIdx];
-		// intersect the ray with four AABBs
-		const __m128 xmin4 = node.xmin4, xmax4 = node.xmax4;
-		const __m128 ymin4 = node.ymin4, ymax4 = node.ymax4;
-		const __m128 zmin4 = node.zmin4, zmax4 = node.zmax4;
-		const __m128 x0 = _mm_sub_ps( xmin4, ox4 ), x1 = _mm_sub_ps( xmax4, ox4 );
-		const __m128 y0 = _mm_sub_ps( ymin4, oy4 ), y1 = _mm_sub_ps( ymax4, oy4 );
-		const __m128 z0 = _mm_sub_ps( zmin4, oz4 ), z1 = _mm_sub_ps( zmax4, oz4 );
+		// intersect the ray with four AABBs; near and far planes follow from the octant.
+		const __m128 x0 = _mm_sub_ps( posX ? node.xmin4 : node.xmax4, ox4 ), x1 = _mm_sub_ps( posX ? node.xmax4 : node.xmin4, ox4 );
+		const __m128 y0 = _mm_sub_ps( posY ? node.ymin4 : node.ymax4, oy4 ), y1 = _mm_sub_ps( posY ? node.ymax4 : node.ymin4, oy4 );
+		const __m128 z0 = _mm_sub_ps( posZ ? node.zmin4 : node.zmax4, oz4 ), z1 = _mm_sub_ps( posZ ? node.zmax4 : node.zmin4, oz4 );
 		const __m128 tx1 = _mm_mul_ps( x0, rdx4 ), tx2 = _mm_mul_ps( x1, rdx4 );
 		const __m128 ty1 = _mm_mul_ps( y0, rdy4 ), ty2 = _mm_mul_ps( y1, rdy4 );
 		const __m128 tz1 = _mm_mul_ps( z0, rdz4 ), tz2 = _mm_mul_ps( z1, rdz4 );
-		const __m128 txmin = _mm_min_ps( tx1, tx2 ), tymin = _mm_min_ps( ty1, ty2 ), tzmin = _mm_min_ps( tz1, tz2 );
-		const __m128 txmax = _mm_max_ps( tx1, tx2 ), tymax = _mm_max_ps( ty1, ty2 ), tzmax = _mm_max_ps( tz1, tz2 );
-		const __m128 tmin = _mm_max_ps( _mm_max_ps( txmin, tymin ), tzmin );
-		const __m128 tmax = _mm_min_ps( _mm_min_ps( txmax, tymax ), tzmax );
+		const __m128 tmin = _mm_max_ps( _mm_max_ps( tx1, ty1 ), tz1 );
+		__m128 tmax = _mm_min_ps( _mm_min_ps( tx2, ty2 ), tz2 );
+#ifdef WATERTIGHT_TRIS
+		tmax = _mm_mul_ps( tmax, _mm_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
 		const __m128 hit = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( tmax, tmin ), _mm_cmplt_ps( tmin, t4 ) ), _mm_cmpge_ps( tmax, zero4 ) );
 		const int32_t hitBits = _mm_movemask_ps( hit ), hits = __popc( hitBits );
 		if (hits == 1 /* 43% */)
@@ -6020,6 +8735,7 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 			if (count == 0) nodeIdx = node.childFirst[lane]; else
 			{
 				const uint32_t first = node.childFirst[lane];
+				if (instList) { if (InstancesOcclude( ray, instList, instData, blasList, instIdx + first, count )) return true; } else
 				for (uint32_t j = 0; j < count; j++) // TODO: aim for 4 prims per leaf
 					if (OccludedCompactTri( ray, (float*)(bvh4Tris + first + j * 4) )) return true;
 				if (stackPtr == 0) break;
@@ -6048,6 +8764,7 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 			if (triCount0 == 0) nodeIdx = node.childFirst[lane0]; else
 			{
 				const uint32_t first = node.childFirst[lane0];
+				if (instList) { if (InstancesOcclude( ray, instList, instData, blasList, instIdx + first, triCount0 )) return true; } else
 				for (uint32_t j = 0; j < triCount0; j++) // TODO: aim for 4 prims per leaf
 					if (OccludedCompactTri( ray, (float*)(bvh4Tris + first + j * 4) )) return true;
 				nodeIdx = 0;
@@ -6061,6 +8778,7 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 			else
 			{
 				const uint32_t first = node.childFirst[lane1];
+				if (instList) { if (InstancesOcclude( ray, instList, instData, blasList, instIdx + first, triCount1 )) return true; } else
 				for (uint32_t j = 0; j < triCount1; j++) // TODO: aim for 4 prims per leaf
 					if (OccludedCompactTri( ray, (float*)(bvh4Tris + first + j * 4) )) return true;
 			}
@@ -6090,6 +8808,7 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 					continue;
 				}
 				const uint32_t first = node.childFirst[lane], count = node.triCount[lane];
+				if (instList) { if (InstancesOcclude( ray, instList, instData, blasList, instIdx + first, count )) return true; } else
 				for (uint32_t j = 0; j < count; j++) // TODO: aim for 4 prims per leaf
 					if (OccludedCompactTri( ray, (float*)(bvh4Tris + first + j * 4) )) return true;
 			}
@@ -6120,6 +8839,7 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 					continue;
 				}
 				const uint32_t first = node.childFirst[lane], count = node.triCount[lane];
+				if (instList) { if (InstancesOcclude( ray, instList, instData, blasList, instIdx + first, count )) return true; } else
 				for (uint32_t j = 0; j < count; j++) // TODO: aim for 4 prims per leaf
 					if (OccludedCompactTri( ray, (float*)(bvh4Tris + first + j * 4) )) return true;
 			}
@@ -6134,6 +8854,110 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 #pragma GCC pop_options
 #endif
 
+const BVH4_CPU::IntersectKernel BVH4_CPU::intersectKernel[8] = OCTANT_KERNELS( BVH4_CPU::Intersect );
+const BVH4_CPU::OcclusionKernel BVH4_CPU::occlusionKernel[8] = OCTANT_KERNELS( BVH4_CPU::IsOccluded );
+
+// Ray stream traversal for the 4-way BVH; see BVH8_CPU::IntersectStream. This
+// layout has no precomputed child order, so children are sorted per node by the
+// position of their near corner along the octant's diagonal.
+void BVH4_CPU::IntersectStream( Ray* rays, const uint32_t count ) const
+{
+	if (isTLAS()) { IntersectBatch( rays, count ); return; } // instances are traced one ray at a time.
+	if (count == 0) return;
+	enum { LEAF_BIT = 1u << 31 }; // task refers to the triangles of a child: (node << 2) + lane
+	struct Task { uint32_t node, first, count; } task[256];
+	uint32_t* order = (uint32_t*)AlignedAlloc( count * sizeof( uint32_t ) );
+	uint8_t* hitMask = (uint8_t*)AlignedAlloc( count );
+	uint32_t capacity = count * 4, * list = (uint32_t*)AlignedAlloc( capacity * sizeof( uint32_t ) );
+	SortRays( rays, count, order );
+	const __m128 zero4 = _mm_setzero_ps();
+	for (uint32_t groupStart = 0, groupEnd; groupStart < count; groupStart = groupEnd)
+	{
+		const uint32_t octant = RayOctant( rays[order[groupStart]] );
+		const bool posX = octant & 1, posY = octant & 2, posZ = octant & 4;
+		for (groupEnd = groupStart + 1; groupEnd < count; groupEnd++) if (RayOctant( rays[order[groupEnd]] ) != octant) break;
+		memcpy( list, order + groupStart, (groupEnd - groupStart) * sizeof( uint32_t ) );
+		Task t = { 0, 0, groupEnd - groupStart };
+		uint32_t taskPtr = 0;
+		while (1)
+		{
+			uint32_t top = t.first + t.count; // lists beyond this belong to finished tasks.
+			if (t.node & LEAF_BIT)
+			{
+				const BVHNode& node = bvh4Node[(t.node & ~LEAF_BIT) >> 2];
+				const uint32_t lane = t.node & 3, first = node.childFirst[lane], triCount = node.triCount[lane];
+				for (uint32_t i = 0; i < t.count; i++)
+				{
+					Ray& ray = rays[list[t.first + i]];
+					__m128 t4 = _mm_set1_ps( ray.hit.t );
+					for (uint32_t j = 0; j < triCount; j++) IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
+				}
+			}
+			else
+			{
+				const BVHNode& node = bvh4Node[t.node];
+				const __m128 nearx4 = posX ? node.xmin4 : node.xmax4, farx4 = posX ? node.xmax4 : node.xmin4;
+				const __m128 neary4 = posY ? node.ymin4 : node.ymax4, fary4 = posY ? node.ymax4 : node.ymin4;
+				const __m128 nearz4 = posZ ? node.zmin4 : node.zmax4, farz4 = posZ ? node.zmax4 : node.zmin4;
+				uint32_t validMask = 0, laneCount[4] = { 0 }, offset[4], lanes[4];
+				float dist[4];
+				for (uint32_t i = 0; i < 4; i++)
+				{
+					if (node.triCount[i] + node.childFirst[i] > 0) validMask |= 1 << i;
+					dist[i] = (posX ? LANE( nearx4, i ) : -LANE( nearx4, i )) + (posY ? LANE( neary4, i ) : -LANE( neary4, i )) +
+						(posZ ? LANE( nearz4, i ) : -LANE( nearz4, i ));
+					lanes[i] = i;
+				}
+				for (uint32_t i = 0; i < t.count; i++)
+				{
+					const Ray& ray = rays[list[t.first + i]];
+					const __m128 ox4 = _mm_set1_ps( ray.O.x ), rdx4 = _mm_set1_ps( ray.rD.x );
+					const __m128 oy4 = _mm_set1_ps( ray.O.y ), rdy4 = _mm_set1_ps( ray.rD.y );
+					const __m128 oz4 = _mm_set1_ps( ray.O.z ), rdz4 = _mm_set1_ps( ray.rD.z );
+					const __m128 tx1 = _mm_mul_ps( _mm_sub_ps( nearx4, ox4 ), rdx4 ), tx2 = _mm_mul_ps( _mm_sub_ps( farx4, ox4 ), rdx4 );
+					const __m128 ty1 = _mm_mul_ps( _mm_sub_ps( neary4, oy4 ), rdy4 ), ty2 = _mm_mul_ps( _mm_sub_ps( fary4, oy4 ), rdy4 );
+					const __m128 tz1 = _mm_mul_ps( _mm_sub_ps( nearz4, oz4 ), rdz4 ), tz2 = _mm_mul_ps( _mm_sub_ps( farz4, oz4 ), rdz4 );
+					const __m128 tmin = _mm_max_ps( _mm_max_ps( _mm_max_ps( zero4, tx1 ), ty1 ), tz1 );
+					__m128 tmax = _mm_min_ps( _mm_min_ps( _mm_min_ps( tx2, _mm_set1_ps( ray.hit.t ) ), ty2 ), tz2 );
+#ifdef WATERTIGHT_TRIS
+					tmax = _mm_mul_ps( tmax, _mm_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
+					uint32_t mask = _mm_movemask_ps( _mm_cmple_ps( tmin, tmax ) ) & validMask;
+					hitMask[i] = (uint8_t)mask;
+					for (; mask; mask &= mask - 1) laneCount[__bfind( mask & (0 - mask) )]++;
+				}
+				// sort lanes far-to-near, allocate the child ray lists and push the children.
+				for (uint32_t i = 1; i < 4; i++) for (uint32_t j = i; j > 0 && dist[lanes[j]] > dist[lanes[j - 1]]; j--)
+					tinybvh_swap( lanes[j], lanes[j - 1] );
+				if (top + t.count * 4 > capacity)
+				{
+					uint32_t* newList = (uint32_t*)AlignedAlloc( (capacity = (top + t.count * 4) * 2) * sizeof( uint32_t ) );
+					memcpy( newList, list, top * sizeof( uint32_t ) );
+					AlignedFree( list );
+					list = newList;
+				}
+				const uint32_t listFirst = t.first, listCount = t.count;
+				for (uint32_t p = 0; p < 4; p++)
+				{
+					const uint32_t lane = lanes[p];
+					if (!laneCount[lane]) continue;
+					const uint32_t childRef = node.triCount[lane] ? (LEAF_BIT + (t.node << 2) + lane) : node.childFirst[lane];
+					offset[lane] = top, task[taskPtr++] = { childRef, top, laneCount[lane] };
+					top += laneCount[lane];
+				}
+				for (uint32_t i = 0; i < listCount; i++)
+					for (uint32_t mask = hitMask[i]; mask; mask &= mask - 1)
+						list[offset[__bfind( mask & (0 - mask) )]++] = list[listFirst + i];
+			}
+			if (!taskPtr) break;
+			t = task[--taskPtr];
+		}
+	}
+	AlignedFree( list );
+	AlignedFree( hitMask );
+	AlignedFree( order );
+}
+
 #ifdef BVH_USEAVX2
 
 ALIGNED( 64 ) static const uint32_t idxLUT4[16] = { 0, 0, 1, 256, 2, 512, 513, 131328, 3, 768, 769, 196864, 770,
@@ -6278,7 +9102,7 @@ int32_t BVH4_AVX2_WIP::Intersect( Ray& ray ) const
 
 bool BVH4_AVX2_WIP::IsOccluded( const Ray& ray ) const
 {
-	const bool posX = ray.D.x > 0, posY = ray.D.y > 0, posZ = ray.D.z > 0;
+	const bool posX = ray.rD.x > 0, posY = ray.rD.y > 0, posZ = ray.rD.z > 0;
 	if (!posX) goto negx;
 	if (posY) { if (posZ) return IsOccluded<true, true, true>( ray ); else return IsOccluded<true, true, false>( ray ); }
 	if (posZ) return IsOccluded<true, false, true>( ray ); else return IsOccluded<true, false, false>( ray );
@@ -6401,19 +9225,25 @@ ALIGNED( 64 ) static const uint64_t idxLUT[256] = {
 
 int32_t BVH8_CPU::Intersect( Ray& ray ) const
 {
-	const bool posX = ray.D.x > 0, posY = ray.D.y > 0, posZ = ray.D.z > 0;
-	if (!posX) goto negx;
-	if (posY) { if (posZ) return Intersect<true, true, true>( ray ); else return Intersect<true, true, false>( ray ); }
-	if (posZ) return Intersect<true, false, true>( ray ); else return Intersect<true, false, false>( ray );
-negx:
-	if (posY) { if (posZ) return Intersect<false, true, true>( ray ); else return Intersect<false, true, false>( ray ); }
-	if (posZ) return Intersect<false, false, true>( ray ); else return Intersect<false, false, false>( ray );
+	return (this->*intersectKernel[RayOctant( ray )])(ray);
 }
 
 template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray ) const
 {
+#ifdef BVH8_CPU_GROUP_STACK
+#ifdef BVH8_CPU_SHORT_STACK
+	constexpr int32_t stackSize = BVH8_CPU_SHORT_STACK;
+	uint8_t trail[64]; // lane taken at each level of the current path
+	int32_t level = 0, dropLevel = -1, restartLevel = -1;
+#else
+	constexpr int32_t stackSize = 64; // at most one entry per level
+#endif
+	// entry: node and a mask of its unvisited children, in octant order; level in bits 8..
+	struct Group { int32_t node; uint32_t mask; } groupStack[stackSize];
+#else
 	ALIGNED( 64 ) int32_t nodeStack[64];
 	ALIGNED( 64 ) float distStack[64];
+#endif
 	const __m256 ox8 = _mm256_set1_ps( ray.O.x ), rdx8 = _mm256_set1_ps( ray.rD.x );
 	const __m256 oy8 = _mm256_set1_ps( ray.O.y ), rdy8 = _mm256_set1_ps( ray.rD.y );
 	const __m256 oz8 = _mm256_set1_ps( ray.O.z ), rdz8 = _mm256_set1_ps( ray.rD.z );
@@ -6434,7 +9264,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 	if (ray.D[kz] < 0) std::swap( kx, ky );
 	const __m128 sx4 = _mm_set1_ps( ray.D[kx] * inv_dir_kz ), sy4 = _mm_set1_ps( ray.D[ky] * inv_dir_kz ), sz4 = _mm_set1_ps( inv_dir_kz );
 	const __m128 ox4 = _mm_set1_ps( ray.O[kx] ), oy4 = _mm_set1_ps( ray.O[ky] ), oz4 = _mm_set1_ps( ray.O[kz] );
-	const __m128 one4 = _mm_set1_ps( 1.0f ), zero4 = _mm_setzero_ps();
+	const __m128 zero4 = _mm_setzero_ps();
 #else
 	const __m128 dx4 = _mm_set1_ps( ray.D.x ), dy4 = _mm_set1_ps( ray.D.y ), dz4 = _mm_set1_ps( ray.D.z );
 	const __m128 epsNeg4 = _mm_set1_ps( -0.000001f ), eps4 = _mm_set1_ps( 0.000001f ), one4 = _mm_set1_ps( 1.0f ), zero4 = _mm_setzero_ps();
@@ -6442,6 +9272,45 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 #ifdef _DEBUG
 	// sorry, not even this can be tolerated in this function. Only in debug.
 	uint32_t steps = 0;
+#endif
+#ifdef BVH8_CPU_GROUP_STACK
+	const auto push = [&]( const int32_t node, const uint32_t mask ) {
+	#ifdef BVH8_CPU_SHORT_STACK
+		if (stackPtr == stackSize) // drop the oldest entry; restart covers it later
+			dropLevel = groupStack[0].mask >> 8, memmove( groupStack, groupStack + 1, (stackSize - 1) * sizeof( Group ) ), stackPtr--;
+		groupStack[stackPtr++] = { node, mask + (level << 8) };
+	#else
+		groupStack[stackPtr++] = { node, mask };
+	#endif
+	};
+	const auto pop = [&]() -> bool {
+		if (!stackPtr)
+		{
+		#ifdef BVH8_CPU_SHORT_STACK
+			if (dropLevel < 0) return false;
+			restartLevel = dropLevel, dropLevel = -1, level = 0, nodeIdx = 0;
+			return true;
+		#else
+			return false;
+		#endif
+		}
+		// children are visited from the highest lane down, as with the regular stack.
+		Group& group = groupStack[stackPtr - 1];
+		const uint32_t lane = __bfind( group.mask & 255 );
+		group.mask -= 1 << lane;
+		if (!(group.mask & 255)) stackPtr--;
+	#ifdef BVH8_CPU_SHORT_STACK
+		level = group.mask >> 8, trail[level++] = (uint8_t)lane;
+	#endif
+	#ifdef BVH8_CPU_COMPACT
+		const BVHNodeCompact* parent = (BVHNodeCompact*)(bvh8Data + group.node);
+	#else
+		const BVHNode* parent = (BVHNode*)(bvh8Data + group.node);
+	#endif
+		const uint32_t slot = (((const uint32_t*)&parent->perm8)[lane] >> signShift) & 7;
+		nodeIdx = ((const int32_t*)&parent->child8)[slot];
+		return true;
+	};
 #endif
 	while (1)
 	{
@@ -6478,10 +9347,16 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 			const __m256 tzMin = _mm256_min_ps( tz1, tz2 ), tzMax = _mm256_max_ps( tz1, tz2 );
 			__m256 tmin = _mm256_max_ps( _mm256_max_ps( _mm256_max_ps( zero8, txMin ), tyMin ), tzMin );
 			__m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_min_ps( txMax, t8 ), tyMax ), tzMax );
+#ifdef WATERTIGHT_TRIS
+			tmax = _mm256_mul_ps( tmax, _mm256_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
 			tmin = _mm256_permutevar8x32_ps( tmin, index ), tmax = _mm256_permutevar8x32_ps( tmax, index );
 			c8 = _mm256_permutevar8x32_epi32( c8, index );
 			const __m256 childMask = _mm256_cmp_ps( _mm256_cvtepi32_ps( c8 ), zero8, _CMP_NEQ_UQ );
 			const uint32_t mask = _mm256_movemask_ps( _mm256_and_ps( _mm256_cmp_ps( tmin, tmax, _CMP_LE_OQ ), childMask ) );
+		#ifdef BVH8_CPU_GROUP_STACK
+			uint32_t hits = mask;
+		#else
 			const uint32_t validNodes = __popc( mask );
 			if (validNodes > 1)
 			{
@@ -6504,6 +9379,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 				if (!stackPtr) goto the_end;
 				nodeIdx = nodeStack[--stackPtr];
 			}
+		#endif
 		#else
 			const BVHNode* n = (BVHNode*)(bvh8Data + nodeIdx);
 			const __m256i index = _mm256_srli_epi32( n->perm8, signShift );
@@ -6516,10 +9392,17 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 			const __m256 tz2 = _mm256_mul_ps( _mm256_sub_ps( posZ ? n->zmax8 : n->zmin8, oz8 ), rdz8 );
 			__m256 tmin = _mm256_max_ps( _mm256_max_ps( _mm256_max_ps( zero8, tx1 ), ty1 ), tz1 );
 			__m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_min_ps( tx2, t8 ), ty2 ), tz2 );
+#ifdef WATERTIGHT_TRIS
+			tmax = _mm256_mul_ps( tmax, _mm256_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
 			tmin = _mm256_permutevar8x32_ps( tmin, index );
 			tmax = _mm256_permutevar8x32_ps( tmax, index );
 			const __m256i mask8 = _mm256_cmpgt_epi32( _mm256_castps_si256( tmin ), _mm256_castps_si256( tmax ) );
 			const uint32_t mask = _mm256_movemask_ps( _mm256_castsi256_ps( mask8 ) );
+		#ifdef BVH8_CPU_GROUP_STACK
+			uint32_t hits = 255 - mask;
+			c8 = _mm256_permutevar8x32_epi32( c8, index );
+		#else
 			const uint32_t invalidNodes = __popc( mask );
 			if (invalidNodes < 7)
 			{
@@ -6545,6 +9428,47 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 				nodeIdx = nodeStack[--stackPtr];
 			}
 		#endif
+		#endif
+		#ifdef BVH8_CPU_GROUP_STACK
+		#ifdef BVH8_CPU_SHORT_STACK
+			if (level <= restartLevel)
+			{
+				// restart: follow the trail; lanes above the trail lane were visited before.
+				const uint32_t lane = trail[level], pending = hits & ((1u << lane) - 1);
+				if (level < restartLevel && (hits >> lane) & 1)
+				{
+					if (pending) push( nodeIdx, pending );
+					c8s = c8, nodeIdx = cs[lane], level++;
+					continue;
+				}
+				hits = pending, restartLevel = -1;
+			}
+		#endif
+			if (!hits)
+			{
+				if (!pop()) goto the_end;
+				continue;
+			}
+			const uint32_t lane = __bfind( hits );
+			if (hits -= 1 << lane) push( nodeIdx, hits );
+		#ifdef BVH8_CPU_SHORT_STACK
+			trail[level++] = (uint8_t)lane;
+		#endif
+			c8s = c8, nodeIdx = cs[lane];
+		#endif
+		}
+	if (instList)
+		{
+			// TLAS leaf: up to four instances, stored by index.
+			IntersectInstances( ray, instList, instData, blasList, instIdx + (nodeIdx & 0x1fffffff), ((nodeIdx >> 29) & 3) + 1 );
+			t8 = _mm256_set1_ps( ray.hit.t );
+		#ifdef BVH8_CPU_GROUP_STACK
+			if (!pop()) break;
+		#else
+			if (!stackPtr) break;
+			nodeIdx = nodeStack[--stackPtr];
+		#endif
+			continue;
 		}
 	#ifdef BVH8_WOOP_TRIS
 		// Modified Woop intersector, based on Embree 4.3.3, kernels/geometry/triangle_intersector_woop.h
@@ -6579,7 +9503,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 				// update hit record
 				const __m128 _d4 = dist4;
 				const float t = ((float*)&_d4)[lane];
-				const __m128 _u4 = _mm_mul_ps( U, inv_det ), _v4 = _mm_mul_ps( V, inv_det );
+				const __m128 _u4 = _mm_mul_ps( V, inv_det ), _v4 = _mm_mul_ps( W, inv_det );
 				ray.hit.t = t, ray.hit.u = ((float*)&_u4)[lane], ray.hit.v = ((float*)&_v4)[lane];
 			#if INST_IDX_BITS == 32
 				ray.hit.prim = leaf->primIdx[lane];
@@ -6588,9 +9512,10 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 				ray.hit.prim = leaf->primIdx[lane] + ray.instIdx;
 			#endif
 				t8 = _mm256_set1_ps( t );
+			#ifndef BVH8_CPU_GROUP_STACK
 				// compress stack
 				uint32_t outStackPtr = 0;
-				for (uint32_t i = 0; i < stackPtr; i += 8)
+				for (uint32_t i = 0; i < (uint32_t)stackPtr; i += 8)
 				{
 					__m256i node8 = _mm256_load_si256( (__m256i*)(nodeStack + i) );
 					__m256 dist8 = _mm256_load_ps( (float*)(distStack + i) );
@@ -6604,6 +9529,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 					outStackPtr += __popc( (255 - mask) & validMask );
 				}
 				stackPtr = outStackPtr;
+			#endif
 			}
 		}
 	#else
@@ -6650,6 +9576,7 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 				ray.hit.prim = leaf->primIdx[lane] + ray.instIdx;
 			#endif
 				t8 = _mm256_set1_ps( t );
+			#ifndef BVH8_CPU_GROUP_STACK
 				// compress stack
 				uint32_t outStackPtr = 0;
 				for (int32_t i = 0; i < stackPtr; i += 8)
@@ -6666,11 +9593,16 @@ template <bool posX, bool posY, bool posZ> int32_t BVH8_CPU::Intersect( Ray& ray
 					outStackPtr += __popc( (255 - mask) & validMask );
 				}
 				stackPtr = outStackPtr;
+			#endif
 			}
 		}
 	#endif
+	#ifdef BVH8_CPU_GROUP_STACK
+		if (!pop()) break;
+	#else
 		if (!stackPtr) break;
 		nodeIdx = nodeStack[--stackPtr];
+	#endif
 	}
 the_end:
 #ifdef _DEBUG
@@ -6682,13 +9614,7 @@ the_end:
 
 bool BVH8_CPU::IsOccluded( const Ray& ray ) const
 {
-	const bool posX = ray.D.x > 0, posY = ray.D.y > 0, posZ = ray.D.z > 0;
-	if (!posX) goto negx;
-	if (posY) { if (posZ) return IsOccluded<true, true, true>( ray ); else return IsOccluded<true, true, false>( ray ); }
-	if (posZ) return IsOccluded<true, false, true>( ray ); else return IsOccluded<true, false, false>( ray );
-negx:
-	if (posY) { if (posZ) return IsOccluded<false, true, true>( ray ); else return IsOccluded<false, true, false>( ray ); }
-	if (posZ) return IsOccluded<false, false, true>( ray ); else return IsOccluded<false, false, false>( ray );
+	return (this->*occlusionKernel[RayOctant( ray )])(ray);
 }
 
 template <bool posX, bool posY, bool posZ> bool BVH8_CPU::IsOccluded( const Ray& ray ) const
@@ -6713,7 +9639,7 @@ template <bool posX, bool posY, bool posZ> bool BVH8_CPU::IsOccluded( const Ray&
 	if (ray.D[kz] < 0) std::swap( kx, ky );
 	const __m128 sx4 = _mm_set1_ps( ray.D[kx] * inv_dir_kz ), sy4 = _mm_set1_ps( ray.D[ky] * inv_dir_kz ), sz4 = _mm_set1_ps( inv_dir_kz );
 	const __m128 ox4 = _mm_set1_ps( ray.O[kx] ), oy4 = _mm_set1_ps( ray.O[ky] ), oz4 = _mm_set1_ps( ray.O[kz] );
-	const __m128 one4 = _mm_set1_ps( 1.0f ), zero4 = _mm_setzero_ps();
+	const __m128 zero4 = _mm_setzero_ps();
 #else
 	const __m128 dx4 = _mm_set1_ps( ray.D.x ), dy4 = _mm_set1_ps( ray.D.y ), dz4 = _mm_set1_ps( ray.D.z );
 	const __m128 epsNeg4 = _mm_set1_ps( -0.000001f ), eps4 = _mm_set1_ps( 0.000001f ), t4 = _mm_set1_ps( ray.hit.t );
@@ -6751,7 +9677,10 @@ template <bool posX, bool posY, bool posZ> bool BVH8_CPU::IsOccluded( const Ray&
 			const __m256 tyMin = _mm256_min_ps( ty1, ty2 ), tyMax = _mm256_max_ps( ty1, ty2 );
 			const __m256 tzMin = _mm256_min_ps( tz1, tz2 ), tzMax = _mm256_max_ps( tz1, tz2 );
 			const __m256 tmin = _mm256_max_ps( _mm256_max_ps( _mm256_max_ps( zero8, txMin ), tyMin ), tzMin );
-			const __m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_min_ps( txMax, t8 ), tyMax ), tzMax );
+			__m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_min_ps( txMax, t8 ), tyMax ), tzMax );
+#ifdef WATERTIGHT_TRIS
+			tmax = _mm256_mul_ps( tmax, _mm256_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
 			const __m256 mask8 = _mm256_and_ps( _mm256_cmp_ps( tmin, tmax, _CMP_LE_OQ ), childMask );
 			const uint32_t mask = _mm256_movemask_ps( mask8 );
 			if (mask)
@@ -6778,7 +9707,10 @@ template <bool posX, bool posY, bool posZ> bool BVH8_CPU::IsOccluded( const Ray&
 			const __m256 ty2 = _mm256_mul_ps( _mm256_sub_ps( posY ? n->ymax8 : n->ymin8, oy8 ), rdy8 );
 			const __m256 tz2 = _mm256_mul_ps( _mm256_sub_ps( posZ ? n->zmax8 : n->zmin8, oz8 ), rdz8 );
 			const __m256 tmin = _mm256_max_ps( _mm256_max_ps( _mm256_max_ps( _mm256_setzero_ps(), tx1 ), ty1 ), tz1 );
-			const __m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_min_ps( tx2, t8 ), ty2 ), tz2 );
+			__m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_min_ps( tx2, t8 ), ty2 ), tz2 );
+#ifdef WATERTIGHT_TRIS
+			tmax = _mm256_mul_ps( tmax, _mm256_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
 			const __m256i mask8 = _mm256_cmpgt_epi32( _mm256_castps_si256( tmin ), _mm256_castps_si256( tmax ) );
 			const uint32_t mask = _mm256_movemask_ps( _mm256_castsi256_ps( mask8 ) );
 			const uint32_t invalidNodes = __popc( mask );
@@ -6803,6 +9735,14 @@ template <bool posX, bool posY, bool posZ> bool BVH8_CPU::IsOccluded( const Ray&
 			}
 		#endif
 		}
+	if (instList)
+		{
+			// TLAS leaf: up to four instances, stored by index.
+			if (InstancesOcclude( ray, instList, instData, blasList, instIdx + (nodeIdx & 0x1fffffff), ((nodeIdx >> 29) & 3) + 1 )) return true;
+			if (!stackPtr) return false;
+			nodeIdx = nodeStack[--stackPtr];
+			continue;
+		}
 	#ifdef BVH8_WOOP_TRIS
 		// Modified Woop intersector, based on Embree 4.3.3, kernels/geometry/triangle_intersector_woop.h
 		const BVHWoop4Leaf* leaf = (BVHWoop4Leaf*)(bvh8Data + (nodeIdx & 0x1fffffff));
@@ -6857,6 +9797,496 @@ template <bool posX, bool posY, bool posZ> bool BVH8_CPU::IsOccluded( const Ray&
 	}
 }
 
+const BVH8_CPU::IntersectKernel BVH8_CPU::intersectKernel[8] = OCTANT_KERNELS( BVH8_CPU::Intersect );
+const BVH8_CPU::OcclusionKernel BVH8_CPU::occlusionKernel[8] = OCTANT_KERNELS( BVH8_CPU::IsOccluded );
+
+// Ray stream traversal: a batch of arbitrary rays is sorted by direction octant
+// and origin, after which the rays of each octant traverse the tree together.
+// A task holds a node and the list of rays that reached it. At an interior node
+// each ray is tested against all eight children at once and added to the lists
+// of the children it hits, which are then pushed far-to-near using the octant's
+// child permutation. Based on "Dynamic Ray Stream Traversal", Barringer &
+// Akenine-Möller, 2014.
+inline void IntersectWoop4Leaf( Ray& ray, const BVHWoop4Leaf* leaf )
+{
+	// watertight intersection of four triangles, as in BVH8_CPU::Intersect
+	const uint32_t kz = tinybvh_maxdim( ray.D );
+	uint32_t kx = (1 << kz) & 3, ky = (1 << kx) & 3;
+	const float inv_dir_kz = ray.rD[kz];
+	if (ray.D[kz] < 0) std::swap( kx, ky );
+	const __m128 sx4 = _mm_set1_ps( ray.D[kx] * inv_dir_kz ), sy4 = _mm_set1_ps( ray.D[ky] * inv_dir_kz ), sz4 = _mm_set1_ps( inv_dir_kz );
+	const __m128 ox4 = _mm_set1_ps( ray.O[kx] ), oy4 = _mm_set1_ps( ray.O[ky] ), oz4 = _mm_set1_ps( ray.O[kz] );
+	const __m128 zero4 = _mm_setzero_ps(), t4 = _mm_set1_ps( ray.hit.t );
+	const __m128 Akx = _mm_sub_ps( leaf->v04[kx], ox4 ), Aky = _mm_sub_ps( leaf->v04[ky], oy4 ), Akz = _mm_sub_ps( leaf->v04[kz], oz4 );
+	const __m128 Bkx = _mm_sub_ps( leaf->v14[kx], ox4 ), Bky = _mm_sub_ps( leaf->v14[ky], oy4 ), Bkz = _mm_sub_ps( leaf->v14[kz], oz4 );
+	const __m128 Ckx = _mm_sub_ps( leaf->v24[kx], ox4 ), Cky = _mm_sub_ps( leaf->v24[ky], oy4 ), Ckz = _mm_sub_ps( leaf->v24[kz], oz4 );
+	const __m128 Ax = _mm_fnmadd_ps( sx4, Akz, Akx ), Ay = _mm_fnmadd_ps( sy4, Akz, Aky );
+	const __m128 Bx = _mm_fnmadd_ps( sx4, Bkz, Bkx ), By = _mm_fnmadd_ps( sy4, Bkz, Bky );
+	const __m128 Cx = _mm_fnmadd_ps( sx4, Ckz, Ckx ), Cy = _mm_fnmadd_ps( sy4, Ckz, Cky );
+	const __m128 U0 = _mm_mul_ps( Cx, By ), U1 = _mm_mul_ps( Cy, Bx ), V0 = _mm_mul_ps( Ax, Cy );
+	const __m128 V1 = _mm_mul_ps( Ay, Cx ), W0 = _mm_mul_ps( Bx, Ay ), W1 = _mm_mul_ps( By, Ax );
+	const __m128 m1 = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( U0, U1 ), _mm_cmpge_ps( V0, V1 ) ), _mm_cmpge_ps( W0, W1 ) );
+	const __m128 m2 = _mm_and_ps( _mm_and_ps( _mm_cmple_ps( U0, U1 ), _mm_cmple_ps( V0, V1 ) ), _mm_cmple_ps( W0, W1 ) );
+	__m128 mask = _mm_or_ps( m1, m2 );
+	if (!_mm_movemask_ps( mask )) return;
+	const __m128 U = _mm_sub_ps( U0, U1 ), V = _mm_sub_ps( V0, V1 ), W = _mm_sub_ps( W0, W1 ), det = _mm_add_ps( _mm_add_ps( U, V ), W );
+	mask = _mm_and_ps( mask, _mm_cmpneq_ps( det, zero4 ) );
+	const __m128 inv_det = fastrcp4( det );
+	const __m128 Az = _mm_mul_ps( sz4, Akz ), Bz = _mm_mul_ps( sz4, Bkz ), Cz = _mm_mul_ps( sz4, Ckz );
+	const __m128 T = _mm_fmadd_ps( U, Az, _mm_fmadd_ps( V, Bz, _mm_mul_ps( W, Cz ) ) ), ta4 = _mm_mul_ps( T, inv_det );
+	mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmplt_ps( zero4, ta4 ), _mm_cmple_ps( ta4, t4 ) ) );
+	if (!_mm_movemask_ps( mask )) return;
+	const __m128 dist4 = _mm_blendv_ps( _mm_set1_ps( 1e30f ), ta4, mask );
+	const __m128 a = _mm_min_ps( dist4, _mm_shuffle_ps( dist4, dist4, _MM_SHUFFLE( 2, 1, 0, 3 ) ) );
+	const __m128 c = _mm_min_ps( a, _mm_shuffle_ps( a, a, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	const uint32_t lane = __bfind( _mm_movemask_ps( _mm_cmpeq_ps( c, dist4 ) ) );
+	const __m128 _u4 = _mm_mul_ps( V, inv_det ), _v4 = _mm_mul_ps( W, inv_det ); // Moeller-Trumbore convention
+	ray.hit.t = LANE( dist4, lane ), ray.hit.u = LANE( _u4, lane ), ray.hit.v = LANE( _v4, lane );
+#if INST_IDX_BITS == 32
+	ray.hit.prim = leaf->primIdx[lane];
+	ray.hit.inst = ray.instIdx;
+#else
+	ray.hit.prim = leaf->primIdx[lane] + ray.instIdx;
+#endif
+}
+inline bool Woop4LeafOccludes( const Ray& ray, const BVHWoop4Leaf* leaf )
+{
+	// any-hit version of IntersectWoop4Leaf
+	const uint32_t kz = tinybvh_maxdim( ray.D );
+	uint32_t kx = (1 << kz) & 3, ky = (1 << kx) & 3;
+	const float inv_dir_kz = ray.rD[kz];
+	if (ray.D[kz] < 0) std::swap( kx, ky );
+	const __m128 sx4 = _mm_set1_ps( ray.D[kx] * inv_dir_kz ), sy4 = _mm_set1_ps( ray.D[ky] * inv_dir_kz ), sz4 = _mm_set1_ps( inv_dir_kz );
+	const __m128 ox4 = _mm_set1_ps( ray.O[kx] ), oy4 = _mm_set1_ps( ray.O[ky] ), oz4 = _mm_set1_ps( ray.O[kz] );
+	const __m128 zero4 = _mm_setzero_ps(), t4 = _mm_set1_ps( ray.hit.t );
+	const __m128 Akx = _mm_sub_ps( leaf->v04[kx], ox4 ), Aky = _mm_sub_ps( leaf->v04[ky], oy4 ), Akz = _mm_sub_ps( leaf->v04[kz], oz4 );
+	const __m128 Bkx = _mm_sub_ps( leaf->v14[kx], ox4 ), Bky = _mm_sub_ps( leaf->v14[ky], oy4 ), Bkz = _mm_sub_ps( leaf->v14[kz], oz4 );
+	const __m128 Ckx = _mm_sub_ps( leaf->v24[kx], ox4 ), Cky = _mm_sub_ps( leaf->v24[ky], oy4 ), Ckz = _mm_sub_ps( leaf->v24[kz], oz4 );
+	const __m128 Ax = _mm_fnmadd_ps( sx4, Akz, Akx ), Ay = _mm_fnmadd_ps( sy4, Akz, Aky );
+	const __m128 Bx = _mm_fnmadd_ps( sx4, Bkz, Bkx ), By = _mm_fnmadd_ps( sy4, Bkz, Bky );
+	const __m128 Cx = _mm_fnmadd_ps( sx4, Ckz, Ckx ), Cy = _mm_fnmadd_ps( sy4, Ckz, Cky );
+	const __m128 U0 = _mm_mul_ps( Cx, By ), U1 = _mm_mul_ps( Cy, Bx ), V0 = _mm_mul_ps( Ax, Cy );
+	const __m128 V1 = _mm_mul_ps( Ay, Cx ), W0 = _mm_mul_ps( Bx, Ay ), W1 = _mm_mul_ps( By, Ax );
+	const __m128 m1 = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( U0, U1 ), _mm_cmpge_ps( V0, V1 ) ), _mm_cmpge_ps( W0, W1 ) );
+	const __m128 m2 = _mm_and_ps( _mm_and_ps( _mm_cmple_ps( U0, U1 ), _mm_cmple_ps( V0, V1 ) ), _mm_cmple_ps( W0, W1 ) );
+	__m128 mask = _mm_or_ps( m1, m2 );
+	if (!_mm_movemask_ps( mask )) return false;
+	const __m128 U = _mm_sub_ps( U0, U1 ), V = _mm_sub_ps( V0, V1 ), W = _mm_sub_ps( W0, W1 ), det = _mm_add_ps( _mm_add_ps( U, V ), W );
+	mask = _mm_and_ps( mask, _mm_cmpneq_ps( det, zero4 ) );
+	const __m128 Az = _mm_mul_ps( sz4, Akz ), Bz = _mm_mul_ps( sz4, Bkz ), Cz = _mm_mul_ps( sz4, Ckz );
+	const __m128 T = _mm_fmadd_ps( U, Az, _mm_fmadd_ps( V, Bz, _mm_mul_ps( W, Cz ) ) ), ta4 = _mm_mul_ps( T, fastrcp4( det ) );
+	return _mm_movemask_ps( _mm_and_ps( mask, _mm_and_ps( _mm_cmplt_ps( zero4, ta4 ), _mm_cmplt_ps( ta4, t4 ) ) ) ) != 0;
+}
+inline void IntersectTri4Leaf( Ray& ray, const BVHTri4Leaf* leaf )
+{
+	// Moeller-Trumbore ray/triangle intersection algorithm for four triangles
+	const __m128 dx4 = _mm_set1_ps( ray.D.x ), dy4 = _mm_set1_ps( ray.D.y ), dz4 = _mm_set1_ps( ray.D.z );
+	const __m128 epsNeg4 = _mm_set1_ps( -0.000001f ), eps4 = _mm_set1_ps( 0.000001f ), one4 = _mm_set1_ps( 1.0f ), zero4 = _mm_setzero_ps();
+	const __m128 hx4 = _mm_fmsub_ps( dy4, leaf->e2z4, _mm_mul_ps( dz4, leaf->e2y4 ) );
+	const __m128 hy4 = _mm_fmsub_ps( dz4, leaf->e2x4, _mm_mul_ps( dx4, leaf->e2z4 ) );
+	const __m128 hz4 = _mm_fmsub_ps( dx4, leaf->e2y4, _mm_mul_ps( dy4, leaf->e2x4 ) );
+	const __m128 sx4 = _mm_sub_ps( _mm_set1_ps( ray.O.x ), leaf->v0x4 );
+	const __m128 sy4 = _mm_sub_ps( _mm_set1_ps( ray.O.y ), leaf->v0y4 );
+	const __m128 sz4 = _mm_sub_ps( _mm_set1_ps( ray.O.z ), leaf->v0z4 );
+	const __m128 det4 = _mm_fmadd_ps( leaf->e1z4, hz4, _mm_fmadd_ps( leaf->e1x4, hx4, _mm_mul_ps( leaf->e1y4, hy4 ) ) );
+	const __m128 mask1 = _mm_or_ps( _mm_cmple_ps( det4, epsNeg4 ), _mm_cmpge_ps( det4, eps4 ) );
+	const __m128 inv_det4 = fastrcp4( det4 );
+	const __m128 u4 = _mm_mul_ps( _mm_fmadd_ps( sz4, hz4, _mm_fmadd_ps( sx4, hx4, _mm_mul_ps( sy4, hy4 ) ) ), inv_det4 );
+	const __m128 qz4 = _mm_fmsub_ps( sx4, leaf->e1y4, _mm_mul_ps( sy4, leaf->e1x4 ) );
+	const __m128 qx4 = _mm_fmsub_ps( sy4, leaf->e1z4, _mm_mul_ps( sz4, leaf->e1y4 ) );
+	const __m128 qy4 = _mm_fmsub_ps( sz4, leaf->e1x4, _mm_mul_ps( sx4, leaf->e1z4 ) );
+	const __m128 v4 = _mm_mul_ps( _mm_fmadd_ps( dz4, qz4, _mm_fmadd_ps( dx4, qx4, _mm_mul_ps( dy4, qy4 ) ) ), inv_det4 );
+	const __m128 mask2 = _mm_and_ps( _mm_cmpge_ps( u4, zero4 ), _mm_cmple_ps( u4, one4 ) );
+	const __m128 mask3 = _mm_and_ps( _mm_cmpge_ps( v4, zero4 ), _mm_cmple_ps( _mm_add_ps( u4, v4 ), one4 ) );
+	const __m128 ta4 = _mm_mul_ps( _mm_fmadd_ps( leaf->e2z4, qz4, _mm_fmadd_ps( leaf->e2x4, qx4, _mm_mul_ps( leaf->e2y4, qy4 ) ) ), inv_det4 );
+	const __m128 inRange = _mm_and_ps( _mm_cmpgt_ps( ta4, zero4 ), _mm_cmplt_ps( ta4, _mm_set1_ps( ray.hit.t ) ) );
+	const __m128 combined = _mm_and_ps( _mm_and_ps( _mm_and_ps( mask1, mask2 ), mask3 ), inRange );
+	if (!_mm_movemask_ps( combined )) return;
+	const __m128 dist4 = _mm_blendv_ps( _mm_set1_ps( 1e30f ), ta4, combined );
+	const __m128 a = _mm_min_ps( dist4, _mm_shuffle_ps( dist4, dist4, _MM_SHUFFLE( 2, 1, 0, 3 ) ) );
+	const __m128 c = _mm_min_ps( a, _mm_shuffle_ps( a, a, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	const uint32_t lane = __bfind( _mm_movemask_ps( _mm_cmpeq_ps( c, dist4 ) ) );
+	ray.hit.t = LANE( dist4, lane ), ray.hit.u = LANE( u4, lane ), ray.hit.v = LANE( v4, lane );
+#if INST_IDX_BITS == 32
+	ray.hit.prim = leaf->primIdx[lane];
+	ray.hit.inst = ray.instIdx;
+#else
+	ray.hit.prim = leaf->primIdx[lane] + ray.instIdx;
+#endif
+}
+inline bool Tri4LeafOccludes( const Ray& ray, const BVHTri4Leaf* leaf )
+{
+	// any-hit version of IntersectTri4Leaf
+	const __m128 dx4 = _mm_set1_ps( ray.D.x ), dy4 = _mm_set1_ps( ray.D.y ), dz4 = _mm_set1_ps( ray.D.z );
+	const __m128 epsNeg4 = _mm_set1_ps( -0.000001f ), eps4 = _mm_set1_ps( 0.000001f ), one4 = _mm_set1_ps( 1.0f ), zero4 = _mm_setzero_ps();
+	const __m128 hx4 = _mm_fmsub_ps( dy4, leaf->e2z4, _mm_mul_ps( dz4, leaf->e2y4 ) );
+	const __m128 hy4 = _mm_fmsub_ps( dz4, leaf->e2x4, _mm_mul_ps( dx4, leaf->e2z4 ) );
+	const __m128 hz4 = _mm_fmsub_ps( dx4, leaf->e2y4, _mm_mul_ps( dy4, leaf->e2x4 ) );
+	const __m128 sx4 = _mm_sub_ps( _mm_set1_ps( ray.O.x ), leaf->v0x4 );
+	const __m128 sy4 = _mm_sub_ps( _mm_set1_ps( ray.O.y ), leaf->v0y4 );
+	const __m128 sz4 = _mm_sub_ps( _mm_set1_ps( ray.O.z ), leaf->v0z4 );
+	const __m128 det4 = _mm_fmadd_ps( leaf->e1z4, hz4, _mm_fmadd_ps( leaf->e1x4, hx4, _mm_mul_ps( leaf->e1y4, hy4 ) ) );
+	const __m128 mask1 = _mm_or_ps( _mm_cmple_ps( det4, epsNeg4 ), _mm_cmpge_ps( det4, eps4 ) );
+	const __m128 inv_det4 = fastrcp4( det4 );
+	const __m128 u4 = _mm_mul_ps( _mm_fmadd_ps( sz4, hz4, _mm_fmadd_ps( sx4, hx4, _mm_mul_ps( sy4, hy4 ) ) ), inv_det4 );
+	const __m128 qz4 = _mm_fmsub_ps( sx4, leaf->e1y4, _mm_mul_ps( sy4, leaf->e1x4 ) );
+	const __m128 qx4 = _mm_fmsub_ps( sy4, leaf->e1z4, _mm_mul_ps( sz4, leaf->e1y4 ) );
+	const __m128 qy4 = _mm_fmsub_ps( sz4, leaf->e1x4, _mm_mul_ps( sx4, leaf->e1z4 ) );
+	const __m128 v4 = _mm_mul_ps( _mm_fmadd_ps( dz4, qz4, _mm_fmadd_ps( dx4, qx4, _mm_mul_ps( dy4, qy4 ) ) ), inv_det4 );
+	const __m128 mask2 = _mm_and_ps( _mm_cmpge_ps( u4, zero4 ), _mm_cmple_ps( u4, one4 ) );
+	const __m128 mask3 = _mm_and_ps( _mm_cmpge_ps( v4, zero4 ), _mm_cmple_ps( _mm_add_ps( u4, v4 ), one4 ) );
+	const __m128 ta4 = _mm_mul_ps( _mm_fmadd_ps( leaf->e2z4, qz4, _mm_fmadd_ps( leaf->e2x4, qx4, _mm_mul_ps( leaf->e2y4, qy4 ) ) ), inv_det4 );
+	const __m128 inRange = _mm_and_ps( _mm_cmpgt_ps( ta4, zero4 ), _mm_cmplt_ps( ta4, _mm_set1_ps( ray.hit.t ) ) );
+	return _mm_movemask_ps( _mm_and_ps( _mm_and_ps( _mm_and_ps( mask1, mask2 ), mask3 ), inRange ) ) != 0;
+}
+
+// Fetch the child bounds of an interior node, dequantizing them for the compact layout.
+inline void LoadChildBounds8( const BVH8_CPU::CacheLine* block, __m256& xmin8, __m256& xmax8, __m256& ymin8, __m256& ymax8, __m256& zmin8, __m256& zmax8 )
+{
+#ifdef BVH8_CPU_COMPACT
+	const BVH8_CPU::BVHNodeCompact* n = (const BVH8_CPU::BVHNodeCompact*)block;
+	const __m256i mantissa8 = _mm256_set1_epi32( 255 << 15 ), exponent8 = _mm256_set1_epi32( 0x3f800000 );
+	const __m256i cbminmax8 = n->cbminmaxyz8;
+	const __m256i bminx8i = _mm256_or_si256( exponent8, _mm256_slli_epi32( _mm256_cvtepu8_epi32( _mm_cvtsi64_si128( n->cbminx8 ) ), 15 ) );
+	const __m256i bmaxx8i = _mm256_or_si256( exponent8, _mm256_and_si256( _mm256_srli_epi32( n->perm8, 9 ), mantissa8 ) );
+	const __m256i bminy8i = _mm256_or_si256( exponent8, _mm256_and_si256( _mm256_srli_epi32( cbminmax8, 9 ), mantissa8 ) );
+	const __m256i bmaxy8i = _mm256_or_si256( exponent8, _mm256_and_si256( _mm256_srli_epi32( cbminmax8, 1 ), mantissa8 ) );
+	const __m256i bminz8i = _mm256_or_si256( exponent8, _mm256_and_si256( _mm256_slli_epi32( cbminmax8, 7 ), mantissa8 ) );
+	const __m256i bmaxz8i = _mm256_or_si256( exponent8, _mm256_and_si256( _mm256_slli_epi32( cbminmax8, 15 ), mantissa8 ) );
+	const __m256 nodeMin8x = _mm256_broadcast_ss( &n->bminx ), nodeExt8x = _mm256_broadcast_ss( &n->bextx );
+	const __m256 nodeMin8y = _mm256_broadcast_ss( &n->bminy ), nodeExt8y = _mm256_broadcast_ss( &n->bexty );
+	const __m256 nodeMin8z = _mm256_broadcast_ss( &n->bminz ), nodeExt8z = _mm256_broadcast_ss( &n->bextz );
+	xmin8 = _mm256_fmadd_ps( nodeExt8x, _mm256_castsi256_ps( bminx8i ), nodeMin8x );
+	xmax8 = _mm256_fmadd_ps( nodeExt8x, _mm256_castsi256_ps( bmaxx8i ), nodeMin8x );
+	ymin8 = _mm256_fmadd_ps( nodeExt8y, _mm256_castsi256_ps( bminy8i ), nodeMin8y );
+	ymax8 = _mm256_fmadd_ps( nodeExt8y, _mm256_castsi256_ps( bmaxy8i ), nodeMin8y );
+	zmin8 = _mm256_fmadd_ps( nodeExt8z, _mm256_castsi256_ps( bminz8i ), nodeMin8z );
+	zmax8 = _mm256_fmadd_ps( nodeExt8z, _mm256_castsi256_ps( bmaxz8i ), nodeMin8z );
+#else
+	const BVH8_CPU::BVHNode* n = (const BVH8_CPU::BVHNode*)block;
+	xmin8 = n->xmin8, xmax8 = n->xmax8, ymin8 = n->ymin8, ymax8 = n->ymax8, zmin8 = n->zmin8, zmax8 = n->zmax8;
+#endif
+}
+
+void BVH8_CPU::IntersectStream( Ray* rays, const uint32_t count ) const
+{
+	if (isTLAS()) { IntersectBatch( rays, count ); return; } // instances are traced one ray at a time.
+	if (count == 0) return;
+	struct Task { uint32_t node, first, count; } task[512];
+	uint32_t* order = (uint32_t*)AlignedAlloc( count * sizeof( uint32_t ) );
+	uint8_t* hitMask = (uint8_t*)AlignedAlloc( count );
+	__m256* entry8 = (__m256*)AlignedAlloc( count * sizeof( __m256 ) );
+	uint32_t capacity = count * 4, * list = (uint32_t*)AlignedAlloc( capacity * sizeof( uint32_t ) );
+	float* entry = (float*)AlignedAlloc( capacity * sizeof( float ) );
+	SortRays( rays, count, order );
+	const __m256 zero8 = _mm256_setzero_ps();
+	for (uint32_t groupStart = 0, groupEnd; groupStart < count; groupStart = groupEnd)
+	{
+		// rays of a single octant form a group.
+		const uint32_t octant = RayOctant( rays[order[groupStart]] ), signShift = octant * 3;
+		const bool posX = octant & 1, posY = octant & 2, posZ = octant & 4;
+		for (groupEnd = groupStart + 1; groupEnd < count; groupEnd++) if (RayOctant( rays[order[groupEnd]] ) != octant) break;
+		memcpy( list, order + groupStart, (groupEnd - groupStart) * sizeof( uint32_t ) );
+		memset( entry, 0, (groupEnd - groupStart) * sizeof( float ) );
+		Task t = { 0, 0, groupEnd - groupStart };
+		uint32_t taskPtr = 0;
+		while (1)
+		{
+			uint32_t top = t.first + t.count; // lists beyond this belong to finished tasks.
+			// drop rays that found a hit closer than the node since it was pushed.
+			uint32_t kept = t.first;
+			for (uint32_t i = t.first; i < top; i++) if (entry[i] < rays[list[i]].hit.t) list[kept] = list[i], entry[kept++] = entry[i];
+			t.count = kept - t.first;
+			if (t.node & LEAF_BIT)
+			{
+			#ifdef BVH8_WOOP_TRIS
+				const BVHWoop4Leaf* leaf = (BVHWoop4Leaf*)(bvh8Data + (t.node & 0x1fffffff));
+				for (uint32_t i = 0; i < t.count; i++) IntersectWoop4Leaf( rays[list[t.first + i]], leaf );
+			#else
+				const BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh8Data + (t.node & 0x1fffffff));
+				for (uint32_t i = 0; i < t.count; i++) IntersectTri4Leaf( rays[list[t.first + i]], leaf );
+			#endif
+			}
+			else if (t.count > 0)
+			{
+				// fetch child bounds once for all rays; select near / far planes for the octant.
+			#ifdef BVH8_CPU_COMPACT
+				const BVHNodeCompact* n = (BVHNodeCompact*)(bvh8Data + t.node);
+			#else
+				const BVHNode* n = (BVHNode*)(bvh8Data + t.node);
+			#endif
+				__m256 xmin8, xmax8, ymin8, ymax8, zmin8, zmax8;
+				LoadChildBounds8( bvh8Data + t.node, xmin8, xmax8, ymin8, ymax8, zmin8, zmax8 );
+				const __m256 nearx8 = posX ? xmin8 : xmax8, farx8 = posX ? xmax8 : xmin8;
+				const __m256 neary8 = posY ? ymin8 : ymax8, fary8 = posY ? ymax8 : ymin8;
+				const __m256 nearz8 = posZ ? zmin8 : zmax8, farz8 = posZ ? zmax8 : zmin8;
+				const uint32_t* child = (const uint32_t*)&n->child8, * perm = (const uint32_t*)&n->perm8;
+				uint32_t validMask = 0, laneCount[8] = { 0 }, offset[8];
+				for (uint32_t i = 0; i < 8; i++) if (child[i]) validMask |= 1 << i;
+				// test each ray against all children.
+				for (uint32_t i = 0; i < t.count; i++)
+				{
+					const Ray& ray = rays[list[t.first + i]];
+					const __m256 ox8 = _mm256_set1_ps( ray.O.x ), rdx8 = _mm256_set1_ps( ray.rD.x );
+					const __m256 oy8 = _mm256_set1_ps( ray.O.y ), rdy8 = _mm256_set1_ps( ray.rD.y );
+					const __m256 oz8 = _mm256_set1_ps( ray.O.z ), rdz8 = _mm256_set1_ps( ray.rD.z );
+					const __m256 tx1 = _mm256_mul_ps( _mm256_sub_ps( nearx8, ox8 ), rdx8 ), tx2 = _mm256_mul_ps( _mm256_sub_ps( farx8, ox8 ), rdx8 );
+					const __m256 ty1 = _mm256_mul_ps( _mm256_sub_ps( neary8, oy8 ), rdy8 ), ty2 = _mm256_mul_ps( _mm256_sub_ps( fary8, oy8 ), rdy8 );
+					const __m256 tz1 = _mm256_mul_ps( _mm256_sub_ps( nearz8, oz8 ), rdz8 ), tz2 = _mm256_mul_ps( _mm256_sub_ps( farz8, oz8 ), rdz8 );
+					const __m256 tmin = _mm256_max_ps( _mm256_max_ps( _mm256_max_ps( zero8, tx1 ), ty1 ), tz1 );
+					__m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_min_ps( tx2, _mm256_set1_ps( ray.hit.t ) ), ty2 ), tz2 );
+#ifdef WATERTIGHT_TRIS
+					tmax = _mm256_mul_ps( tmax, _mm256_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
+					uint32_t mask = _mm256_movemask_ps( _mm256_cmp_ps( tmin, tmax, _CMP_LE_OQ ) ) & validMask;
+					hitMask[i] = (uint8_t)mask, entry8[i] = tmin;
+					for (; mask; mask &= mask - 1) laneCount[__bfind( mask & (0 - mask) )]++;
+				}
+				// allocate the child ray lists and push the children far-to-near.
+				if (top + t.count * 8 > capacity)
+				{
+					capacity = (top + t.count * 8) * 2;
+					uint32_t* newList = (uint32_t*)AlignedAlloc( capacity * sizeof( uint32_t ) );
+					float* newEntry = (float*)AlignedAlloc( capacity * sizeof( float ) );
+					memcpy( newList, list, top * sizeof( uint32_t ) );
+					memcpy( newEntry, entry, top * sizeof( float ) );
+					AlignedFree( list );
+					AlignedFree( entry );
+					list = newList, entry = newEntry;
+				}
+				// the permutation is only reliable for used slots, so children that it
+				// misses are pushed first, i.e. treated as farthest.
+				const uint32_t listFirst = t.first, listCount = t.count;
+				uint32_t lanes[16], laneTotal = 0, inPerm = 0, pushed = 0;
+				for (uint32_t p = 0; p < 8; p++) inPerm |= 1 << ((perm[p] >> signShift) & 7);
+				for (uint32_t lane = 0; lane < 8; lane++) if (!((inPerm >> lane) & 1)) lanes[laneTotal++] = lane;
+				for (uint32_t p = 0; p < 8; p++) lanes[laneTotal++] = (perm[p] >> signShift) & 7;
+				for (uint32_t i = 0; i < laneTotal; i++)
+				{
+					const uint32_t lane = lanes[i];
+					if (!laneCount[lane] || ((pushed >> lane) & 1)) continue;
+					offset[lane] = top, task[taskPtr++] = { child[lane], top, laneCount[lane] };
+					top += laneCount[lane], pushed |= 1 << lane;
+				}
+				for (uint32_t i = 0; i < listCount; i++)
+					for (uint32_t mask = hitMask[i]; mask; mask &= mask - 1)
+					{
+						const uint32_t lane = __bfind( mask & (0 - mask) ), slot = offset[lane]++;
+						list[slot] = list[listFirst + i], entry[slot] = ((float*)&entry8[i])[lane];
+					}
+			}
+			if (!taskPtr) break;
+			t = task[--taskPtr];
+		}
+	}
+	AlignedFree( entry );
+	AlignedFree( list );
+	AlignedFree( entry8 );
+	AlignedFree( hitMask );
+	AlignedFree( order );
+}
+
+// Packet traversal: 8 or 16 rays with the same direction octant traverse the tree
+// together, using 8-wide slab tests over K groups of eight rays. A child is visited
+// when any ray of the packet hits it; the ray mask on the stack restricts further
+// work to the rays that reached the node. Packets with mixed octants, and packets
+// that lose coherence during traversal, are finished with single-ray traversal.
+// Rays are read from 'packet'; hits are written to 'hits', which is the same array
+// for Intersect8Rays / Intersect16Rays and null for the occlusion queries.
+template <uint32_t K, bool occlusion> uint32_t BVH8_CPU::IntersectPacket( const Ray* packet, Ray* hits ) const
+{
+	if (isTLAS()) // instances are traced one ray at a time.
+	{
+		uint32_t occluded = 0;
+		for (uint32_t i = 0; i < K * 8; i++) if (!occlusion) Intersect( hits[i] );
+			else if (IsOccluded( packet[i] )) occluded |= 1u << i;
+		return occluded;
+	}
+	constexpr uint32_t N = K * 8, allRays = (1u << N) - 1;
+	uint32_t occluded = 0, active = allRays;
+	const auto finishSingle = [&]( uint32_t mask ) {
+		for (; mask; mask &= mask - 1)
+		{
+			const uint32_t i = __bfind( mask & (0 - mask) );
+			if (!occlusion) Intersect( hits[i] ); else if (IsOccluded( packet[i] )) occluded |= 1 << i;
+		}
+		return occluded;
+	};
+	const uint32_t octant = RayOctant( packet[0] ), signShift = octant * 3;
+	for (uint32_t i = 1; i < N; i++) if (RayOctant( packet[i] ) != octant) return finishSingle( allRays );
+	const bool posX = octant & 1, posY = octant & 2, posZ = octant & 4;
+	// transpose the packet to SoA.
+	__m256 ox8[K], oy8[K], oz8[K], rdx8[K], rdy8[K], rdz8[K], t8[K];
+	const __m256i stride8 = _mm256_mullo_epi32( _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ), _mm256_set1_epi32( sizeof( Ray ) / 4 ) );
+	for (uint32_t k = 0; k < K; k++)
+	{
+		const Ray* r = packet + k * 8;
+		ox8[k] = _mm256_i32gather_ps( &r->O.x, stride8, 4 ), oy8[k] = _mm256_i32gather_ps( &r->O.y, stride8, 4 );
+		oz8[k] = _mm256_i32gather_ps( &r->O.z, stride8, 4 ), t8[k] = _mm256_i32gather_ps( &r->hit.t, stride8, 4 );
+		rdx8[k] = _mm256_i32gather_ps( &r->rD.x, stride8, 4 ), rdy8[k] = _mm256_i32gather_ps( &r->rD.y, stride8, 4 );
+		rdz8[k] = _mm256_i32gather_ps( &r->rD.z, stride8, 4 );
+	}
+	const __m256 zero8 = _mm256_setzero_ps();
+#ifndef BVH8_WOOP_TRIS
+	// ray directions and constants for the packet triangle test; Woop leafs are tested per ray.
+	__m256 dx8[K], dy8[K], dz8[K];
+	for (uint32_t k = 0; k < K; k++)
+	{
+		const Ray* r = packet + k * 8;
+		dx8[k] = _mm256_i32gather_ps( &r->D.x, stride8, 4 ), dy8[k] = _mm256_i32gather_ps( &r->D.y, stride8, 4 );
+		dz8[k] = _mm256_i32gather_ps( &r->D.z, stride8, 4 );
+	}
+	const __m256 one8 = _mm256_set1_ps( 1.0f ), eps8 = _mm256_set1_ps( 0.000001f );
+	const __m256 signMask8 = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7fffffff ) );
+#endif
+	struct Entry { uint32_t node, mask; } stack[512], e = { 0, allRays };
+	uint32_t stackPtr = 0, visits = 0, rayVisits = 0;
+	while (1)
+	{
+		e.mask &= active;
+		if (e.mask)
+		{
+			// give up on the packet when, on average, less than a quarter of its rays are active.
+			visits++, rayVisits += __popc( e.mask );
+			if (visits > 32 && rayVisits * 4 < visits * N)
+			{
+				uint32_t pending = e.mask;
+				for (uint32_t i = 0; i < stackPtr; i++) pending |= stack[i].mask;
+				return finishSingle( pending & active );
+			}
+			if (e.node & LEAF_BIT)
+			{
+			#ifdef BVH8_WOOP_TRIS
+				const BVHWoop4Leaf* leaf = (BVHWoop4Leaf*)(bvh8Data + (e.node & 0x1fffffff));
+				for (uint32_t mask = e.mask; mask; mask &= mask - 1)
+				{
+					const uint32_t i = __bfind( mask & (0 - mask) );
+					if (occlusion)
+					{
+						Ray ray = packet[i];
+						IntersectWoop4Leaf( ray, leaf );
+						if (ray.hit.t < packet[i].hit.t) occluded |= 1 << i, active &= ~(1 << i);
+					}
+					else IntersectWoop4Leaf( hits[i], leaf ), LANE8( t8[i >> 3], i & 7 ) = hits[i].hit.t;
+				}
+			#else
+				// Moeller-Trumbore, one triangle against eight rays at a time.
+				const BVHTri4Leaf* leaf = (BVHTri4Leaf*)(bvh8Data + (e.node & 0x1fffffff));
+				for (uint32_t j = 0; j < 4; j++)
+				{
+					const __m256 v0x = _mm256_set1_ps( LANE( leaf->v0x4, j ) ), v0y = _mm256_set1_ps( LANE( leaf->v0y4, j ) ), v0z = _mm256_set1_ps( LANE( leaf->v0z4, j ) );
+					const __m256 e1x = _mm256_set1_ps( LANE( leaf->e1x4, j ) ), e1y = _mm256_set1_ps( LANE( leaf->e1y4, j ) ), e1z = _mm256_set1_ps( LANE( leaf->e1z4, j ) );
+					const __m256 e2x = _mm256_set1_ps( LANE( leaf->e2x4, j ) ), e2y = _mm256_set1_ps( LANE( leaf->e2y4, j ) ), e2z = _mm256_set1_ps( LANE( leaf->e2z4, j ) );
+					for (uint32_t k = 0; k < K; k++)
+					{
+						if (!((e.mask >> (k * 8)) & 255)) continue;
+						const __m256 hx = _mm256_fmsub_ps( dy8[k], e2z, _mm256_mul_ps( dz8[k], e2y ) );
+						const __m256 hy = _mm256_fmsub_ps( dz8[k], e2x, _mm256_mul_ps( dx8[k], e2z ) );
+						const __m256 hz = _mm256_fmsub_ps( dx8[k], e2y, _mm256_mul_ps( dy8[k], e2x ) );
+						const __m256 det = _mm256_fmadd_ps( e1z, hz, _mm256_fmadd_ps( e1x, hx, _mm256_mul_ps( e1y, hy ) ) );
+						const __m256 inv_det = _mm256_div_ps( one8, det );
+						const __m256 sx = _mm256_sub_ps( ox8[k], v0x ), sy = _mm256_sub_ps( oy8[k], v0y ), sz = _mm256_sub_ps( oz8[k], v0z );
+						const __m256 u = _mm256_mul_ps( _mm256_fmadd_ps( sz, hz, _mm256_fmadd_ps( sx, hx, _mm256_mul_ps( sy, hy ) ) ), inv_det );
+						const __m256 qz = _mm256_fmsub_ps( sx, e1y, _mm256_mul_ps( sy, e1x ) );
+						const __m256 qx = _mm256_fmsub_ps( sy, e1z, _mm256_mul_ps( sz, e1y ) );
+						const __m256 qy = _mm256_fmsub_ps( sz, e1x, _mm256_mul_ps( sx, e1z ) );
+						const __m256 v = _mm256_mul_ps( _mm256_fmadd_ps( dz8[k], qz, _mm256_fmadd_ps( dx8[k], qx, _mm256_mul_ps( dy8[k], qy ) ) ), inv_det );
+						const __m256 ta = _mm256_mul_ps( _mm256_fmadd_ps( e2z, qz, _mm256_fmadd_ps( e2x, qx, _mm256_mul_ps( e2y, qy ) ) ), inv_det );
+						const __m256 mask1 = _mm256_and_ps( _mm256_cmp_ps( _mm256_and_ps( det, signMask8 ), eps8, _CMP_GE_OQ ), _mm256_cmp_ps( u, zero8, _CMP_GE_OQ ) );
+						const __m256 mask2 = _mm256_and_ps( _mm256_cmp_ps( v, zero8, _CMP_GE_OQ ), _mm256_cmp_ps( _mm256_add_ps( u, v ), one8, _CMP_LE_OQ ) );
+						const __m256 mask3 = _mm256_and_ps( _mm256_cmp_ps( ta, zero8, _CMP_GT_OQ ), _mm256_cmp_ps( ta, t8[k], _CMP_LT_OQ ) );
+						const __m256 hit = _mm256_and_ps( _mm256_and_ps( mask1, mask2 ), mask3 );
+						uint32_t hitMask = _mm256_movemask_ps( hit );
+						if (!hitMask) continue;
+						if (occlusion) { occluded |= hitMask << (k * 8), active &= ~(hitMask << (k * 8)); continue; }
+						t8[k] = _mm256_blendv_ps( t8[k], ta, hit );
+						for (; hitMask; hitMask &= hitMask - 1)
+						{
+							const uint32_t lane = __bfind( hitMask & (0 - hitMask) );
+							Ray& ray = hits[k * 8 + lane];
+							ray.hit.t = LANE8( ta, lane ), ray.hit.u = LANE8( u, lane ), ray.hit.v = LANE8( v, lane );
+						#if INST_IDX_BITS == 32
+							ray.hit.prim = leaf->primIdx[j];
+							ray.hit.inst = ray.instIdx;
+						#else
+							ray.hit.prim = leaf->primIdx[j] + ray.instIdx;
+						#endif
+						}
+					}
+				}
+			#endif
+				if (occlusion && !active) return occluded;
+			}
+			else
+			{
+				// test the packet against each child; keep the rays that hit it.
+			#ifdef BVH8_CPU_COMPACT
+				const BVHNodeCompact* n = (BVHNodeCompact*)(bvh8Data + e.node);
+			#else
+				const BVHNode* n = (BVHNode*)(bvh8Data + e.node);
+			#endif
+				__m256 xmin8, xmax8, ymin8, ymax8, zmin8, zmax8;
+				LoadChildBounds8( bvh8Data + e.node, xmin8, xmax8, ymin8, ymax8, zmin8, zmax8 );
+				const __m256 nearx8 = posX ? xmin8 : xmax8, farx8 = posX ? xmax8 : xmin8;
+				const __m256 neary8 = posY ? ymin8 : ymax8, fary8 = posY ? ymax8 : ymin8;
+				const __m256 nearz8 = posZ ? zmin8 : zmax8, farz8 = posZ ? zmax8 : zmin8;
+				const uint32_t* child = (const uint32_t*)&n->child8, * perm = (const uint32_t*)&n->perm8;
+				uint32_t childMask[8];
+				for (uint32_t c = 0; c < 8; c++)
+				{
+					childMask[c] = 0;
+					if (!child[c]) continue;
+					const __m256 nx = _mm256_set1_ps( LANE8( nearx8, c ) ), fx = _mm256_set1_ps( LANE8( farx8, c ) );
+					const __m256 ny = _mm256_set1_ps( LANE8( neary8, c ) ), fy = _mm256_set1_ps( LANE8( fary8, c ) );
+					const __m256 nz = _mm256_set1_ps( LANE8( nearz8, c ) ), fz = _mm256_set1_ps( LANE8( farz8, c ) );
+					for (uint32_t k = 0; k < K; k++)
+					{
+						const __m256 tx1 = _mm256_mul_ps( _mm256_sub_ps( nx, ox8[k] ), rdx8[k] ), tx2 = _mm256_mul_ps( _mm256_sub_ps( fx, ox8[k] ), rdx8[k] );
+						const __m256 ty1 = _mm256_mul_ps( _mm256_sub_ps( ny, oy8[k] ), rdy8[k] ), ty2 = _mm256_mul_ps( _mm256_sub_ps( fy, oy8[k] ), rdy8[k] );
+						const __m256 tz1 = _mm256_mul_ps( _mm256_sub_ps( nz, oz8[k] ), rdz8[k] ), tz2 = _mm256_mul_ps( _mm256_sub_ps( fz, oz8[k] ), rdz8[k] );
+						const __m256 tmin = _mm256_max_ps( _mm256_max_ps( _mm256_max_ps( zero8, tx1 ), ty1 ), tz1 );
+						__m256 tmax = _mm256_min_ps( _mm256_min_ps( _mm256_min_ps( tx2, t8[k] ), ty2 ), tz2 );
+#ifdef WATERTIGHT_TRIS
+						tmax = _mm256_mul_ps( tmax, _mm256_set1_ps( BVH_CONSERVATIVE_TMAX ) );
+#endif
+						childMask[c] |= (uint32_t)_mm256_movemask_ps( _mm256_cmp_ps( tmin, tmax, _CMP_LE_OQ ) ) << (k * 8);
+					}
+					childMask[c] &= e.mask;
+				}
+				// push far-to-near; children missing from the permutation count as farthest.
+				uint32_t lanes[16], laneTotal = 0, inPerm = 0, pushed = 0;
+				for (uint32_t p = 0; p < 8; p++) inPerm |= 1 << ((perm[p] >> signShift) & 7);
+				for (uint32_t lane = 0; lane < 8; lane++) if (!((inPerm >> lane) & 1)) lanes[laneTotal++] = lane;
+				for (uint32_t p = 0; p < 8; p++) lanes[laneTotal++] = (perm[p] >> signShift) & 7;
+				for (uint32_t i = 0; i < laneTotal; i++)
+				{
+					const uint32_t lane = lanes[i];
+					if (!childMask[lane] || ((pushed >> lane) & 1)) continue;
+					stack[stackPtr++] = { child[lane], childMask[lane] }, pushed |= 1 << lane;
+				}
+			}
+		}
+		if (!stackPtr) break;
+		e = stack[--stackPtr];
+	}
+	return occluded;
+}
+
+void BVH8_CPU::Intersect8Rays( Ray* packet ) const { IntersectPacket<1, false>( packet, packet ); }
+void BVH8_CPU::Intersect16Rays( Ray* packet ) const { IntersectPacket<2, false>( packet, packet ); }
+uint32_t BVH8_CPU::IsOccluded8Rays( const Ray* packet ) const { return IntersectPacket<1, true>( packet, 0 ); }
+uint32_t BVH8_CPU::IsOccluded16Rays( const Ray* packet ) const { return IntersectPacket<2, true>( packet, 0 ); }
+
+// Batch occlusion: runs of 16 rays use packet traversal, which retires occluded rays
+// from the packet's active mask; incoherent packets fall back to single rays.
+void BVH8_CPU::IsOccluded( const Ray* rays, const uint32_t count, uint32_t* occludedMask ) const
+{
+	memset( occludedMask, 0, ((count + 31) >> 5) * sizeof( uint32_t ) );
+	uint32_t i = 0;
+	for (; i + 16 <= count; i += 16) occludedMask[i >> 5] |= IsOccluded16Rays( rays + i ) << (i & 31);
+	for (; i < count; i++) if (IsOccluded( rays[i] )) occludedMask[i >> 5] |= 1u << (i & 31);
+}
+
 #endif // BVH_USEAVX2
 
 #endif // BVH_USEAVX
@@ -6917,8 +10347,8 @@ void BVH::PrepareNEONBuild( const bvhvec4slice& vertices, const uint32_t* indice
 {
 	FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareNEONBuild( .. ), primCount == 0." );
 	FATAL_ERROR_IF( vertices.stride & 15, "BVH::PrepareNEONBuild( .. ), stride must be multiple of 16." );
-	// some constants
-	static const float32x4_t min4 = vdupq_n_f32( BVH_FAR ), max4 = vdupq_n_f32( -BVH_FAR );
+	DiscardLeafTris();
+	DiscardMotion();
 	// reset node pool
 	uint32_t primCount = prims > 0 ? prims : vertices.count / 3;
 	const uint32_t spaceNeeded = primCount * 2;
@@ -6938,44 +10368,10 @@ void BVH::PrepareNEONBuild( const bvhvec4slice& vertices, const uint32_t* indice
 	vertIdx = (uint32_t*)indices;
 	triCount = idxCount = primCount;
 	newNodePtr = 2;
-	struct FragSSE { float32x4_t bmin4, bmax4; };
-	FragSSE* frag4 = (FragSSE*)fragment;
-	const float32x4_t* verts4 = (float32x4_t*)verts.data; // that's why it must be 16-byte aligned.
-	// assign all triangles to the root node
-	BVHNode& root = bvhNode[0];
-	root.leftFirst = 0, root.triCount = triCount;
-	// initialize fragments and update root bounds
-	float32x4_t rootMin = min4, rootMax = max4;
-	if (indices)
-	{
-		FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareAVXBuild( .. ), empty vertex slice." );
-		FATAL_ERROR_IF( prims == 0, "BVH::PrepareAVXBuild( .. ), prims == 0." );
-		// build the BVH over indexed triangles
-		for (uint32_t i = 0; i < triCount; i++)
-		{
-			const uint32_t i0 = indices[i * 3], i1 = indices[i * 3 + 1], i2 = indices[i * 3 + 2];
-			const float32x4_t v0 = verts4[i0], v1 = verts4[i1], v2 = verts4[i2];
-			const float32x4_t t1 = vminq_f32( vminq_f32( v0, v1 ), v2 );
-			const float32x4_t t2 = vmaxq_f32( vmaxq_f32( v0, v1 ), v2 );
-			frag4[i].bmin4 = t1, frag4[i].bmax4 = t2, rootMin = vminq_f32( rootMin, t1 ), rootMax = vmaxq_f32( rootMax, t2 );
-			primIdx[i] = i;
-		}
-	}
-	else
-	{
-		FATAL_ERROR_IF( vertices.count == 0, "BVH::PrepareAVXBuild( .. ), empty vertex slice." );
-		FATAL_ERROR_IF( prims != 0, "BVH::PrepareAVXBuild( .. ), indices == 0." );
-		// build the BVH over a list of vertices: three per triangle
-		for (uint32_t i = 0; i < triCount; i++)
-		{
-			const float32x4_t v0 = verts4[i * 3], v1 = verts4[i * 3 + 1], v2 = verts4[i * 3 + 2];
-			const float32x4_t t1 = vminq_f32( vminq_f32( v0, v1 ), v2 );
-			const float32x4_t t2 = vmaxq_f32( vmaxq_f32( v0, v1 ), v2 );
-			frag4[i].bmin4 = t1, frag4[i].bmax4 = t2, rootMin = vminq_f32( rootMin, t1 ), rootMax = vmaxq_f32( rootMax, t2 );
-			primIdx[i] = i;
-		}
-	}
-	root.aabbMin = *(bvhvec3*)&rootMin, root.aabbMax = *(bvhvec3*)&rootMax;
+	// initialize fragments and assign all triangles to the root node
+	FATAL_ERROR_IF( indices && prims == 0, "BVH::PrepareNEONBuild( .. ), prims == 0." );
+	FATAL_ERROR_IF( !indices && prims != 0, "BVH::PrepareNEONBuild( .. ), indices == 0." );
+	PrepareFragments( indices );
 	bvh_over_indices = indices != nullptr;
 }
 
@@ -7131,6 +10527,11 @@ void BVH::BuildNEON()
 
 // Traverse the second alternative BVH layout (ALT_SOA).
 int32_t BVH_SoA::Intersect( Ray& ray ) const
+{
+	return (this->*intersectKernel[RayOctant( ray )])(ray);
+}
+
+template <bool posX, bool posY, bool posZ> int32_t BVH_SoA::Intersect( Ray& ray ) const
 {
 	BVHNode* node = &bvhNode[0], * stack[64];
 	const bvhvec4slice& verts = bvh.verts;
@@ -7168,32 +10569,24 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
 		}
-		float32x4_t x4 = vmulq_f32( vsubq_f32( node->xxxx, Ox4 ), rDx4 );
-		float32x4_t y4 = vmulq_f32( vsubq_f32( node->yyyy, Oy4 ), rDy4 );
-		float32x4_t z4 = vmulq_f32( vsubq_f32( node->zzzz, Oz4 ), rDz4 );
-		// transpose
-		float32x4_t t0 = vzip1q_f32( x4, y4 ), t2 = vzip1q_f32( z4, z4 );
-		float32x4_t t1 = vzip2q_f32( x4, y4 ), t3 = vzip2q_f32( z4, z4 );
-		float32x4_t xyzw1a = vcombine_f32( vget_low_f32( t0 ), vget_low_f32( t2 ) );
-		float32x4_t xyzw2a = vcombine_f32( vget_high_f32( t0 ), vget_high_f32( t2 ) );
-		float32x4_t xyzw1b = vcombine_f32( vget_low_f32( t1 ), vget_low_f32( t3 ) );
-		float32x4_t xyzw2b = vcombine_f32( vget_high_f32( t1 ), vget_high_f32( t3 ) );
-		// process
-		float32x4_t tmina4 = vminq_f32( xyzw1a, xyzw2a ), tmaxa4 = vmaxq_f32( xyzw1a, xyzw2a );
-		float32x4_t tminb4 = vminq_f32( xyzw1b, xyzw2b ), tmaxb4 = vmaxq_f32( xyzw1b, xyzw2b );
-		// transpose back
-		t0 = vzip1q_f32( tmina4, tmaxa4 ), t2 = vzip1q_f32( tminb4, tmaxb4 );
-		t1 = vzip2q_f32( tmina4, tmaxa4 ), t3 = vzip2q_f32( tminb4, tmaxb4 );
-		x4 = vcombine_f32( vget_low_f32( t0 ), vget_low_f32( t2 ) );
-		y4 = vcombine_f32( vget_high_f32( t0 ), vget_high_f32( t2 ) );
-		z4 = vcombine_f32( vget_low_f32( t1 ), vget_low_f32( t3 ) );
+		const float32x4_t x4 = vmulq_f32( vsubq_f32( node->xxxx, Ox4 ), rDx4 );
+		const float32x4_t y4 = vmulq_f32( vsubq_f32( node->yyyy, Oy4 ), rDy4 );
+		const float32x4_t z4 = vmulq_f32( vsubq_f32( node->zzzz, Oz4 ), rDz4 );
+		// lanes hold (lmin, lmax, rmin, rmax); the octant tells which of these are near planes.
+		const float32x4_t evenxy4 = vuzp1q_f32( x4, y4 ), oddxy4 = vuzp2q_f32( x4, y4 );
+		const float32x2_t evenz2 = vget_low_f32( vuzp1q_f32( z4, z4 ) ), oddz2 = vget_low_f32( vuzp2q_f32( z4, z4 ) );
+		const float32x2_t nearx2 = vget_low_f32( posX ? evenxy4 : oddxy4 ), farx2 = vget_low_f32( posX ? oddxy4 : evenxy4 );
+		const float32x2_t neary2 = vget_high_f32( posY ? evenxy4 : oddxy4 ), fary2 = vget_high_f32( posY ? oddxy4 : evenxy4 );
+		const float32x2_t nearz2 = posZ ? evenz2 : oddz2, farz2 = posZ ? oddz2 : evenz2;
+		const float32x2_t min2 = vmax_f32( vmax_f32( vmax_f32( nearx2, neary2 ), nearz2 ), vdup_n_f32( 0 ) );
+		float32x2_t max2 = vmin_f32( vmin_f32( vmin_f32( farx2, fary2 ), farz2 ), vdup_n_f32( ray.hit.t ) );
+#ifdef WATERTIGHT_TRIS
+		max2 = vmul_n_f32( max2, BVH_CONSERVATIVE_TMAX );
+#endif
 		uint32_t lidx = node->left, ridx = node->right;
-		const float32x4_t min4 = vmaxq_f32( vmaxq_f32( vmaxq_f32( x4, y4 ), z4 ), vdupq_n_f32( 0 ) );
-		const float32x4_t max4 = vminq_f32( vminq_f32( vminq_f32( x4, y4 ), z4 ), vdupq_n_f32( ray.hit.t ) );
-		const float tmina_0 = vgetq_lane_f32( min4, 0 ), tmaxa_1 = vgetq_lane_f32( max4, 1 );
-		const float tminb_2 = vgetq_lane_f32( min4, 2 ), tmaxb_3 = vgetq_lane_f32( max4, 3 );
-		float dist1 = tmaxa_1 >= tmina_0 ? tmina_0 : BVH_FAR;
-		float dist2 = tmaxb_3 >= tminb_2 ? tminb_2 : BVH_FAR;
+		const float tmina = vget_lane_f32( min2, 0 ), tminb = vget_lane_f32( min2, 1 );
+		float dist1 = vget_lane_f32( max2, 0 ) >= tmina ? tmina : BVH_FAR;
+		float dist2 = vget_lane_f32( max2, 1 ) >= tminb ? tminb : BVH_FAR;
 		if (dist1 > dist2)
 		{
 			float t = dist1; dist1 = dist2; dist2 = t;
@@ -7213,6 +10606,11 @@ int32_t BVH_SoA::Intersect( Ray& ray ) const
 }
 
 bool BVH_SoA::IsOccluded( const Ray& ray ) const
+{
+	return (this->*occlusionKernel[RayOctant( ray )])(ray);
+}
+
+template <bool posX, bool posY, bool posZ> bool BVH_SoA::IsOccluded( const Ray& ray ) const
 {
 	BVHNode* node = &bvhNode[0], * stack[64];
 	const bvhvec4slice& verts = bvh.verts;
@@ -7246,32 +10644,24 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
 		}
-		float32x4_t x4 = vmulq_f32( vsubq_f32( node->xxxx, Ox4 ), rDx4 );
-		float32x4_t y4 = vmulq_f32( vsubq_f32( node->yyyy, Oy4 ), rDy4 );
-		float32x4_t z4 = vmulq_f32( vsubq_f32( node->zzzz, Oz4 ), rDz4 );
-		// transpose
-		float32x4_t t0 = vzip1q_f32( x4, y4 ), t2 = vzip1q_f32( z4, z4 );
-		float32x4_t t1 = vzip2q_f32( x4, y4 ), t3 = vzip2q_f32( z4, z4 );
-		float32x4_t xyzw1a = vcombine_f32( vget_low_f32( t0 ), vget_low_f32( t2 ) );
-		float32x4_t xyzw2a = vcombine_f32( vget_high_f32( t0 ), vget_high_f32( t2 ) );
-		float32x4_t xyzw1b = vcombine_f32( vget_low_f32( t1 ), vget_low_f32( t3 ) );
-		float32x4_t xyzw2b = vcombine_f32( vget_high_f32( t1 ), vget_high_f32( t3 ) );
-		// process
-		float32x4_t tmina4 = vminq_f32( xyzw1a, xyzw2a ), tmaxa4 = vmaxq_f32( xyzw1a, xyzw2a );
-		float32x4_t tminb4 = vminq_f32( xyzw1b, xyzw2b ), tmaxb4 = vmaxq_f32( xyzw1b, xyzw2b );
-		// transpose back
-		t0 = vzip1q_f32( tmina4, tmaxa4 ), t2 = vzip1q_f32( tminb4, tmaxb4 );
-		t1 = vzip2q_f32( tmina4, tmaxa4 ), t3 = vzip2q_f32( tminb4, tmaxb4 );
-		x4 = vcombine_f32( vget_low_f32( t0 ), vget_low_f32( t2 ) );
-		y4 = vcombine_f32( vget_high_f32( t0 ), vget_high_f32( t2 ) );
-		z4 = vcombine_f32( vget_low_f32( t1 ), vget_low_f32( t3 ) );
+		const float32x4_t x4 = vmulq_f32( vsubq_f32( node->xxxx, Ox4 ), rDx4 );
+		const float32x4_t y4 = vmulq_f32( vsubq_f32( node->yyyy, Oy4 ), rDy4 );
+		const float32x4_t z4 = vmulq_f32( vsubq_f32( node->zzzz, Oz4 ), rDz4 );
+		// lanes hold (lmin, lmax, rmin, rmax); the octant tells which of these are near planes.
+		const float32x4_t evenxy4 = vuzp1q_f32( x4, y4 ), oddxy4 = vuzp2q_f32( x4, y4 );
+		const float32x2_t evenz2 = vget_low_f32( vuzp1q_f32( z4, z4 ) ), oddz2 = vget_low_f32( vuzp2q_f32( z4, z4 ) );
+		const float32x2_t nearx2 = vget_low_f32( posX ? evenxy4 : oddxy4 ), farx2 = vget_low_f32( posX ? oddxy4 : evenxy4 );
+		const float32x2_t neary2 = vget_high_f32( posY ? evenxy4 : oddxy4 ), fary2 = vget_high_f32( posY ? oddxy4 : evenxy4 );
+		const float32x2_t nearz2 = posZ ? evenz2 : oddz2, farz2 = posZ ? oddz2 : evenz2;
+		const float32x2_t min2 = vmax_f32( vmax_f32( vmax_f32( nearx2, neary2 ), nearz2 ), vdup_n_f32( 0 ) );
+		float32x2_t max2 = vmin_f32( vmin_f32( vmin_f32( farx2, fary2 ), farz2 ), vdup_n_f32( ray.hit.t ) );
+#ifdef WATERTIGHT_TRIS
+		max2 = vmul_n_f32( max2, BVH_CONSERVATIVE_TMAX );
+#endif
 		uint32_t lidx = node->left, ridx = node->right;
-		const float32x4_t min4 = vmaxq_f32( vmaxq_f32( vmaxq_f32( x4, y4 ), z4 ), vdupq_n_f32( 0 ) );
-		const float32x4_t max4 = vminq_f32( vminq_f32( vminq_f32( x4, y4 ), z4 ), vdupq_n_f32( ray.hit.t ) );
-		const float tmina_0 = vgetq_lane_f32( min4, 0 ), tmaxa_1 = vgetq_lane_f32( max4, 1 );
-		const float tminb_2 = vgetq_lane_f32( min4, 2 ), tmaxb_3 = vgetq_lane_f32( max4, 3 );
-		float dist1 = tmaxa_1 >= tmina_0 ? tmina_0 : BVH_FAR;
-		float dist2 = tmaxb_3 >= tminb_2 ? tminb_2 : BVH_FAR;
+		const float tmina = vget_lane_f32( min2, 0 ), tminb = vget_lane_f32( min2, 1 );
+		float dist1 = vget_lane_f32( max2, 0 ) >= tmina ? tmina : BVH_FAR;
+		float dist2 = vget_lane_f32( max2, 1 ) >= tminb ? tminb : BVH_FAR;
 		if (dist1 > dist2)
 		{
 			float t = dist1; dist1 = dist2; dist2 = t;
@@ -7293,6 +10683,11 @@ bool BVH_SoA::IsOccluded( const Ray& ray ) const
 // Traverse a 4-way BVH stored in 'Atilla Áfra' layout.
 inline void IntersectCompactTri( Ray& r, float32x4_t& t4, const float* T )
 {
+#ifdef WATERTIGHT_TRIS
+	// T holds the original vertices, see BVH4_CPU::ConvertFrom.
+	float ta, u, v;
+	const bool hit = IntersectWatertight( r, bvhvec3( T[0], T[1], T[2] ), bvhvec3( T[4], T[5], T[6] ), bvhvec3( T[8], T[9], T[10] ), ta, u, v );
+#else
 	const float transS = T[8] * r.O.x + T[9] * r.O.y + T[10] * r.O.z + T[11];
 	const float transD = T[8] * r.D.x + T[9] * r.D.y + T[10] * r.D.z;
 	const float ta = -transS / transD;
@@ -7301,10 +10696,14 @@ inline void IntersectCompactTri( Ray& r, float32x4_t& t4, const float* T )
 	const float u = T[0] * wr.x + T[1] * wr.y + T[2] * wr.z + T[3];
 	const float v = T[4] * wr.x + T[5] * wr.y + T[6] * wr.z + T[7];
 	const bool hit = u >= 0 && v >= 0 && u + v < 1;
+#endif
+	// set fields one by one: an aggregate would also clear auxData and the instance path.
+	if (!hit) return;
+	r.hit.t = ta, r.hit.u = u, r.hit.v = v, t4 = vdupq_n_f32( ta );
 #if INST_IDX_BITS == 32
-	if (hit) r.hit = { 0, ta, u, v, *(uint32_t*)&T[15] }, t4 = vdupq_n_f32( ta );
+	r.hit.prim = *(uint32_t*)&T[15], r.hit.inst = r.instIdx;
 #else
-	if (hit) r.hit = { ta, u, v, *(uint32_t*)&T[15] }, t4 = vdupq_n_f32( ta );
+	r.hit.prim = *(uint32_t*)&T[15] + r.instIdx;
 #endif
 }
 
@@ -7315,6 +10714,11 @@ inline int32_t ARMVecMovemask( uint32x4_t v ) {
 }
 
 int32_t BVH4_CPU::Intersect( Ray& ray ) const
+{
+	return (this->*intersectKernel[RayOctant( ray )])(ray);
+}
+
+template <bool posX, bool posY, bool posZ> int32_t BVH4_CPU::Intersect( Ray& ray ) const
 {
 	uint32_t nodeIdx = 0, stack[1024], stackPtr = 0;
 	float cost = 0;
@@ -7329,20 +10733,18 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 	{
 		cost += c_trav;
 		const BVHNode& node = bvh4Node[nodeIdx];
-		// intersect the ray with four AABBs
-		const float32x4_t xmin4 = node.xmin4, xmax4 = node.xmax4;
-		const float32x4_t ymin4 = node.ymin4, ymax4 = node.ymax4;
-		const float32x4_t zmin4 = node.zmin4, zmax4 = node.zmax4;
-		const float32x4_t x0 = vsubq_f32( xmin4, ox4 ), x1 = vsubq_f32( xmax4, ox4 );
-		const float32x4_t y0 = vsubq_f32( ymin4, oy4 ), y1 = vsubq_f32( ymax4, oy4 );
-		const float32x4_t z0 = vsubq_f32( zmin4, oz4 ), z1 = vsubq_f32( zmax4, oz4 );
+		// intersect the ray with four AABBs; near and far planes follow from the octant.
+		const float32x4_t x0 = vsubq_f32( posX ? node.xmin4 : node.xmax4, ox4 ), x1 = vsubq_f32( posX ? node.xmax4 : node.xmin4, ox4 );
+		const float32x4_t y0 = vsubq_f32( posY ? node.ymin4 : node.ymax4, oy4 ), y1 = vsubq_f32( posY ? node.ymax4 : node.ymin4, oy4 );
+		const float32x4_t z0 = vsubq_f32( posZ ? node.zmin4 : node.zmax4, oz4 ), z1 = vsubq_f32( posZ ? node.zmax4 : node.zmin4, oz4 );
 		const float32x4_t tx1 = vmulq_f32( x0, rdx4 ), tx2 = vmulq_f32( x1, rdx4 );
 		const float32x4_t ty1 = vmulq_f32( y0, rdy4 ), ty2 = vmulq_f32( y1, rdy4 );
 		const float32x4_t tz1 = vmulq_f32( z0, rdz4 ), tz2 = vmulq_f32( z1, rdz4 );
-		const float32x4_t txmin = vminq_f32( tx1, tx2 ), tymin = vminq_f32( ty1, ty2 ), tzmin = vminq_f32( tz1, tz2 );
-		const float32x4_t txmax = vmaxq_f32( tx1, tx2 ), tymax = vmaxq_f32( ty1, ty2 ), tzmax = vmaxq_f32( tz1, tz2 );
-		const float32x4_t tmin = vmaxq_f32( vmaxq_f32( txmin, tymin ), tzmin );
-		const float32x4_t tmax = vminq_f32( vminq_f32( txmax, tymax ), tzmax );
+		const float32x4_t tmin = vmaxq_f32( vmaxq_f32( tx1, ty1 ), tz1 );
+		float32x4_t tmax = vminq_f32( vminq_f32( tx2, ty2 ), tz2 );
+#ifdef WATERTIGHT_TRIS
+		tmax = vmulq_n_f32( tmax, BVH_CONSERVATIVE_TMAX );
+#endif
 		uint32x4_t hit = vandq_u32( vandq_u32( vcgeq_f32( tmax, tmin ), vcltq_f32( tmin, t4 ) ), vcgeq_f32( tmax, zero4 ) );
 		int32_t hitBits = ARMVecMovemask( hit ), hits = vcnt_s8( vreinterpret_s8_s32( vcreate_u32( hitBits ) ) )[0];
 		if (hits == 1 /* 43% */)
@@ -7352,6 +10754,7 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 			if (count == 0) nodeIdx = node.childFirst[lane]; else
 			{
 				const uint32_t first = node.childFirst[lane];
+				if (instList) cost += IntersectInstances( ray, instList, instData, blasList, instIdx + first, count ), t4 = vdupq_n_f32( ray.hit.t ); else
 				for (uint32_t j = 0; j < count; j++, cost += c_int) // TODO: aim for 4 prims per leaf
 					IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
 				if (stackPtr == 0) break;
@@ -7380,6 +10783,7 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 			if (triCount0 == 0) nodeIdx = node.childFirst[lane0]; else
 			{
 				const uint32_t first = node.childFirst[lane0];
+				if (instList) cost += IntersectInstances( ray, instList, instData, blasList, instIdx + first, triCount0 ), t4 = vdupq_n_f32( ray.hit.t ); else
 				for (uint32_t j = 0; j < triCount0; j++, cost += c_int) // TODO: aim for 4 prims per leaf
 					IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
 				nodeIdx = 0;
@@ -7393,6 +10797,7 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 			else
 			{
 				const uint32_t first = node.childFirst[lane1];
+				if (instList) cost += IntersectInstances( ray, instList, instData, blasList, instIdx + first, triCount1 ), t4 = vdupq_n_f32( ray.hit.t ); else
 				for (uint32_t j = 0; j < triCount1; j++, cost += c_int) // TODO: aim for 4 prims per leaf
 					IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
 			}
@@ -7424,6 +10829,7 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 					continue;
 				}
 				const uint32_t first = node.childFirst[lane], count = node.triCount[lane];
+				if (instList) cost += IntersectInstances( ray, instList, instData, blasList, instIdx + first, count ), t4 = vdupq_n_f32( ray.hit.t ); else
 				for (uint32_t j = 0; j < count; j++, cost += c_int) // TODO: aim for 4 prims per leaf
 					IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
 			}
@@ -7455,6 +10861,7 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 					continue;
 				}
 				const uint32_t first = node.childFirst[lane], count = node.triCount[lane];
+				if (instList) cost += IntersectInstances( ray, instList, instData, blasList, instIdx + first, count ), t4 = vdupq_n_f32( ray.hit.t ); else
 				for (uint32_t j = 0; j < count; j++, cost += c_int) // TODO: aim for 4 prims per leaf
 					IntersectCompactTri( ray, t4, (float*)(bvh4Tris + first + j * 4) );
 			}
@@ -7469,6 +10876,10 @@ int32_t BVH4_CPU::Intersect( Ray& ray ) const
 // Find occlusions in a 4-way BVH stored in 'Atilla Áfra' layout.
 inline bool OccludedCompactTri( const Ray& r, const float* T )
 {
+#ifdef WATERTIGHT_TRIS
+	float ta, u, v;
+	return IntersectWatertight( r, bvhvec3( T[0], T[1], T[2] ), bvhvec3( T[4], T[5], T[6] ), bvhvec3( T[8], T[9], T[10] ), ta, u, v );
+#else
 	const float transS = T[8] * r.O.x + T[9] * r.O.y + T[10] * r.O.z + T[11];
 	const float transD = T[8] * r.D.x + T[9] * r.D.y + T[10] * r.D.z;
 	const float ta = -transS / transD;
@@ -7477,9 +10888,15 @@ inline bool OccludedCompactTri( const Ray& r, const float* T )
 	const float u = T[0] * wr.x + T[1] * wr.y + T[2] * wr.z + T[3];
 	const float v = T[4] * wr.x + T[5] * wr.y + T[6] * wr.z + T[7];
 	return u >= 0 && v >= 0 && u + v < 1;
+#endif
 }
 
 bool BVH4_CPU::IsOccluded( const Ray& ray ) const
+{
+	return (this->*occlusionKernel[RayOctant( ray )])(ray);
+}
+
+template <bool posX, bool posY, bool posZ> bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 {
 	uint32_t nodeIdx = 0, stack[1024], stackPtr = 0;
 	const float32x4_t ox4 = vdupq_n_f32( ray.O.x ), rdx4 = vdupq_n_f32( ray.rD.x );
@@ -7492,20 +10909,18 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 	while (1)
 	{
 		const BVHNode& node = bvh4Node[nodeIdx];
-		// intersect the ray with four AABBs
-		const float32x4_t xmin4 = node.xmin4, xmax4 = node.xmax4;
-		const float32x4_t ymin4 = node.ymin4, ymax4 = node.ymax4;
-		const float32x4_t zmin4 = node.zmin4, zmax4 = node.zmax4;
-		const float32x4_t x0 = vsubq_f32( xmin4, ox4 ), x1 = vsubq_f32( xmax4, ox4 );
-		const float32x4_t y0 = vsubq_f32( ymin4, oy4 ), y1 = vsubq_f32( ymax4, oy4 );
-		const float32x4_t z0 = vsubq_f32( zmin4, oz4 ), z1 = vsubq_f32( zmax4, oz4 );
+		// intersect the ray with four AABBs; near and far planes follow from the octant.
+		const float32x4_t x0 = vsubq_f32( posX ? node.xmin4 : node.xmax4, ox4 ), x1 = vsubq_f32( posX ? node.xmax4 : node.xmin4, ox4 );
+		const float32x4_t y0 = vsubq_f32( posY ? node.ymin4 : node.ymax4, oy4 ), y1 = vsubq_f32( posY ? node.ymax4 : node.ymin4, oy4 );
+		const float32x4_t z0 = vsubq_f32( posZ ? node.zmin4 : node.zmax4, oz4 ), z1 = vsubq_f32( posZ ? node.zmax4 : node.zmin4, oz4 );
 		const float32x4_t tx1 = vmulq_f32( x0, rdx4 ), tx2 = vmulq_f32( x1, rdx4 );
 		const float32x4_t ty1 = vmulq_f32( y0, rdy4 ), ty2 = vmulq_f32( y1, rdy4 );
 		const float32x4_t tz1 = vmulq_f32( z0, rdz4 ), tz2 = vmulq_f32( z1, rdz4 );
-		const float32x4_t txmin = vminq_f32( tx1, tx2 ), tymin = vminq_f32( ty1, ty2 ), tzmin = vminq_f32( tz1, tz2 );
-		const float32x4_t txmax = vmaxq_f32( tx1, tx2 ), tymax = vmaxq_f32( ty1, ty2 ), tzmax = vmaxq_f32( tz1, tz2 );
-		const float32x4_t tmin = vmaxq_f32( vmaxq_f32( txmin, tymin ), tzmin );
-		const float32x4_t tmax = vminq_f32( vminq_f32( txmax, tymax ), tzmax );
+		const float32x4_t tmin = vmaxq_f32( vmaxq_f32( tx1, ty1 ), tz1 );
+		float32x4_t tmax = vminq_f32( vminq_f32( tx2, ty2 ), tz2 );
+#ifdef WATERTIGHT_TRIS
+		tmax = vmulq_n_f32( tmax, BVH_CONSERVATIVE_TMAX );
+#endif
 		uint32x4_t hit = vandq_u32( vandq_u32( vcgeq_f32( tmax, tmin ), vcltq_f32( tmin, t4 ) ), vcgeq_f32( tmax, zero4 ) );
 		int32_t hitBits = ARMVecMovemask( hit ), hits = vcnt_s8( vreinterpret_s8_s32( vcreate_u32( hitBits ) ) )[0];
 		if (hits == 1 /* 43% */)
@@ -7515,6 +10930,7 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 			if (count == 0) nodeIdx = node.childFirst[lane]; else
 			{
 				const uint32_t first = node.childFirst[lane];
+				if (instList) { if (InstancesOcclude( ray, instList, instData, blasList, instIdx + first, count )) return true; } else
 				for (uint32_t j = 0; j < count; j++) // TODO: aim for 4 prims per leaf
 					if (OccludedCompactTri( ray, (float*)(bvh4Tris + first + j * 4) )) return true;
 				if (stackPtr == 0) break;
@@ -7543,6 +10959,7 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 			if (triCount0 == 0) nodeIdx = node.childFirst[lane0]; else
 			{
 				const uint32_t first = node.childFirst[lane0];
+				if (instList) { if (InstancesOcclude( ray, instList, instData, blasList, instIdx + first, triCount0 )) return true; } else
 				for (uint32_t j = 0; j < triCount0; j++) // TODO: aim for 4 prims per leaf
 					if (OccludedCompactTri( ray, (float*)(bvh4Tris + first + j * 4) )) return true;
 				nodeIdx = 0;
@@ -7556,6 +10973,7 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 			else
 			{
 				const uint32_t first = node.childFirst[lane1];
+				if (instList) { if (InstancesOcclude( ray, instList, instData, blasList, instIdx + first, triCount1 )) return true; } else
 				for (uint32_t j = 0; j < triCount1; j++) // TODO: aim for 4 prims per leaf
 					if (OccludedCompactTri( ray, (float*)(bvh4Tris + first + j * 4) )) return true;
 			}
@@ -7587,6 +11005,7 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 					continue;
 				}
 				const uint32_t first = node.childFirst[lane], count = node.triCount[lane];
+				if (instList) { if (InstancesOcclude( ray, instList, instData, blasList, instIdx + first, count )) return true; } else
 				for (uint32_t j = 0; j < count; j++) // TODO: aim for 4 prims per leaf
 					if (OccludedCompactTri( ray, (float*)(bvh4Tris + first + j * 4) )) return true;
 			}
@@ -7619,6 +11038,7 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 					continue;
 				}
 				const uint32_t first = node.childFirst[lane], count = node.triCount[lane];
+				if (instList) { if (InstancesOcclude( ray, instList, instData, blasList, instIdx + first, count )) return true; } else
 				for (uint32_t j = 0; j < count; j++) // TODO: aim for 4 prims per leaf
 					if (OccludedCompactTri( ray, (float*)(bvh4Tris + first + j * 4) )) return true;
 			}
@@ -7630,6 +11050,12 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 	return false;
 }
 
+void BVH4_CPU::IntersectStream( Ray* rays, const uint32_t count ) const
+{
+	// no NEON stream traversal yet: trace the rays one by one.
+	for (uint32_t i = 0; i < count; i++) Intersect( rays[i] );
+}
+
 #endif // BVH_USENEON
 
 #if !defined( BVH_USEAVX ) && !defined( BVH_USENEON )
@@ -7654,6 +11080,11 @@ bool BVH4_CPU::IsOccluded( const Ray& ray ) const
 	FATAL_ERROR( "BVH4_CPU::IsOccluded: Requires AVX or NEON." );
 }
 
+void BVH4_CPU::IntersectStream( Ray* rays, const uint32_t count ) const
+{
+	FATAL_ERROR( "BVH4_CPU::IntersectStream: Requires AVX or NEON." );
+}
+
 #endif
 
 // ============================================================================
@@ -8124,24 +11555,54 @@ double BVH_Double::BVHNode::Intersect( const RayEx& ray ) const
 // Update
 void BLASInstance::Update( BVHBase* blas )
 {
-	InvertTransform(); // TODO: done unconditionally; for a big TLAS this may be wasteful. Detect changes automatically?
+	InvertTransform(); // BVH::UpdateTLAS only calls this for instances flagged as dirty.
 	// transform the eight corners of the root node aabb using the
 	// instance transform and calculate the worldspace aabb over those.
+	// Keyframed instances: the corners move linearly between keyframes, so the
+	// union over the keyframes bounds the swept box.
 	aabbMin = bvhvec3( BVH_FAR ), aabbMax = bvhvec3( -BVH_FAR );
 	bvhvec3 bmin = blas->aabbMin, bmax = blas->aabbMax;
-	for (int32_t j = 0; j < 8; j++)
+	for (uint32_t k = 0; k < tinybvh_max( keyCount, 1u ); k++)
 	{
-		const bvhvec3 p( j & 1 ? bmax.x : bmin.x, j & 2 ? bmax.y : bmin.y, j & 4 ? bmax.z : bmin.z );
-		const bvhvec3 t = tinybvh_transform_point( p, transform );
-		aabbMin = tinybvh_min( aabbMin, t ), aabbMax = tinybvh_max( aabbMax, t );
+		const float* T = keyCount > 1 ? (keyframes + k * 16) : transform;
+		for (int32_t j = 0; j < 8; j++)
+		{
+			const bvhvec3 p( j & 1 ? bmax.x : bmin.x, j & 2 ? bmax.y : bmin.y, j & 4 ? bmax.z : bmin.z );
+			const bvhvec3 t = tinybvh_transform_point( p, T );
+			aabbMin = tinybvh_min( aabbMin, t ), aabbMax = tinybvh_max( aabbMax, t );
+		}
 	}
 }
 
+// GetTransform - instance transform at 'time'; keyframes are interpolated linearly.
+void BLASInstance::GetTransform( const float time, float* T ) const
+{
+	if (keyCount < 2) { memcpy( T, transform, sizeof( transform ) ); return; }
+	const float s = tinybvh_clamp( time, 0.0f, 1.0f ) * (keyCount - 1);
+	const uint32_t k = tinybvh_min( (uint32_t)s, keyCount - 2 );
+	const float f = s - (float)k, * A = keyframes + k * 16, * B = A + 16;
+	for (int i = 0; i < 16; i++) T[i] = A[i] + (B[i] - A[i]) * f;
+}
+
+// TransformRay - motion blur: transform a ray to the instance space at the ray time.
+void BLASInstance::TransformRay( const Ray& ray, Ray& tmp ) const
+{
+	float T[16], invT[16];
+	GetTransform( ray.time, T ), InvertMatrix( T, invT );
+	tmp.O = tinybvh_transform_point( ray.O, invT );
+	tmp.D = tinybvh_transform_vector( ray.D, invT );
+	tmp.rD = tinybvh_safercp( tmp.D ), tmp.time = ray.time;
+}
+
 // InvertTransform - calculate the inverse of the matrix stored in 'transform'
 void BLASInstance::InvertTransform()
+{
+	InvertMatrix( transform, invTransform );
+}
+
+void BLASInstance::InvertMatrix( const float* T, float* invTransform )
 {
 	// math from MESA, via http://stackoverflow.com/questions/1148309/inverting-a-4x4-matrix
-	const float* T = this->transform;
 	invTransform[0] = T[5] * T[10] * T[15] - T[5] * T[11] * T[14] - T[9] * T[6] * T[15] + T[9] * T[7] * T[14] + T[13] * T[6] * T[11] - T[13] * T[7] * T[10];
 	invTransform[1] = -T[1] * T[10] * T[15] + T[1] * T[11] * T[14] + T[9] * T[2] * T[15] - T[9] * T[3] * T[14] - T[13] * T[2] * T[11] + T[13] * T[3] * T[10];
 	invTransform[2] = T[1] * T[6] * T[15] - T[1] * T[7] * T[14] - T[5] * T[2] * T[15] + T[5] * T[3] * T[14] + T[13] * T[2] * T[7] - T[13] * T[3] * T[6];
@@ -8221,8 +11682,12 @@ float BVHBase::SA( const bvhvec3& aabbMin, const bvhvec3& aabbMax )
 // IntersectTri
 void BVHBase::IntersectTri( Ray& ray, const bvhvec4slice& verts, const uint32_t idx ) const
 {
-	// Moeller-Trumbore ray/triangle intersection algorithm
 	const uint32_t vertIdx = idx * 3;
+#ifdef WATERTIGHT_TRIS
+	float t, u, v;
+	if (!IntersectWatertight( ray, verts[vertIdx], verts[vertIdx + 1], verts[vertIdx + 2], t, u, v )) return;
+#else
+	// Moeller-Trumbore ray/triangle intersection algorithm
 	const bvhvec4 vert0 = verts[vertIdx];
 	const bvhvec3 edge1 = verts[vertIdx + 1] - vert0;
 	const bvhvec3 edge2 = verts[vertIdx + 2] - vert0;
@@ -8237,23 +11702,26 @@ void BVHBase::IntersectTri( Ray& ray, const bvhvec4slice& verts, const uint32_t
 	const float v = f * tinybvh_dot( ray.D, q );
 	if (v < 0 || u + v > 1) return;
 	const float t = f * tinybvh_dot( edge2, q );
-	if (t > 0 && t < ray.hit.t)
-	{
-		// register a hit: ray is shortened to t
-		ray.hit.t = t, ray.hit.u = u, ray.hit.v = v;
-	#if INST_IDX_BITS == 32
-		ray.hit.prim = idx, ray.hit.inst = ray.instIdx;
-	#else
-		ray.hit.prim = idx + ray.instIdx;
-	#endif
-	}
+	if (t <= 0 || t >= ray.hit.t) return;
+#endif
+	// register a hit: ray is shortened to t
+	ray.hit.t = t, ray.hit.u = u, ray.hit.v = v;
+#if INST_IDX_BITS == 32
+	ray.hit.prim = idx, ray.hit.inst = ray.instIdx;
+#else
+	ray.hit.prim = idx + ray.instIdx;
+#endif
 }
 
 // IntersectTriIndexed
 void BVHBase::IntersectTriIndexed( Ray& ray, const bvhvec4slice& verts, const uint32_t* indices, const uint32_t idx ) const
 {
-	// Moeller-Trumbore ray/triangle intersection algorithm
 	const uint32_t i0 = indices[idx * 3], i1 = indices[idx * 3 + 1], i2 = indices[idx * 3 + 2];
+#ifdef WATERTIGHT_TRIS
+	float t, u, v;
+	if (!IntersectWatertight( ray, verts[i0], verts[i1], verts[i2], t, u, v )) return;
+#else
+	// Moeller-Trumbore ray/triangle intersection algorithm
 	const bvhvec4 vert0 = verts[i0];
 	const bvhvec3 edge1 = verts[i1] - vert0;
 	const bvhvec3 edge2 = verts[i2] - vert0;
@@ -8268,23 +11736,26 @@ void BVHBase::IntersectTriIndexed( Ray& ray, const bvhvec4slice& verts, const ui
 	const float v = f * tinybvh_dot( ray.D, q );
 	if (v < 0 || u + v > 1) return;
 	const float t = f * tinybvh_dot( edge2, q );
-	if (t > 0 && t < ray.hit.t)
-	{
-		// register a hit: ray is shortened to t
-		ray.hit.t = t, ray.hit.u = u, ray.hit.v = v;
-	#if INST_IDX_BITS == 32
-		ray.hit.prim = idx, ray.hit.inst = ray.instIdx;
-	#else
-		ray.hit.prim = idx + ray.instIdx;
-	#endif
-	}
+	if (t <= 0 || t >= ray.hit.t) return;
+#endif
+	// register a hit: ray is shortened to t
+	ray.hit.t = t, ray.hit.u = u, ray.hit.v = v;
+#if INST_IDX_BITS == 32
+	ray.hit.prim = idx, ray.hit.inst = ray.instIdx;
+#else
+	ray.hit.prim = idx + ray.instIdx;
+#endif
 }
 
 // TriOccludes
 bool BVHBase::TriOccludes( const Ray& ray, const bvhvec4slice& verts, const uint32_t idx ) const
 {
-	// Moeller-Trumbore ray/triangle intersection algorithm
 	const uint32_t vertIdx = idx * 3;
+#ifdef WATERTIGHT_TRIS
+	float t, u, v;
+	return IntersectWatertight( ray, verts[vertIdx], verts[vertIdx + 1], verts[vertIdx + 2], t, u, v );
+#else
+	// Moeller-Trumbore ray/triangle intersection algorithm
 	const bvhvec4 vert0 = verts[vertIdx];
 	const bvhvec3 edge1 = verts[vertIdx + 1] - vert0;
 	const bvhvec3 edge2 = verts[vertIdx + 2] - vert0;
@@ -8300,12 +11771,17 @@ bool BVHBase::TriOccludes( const Ray& ray, const bvhvec4slice& verts, const uint
 	if (v < 0 || u + v > 1) return false;
 	const float t = f * tinybvh_dot( edge2, q );
 	return t > 0 && t < ray.hit.t;
+#endif
 }
 
 bool BVHBase::IndexedTriOccludes( const Ray& ray, const bvhvec4slice& verts, const uint32_t* indices, const uint32_t idx ) const
 {
-	// Moeller-Trumbore ray/triangle intersection algorithm
 	const uint32_t i0 = indices[idx * 3], i1 = indices[idx * 3 + 1], i2 = indices[idx * 3 + 2];
+#ifdef WATERTIGHT_TRIS
+	float t, u, v;
+	return IntersectWatertight( ray, verts[i0], verts[i1], verts[i2], t, u, v );
+#else
+	// Moeller-Trumbore ray/triangle intersection algorithm
 	const bvhvec4 vert0 = verts[i0];
 	const bvhvec3 edge1 = verts[i1] - vert0;
 	const bvhvec3 edge2 = verts[i2] - vert0;
@@ -8321,6 +11797,7 @@ bool BVHBase::IndexedTriOccludes( const Ray& ray, const bvhvec4slice& verts, con
 	if (v < 0 || u + v > 1) return false;
 	const float t = f * tinybvh_dot( edge2, q );
 	return t > 0 && t < ray.hit.t;
+#endif
 }
 
 // IntersectAABB
@@ -8335,6 +11812,23 @@ float BVHBase::IntersectAABB( const Ray& ray, const bvhvec3& aabbMin, const bvhv
 	float tz1 = (aabbMin.z - ray.O.z) * ray.rD.z, tz2 = (aabbMax.z - ray.O.z) * ray.rD.z;
 	tmin = tinybvh_max( tmin, tinybvh_min( tz1, tz2 ) );
 	tmax = tinybvh_min( tmax, tinybvh_max( tz1, tz2 ) );
+#ifdef WATERTIGHT_TRIS
+	tmax *= BVH_CONSERVATIVE_TMAX;
+#endif
+	if (tmax >= tmin && tmin < ray.hit.t && tmax >= 0) return tmin; else return BVH_FAR;
+}
+
+// IntersectAABB for a known ray octant: near and far planes are selected at compile time.
+template <bool posX, bool posY, bool posZ> float BVHBase::IntersectAABB( const Ray& ray, const bvhvec3& aabbMin, const bvhvec3& aabbMax )
+{
+	const float tx1 = ((posX ? aabbMin.x : aabbMax.x) - ray.O.x) * ray.rD.x, tx2 = ((posX ? aabbMax.x : aabbMin.x) - ray.O.x) * ray.rD.x;
+	const float ty1 = ((posY ? aabbMin.y : aabbMax.y) - ray.O.y) * ray.rD.y, ty2 = ((posY ? aabbMax.y : aabbMin.y) - ray.O.y) * ray.rD.y;
+	const float tz1 = ((posZ ? aabbMin.z : aabbMax.z) - ray.O.z) * ray.rD.z, tz2 = ((posZ ? aabbMax.z : aabbMin.z) - ray.O.z) * ray.rD.z;
+	const float tmin = tinybvh_max( tinybvh_max( tx1, ty1 ), tz1 );
+	float tmax = tinybvh_min( tinybvh_min( tx2, ty2 ), tz2 );
+#ifdef WATERTIGHT_TRIS
+	tmax *= BVH_CONSERVATIVE_TMAX;
+#endif
 	if (tmax >= tmin && tmin < ray.hit.t && tmax >= 0) return tmin; else return BVH_FAR;
 }
 
@@ -8369,6 +11863,37 @@ void BVHBase::PrecomputeTriangle( const bvhvec4slice& vert, const uint32_t ti0,
 	else memset( T, 0, 12 * 4 ); // cerr << "degenerate source " << endl;
 }
 
+// PackTri4Leafs (helper), stores 'count' triangles in ceil(count/4) BVHTri4Leaf blocks.
+// Unused lanes of the last block repeat its last triangle, so they never add a hit.
+void BVHBase::PackTri4Leafs( BVHTri4Leaf* leaf, const bvhvec4slice& verts, const uint32_t* vertIdx, const uint32_t* prims, const uint32_t count )
+{
+	for (uint32_t first = 0; first < count; first += 4, leaf++) for (uint32_t l = 0; l < 4; l++)
+	{
+		const uint32_t primIdx = prims[tinybvh_min( first + l, count - 1 )];
+		uint32_t i0, i1, i2;
+		if (indexedEnabled && vertIdx != 0)
+			i0 = vertIdx[primIdx * 3], i1 = vertIdx[primIdx * 3 + 1], i2 = vertIdx[primIdx * 3 + 2];
+		else
+			i0 = primIdx * 3, i1 = primIdx * 3 + 1, i2 = primIdx * 3 + 2;
+		const bvhvec4 v0 = verts[i0];
+	#ifdef WATERTIGHT_TRIS
+		// the watertight test needs the original vertices: store a BVHWoop4Leaf (same size).
+		BVHWoop4Leaf* woop = (BVHWoop4Leaf*)leaf;
+		const bvhvec4 v1 = verts[i1], v2 = verts[i2];
+		((float*)&woop->v0x4)[l] = v0.x, ((float*)&woop->v0y4)[l] = v0.y, ((float*)&woop->v0z4)[l] = v0.z;
+		((float*)&woop->v1x4)[l] = v1.x, ((float*)&woop->v1y4)[l] = v1.y, ((float*)&woop->v1z4)[l] = v1.z;
+		((float*)&woop->v2x4)[l] = v2.x, ((float*)&woop->v2y4)[l] = v2.y, ((float*)&woop->v2z4)[l] = v2.z;
+	#else
+		const bvhvec4 e1 = verts[i1] - v0;
+		const bvhvec4 e2 = verts[i2] - v0;
+		((float*)&leaf->v0x4)[l] = v0.x, ((float*)&leaf->v0y4)[l] = v0.y, ((float*)&leaf->v0z4)[l] = v0.z;
+		((float*)&leaf->e1x4)[l] = e1.x, ((float*)&leaf->e1y4)[l] = e1.y, ((float*)&leaf->e1z4)[l] = e1.z;
+		((float*)&leaf->e2x4)[l] = e2.x, ((float*)&leaf->e2y4)[l] = e2.y, ((float*)&leaf->e2z4)[l] = e2.z;
+	#endif
+		leaf->primIdx[l] = primIdx;
+	}
+}
+
 bool BVH::BVHNode::Intersect( const bvhvec3& bmin, const bvhvec3& bmax ) const
 {
 	return bmin.x < aabbMax.x && bmax.x > aabbMin.x &&
@@ -8591,8 +12116,12 @@ float BVH_Verbose::SAHCostUp( uint32_t nodeIdx ) const
 // FindBestNewPosition
 // Part of "Fast Insertion-Based Optimization of Bounding Volume Hierarchies"
 // K.I.S.S. version with brute-force array search.
-uint32_t BVH_Verbose::FindBestNewPosition( const uint32_t Lid ) const
+// If Nid is specified, the tree is searched as if node Nid and its parent were
+// removed, i.e. with the sibling of Nid in the place of its parent.
+uint32_t BVH_Verbose::FindBestNewPosition( const uint32_t Lid, const uint32_t Nid ) const
 {
+	const uint32_t Pid = Nid ? bvhNode[Nid].parent : 0;
+	const uint32_t X2 = Nid ? (bvhNode[Pid].left == Nid ? bvhNode[Pid].right : bvhNode[Pid].left) : 0;
 	struct Task { float ci; uint32_t node; };
 	ALIGNED( 64 ) Task task[512];
 	float Cbest = BVH_FAR;
@@ -8606,7 +12135,7 @@ uint32_t BVH_Verbose::FindBestNewPosition( const uint32_t Lid ) const
 		uint32_t bestTask = 0;
 		float minCi = task[0].ci; // tnx Brian
 		for (int j = 1; j < tasks; j++) if (task[j].ci < minCi) minCi = task[j].ci, bestTask = j;
-		const uint32_t Xid = task[bestTask].node;
+		const uint32_t Xid = (Pid && task[bestTask].node == Pid) ? X2 : task[bestTask].node;
 		const float CiLX = task[bestTask].ci;
 		if (--tasks > 0) task[bestTask] = task[tasks];
 		// execute task